@@ -22,12 +22,20 @@
  * SOFTWARE.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -57,519 +65,9034 @@ static size_t roundPower(size_t target)
 	target |= target >> 4;
 	target |= target >> 8;
 	target |= target >> 16;
+#if SIZE_MAX > 0xffffffff
+	target |= target >> 32;
+#endif
 	target++;
 	return (target);
 }
 
 /**
- * Reads the kernel from a specified file.
- * @param path File to be read.
- * @param buf Memory buffer.
+ * Gets the current (monotonic) host time.
+ * @returns Time in milliseconds.
+ */
+static double nowMs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0);
+}
+
+/**
+ * Duplicates a string, plain C99 does not have strdup.
+ * @param str String to be duplicated.
+ * @returns A newly allocated copy or NULL if error.
+ */
+static char *strDup(const char *str)
+{
+	char *dup;
+	size_t len;
+
+	len = strlen(str) + 1;
+	dup = malloc(len);
+	if (dup != NULL)
+		memcpy(dup, str, len);
+	return (dup);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Host fallback executor.                                                   *
+ * ------------------------------------------------------------------------- */
+
+/*
+ * Native kernels, process-wide: they are registered before any context
+ * is started, and looked up by name when a fallback context loads a
+ * kernel.
+ */
+struct native_entry
+{
+	char *name;                /* Kernel name.  */
+	clh_native_fn fn;          /* Native code.  */
+	struct native_entry *next; /* Next kernel.  */
+};
+
+static struct
+{
+	pthread_mutex_t lock;
+	struct native_entry *list;
+} nativeRegistry = {PTHREAD_MUTEX_INITIALIZER, NULL};
+
+/**
+ * Host buffer, what a cl_mem points to in fallback contexts.
+ */
+struct cpu_buffer
+{
+	void *ptr;                 /* Data.         */
+	size_t size;               /* Size.         */
+};
+
+/**
+ * Work-group range owned by a worker. The owner takes groups from the
+ * front, thieves take the back half.
+ */
+struct cpu_queue
+{
+	pthread_mutex_t lock;
+	size_t begin;              /* Next group.   */
+	size_t end;                /* Past the last.*/
+};
+
+/**
+ * Worker thread, worker 0 is the thread that launches.
+ */
+struct cpu_worker
+{
+	struct clh_cpu_exec *ex;   /* Executor.     */
+	int id;                    /* Worker index. */
+	pthread_t thread;          /* Thread.       */
+	void **args;               /* Kernel args.  */
+	int max_args;              /* args size.    */
+	char *scratch;             /* Local memory. */
+	size_t scratch_size;       /* scratch size. */
+};
+
+/**
+ * Host executor: a thread pool that runs the work-groups of a launch.
+ */
+struct clh_cpu_exec
+{
+	int nthreads;              /* Workers.      */
+	struct cpu_worker *workers;
+	struct cpu_queue *queues;  /* One per worker. */
+
+	pthread_mutex_t lock;
+	pthread_cond_t wake;       /* New launch.   */
+	pthread_cond_t idle;       /* Worker done.  */
+	unsigned long generation;  /* Launch count. */
+	int done;                  /* Workers done. */
+	int quit;                  /* Shutting down.*/
+
+	/* Current launch. */
+	struct clh_native_kernel *kernel;
+	struct clh_group grid;     /* Nominal group.*/
+};
+
+/* Local memory alignment. */
+#define CPU_ALIGN 64
+#define CPU_ROUND(x) (((x) + CPU_ALIGN - 1) & ~(size_t)(CPU_ALIGN - 1))
+
+/**
+ * Registers the native (host) implementation of a kernel, used when the
+ * context falls back to the host because no device was found, see
+ * clh_device_filter.fallback. The function is called once per
+ * work-group, and gets the kernel arguments in the clEnqueueNativeKernel
+ * fashion: args[i] points to the data of buffers and local memory, and
+ * to the value of everything else.
+ * Registering a name again replaces its function.
+ * @param kernel_name Kernel name, the same as in the .cl file.
+ * @param fn Native function.
  * @returns Returns a positive number if success and a negative
  * number otherwise.
  */
-int clhLoadKernel(struct cl_helper_context *chc, char const *path,
-	char const *kernel_name)
+int clhRegisterNative(const char *kernel_name, clh_native_fn fn)
 {
-	FILE   *fp;
-	size_t fsz;
-	long   off_end;
-	int    rc;
-	char   *buf;
-	int    err;
-	
-	/* Set buffer. */
-	buf = chc->buffer;
+	struct native_entry *e;
+	int ret;
 
-	/* Open the file */
-	fp = fopen(path, "r");
-	if (fp == NULL)
-		return (-CLH_FILE_ERROR);
+	if (!kernel_name || !fn)
+		return (-CLH_INV_ARG);
 
-	/* Seek to the end of the file */
-	rc = fseek(fp, 0L, SEEK_END);
-	if (rc != 0)
-		return (-CLH_FILE_ERROR);
+	ret = CLH_OK;
+	pthread_mutex_lock(&nativeRegistry.lock);
 
-	/* Byte offset to the end of the file (size) */
-	if ((off_end = ftell(fp)) < 0)
-		return (-CLH_FILE_ERROR);
+	for (e = nativeRegistry.list; e; e = e->next)
+		if (!strcmp(e->name, kernel_name))
+			break;
 
-	fsz = (size_t)off_end;
+	if (e)
+		e->fn = fn;
+	else if ((e = malloc(sizeof(*e))) == NULL ||
+		(e->name = strDup(kernel_name)) == NULL)
+	{
+		free(e);
+		ret = -CLH_OUT_OF_MEM;
+	}
+	else
+	{
+		e->fn = fn;
+		e->next = nativeRegistry.list;
+		nativeRegistry.list = e;
+	}
 
-	/* Allocate a buffer to hold the whole file */
-	buf = malloc(fsz+1);
-	if (buf == NULL)
-		return (-CLH_FILE_ERROR);
+	pthread_mutex_unlock(&nativeRegistry.lock);
+	return (ret);
+}
+
+/**
+ * Error for the features that need a real device.
+ * @param what Function name.
+ * @returns Always -CLH_DEVICE_NOT_FOUND.
+ */
+static int noDevice(const char *what)
+{
+	fprintf(stderr, "clHelper: %s is not available without a device!\n", what);
+	return (-CLH_DEVICE_NOT_FOUND);
+}
 
-	/* Rewind file pointer to start of file */
-	rewind(fp);
+/**
+ * Takes the next work-group for a worker: from its own range or, if
+ * empty, stealing the back half of another worker range.
+ * @param ex Executor.
+ * @param id Worker index.
+ * @param group Returned linear work-group index.
+ * @returns 1 if a group was taken, 0 if there is no work left.
+ */
+static int cpuNext(struct clh_cpu_exec *ex, int id, size_t *group)
+{
+	struct cpu_queue *q, *v;
+	size_t begin, end;
 
-	/* Read file into buffer */
-	if (fread(buf, 1, fsz, fp) != fsz)
+	q = &ex->queues[id];
+	pthread_mutex_lock(&q->lock);
+	if (q->begin < q->end)
 	{
-		free(buf);
-		return (-CLH_FILE_ERROR);
+		*group = q->begin++;
+		pthread_mutex_unlock(&q->lock);
+		return (1);
 	}
+	pthread_mutex_unlock(&q->lock);
 
-	/* Close the file */
-	if (fclose(fp) == EOF)
+	/* Steal, starting from the neighbor. */
+	for (int i = 1; i < ex->nthreads; i++)
 	{
-		free(buf);
-		return (-CLH_FILE_ERROR);
-	}
+		v = &ex->queues[(id + i) % ex->nthreads];
 
-	/* Make sure the buffer is NUL-terminated, just in case */
-	buf[fsz] = '\0';
-	chc->buffer = buf;
+		pthread_mutex_lock(&v->lock);
+		if (v->begin >= v->end)
+		{
+			pthread_mutex_unlock(&v->lock);
+			continue;
+		}
+		end = v->end;
+		begin = v->end - (v->end - v->begin + 1) / 2;
+		v->end = begin;
+		pthread_mutex_unlock(&v->lock);
 
-	/**
-	 * Now, we have to prepare the environment.
-	 */
-	chc->program = clCreateProgramWithSource(chc->context, 1,
-		(const char **)&chc->buffer, NULL, &err);
+		/* First group now, the rest can be stolen from us. */
+		pthread_mutex_lock(&q->lock);
+		q->begin = begin + 1;
+		q->end = end;
+		pthread_mutex_unlock(&q->lock);
 
-	if (!chc->program)
-	{
-		fprintf(stderr, "clHelper: Failed to create compute program!\n");
-		return (-CLH_NOT_COMP_PROG);
+		*group = begin;
+		return (1);
 	}
+	return (0);
+}
 
-	/* Build the program executable. */
-	if ( (clBuildProgram(chc->program, 0, NULL, NULL, NULL, NULL)) != CL_SUCCESS)
+/**
+ * Runs work-groups of the current launch until there are none left.
+ * @param w Worker.
+ */
+static void cpuRun(struct cpu_worker *w)
+{
+	struct clh_native_kernel *nk;
+	struct clh_cpu_exec *ex;
+	struct clh_group g;
+	size_t lin, off;
+
+	ex = w->ex;
+	nk = ex->kernel;
+
+	/* Arguments, local memory is private to each worker. */
+	off = 0;
+	for (int i = 0; i < nk->nargs; i++)
 	{
-		size_t len;
-		char buffer[2048];
-		
-		fprintf(stderr, "clHelper: Failed to build program executable!\n");
-		clGetProgramBuildInfo(chc->program, chc->device_id, CL_PROGRAM_BUILD_LOG,
-			sizeof(buffer), buffer, &len);
-		
-		fprintf(stderr, "%s\n", buffer);
-		exit(1);
+		switch (nk->args[i].type)
+		{
+			case CLH_ARG_BUF:
+				w->args[i] = nk->args[i].v.mem ?
+					((struct cpu_buffer *)nk->args[i].v.mem)->ptr : NULL;
+				break;
+			case CLH_ARG_LOCAL:
+				w->args[i] = w->scratch + off;
+				off += CPU_ROUND(nk->args[i].size);
+				break;
+			case CLH_ARG_RAW:
+				w->args[i] = nk->raw[i];
+				break;
+			default:
+				w->args[i] = &nk->args[i].v;
+				break;
+		}
 	}
 
-	/* Create the compute kernel in the program we wish to run. */
-	chc->kernel = clCreateKernel(chc->program, kernel_name, &err);
-	if (!chc->kernel || err != CL_SUCCESS)
+	g = ex->grid;
+	while (cpuNext(ex, w->id, &lin))
 	{
-		fprintf(stderr, "clHelper: Failed to create compute kernel!\n");
-		exit(1);
+		for (int d = 0; d < 3; d++)
+		{
+			g.group_id[d] = lin % g.num_groups[d];
+			lin /= g.num_groups[d];
+
+			g.offset[d] = g.group_id[d] * ex->grid.local_size[d];
+			g.local_size[d] = ex->grid.local_size[d];
+			if (g.offset[d] + g.local_size[d] > g.global_size[d])
+				g.local_size[d] = g.global_size[d] - g.offset[d];
+		}
+		nk->fn(&g, w->args);
 	}
-	
-	return (CLH_OK);
 }
 
-int clhStartContext(struct cl_helper_context *chc)
+/**
+ * Worker thread: waits for launches and runs them.
+ * @param arg Worker.
+ * @returns Always NULL.
+ */
+static void *cpuWorker(void *arg)
 {
-	int err;
-	cl_uint platformCount;
-	cl_platform_id* platform_ids;
-	
-	/* Clean the context structure. */
-	memset(chc, 0, sizeof(struct cl_helper_context));
-	
-#ifdef CL_DEBUG
-	fprintf(stderr, "Initializing OpenCL device...\n"); 
-#endif
+	struct cpu_worker *w = arg;
+	struct clh_cpu_exec *ex = w->ex;
+	unsigned long seen = 0;
 
-	clGetPlatformIDs(0, 0, &platformCount);
-	
-#ifdef CL_DEBUG
-	fprintf(stderr, "Found %d platforms(s)...\n\n", platformCount);
-#endif
-	
-	/*
-	 * Get the platforms available.
-	 */
-	platform_ids = malloc(sizeof(cl_platform_id) * platformCount);
-	clGetPlatformIDs(platformCount, platform_ids, NULL);
-	
-	for (int i = 0; i < platformCount; i++)
+	pthread_mutex_lock(&ex->lock);
+	for (;;)
 	{
-		char *info;
-		size_t infoSize;
-	
-		cl_uint deviceCount;
-		cl_device_id* devices;
+		while (!ex->quit && ex->generation == seen)
+			pthread_cond_wait(&ex->wake, &ex->lock);
+		if (ex->quit)
+			break;
+		seen = ex->generation;
+		pthread_mutex_unlock(&ex->lock);
 
-#ifdef CL_DEBUG		
-		clGetPlatformInfo(platform_ids[i], CL_PLATFORM_NAME, 0, NULL, &infoSize);
-		info = malloc(infoSize);
-		clGetPlatformInfo(platform_ids[i], CL_PLATFORM_NAME, infoSize, info, NULL);
-		
-		fprintf(stderr, "Platform #%d: %s\n", i, info);
-		free(info);
-#endif		
-		
-		/**
-		 * For each platform, iterate over the devices.
-		 */
-		clGetDeviceIDs(platform_ids[i], CL_DEVICE_TYPE_ALL, 0, NULL, &deviceCount);
-        devices = malloc(sizeof(cl_device_id) * deviceCount);
-        clGetDeviceIDs(platform_ids[i], CL_DEVICE_TYPE_ALL, deviceCount, devices, NULL);
-        
-        for (int j = 0; j < deviceCount; j++)
-        {
-        	char *device_name;
-        	size_t device_size;
-
-        	cl_device_type device_type;
-			size_t max_group_size;
-			cl_uint max_items_dimensions;
-			size_t max_work_item_size[3];
-			cl_uint global_work_size;
-			cl_ulong global_mem_size;
-			cl_ulong local_mem_size;			
-			
-			/* Device name. */
-#ifdef CL_DEBUG
-			clGetDeviceInfo(devices[j], CL_DEVICE_NAME, 0, NULL, &device_size);
-			device_name = malloc(device_size);
-			clGetDeviceInfo(devices[j], CL_DEVICE_NAME, device_size, device_name, NULL);
-			fprintf(stderr, "  Device #%d: %s\n", j, device_name);
-			free(device_name);
-#endif
-			
-			/* Device type */
-			clGetDeviceInfo(devices[j], CL_DEVICE_TYPE,
-				sizeof(device_type), &device_type, NULL);
-#ifdef CL_DEBUG
-			switch (device_type)
-			{
-				case CL_DEVICE_TYPE_CPU:
-					fprintf(stderr, "    Device type: CL_DEVICE_TYPE_CPU\n");
-					break;
-					
-				case CL_DEVICE_TYPE_GPU:
-					fprintf(stderr, "    Device type: CL_DEVICE_TYPE_GPU\n");
-					break;
-					
-				case CL_DEVICE_TYPE_ACCELERATOR:
-					fprintf(stderr, "    Device type: CL_DEVICE_TYPE_ACCELERATOR\n");
-					break;
-				
-				default:
-					fprintf(stderr, "    Device type: NOT_RECOGNIZED\n");
-					break;
-			}
-#endif
-			/* Global memory. */
-			clGetDeviceInfo(devices[j], CL_DEVICE_GLOBAL_MEM_SIZE,
-				sizeof(global_mem_size), &global_mem_size, NULL);
-#ifdef CL_DEBUG
-			fprintf(stderr, "    Global memory size: %zd MiB\n", global_mem_size/MB);
-#endif
+		cpuRun(w);
 
-			/* Local memory. */
-			clGetDeviceInfo(devices[j], CL_DEVICE_LOCAL_MEM_SIZE,
-				sizeof(local_mem_size), &local_mem_size, NULL);
-#ifdef CL_DEBUG
-			fprintf(stderr, "    Local memory size: %zd KiB\n", local_mem_size/KB);
-#endif		
-		
-			/* Max number of work-items in a work-group. */
-			clGetDeviceInfo(devices[j], CL_DEVICE_MAX_WORK_GROUP_SIZE,
-				sizeof(max_group_size), &max_group_size, NULL);
-#ifdef CL_DEBUG
-			fprintf(stderr, "    Max work-items: %zd\n", max_group_size);
-#endif			
+		pthread_mutex_lock(&ex->lock);
+		if (++ex->done == ex->nthreads - 1)
+			pthread_cond_signal(&ex->idle);
+	}
+	pthread_mutex_unlock(&ex->lock);
+	return (NULL);
+}
 
-			/* Max work-item dimensions. */
-			clGetDeviceInfo(devices[j], CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS,
-				sizeof(max_items_dimensions), &max_items_dimensions, NULL);
-#ifdef CL_DEBUG
-			fprintf(stderr, "    Max work-items dimensions: %d\n", max_items_dimensions);
-#endif			
+/**
+ * Stops the executor threads and releases the fallback state.
+ * @param chc Context.
+ */
+static void cpuStop(struct cl_helper_context *chc)
+{
+	struct clh_cpu_exec *ex = chc->cpu;
 
-			/* Max work-item size for dimensions. */
-			clGetDeviceInfo(devices[j], CL_DEVICE_MAX_WORK_ITEM_SIZES,
-				sizeof(max_work_item_size), &max_work_item_size, NULL);
-#ifdef CL_DEBUG
-			fprintf(stderr, "    Max work-items size for dimensions: (%zd, %zd, %zd)\n",
-				max_work_item_size[0], max_work_item_size[1], max_work_item_size[2]);
-#endif			
-			
-			/* Global work size. */
-			clGetDeviceInfo(devices[j], CL_DEVICE_ADDRESS_BITS,
-				sizeof(global_work_size), &global_work_size, NULL);
-#ifdef CL_DEBUG		
-			fprintf(stderr, "    Global work size: %d bits\n", global_work_size);
-#endif			
-			
-			/**
-			 * Checks if the current device is a GPU, if so, set this as
-			 * the device that will be used.
-			 */
-			if (device_type == CL_DEVICE_TYPE_GPU)
-			{
-				/* Some context. */
-				chc->device_id = devices[j];
-				
-				/* Device info. */
-				chc->device_type = device_type;
-				chc->max_group_size = max_group_size;
-				chc->max_items_dimensions = max_items_dimensions;
-				chc->max_work_item_size[0] = max_work_item_size[0];
-				chc->max_work_item_size[1] = max_work_item_size[1];
-				chc->max_work_item_size[2] = max_work_item_size[2];
-				chc->global_work_size = global_work_size;
-				chc->global_mem_size = global_mem_size;
-				chc->local_mem_size = local_mem_size;				
-				
-				if (!DEBUG_ON)
-				{
-					free(devices);
-					free(platform_ids);
-					goto device_check;
-				}
-			}
-		}
-		free(devices);
-	}
-	free(platform_ids);
-	
-device_check:
-	if (chc->device_id == NULL)
+	while (chc->natives)
 	{
-		fprintf(stderr, "clHelper: No GPUs were found in the system\n");
-		return (-CLH_GPU_NOT_FOUND);
-	}
-	
-	/* Create a compute context. */
-	chc->context = clCreateContext(0, 1, &chc->device_id, NULL, NULL, &err);
-	if (!chc->context)
-	{
-		fprintf(stderr, "clHelper: Failed to create a compute context!\n");
-		return (-CLH_NOT_COM_CONT);
+		struct clh_native_kernel *nk = chc->natives;
+		chc->natives = nk->next;
+		for (int i = 0; i < nk->nargs; i++)
+			free(nk->raw[i]);
+		free(nk->raw);
+		free(nk->args);
+		free(nk);
 	}
-	
-	/* Create a command queue. */
-	chc->command_queue = clCreateCommandQueue(chc->context, chc->device_id,
-		CL_QUEUE_PROFILING_ENABLE, &err);
 
-	if (!chc->command_queue)
+	if (!ex)
+		return;
+
+	pthread_mutex_lock(&ex->lock);
+	ex->quit = 1;
+	pthread_cond_broadcast(&ex->wake);
+	pthread_mutex_unlock(&ex->lock);
+
+	for (int i = 0; i < ex->nthreads; i++)
 	{
-		fprintf(stderr, "clHelper: Failed to create a command queue!\n");
-		return (-CLH_NOT_COM_QUEUE);
+		if (i > 0 && ex->workers[i].thread)
+			pthread_join(ex->workers[i].thread, NULL);
+		pthread_mutex_destroy(&ex->queues[i].lock);
+		free(ex->workers[i].args);
+		free(ex->workers[i].scratch);
 	}
-	
-	return (CLH_OK);
+
+	pthread_mutex_destroy(&ex->lock);
+	pthread_cond_destroy(&ex->wake);
+	pthread_cond_destroy(&ex->idle);
+	free(ex->workers);
+	free(ex->queues);
+	free(ex);
+	chc->cpu = NULL;
 }
 
 /**
- * Sets the local work size, i.e: the block size.
- * @param x X-Axis.
- * @param y Y-Axis.
- * @param z Z-Axis.
+ * Starts the host executor of a fallback context: a thread pool with
+ * one thread per online CPU.
+ * @param chc Context, already cleared.
+ * @param info Returned device info, describing the host.
  * @returns Returns a positive number if success and a negative
- * number otherwise. 
+ * number otherwise.
  */
-int clhSetBlockSize(struct cl_helper_context *chc, size_t x, size_t y, size_t z)
+static int cpuStart(struct cl_helper_context *chc,
+	struct clh_device_info *info)
 {
-	int dimensions;
-	size_t xx = (x == 0) ? 1 : x;
-	size_t yy = (y == 0) ? 1 : y;
-	size_t zz = (z == 0) ? 1 : z;
-	
-	/* Check bounds. */
-	if (xx*yy*zz > chc->max_group_size  || xx > chc->max_work_item_size[0] ||
-		yy > chc->max_work_item_size[1] || zz > chc->max_work_item_size[2])
+	struct clh_cpu_exec *ex;
+	long ncpu, pages, page;
+
+	ncpu  = sysconf(_SC_NPROCESSORS_ONLN);
+	pages = sysconf(_SC_PHYS_PAGES);
+	page  = sysconf(_SC_PAGESIZE);
+	if (ncpu < 1)
+		ncpu = 1;
+
+	if ((ex = calloc(1, sizeof(*ex))) == NULL)
+		return (-CLH_OUT_OF_MEM);
+	chc->cpu = ex;
+
+	ex->nthreads = (int)ncpu;
+	ex->workers  = calloc(ex->nthreads, sizeof(struct cpu_worker));
+	ex->queues   = calloc(ex->nthreads, sizeof(struct cpu_queue));
+	if (!ex->workers || !ex->queues)
 	{
-		fprintf(stderr, "clHelper: Invalid work-item/block size!!\n");
-		return (-CLH_INV_WORK_ITEM);
+		ex->nthreads = 0;
+		cpuStop(chc);
+		return (-CLH_OUT_OF_MEM);
 	}
-	
-	/* Check first dimension. */
-	if (!x)
+
+	pthread_mutex_init(&ex->lock, NULL);
+	pthread_cond_init(&ex->wake, NULL);
+	pthread_cond_init(&ex->idle, NULL);
+	for (int i = 0; i < ex->nthreads; i++)
 	{
-		fprintf(stderr, "clHelper: Invalid dimension, X should be at least 1\n");
-		return (-CLH_INV_DIM);
+		ex->workers[i].ex = ex;
+		ex->workers[i].id = i;
+		pthread_mutex_init(&ex->queues[i].lock, NULL);
 	}
-	
-	/* Get number of dimensions. */
-	dimensions = 1;
-	if (y != 0) dimensions++;
-	if (z != 0) dimensions++;
-	chc->dimensions = dimensions;
 
-	/* Allocate and set local work sizes. */
-	if (chc->localWorkSize != NULL)
-		free(chc->localWorkSize);
-	
-	chc->localWorkSize = malloc(sizeof(size_t) * dimensions);
-	chc->localWorkSize[0] = roundPower(x);
-	if (y)
-		chc->localWorkSize[1] = roundPower(y);
-	if (z)
-		chc->localWorkSize[2] = roundPower(z);
-		
+	/* Worker 0 is the launching thread itself. */
+	for (int i = 1; i < ex->nthreads; i++)
+	{
+		if (pthread_create(&ex->workers[i].thread, NULL, cpuWorker,
+			&ex->workers[i]) != 0)
+		{
+			/* Run with the ones we got. */
+			ex->nthreads = i;
+			break;
+		}
+	}
+
+	/* The host, as a device. */
+	memset(info, 0, sizeof(*info));
+	snprintf(info->platform_name, sizeof(info->platform_name), "clHelper");
+	snprintf(info->name, sizeof(info->name), "Host fallback (%d threads)",
+		ex->nthreads);
+	info->type = CL_DEVICE_TYPE_CPU;
+	info->max_group_size = 1024;
+	info->max_items_dimensions = 3;
+	info->max_work_item_size[0] = 1024;
+	info->max_work_item_size[1] = 1024;
+	info->max_work_item_size[2] = 1024;
+	info->global_work_size = sizeof(void *) * 8;
+	info->global_mem_size = (pages > 0 && page > 0) ?
+		(cl_ulong)pages * page : 0;
+	info->local_mem_size = 64 * KB;
+	info->compute_units = ex->nthreads;
+
+	chc->host_unified = 1;
+	chc->fallback = 1;
+
+#ifdef CL_DEBUG
+	fprintf(stderr, "\nSelected device: %s (%s)\n", info->name,
+		info->platform_name);
+#endif
 	return (CLH_OK);
 }
 
 /**
- * Sets the local work size. It's the same thing as the function
- * above, just an alias.
+ * Gets the native kernel of a fallback context, see clhGetKernel.
  * @param chc Context.
- * @param x X-Axis.
- * @param y Y-Axis.
- * @param z Z-Axis.
+ * @param kernel_name Kernel name.
+ * @returns The kernel handle, or NULL if no native implementation was
+ * registered with that name.
+ */
+static cl_kernel cpuKernel(struct cl_helper_context *chc,
+	const char *kernel_name)
+{
+	struct clh_native_kernel *nk;
+	struct native_entry *e;
+
+	for (nk = chc->natives; nk; nk = nk->next)
+		if (!strcmp(nk->name, kernel_name))
+			return ((cl_kernel)nk);
+
+	pthread_mutex_lock(&nativeRegistry.lock);
+	for (e = nativeRegistry.list; e; e = e->next)
+		if (!strcmp(e->name, kernel_name))
+			break;
+	pthread_mutex_unlock(&nativeRegistry.lock);
+
+	if (!e)
+	{
+		fprintf(stderr, "clHelper: No native implementation of '%s'!\n",
+			kernel_name);
+		return (NULL);
+	}
+
+	if ((nk = calloc(1, sizeof(*nk))) == NULL)
+		return (NULL);
+
+	/* Registry entries are never freed, the name can be shared. */
+	nk->name = e->name;
+	nk->fn = e->fn;
+	nk->next = chc->natives;
+	chc->natives = nk;
+	return ((cl_kernel)nk);
+}
+
+/**
+ * Sets the arguments of a native kernel, see clhSetKernelArgs.
+ * @param kernel Native kernel.
+ * @param args Argument array.
+ * @param nargs Number of arguments.
  * @returns Returns a positive number if success and a negative
  * number otherwise.
  */
-int clhSetLocalSize(struct cl_helper_context *chc, size_t x, size_t y, size_t z)
+static int cpuSetArgs(cl_kernel kernel, const struct clh_arg *args,
+	int nargs)
 {
-	return clhSetBlockSize(chc, x, y, z);
+	struct clh_native_kernel *nk = (struct clh_native_kernel *)kernel;
+	struct clh_arg *a;
+	void **raw;
+
+	if (!nk)
+		return (-CLH_INV_ARG);
+
+	if (nargs > nk->nargs)
+	{
+		a   = realloc(nk->args, sizeof(*a) * nargs);
+		if (a)
+			nk->args = a;
+		raw = realloc(nk->raw, sizeof(*raw) * nargs);
+		if (raw)
+			nk->raw = raw;
+		if (!a || !raw)
+			return (-CLH_OUT_OF_MEM);
+
+		memset(nk->args + nk->nargs, 0, sizeof(*a) * (nargs - nk->nargs));
+		memset(nk->raw + nk->nargs, 0, sizeof(*raw) * (nargs - nk->nargs));
+		nk->nargs = nargs;
+	}
+
+	for (int i = 0; i < nargs; i++)
+	{
+		/* Raw values are copied, as clSetKernelArg does. */
+		if (args[i].type == CLH_ARG_RAW)
+		{
+			if ((raw = realloc(nk->raw[i], args[i].size)) == NULL)
+				return (-CLH_OUT_OF_MEM);
+			nk->raw[i] = (void *)raw;
+			memcpy(nk->raw[i], args[i].ptr, args[i].size);
+		}
+		nk->args[i] = args[i];
+
+		/* Tracked buffers wrap their host memory. */
+		if (args[i].type == CLH_ARG_TRACKED)
+		{
+			nk->args[i].type = CLH_ARG_BUF;
+			nk->args[i].v.mem = ((const struct clh_tracked *)args[i].ptr)->mem;
+		}
+		else if (args[i].type == CLH_ARG_SPLIT)
+			nk->args[i].type = CLH_ARG_BUF;
+	}
+	return (CLH_OK);
 }
 
 /**
- * Configures the global work size, i.e: the grid size.
+ * Runs a native kernel over the current NDRange, on all the workers,
+ * and waits for it.
  * @param chc Context.
- * @param x X-Axis.
- * @param y Y-Axis.
- * @param z Z-Axis.
+ * @param kernel Native kernel.
  * @returns Returns a positive number if success and a negative
  * number otherwise.
  */
-int clhSetGridSize(struct cl_helper_context *chc, size_t x, size_t y, size_t z)
+static int cpuLaunch(struct cl_helper_context *chc, cl_kernel kernel)
 {
-	/* Check if local size was already set. */
-	if (chc->dimensions <= 0)
+	struct clh_native_kernel *nk = (struct clh_native_kernel *)kernel;
+	struct clh_cpu_exec *ex = chc->cpu;
+	struct clh_group *grid;
+	size_t total, local, scratch;
+	double start;
+
+	if (!nk || !chc->globalWorkSize || chc->dimensions < 1)
 	{
-		fprintf(stderr, "clHelper: The grid size should be set *after*"
-			" blockSize!\n");
-		return (-CLH_INV_GRID);
+		fprintf(stderr, "clHelper: Failed to execute kernel! no NDRange\n");
+		return (-CLH_KERN_FAIL);
 	}
-	
-	int dimensions;
-	/* Check first dimension. */
-	if (!x)
+
+	start = nowMs();
+
+	/* NDRange, unused dimensions have size 1. */
+	grid = &ex->grid;
+	memset(grid, 0, sizeof(*grid));
+	grid->dims = chc->dimensions;
+	total = 1;
+	for (int d = 0; d < 3; d++)
 	{
-		fprintf(stderr, "clHelper: Invalid dimension, X should be at least 1\n");
+		grid->global_size[d] = 1;
+		grid->local_size[d] = 1;
+
+		if (d < chc->dimensions)
+		{
+			grid->global_size[d] = chc->globalWorkSize[d];
+			if (chc->localWorkSize)
+				grid->local_size[d] = chc->localWorkSize[d];
+			else if (d == 0)
+			{
+				/* Runtime-chosen: the largest power of two up to 256. */
+				for (local = 256; local > 1; local >>= 1)
+					if (grid->global_size[0] % local == 0)
+						break;
+				grid->local_size[0] = local;
+			}
+		}
+
+		grid->num_groups[d] = (grid->global_size[d] + grid->local_size[d] - 1)
+			/ grid->local_size[d];
+		total *= grid->num_groups[d];
+	}
+
+	/* Per-worker argument arrays and local memory. */
+	scratch = 0;
+	for (int i = 0; i < nk->nargs; i++)
+		if (nk->args[i].type == CLH_ARG_LOCAL)
+			scratch += CPU_ROUND(nk->args[i].size);
+
+	for (int i = 0; i < ex->nthreads; i++)
+	{
+		struct cpu_worker *w = &ex->workers[i];
+
+		if (nk->nargs > w->max_args)
+		{
+			void **args = realloc(w->args, sizeof(void *) * nk->nargs);
+			if (!args)
+				return (-CLH_OUT_OF_MEM);
+			w->args = args;
+			w->max_args = nk->nargs;
+		}
+
+		if (scratch > w->scratch_size)
+		{
+			free(w->scratch);
+			w->scratch_size = 0;
+			if (posix_memalign((void **)&w->scratch, CPU_ALIGN, scratch))
+			{
+				w->scratch = NULL;
+				return (-CLH_OUT_OF_MEM);
+			}
+			w->scratch_size = scratch;
+		}
+
+		/* Contiguous ranges, so neighbor groups run on the same core. */
+		ex->queues[i].begin = total * i / ex->nthreads;
+		ex->queues[i].end   = total * (i + 1) / ex->nthreads;
+	}
+
+	/* Go. */
+	ex->kernel = nk;
+	pthread_mutex_lock(&ex->lock);
+	ex->done = 0;
+	ex->generation++;
+	pthread_cond_broadcast(&ex->wake);
+	pthread_mutex_unlock(&ex->lock);
+
+	cpuRun(&ex->workers[0]);
+
+	pthread_mutex_lock(&ex->lock);
+	while (ex->done < ex->nthreads - 1)
+		pthread_cond_wait(&ex->idle, &ex->lock);
+	pthread_mutex_unlock(&ex->lock);
+
+	chc->time_ms = nowMs() - start;
+	return (CLH_OK);
+}
+
+/**
+ * Allocates a host buffer for a fallback context, see clhAllocBuffer.
+ * @param chc Context.
+ * @param flags Memory flags.
+ * @param size Buffer size, in bytes.
+ * @param host_ptr Data to be copied if CL_MEM_COPY_HOST_PTR is set.
+ * @returns The buffer, or NULL if error.
+ */
+static cl_mem cpuAllocBuffer(struct cl_helper_context *chc,
+	cl_mem_flags flags, size_t size, void *host_ptr)
+{
+	struct cpu_buffer *buf;
+
+	if ((buf = malloc(sizeof(*buf))) == NULL)
+		return (NULL);
+
+	if (posix_memalign(&buf->ptr, CPU_ALIGN, size))
+	{
+		free(buf);
+		return (NULL);
+	}
+	buf->size = size;
+
+	if ((flags & CL_MEM_COPY_HOST_PTR) && host_ptr)
+		memcpy(buf->ptr, host_ptr, size);
+
+	chc->pool_stats.allocs++;
+	chc->pool_stats.live_bytes += size;
+	if (chc->pool_stats.live_bytes > chc->pool_stats.peak_bytes)
+		chc->pool_stats.peak_bytes = chc->pool_stats.live_bytes;
+	return ((cl_mem)buf);
+}
+
+/**
+ * Releases a host buffer, see clhFreeBuffer.
+ * @param chc Context.
+ * @param mem Buffer.
+ */
+static void cpuFreeBuffer(struct cl_helper_context *chc, cl_mem mem)
+{
+	struct cpu_buffer *buf = (struct cpu_buffer *)mem;
+
+	chc->pool_stats.live_bytes -= buf->size;
+	free(buf->ptr);
+	free(buf);
+}
+
+/**
+ * Wraps host memory as a buffer, without copying it.
+ * @param ptr Host memory.
+ * @param size Size, in bytes.
+ * @returns The buffer, or NULL if error. It must be released with
+ * free(), the memory is not owned.
+ */
+static cl_mem cpuWrapBuffer(void *ptr, size_t size)
+{
+	struct cpu_buffer *buf;
+
+	if ((buf = malloc(sizeof(*buf))) == NULL)
+		return (NULL);
+	buf->ptr = ptr;
+	buf->size = size;
+	return ((cl_mem)buf);
+}
+
+/**
+ * Gets the data of a host buffer.
+ * @param mem Buffer.
+ * @returns Buffer data.
+ */
+static void *cpuBufferPtr(cl_mem mem)
+{
+	return (((struct cpu_buffer *)mem)->ptr);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Program binary cache.                                                     *
+ * ------------------------------------------------------------------------- */
+
+/* Cache file header. */
+#define CACHE_MAGIC   0x42484c43 /* 'CLHB'. */
+#define CACHE_VERSION 1
+
+struct cache_header
+{
+	uint32_t magic;   /* CACHE_MAGIC.             */
+	uint32_t version; /* CACHE_VERSION.           */
+	uint64_t key;     /* Key used to name it.     */
+	uint64_t size;    /* Binary size, in bytes.   */
+};
+
+/**
+ * FNV-1a 64-bit hash, used to build the cache keys.
+ * @param hash Previous hash value, or the offset basis.
+ * @param data Data to be hashed.
+ * @param len Data length.
+ * @returns The updated hash.
+ */
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	for (size_t i = 0; i < len; i++)
+	{
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return (hash);
+}
+
+/**
+ * Hashes a device/platform info string into the key.
+ * @param hash Previous hash value.
+ * @param device Device queried.
+ * @param param Device info to be hashed.
+ * @returns The updated hash.
+ */
+static uint64_t hashDeviceInfo(uint64_t hash, cl_device_id device,
+	cl_device_info param)
+{
+	char info[256];
+	size_t len;
+
+	if (clGetDeviceInfo(device, param, sizeof(info), info, &len) != CL_SUCCESS)
+		return (hash);
+
+	/* Separate the fields, so 'ab'+'c' differs from 'a'+'bc'. */
+	hash = fnv1a(hash, info, strnlen(info, sizeof(info)));
+	return (fnv1a(hash, "\n", 1));
+}
+
+/**
+ * Hashes the platform, device and driver of the context device.
+ * @param chc Context.
+ * @param hash Previous hash value.
+ * @returns The updated hash.
+ */
+static uint64_t hashDevice(struct cl_helper_context *chc, uint64_t hash)
+{
+	cl_platform_id platform;
+	char info[256];
+	size_t len;
+
+	/* Platform. */
+	if (clGetDeviceInfo(chc->device_id, CL_DEVICE_PLATFORM, sizeof(platform),
+		&platform, NULL) == CL_SUCCESS &&
+		clGetPlatformInfo(platform, CL_PLATFORM_NAME, sizeof(info), info,
+		&len) == CL_SUCCESS)
+	{
+		hash = fnv1a(hash, info, strnlen(info, sizeof(info)));
+	}
+
+	/* Device and driver. */
+	hash = hashDeviceInfo(hash, chc->device_id, CL_DEVICE_NAME);
+	hash = hashDeviceInfo(hash, chc->device_id, CL_DEVICE_VERSION);
+	hash = hashDeviceInfo(hash, chc->device_id, CL_DRIVER_VERSION);
+	return (hash);
+}
+
+/**
+ * Maps a source file into memory.
+ * @param path File path.
+ * @param size Returned file size.
+ * @returns The mapped file, or NULL if error. Empty files are mapped
+ * to an empty string.
+ */
+static const char *mapSource(const char *path, size_t *size)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return (NULL);
+
+	if (fstat(fd, &st) < 0)
+	{
+		close(fd);
+		return (NULL);
+	}
+
+	*size = (size_t)st.st_size;
+	if (*size == 0)
+	{
+		close(fd);
+		return ("");
+	}
+
+	map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	return (map == MAP_FAILED ? NULL : map);
+}
+
+/**
+ * Hashes the sources of a program, each one followed by a NUL, so
+ * 'ab'+'c' differs from 'a'+'bc'.
+ * @param count Number of sources.
+ * @param sources Sources.
+ * @param lengths Source lengths.
+ * @returns The sources hash.
+ */
+static uint64_t hashSources(cl_uint count, const char **sources,
+	const size_t *lengths)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for (cl_uint i = 0; i < count; i++)
+	{
+		hash = fnv1a(hash, sources[i], lengths[i]);
+		hash = fnv1a(hash, "", 1);
+	}
+	return (hash);
+}
+
+/* Include nesting followed by hashIncludes. */
+#define INCLUDE_DEPTH 16
+
+/**
+ * Gets the next include directory (-I) of the build options.
+ * @param options Build options, from the previous call.
+ * @param dir Returned directory.
+ * @param size Size of dir.
+ * @returns Options after the directory, or NULL if there are no more.
+ */
+static const char *nextIncludeDir(const char *options, char *dir,
+	size_t size)
+{
+	const char *end;
+	size_t len;
+
+	while ((options = strstr(options, "-I")) != NULL)
+	{
+		options += 2;
+		while (*options == ' ')
+			options++;
+
+		/* Quoted (see clhAddIncludeDir) or up to the next space. */
+		if (*options == '"')
+			end = strchr(++options, '"');
+		else
+			end = options + strcspn(options, " ");
+		if (end == NULL)
+			return (NULL);
+
+		len = end - options;
+		if (len && len < size)
+		{
+			memcpy(dir, options, len);
+			dir[len] = '\0';
+			return (*end ? end + 1 : end);
+		}
+		options = end;
+	}
+	return (NULL);
+}
+
+/**
+ * Maps an included file, if found in a given directory.
+ * @param dir Directory.
+ * @param name Include name.
+ * @param path Returned file path.
+ * @param size Size of path.
+ * @param len Returned file size.
+ * @returns The mapped file, or NULL if not found.
+ */
+static const char *mapInclude(const char *dir, const char *name,
+	char *path, size_t size, size_t *len)
+{
+	snprintf(path, size, "%s/%s", dir, name);
+	return (mapSource(path, len));
+}
+
+/**
+ * Hashes the files pulled by #include from a source, recursively: the
+ * name of each one, and its contents if found in the directory of the
+ * including file, the -I directories of the build options, or the
+ * current directory. So the keys change when a header does.
+ * @param hash Previous hash value.
+ * @param src Source.
+ * @param len Source length.
+ * @param dir Directory of the source, NULL if not known.
+ * @param options Build options.
+ * @param depth Include nesting.
+ * @returns The updated hash.
+ */
+static uint64_t hashIncludes(uint64_t hash, const char *src, size_t len,
+	const char *dir, const char *options, int depth)
+{
+	const char *p, *end, *opts, *inc;
+	char name[256], path[1024], idir[768];
+	size_t nlen, ilen;
+	char close;
+
+	if (depth >= INCLUDE_DEPTH)
+		return (hash);
+
+	end = src + len;
+	for (p = src; p < end; p = memchr(p, '\n', end - p), p = p ? p + 1 : end)
+	{
+		while (p < end && (*p == ' ' || *p == '\t'))
+			p++;
+		if (p == end || *p != '#')
+			continue;
+		for (p++; p < end && (*p == ' ' || *p == '\t'); p++)
+			;
+		if (end - p < 8 || strncmp(p, "include", 7))
+			continue;
+		for (p += 7; p < end && (*p == ' ' || *p == '\t'); p++)
+			;
+		if (p == end || (*p != '"' && *p != '<'))
+			continue;
+
+		close = (*p++ == '"') ? '"' : '>';
+		for (nlen = 0; p + nlen < end && p[nlen] != close && p[nlen] != '\n';
+			nlen++)
+			;
+		if (p + nlen == end || p[nlen] != close || !nlen ||
+			nlen >= sizeof(name))
+		{
+			continue;
+		}
+		memcpy(name, p, nlen);
+		name[nlen] = '\0';
+		hash = fnv1a(hash, name, nlen + 1);
+
+		/* First match wins, as for the compiler. */
+		inc = dir ? mapInclude(dir, name, path, sizeof(path), &ilen) : NULL;
+		for (opts = options; !inc &&
+			(opts = nextIncludeDir(opts, idir, sizeof(idir))) != NULL; )
+		{
+			inc = mapInclude(idir, name, path, sizeof(path), &ilen);
+		}
+		if (!inc && (inc = mapInclude(".", name, path, sizeof(path),
+			&ilen)) == NULL)
+		{
+			continue;
+		}
+
+		/* Nested includes are relative to this file. */
+		hash = fnv1a(hash, inc, ilen);
+		snprintf(idir, sizeof(idir), "%.*s", (int)(strrchr(path, '/') - path),
+			path);
+		hash = hashIncludes(hash, inc, ilen, idir, options, depth + 1);
+		if (ilen)
+			munmap((void *)inc, ilen);
+	}
+	return (hash);
+}
+
+/**
+ * Builds the cache key for given sources and build options. The key
+ * covers everything that could make a binary unusable: source text
+ * (and the included files, see hashIncludes), options, platform,
+ * device and driver version.
+ * @param chc Context.
+ * @param shash Sources hash, see hashSources.
+ * @param options Build options, may be NULL.
+ * @returns The cache key.
+ */
+static uint64_t cacheKey(struct cl_helper_context *chc, uint64_t shash,
+	const char *options)
+{
+	uint64_t hash;
+
+	hash = shash;
+	if (options)
+		hash = fnv1a(hash, options, strlen(options));
+	hash = fnv1a(hash, "\n", 1);
+	return (hashDevice(chc, hash));
+}
+
+/**
+ * Gets the cache file path for a given key.
+ * @param chc Context.
+ * @param key Cache key.
+ * @returns Allocated path, or NULL if error.
+ */
+static char *cachePath(struct cl_helper_context *chc, uint64_t key)
+{
+	char *path;
+	size_t len;
+
+	len = strlen(chc->cache_dir) + 32;
+	path = malloc(len);
+	if (path == NULL)
+		return (NULL);
+
+	snprintf(path, len, "%s/%016llx.clbin", chc->cache_dir,
+		(unsigned long long)key);
+	return (path);
+}
+
+/**
+ * Tries to load and build a program from the binary cache.
+ * @param chc Context.
+ * @param key Cache key.
+ * @param options Build options, may be NULL.
+ * @param program Loaded program, if success.
+ * @returns Returns CLH_OK if success and a negative number if the
+ * binary is missing, stale or was rejected by the driver.
+ */
+static int cacheLoad(struct cl_helper_context *chc, uint64_t key,
+	const char *options, cl_program *program)
+{
+	struct cache_header hdr;
+	unsigned char *bin;
+	cl_int status;
+	cl_program prog;
+	size_t size;
+	char *path;
+	FILE *fp;
+	int err;
+
+	if ((path = cachePath(chc, key)) == NULL)
+		return (-CLH_FILE_ERROR);
+
+	fp = fopen(path, "rb");
+	free(path);
+	if (fp == NULL)
+		return (-CLH_FILE_ERROR);
+
+	/* Validate header. */
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != CACHE_MAGIC ||
+		hdr.version != CACHE_VERSION || hdr.key != key || hdr.size == 0)
+	{
+		fclose(fp);
+		return (-CLH_FILE_ERROR);
+	}
+
+	size = (size_t)hdr.size;
+	if ((bin = malloc(size)) == NULL)
+	{
+		fclose(fp);
+		return (-CLH_FILE_ERROR);
+	}
+
+	if (fread(bin, 1, size, fp) != size)
+	{
+		free(bin);
+		fclose(fp);
+		return (-CLH_FILE_ERROR);
+	}
+	fclose(fp);
+
+	/* Let the driver decide whether the binary still fits. */
+	prog = clCreateProgramWithBinary(chc->context, 1, &chc->device_id, &size,
+		(const unsigned char **)&bin, &status, &err);
+	free(bin);
+
+	if (!prog || err != CL_SUCCESS || status != CL_SUCCESS)
+	{
+		if (prog)
+			clReleaseProgram(prog);
+		return (-CLH_NOT_COMP_PROG);
+	}
+
+	if (clBuildProgram(prog, 0, NULL, options, NULL, NULL) != CL_SUCCESS)
+	{
+		clReleaseProgram(prog);
+		return (-CLH_NOT_COMP_PROG);
+	}
+
+	*program = prog;
+	return (CLH_OK);
+}
+
+/**
+ * Saves the binary of an already built program into the cache. The
+ * file is written into a temporary and then renamed, so concurrent
+ * processes never see a partial binary.
+ * @param chc Context.
+ * @param key Cache key.
+ * @param program Built program.
+ * @returns Returns CLH_OK if success and a negative number otherwise.
+ */
+static int cacheStore(struct cl_helper_context *chc, uint64_t key,
+	cl_program program)
+{
+	struct cache_header hdr;
+	unsigned char *bin;
+	char *path, *tmp;
+	size_t size, len;
+	FILE *fp;
+	int ret;
+
+	if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size),
+		&size, NULL) != CL_SUCCESS || size == 0)
+	{
+		return (-CLH_NOT_COMP_PROG);
+	}
+
+	if ((bin = malloc(size)) == NULL)
+		return (-CLH_FILE_ERROR);
+
+	if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(bin), &bin,
+		NULL) != CL_SUCCESS)
+	{
+		free(bin);
+		return (-CLH_NOT_COMP_PROG);
+	}
+
+	ret  = -CLH_FILE_ERROR;
+	path = cachePath(chc, key);
+	len  = path ? strlen(path) + 32 : 0;
+	tmp  = path ? malloc(len) : NULL;
+	if (tmp == NULL)
+		goto out;
+
+	snprintf(tmp, len, "%s.%ld.tmp", path, (long)getpid());
+	if ((fp = fopen(tmp, "wb")) == NULL)
+		goto out;
+
+	hdr.magic   = CACHE_MAGIC;
+	hdr.version = CACHE_VERSION;
+	hdr.key     = key;
+	hdr.size    = size;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+		fwrite(bin, 1, size, fp) != size)
+	{
+		fclose(fp);
+		unlink(tmp);
+		goto out;
+	}
+
+	if (fclose(fp) == EOF || rename(tmp, path) != 0)
+	{
+		unlink(tmp);
+		goto out;
+	}
+	ret = CLH_OK;
+
+out:
+	free(tmp);
+	free(path);
+	free(bin);
+	return (ret);
+}
+
+/**
+ * Sets the directory used to cache the program binaries. Once set,
+ * clhLoadKernel tries to reuse a previously built binary before
+ * building from source.
+ * @param chc Context.
+ * @param dir Cache directory, NULL disables the cache.
+ * @returns Returns CLH_OK if success and a negative number otherwise.
+ */
+int clhSetCacheDir(struct cl_helper_context *chc, const char *dir)
+{
+	free(chc->cache_dir);
+	chc->cache_dir = NULL;
+
+	if (dir == NULL)
+		return (CLH_OK);
+
+	/* Create if not exists. */
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+	{
+		fprintf(stderr, "clHelper: Unable to create cache dir: %s\n", dir);
+		return (-CLH_FILE_ERROR);
+	}
+
+	if ((chc->cache_dir = strDup(dir)) == NULL)
+		return (-CLH_FILE_ERROR);
+
+	return (CLH_OK);
+}
+
+/**
+ * Sets the build options used by the next program loads, e.g:
+ * "-cl-fast-relaxed-math -cl-mad-enable". Any define previously added
+ * with clhDefine is dropped.
+ * @param chc Context.
+ * @param options Build options, NULL for none.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhSetBuildOptions(struct cl_helper_context *chc, const char *options)
+{
+	char *opts = NULL;
+
+	if (options && (opts = strDup(options)) == NULL)
+		return (-CLH_OUT_OF_MEM);
+
+	free(chc->build_options);
+	chc->build_options = opts;
+	return (CLH_OK);
+}
+
+/**
+ * Adds a compile-time constant (-D name=value) to the build options
+ * used by the next program loads. Each distinct set of constants
+ * produces its own program variant, so the compiler can specialize
+ * the kernels for it (e.g: unrolling loops with a fixed trip count).
+ * @param chc Context.
+ * @param name Macro name.
+ * @param value Macro value, NULL to just define it.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhDefine(struct cl_helper_context *chc, const char *name,
+	const char *value)
+{
+	size_t len;
+	char *opts;
+
+	len = (chc->build_options ? strlen(chc->build_options) : 0) +
+		strlen(name) + (value ? strlen(value) : 0) + 6;
+
+	if ((opts = malloc(len)) == NULL)
+		return (-CLH_OUT_OF_MEM);
+
+	snprintf(opts, len, "%s%s-D %s%s%s",
+		chc->build_options ? chc->build_options : "",
+		chc->build_options ? " " : "", name, value ? "=" : "",
+		value ? value : "");
+
+	free(chc->build_options);
+	chc->build_options = opts;
+	return (CLH_OK);
+}
+
+/**
+ * Adds an integer compile-time constant, see clhDefine.
+ * @param chc Context.
+ * @param name Macro name.
+ * @param value Macro value.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhDefineInt(struct cl_helper_context *chc, const char *name,
+	long value)
+{
+	char str[32];
+	snprintf(str, sizeof(str), "%ld", value);
+	return (clhDefine(chc, name, str));
+}
+
+/**
+ * Saves the build log of a program (of all the devices) into
+ * chc->build_log, and prints it.
+ * @param chc Context.
+ * @param prog Program.
+ */
+static void saveBuildLog(struct cl_helper_context *chc, cl_program prog)
+{
+	size_t len, total;
+	char *log;
+
+	free(chc->build_log);
+	chc->build_log = NULL;
+
+	total = 0;
+	for (int i = 0; i < (chc->num_devices ? chc->num_devices : 1); i++)
+	{
+		cl_device_id dev = chc->devices ? chc->devices[i] : chc->device_id;
+
+		len = 0;
+		if (clGetProgramBuildInfo(prog, dev, CL_PROGRAM_BUILD_LOG, 0, NULL,
+			&len) != CL_SUCCESS || len <= 1)
+		{
+			continue;
+		}
+
+		if ((log = realloc(chc->build_log, total + len + 1)) == NULL)
+			break;
+		chc->build_log = log;
+
+		if (clGetProgramBuildInfo(prog, dev, CL_PROGRAM_BUILD_LOG, len,
+			log + total, NULL) != CL_SUCCESS)
+		{
+			log[total] = '\0';
+			continue;
+		}
+
+		/* One log per device, one after the other. */
+		total = strlen(log);
+		log[total++] = '\n';
+		log[total] = '\0';
+	}
+
+	if (chc->build_log)
+		fprintf(stderr, "%s", chc->build_log);
+}
+
+/**
+ * Builds a program from the given sources, using the binary cache
+ * when enabled. Programs are kept per (sources, options) pair, so
+ * loading the same variant again just selects it. On build errors,
+ * the log is saved in chc->build_log.
+ * @param chc Context.
+ * @param count Number of sources.
+ * @param sources Kernel sources.
+ * @param lengths Source lengths.
+ * @param options Build options, may be NULL.
+ * @returns Returns CLH_OK if success and a negative number otherwise.
+ */
+static int buildSources(struct cl_helper_context *chc, cl_uint count,
+	const char **sources, const size_t *lengths, const char *options)
+{
+	struct clh_program_entry *entry;
+	cl_program prog;
+	uint64_t shash;
+	uint64_t key;
+	int err;
+
+	key = 0;
+	if (!options)
+		options = "";
+
+	/* Already built in this context? Headers may have changed. */
+	shash = hashSources(count, sources, lengths);
+	for (cl_uint i = 0; i < count; i++)
+		shash = hashIncludes(shash, sources[i], lengths[i], NULL, options, 0);
+	for (entry = chc->programs; entry; entry = entry->next)
+	{
+		if (entry->source_hash == shash && !strcmp(entry->options, options))
+		{
+			chc->program = entry->program;
+			return (CLH_OK);
+		}
+	}
+
+	entry = calloc(1, sizeof(struct clh_program_entry));
+	if (entry == NULL || (entry->options = strDup(options)) == NULL)
+	{
+		free(entry);
+		return (-CLH_OUT_OF_MEM);
+	}
+	entry->source_hash = shash;
+
+	/* Try the cache first (single device contexts only). */
+	if (chc->cache_dir && chc->num_devices <= 1)
+	{
+		key = cacheKey(chc, shash, options);
+		if (cacheLoad(chc, key, options, &prog) == CLH_OK)
+		{
+			chc->cache_hits++;
+#ifdef CL_DEBUG
+			fprintf(stderr, "clHelper: binary cache hit (%016llx)\n",
+				(unsigned long long)key);
+#endif
+			goto done;
+		}
+		chc->cache_misses++;
+	}
+
+	prog = clCreateProgramWithSource(chc->context, count, sources, lengths,
+		&err);
+
+	if (!prog)
+	{
+		fprintf(stderr, "clHelper: Failed to create compute program!\n");
+		free(entry->options);
+		free(entry);
+		return (-CLH_NOT_COMP_PROG);
+	}
+
+	/* Build the program executable. */
+	if ( (clBuildProgram(prog, 0, NULL, options, NULL, NULL)) != CL_SUCCESS)
+	{
+		fprintf(stderr, "clHelper: Failed to build program executable!\n");
+		saveBuildLog(chc, prog);
+		clReleaseProgram(prog);
+		free(entry->options);
+		free(entry);
+		return (-CLH_NOT_COMP_PROG);
+	}
+
+	/* Save for the next runs, a failure here is not fatal. */
+	if (chc->cache_dir && chc->num_devices <= 1 &&
+		cacheStore(chc, key, prog) != CLH_OK)
+		fprintf(stderr, "clHelper: Unable to save program binary!\n");
+
+done:
+	entry->program = prog;
+	entry->next = chc->programs;
+	chc->programs = entry;
+	chc->program = prog;
+	return (CLH_OK);
+}
+
+/**
+ * Builds the program for the given source, see buildSources.
+ * @param chc Context.
+ * @param source Kernel source.
+ * @param options Build options, may be NULL.
+ * @returns Returns CLH_OK if success and a negative number otherwise.
+ */
+static int buildProgram(struct cl_helper_context *chc, const char *source,
+	const char *options)
+{
+	size_t len = strlen(source);
+	return (buildSources(chc, 1, &source, &len, options));
+}
+
+/**
+ * Adds a directory to the include search path of the next program
+ * loads (-I). The directory of each source file is always searched,
+ * so includes relative to the kernel file work from any directory.
+ * @param chc Context.
+ * @param dir Include directory.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhAddIncludeDir(struct cl_helper_context *chc, const char *dir)
+{
+	size_t len;
+	char *opts;
+
+	len = (chc->include_opts ? strlen(chc->include_opts) : 0) +
+		strlen(dir) + 8;
+
+	if ((opts = malloc(len)) == NULL)
+		return (-CLH_OUT_OF_MEM);
+
+	/* Quoted only if needed, not all the compilers like quotes. */
+	snprintf(opts, len, "%s -I %s%s%s",
+		chc->include_opts ? chc->include_opts : "",
+		strchr(dir, ' ') ? "\"" : "", dir, strchr(dir, ' ') ? "\"" : "");
+
+	free(chc->include_opts);
+	chc->include_opts = opts;
+	return (CLH_OK);
+}
+
+/**
+ * Loads and builds a program made of several source files, without
+ * creating any kernel. The files are memory-mapped, and the build
+ * options are the ones from clhSetBuildOptions/clhDefine plus the
+ * include directories: the ones from clhAddIncludeDir and the
+ * directory of each file. On build errors the full build log is kept
+ * in chc->build_log.
+ * @param chc Context.
+ * @param paths Files to be read.
+ * @param count Number of files.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhLoadProgramFiles(struct cl_helper_context *chc, const char **paths,
+	int count)
+{
+	const char **sources;
+	size_t *lengths;
+	size_t len;
+	char *options;
+	char *slash;
+	int ret;
+	int n;
+
+	if (count <= 0)
+		return (-CLH_INV_ARG);
+
+	/* Native kernels do not need the sources. */
+	if (chc->fallback)
+		return (CLH_OK);
+
+	sources = calloc(count, sizeof(char *));
+	lengths = calloc(count, sizeof(size_t));
+
+	/* Options: user options, include dirs and the file dirs. */
+	len = (chc->build_options ? strlen(chc->build_options) : 0) +
+		(chc->include_opts ? strlen(chc->include_opts) : 0) + 1;
+	for (int i = 0; i < count; i++)
+		len += strlen(paths[i]) + 8;
+
+	options = malloc(len);
+	if (!sources || !lengths || !options)
+	{
+		ret = -CLH_OUT_OF_MEM;
+		n = 0;
+		goto out;
+	}
+
+	snprintf(options, len, "%s%s", chc->build_options ? chc->build_options :
+		"", chc->include_opts ? chc->include_opts : "");
+
+	for (int i = 0; i < count; i++)
+	{
+		if ((slash = strrchr(paths[i], '/')) == NULL)
+			continue;
+
+		n = strlen(options);
+		snprintf(options + n, len - n, " -I %s%.*s%s",
+			strchr(paths[i], ' ') ? "\"" : "", (int)(slash - paths[i] + 1),
+			paths[i], strchr(paths[i], ' ') ? "\"" : "");
+	}
+
+	/* Map the sources. */
+	ret = CLH_OK;
+	for (n = 0; n < count; n++)
+	{
+		if ((sources[n] = mapSource(paths[n], &lengths[n])) == NULL)
+		{
+			fprintf(stderr, "clHelper: Unable to read '%s'!\n", paths[n]);
+			ret = -CLH_FILE_ERROR;
+			break;
+		}
+	}
+
+	if (ret == CLH_OK)
+		ret = buildSources(chc, count, sources, lengths, options);
+
+out:
+	for (int i = 0; i < n; i++)
+		if (lengths[i])
+			munmap((void *)sources[i], lengths[i]);
+	free(sources);
+	free(lengths);
+	free(options);
+	return (ret);
+}
+
+/**
+ * Reads the program from a specified file and builds it, without
+ * creating any kernel. Kernels can be then retrieved by name with
+ * clhGetKernel.
+ * @param chc Context.
+ * @param path File to be read.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhLoadProgram(struct cl_helper_context *chc, char const *path)
+{
+	return (clhLoadProgramFiles(chc, &path, 1));
+}
+
+/**
+ * Registers a kernel into the context kernel registry.
+ * @param chc Context.
+ * @param name Kernel name.
+ * @param kernel Kernel object, owned by the registry afterwards.
+ * @returns Returns CLH_OK if success and a negative number otherwise.
+ */
+static int registerKernel(struct cl_helper_context *chc, const char *name,
+	cl_kernel kernel)
+{
+	struct clh_kernel_entry *entries;
+	int capacity;
+
+	/* Grow if needed. */
+	if (chc->num_kernels == chc->max_kernels)
+	{
+		capacity = (chc->max_kernels == 0) ? 4 : chc->max_kernels * 2;
+		entries  = realloc(chc->kernels, sizeof(*entries) * capacity);
+		if (entries == NULL)
+			return (-CLH_KERN_FAIL);
+
+		chc->kernels = entries;
+		chc->max_kernels = capacity;
+	}
+
+	entries = &chc->kernels[chc->num_kernels];
+	memset(entries, 0, sizeof(*entries));
+	if ((entries->name = strDup(name)) == NULL)
+		return (-CLH_KERN_FAIL);
+
+	entries->program  = chc->program;
+	entries->kernel   = kernel;
+	entries->num_args = -1;
+	chc->num_kernels++;
+	return (CLH_OK);
+}
+
+/**
+ * Gets a kernel from the current program by its name. The kernel is
+ * created on the first call and reused on the subsequent ones, so
+ * several kernels can share the same program and command queue.
+ * @param chc Context.
+ * @param kernel_name Kernel name.
+ * @returns The kernel, or NULL if not found.
+ */
+cl_kernel clhGetKernel(struct cl_helper_context *chc, char const *kernel_name)
+{
+	cl_kernel kernel;
+	int err;
+
+	if (chc->fallback)
+		return (cpuKernel(chc, kernel_name));
+
+	/* Lookup. */
+	for (int i = 0; i < chc->num_kernels; i++)
+	{
+		if (chc->kernels[i].program == chc->program &&
+			!strcmp(chc->kernels[i].name, kernel_name))
+		{
+			return (chc->kernels[i].kernel);
+		}
+	}
+
+	/* Not found, create it. */
+	kernel = clCreateKernel(chc->program, kernel_name, &err);
+	if (!kernel || err != CL_SUCCESS)
+	{
+		fprintf(stderr, "clHelper: Failed to create compute kernel '%s'!\n",
+			kernel_name);
+		return (NULL);
+	}
+
+	if (registerKernel(chc, kernel_name, kernel) != CLH_OK)
+	{
+		clReleaseKernel(kernel);
+		return (NULL);
+	}
+
+	return (kernel);
+}
+
+/**
+ * Creates all the kernels from the current program at once and puts
+ * them into the registry.
+ * @param chc Context.
+ * @returns Returns the number of kernels in the program if success
+ * and a negative number otherwise.
+ */
+int clhCreateAllKernels(struct cl_helper_context *chc)
+{
+	cl_kernel *kernels;
+	cl_uint num;
+	char name[256];
+	int ret;
+
+	if (chc->fallback)
+		return (noDevice("clhCreateAllKernels"));
+
+	if (clCreateKernelsInProgram(chc->program, 0, NULL, &num) != CL_SUCCESS)
+		return (-CLH_KERN_FAIL);
+
+	if ((kernels = malloc(sizeof(cl_kernel) * num)) == NULL)
+		return (-CLH_KERN_FAIL);
+
+	if (clCreateKernelsInProgram(chc->program, num, kernels, NULL) != CL_SUCCESS)
+	{
+		free(kernels);
+		return (-CLH_KERN_FAIL);
+	}
+
+	ret = (int)num;
+	for (cl_uint i = 0; i < num; i++)
+	{
+		int found = 0;
+
+		if (clGetKernelInfo(kernels[i], CL_KERNEL_FUNCTION_NAME, sizeof(name),
+			name, NULL) != CL_SUCCESS)
+		{
+			clReleaseKernel(kernels[i]);
+			ret = -CLH_KERN_FAIL;
+			continue;
+		}
+
+		/* Skip the ones already registered. */
+		for (int j = 0; j < chc->num_kernels && !found; j++)
+		{
+			found = chc->kernels[j].program == chc->program &&
+				!strcmp(chc->kernels[j].name, name);
+		}
+
+		if (found || registerKernel(chc, name, kernels[i]) != CLH_OK)
+			clReleaseKernel(kernels[i]);
+	}
+
+	free(kernels);
+	return (ret);
+}
+
+/**
+ * Finds the registry entry of a given kernel.
+ * @param chc Context.
+ * @param kernel Kernel.
+ * @returns The entry, or NULL if the kernel is not registered.
+ */
+static struct clh_kernel_entry *findKernel(struct cl_helper_context *chc,
+	cl_kernel kernel)
+{
+	for (int i = 0; i < chc->num_kernels; i++)
+		if (chc->kernels[i].kernel == kernel)
+			return (&chc->kernels[i]);
+	return (NULL);
+}
+
+/**
+ * Queries the argument info of a registered kernel, only done once
+ * per kernel.
+ * @param entry Kernel entry.
+ * @returns Returns CLH_OK if success and a negative number otherwise.
+ */
+static int queryArgInfo(struct clh_kernel_entry *entry)
+{
+	cl_uint num_args;
+	int n;
+
+	if (entry->num_args >= 0)
+		return (CLH_OK);
+
+	if (clGetKernelInfo(entry->kernel, CL_KERNEL_NUM_ARGS, sizeof(num_args),
+		&num_args, NULL) != CL_SUCCESS)
+	{
+		return (-CLH_INV_ARG);
+	}
+
+	n = (int)num_args;
+	entry->args     = calloc(n ? n : 1, sizeof(struct clh_arg));
+	entry->arg_set  = calloc(n ? n : 1, sizeof(char));
+	entry->arg_qual = calloc(n ? n : 1, sizeof(cl_kernel_arg_address_qualifier));
+	if (!entry->args || !entry->arg_set || !entry->arg_qual)
+		return (-CLH_INV_ARG);
+
+	/*
+	 * Argument info is optional: some runtimes only provide it if the
+	 * program was built with -cl-kernel-arg-info.
+	 */
+	entry->arg_info = 1;
+	for (int i = 0; i < n && entry->arg_info; i++)
+	{
+		if (clGetKernelArgInfo(entry->kernel, i,
+			CL_KERNEL_ARG_ADDRESS_QUALIFIER, sizeof(entry->arg_qual[i]),
+			&entry->arg_qual[i], NULL) != CL_SUCCESS)
+		{
+			entry->arg_info = 0;
+		}
+	}
+
+	entry->num_args = n;
+	return (CLH_OK);
+}
+
+/**
+ * Checks if a given argument matches the kernel signature.
+ * @param entry Kernel entry.
+ * @param idx Argument index.
+ * @param arg Argument.
+ * @returns Returns CLH_OK if valid and a negative number otherwise.
+ */
+static int checkArg(struct clh_kernel_entry *entry, int idx,
+	const struct clh_arg *arg)
+{
+	cl_kernel_arg_address_qualifier qual;
+	int ok;
+
+	if (!entry->arg_info)
+		return (CLH_OK);
+
+	qual = entry->arg_qual[idx];
+	switch (arg->type)
+	{
+		case CLH_ARG_BUF:
+		case CLH_ARG_TRACKED:
+		case CLH_ARG_SPLIT:
+			ok = (qual == CL_KERNEL_ARG_ADDRESS_GLOBAL ||
+				qual == CL_KERNEL_ARG_ADDRESS_CONSTANT);
+			break;
+		case CLH_ARG_LOCAL:
+			ok = (qual == CL_KERNEL_ARG_ADDRESS_LOCAL);
+			break;
+		case CLH_ARG_RAW:
+			ok = 1;
+			break;
+		default:
+			ok = (qual == CL_KERNEL_ARG_ADDRESS_PRIVATE);
+			break;
+	}
+
+	if (!ok)
+	{
+		fprintf(stderr, "clHelper: Argument #%d of '%s' does not match the"
+			" kernel signature!\n", idx, entry->name);
+		return (-CLH_INV_ARG);
+	}
+	return (CLH_OK);
+}
+
+/**
+ * Checks if an argument has the same value as the last bound one.
+ * @param a Argument.
+ * @param b Another argument.
+ * @returns 1 if same, 0 otherwise.
+ */
+static int sameArg(const struct clh_arg *a, const struct clh_arg *b)
+{
+	if (a->type != b->type || a->size != b->size)
+		return (0);
+
+	switch (a->type)
+	{
+		case CLH_ARG_LOCAL:
+			return (1);
+		case CLH_ARG_RAW:
+		case CLH_ARG_TRACKED:
+			return (0);
+		default:
+			return (!memcmp(&a->v, &b->v, a->size));
+	}
+}
+
+/**
+ * Value pointer of an argument, as clSetKernelArg wants it.
+ * @param arg Argument.
+ * @returns The value pointer.
+ */
+static const void *argValue(const struct clh_arg *arg)
+{
+	switch (arg->type)
+	{
+		case CLH_ARG_LOCAL:
+			return (NULL);
+		case CLH_ARG_RAW:
+			return (arg->ptr);
+		case CLH_ARG_TRACKED:
+			return (&((const struct clh_tracked *)arg->ptr)->mem);
+		default:
+			return (&arg->v);
+	}
+}
+
+/**
+ * Checks if some argument is bound through the context state, i.e:
+ * tracked (CLH_TRACKED) or split (CLH_SPLIT) buffers, which only
+ * clhSetKernelArgs and the context launches handle.
+ * @param args Arguments.
+ * @param nargs Number of arguments.
+ * @returns 1 if so, 0 otherwise.
+ */
+static int contextArgs(const struct clh_arg *args, int nargs)
+{
+	for (int i = 0; i < nargs; i++)
+		if (args[i].type == CLH_ARG_TRACKED || args[i].type == CLH_ARG_SPLIT)
+			return (1);
+	return (0);
+}
+
+/**
+ * Gets the command queue of a context device.
+ * @param chc Context.
+ * @param device Device index.
+ * @returns The queue.
+ */
+static cl_command_queue deviceQueue(struct cl_helper_context *chc,
+	int device)
+{
+	return (chc->queues ? chc->queues[device] : chc->command_queue);
+}
+
+/**
+ * Records the tracked buffer bound to a kernel argument. It is kept
+ * out of the eviction set until the kernel is launched.
+ * @param chc Context.
+ * @param kernel Kernel.
+ * @param idx Argument index.
+ * @param t Tracked buffer, NULL if the argument is not one anymore.
+ * @returns Returns CLH_OK if success and a negative number otherwise.
+ */
+static int trackedBind(struct cl_helper_context *chc, cl_kernel kernel,
+	int idx, struct clh_tracked *t)
+{
+	struct clh_tracked_arg *b, *list;
+	int max;
+
+	b = NULL;
+	for (int i = 0; i < chc->num_tracked_args && !b; i++)
+	{
+		if (chc->tracked_args[i].kernel == kernel &&
+			chc->tracked_args[i].idx == idx)
+		{
+			b = &chc->tracked_args[i];
+		}
+	}
+
+	if (b && b->pending)
+	{
+		b->t->bound--;
+		b->pending = 0;
+	}
+
+	if (!t)
+	{
+		if (b)
+			*b = chc->tracked_args[--chc->num_tracked_args];
+		return (CLH_OK);
+	}
+
+	if (!b)
+	{
+		if (chc->num_tracked_args == chc->max_tracked_args)
+		{
+			max  = chc->max_tracked_args ? chc->max_tracked_args * 2 : 16;
+			list = realloc(chc->tracked_args, sizeof(*list) * max);
+			if (list == NULL)
+				return (-CLH_OUT_OF_MEM);
+			chc->tracked_args = list;
+			chc->max_tracked_args = max;
+		}
+		b = &chc->tracked_args[chc->num_tracked_args++];
+		b->kernel = kernel;
+		b->idx = idx;
+	}
+
+	b->t = t;
+	b->pending = 1;
+	t->bound++;
+	return (CLH_OK);
+}
+
+/**
+ * Forgets the tracked buffers bound to kernel arguments.
+ * @param chc Context.
+ * @param kernel Only the arguments of this kernel, if not NULL.
+ * @param t Only the arguments bound to this buffer, if not NULL.
+ */
+static void trackedUnbind(struct cl_helper_context *chc, cl_kernel kernel,
+	struct clh_tracked *t)
+{
+	struct clh_tracked_arg *b;
+
+	for (int i = 0; i < chc->num_tracked_args; )
+	{
+		b = &chc->tracked_args[i];
+		if ((kernel && b->kernel != kernel) || (t && b->t != t))
+		{
+			i++;
+			continue;
+		}
+		if (b->pending)
+			b->t->bound--;
+		*b = chc->tracked_args[--chc->num_tracked_args];
+	}
+}
+
+/**
+ * Makes the tracked buffers bound to a kernel resident on the device
+ * of the launch queue, uploading the evicted or stale ones, and binds
+ * them again, since their device copy may have changed. Must be
+ * followed by trackedLaunched, whatever the launch result.
+ * @param chc Context.
+ * @param kernel Kernel about to be launched.
+ * @param queue Launch queue.
+ * @returns Returns CLH_OK if success and a negative number otherwise.
+ */
+static int trackedLaunch(struct cl_helper_context *chc, cl_kernel kernel,
+	cl_command_queue queue)
+{
+	struct clh_tracked_arg *b;
+	struct clh_tracked *t;
+	unsigned long uploads;
+	int device;
+
+	if (!chc->num_tracked_args)
+		return (CLH_OK);
+
+	/* Queues of other devices run on the first one (e.g: streams). */
+	device = 0;
+	for (int i = 0; chc->queues && i < chc->num_devices; i++)
+		if (chc->queues[i] == queue)
+			device = i;
+
+	/* Pin them all first, so that an upload does not evict another. */
+	for (int i = 0; i < chc->num_tracked_args; i++)
+	{
+		b = &chc->tracked_args[i];
+		if (b->kernel == kernel && !b->pending)
+		{
+			b->pending = 1;
+			b->t->bound++;
+		}
+	}
+
+	uploads = chc->mem_stats.uploads;
+	for (int i = 0; i < chc->num_tracked_args; i++)
+	{
+		b = &chc->tracked_args[i];
+		if (b->kernel != kernel)
+			continue;
+
+		t = b->t;
+		if (clhTrackedPrefetch(chc, t, device) != CLH_OK)
+			return (-CLH_OUT_OF_MEM);
+
+		if (clSetKernelArg(kernel, b->idx, sizeof(cl_mem), &t->mem) !=
+			CL_SUCCESS)
+		{
+			fprintf(stderr, "clHelper: Failed to bind tracked argument #%d!\n",
+				b->idx);
+			return (-CLH_INV_ARG);
+		}
+
+		/* Evictions and maps must wait for this launch. */
+		if (t->queue != queue)
+		{
+			if (t->queue)
+			{
+				clFinish(t->queue);
+				clReleaseCommandQueue(t->queue);
+			}
+			t->queue = NULL;
+			if (queue != deviceQueue(chc, device))
+				clRetainCommandQueue(t->queue = queue);
+		}
+
+		if (!(t->flags & CL_MEM_READ_ONLY))
+			t->device_newer = 1;
+	}
+
+	/* Uploads went through the device queue. */
+	if (chc->mem_stats.uploads != uploads &&
+		queue != deviceQueue(chc, device))
+	{
+		clFinish(deviceQueue(chc, device));
+	}
+	return (CLH_OK);
+}
+
+/**
+ * Ends a launch started by trackedLaunch: the tracked buffers of the
+ * kernel may be evicted again.
+ * @param chc Context.
+ * @param kernel Kernel launched.
+ */
+static void trackedLaunched(struct cl_helper_context *chc, cl_kernel kernel)
+{
+	struct clh_tracked_arg *b;
+
+	for (int i = 0; i < chc->num_tracked_args; i++)
+	{
+		b = &chc->tracked_args[i];
+		if (b->kernel == kernel && b->pending)
+		{
+			b->pending = 0;
+			b->t->bound--;
+		}
+	}
+}
+
+/**
+ * Records the split buffer bound to a kernel argument.
+ * @param chc Context.
+ * @param kernel Kernel.
+ * @param idx Argument index.
+ * @param mem Split buffer, NULL if the argument is not one anymore.
+ * @returns Returns CLH_OK if success and a negative number otherwise.
+ */
+static int splitBind(struct cl_helper_context *chc, cl_kernel kernel,
+	int idx, cl_mem mem)
+{
+	struct clh_split_arg *s, *list;
+	int max;
+
+	s = NULL;
+	for (int i = 0; i < chc->num_split_args && !s; i++)
+	{
+		if (chc->split_args[i].kernel == kernel &&
+			chc->split_args[i].idx == idx)
+		{
+			s = &chc->split_args[i];
+		}
+	}
+
+	if (!mem)
+	{
+		if (s)
+			*s = chc->split_args[--chc->num_split_args];
+		return (CLH_OK);
+	}
+
+	if (!s)
+	{
+		if (chc->num_split_args == chc->max_split_args)
+		{
+			max  = chc->max_split_args ? chc->max_split_args * 2 : 8;
+			list = realloc(chc->split_args, sizeof(*list) * max);
+			if (list == NULL)
+				return (-CLH_OUT_OF_MEM);
+			chc->split_args = list;
+			chc->max_split_args = max;
+		}
+		s = &chc->split_args[chc->num_split_args++];
+		s->kernel = kernel;
+		s->idx = idx;
+	}
+
+	s->mem = mem;
+	return (CLH_OK);
+}
+
+/**
+ * Sets the kernel arguments from an array of typed arguments, the
+ * i-th element is bound to the i-th kernel argument.
+ *
+ * For kernels in the registry (i.e: obtained by clhGetKernel), the
+ * arguments are checked against the kernel signature (when the runtime
+ * provides the argument info) and the bound values are remembered, so
+ * that unchanged arguments are not sent again to the driver. If the
+ * kernel arguments are also set by clSetKernelArg elsewhere, call
+ * clhInvalidateArgs before.
+ *
+ * Split buffers (CLH_SPLIT) are plain buffers, except for
+ * clhLaunchKernelMulti, which gives each device its own rows.
+ *
+ * Tracked buffers (CLH_TRACKED) are not evicted until the next launch
+ * of the kernel, and each launch makes them resident and binds them
+ * again, so the arguments may be set once for many launches.
+ *
+ * @param chc Context.
+ * @param kernel Kernel.
+ * @param args Argument array.
+ * @param nargs Number of arguments.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhSetKernelArgs(struct cl_helper_context *chc, cl_kernel kernel,
+	const struct clh_arg *args, int nargs)
+{
+	struct clh_kernel_entry *entry;
+	struct clh_tracked *t;
+	const void *value;
+	int err;
+
+	if (chc->fallback)
+		return (cpuSetArgs(kernel, args, nargs));
+
+	entry = findKernel(chc, kernel);
+	if (entry && queryArgInfo(entry) != CLH_OK)
+		entry = NULL;
+
+	if (entry && nargs > entry->num_args)
+	{
+		fprintf(stderr, "clHelper: Too many arguments for '%s' (%d > %d)!\n",
+			entry->name, nargs, entry->num_args);
+		return (-CLH_INV_ARG);
+	}
+
+	for (int i = 0; i < nargs; i++)
+	{
+		if (entry)
+		{
+			if (checkArg(entry, i, &args[i]) != CLH_OK)
+				return (-CLH_INV_ARG);
+
+			/* Unchanged, skip. */
+			if (entry->arg_set[i] && sameArg(&entry->args[i], &args[i]))
+				continue;
+		}
+
+		/* Tracked buffer: made resident by the launches. */
+		t = (args[i].type == CLH_ARG_TRACKED) ?
+			(struct clh_tracked *)args[i].ptr : NULL;
+		if ((t || chc->num_tracked_args) &&
+			trackedBind(chc, kernel, i, t) != CLH_OK)
+		{
+			return (-CLH_OUT_OF_MEM);
+		}
+
+		/* Split buffer: cut per device by clhLaunchKernelMulti. */
+		if ((args[i].type == CLH_ARG_SPLIT || chc->num_split_args) &&
+			splitBind(chc, kernel, i, (args[i].type == CLH_ARG_SPLIT) ?
+			args[i].v.mem : NULL) != CLH_OK)
+		{
+			return (-CLH_OUT_OF_MEM);
+		}
+
+		value = argValue(&args[i]);
+		err = clSetKernelArg(kernel, i, args[i].size, value);
+		if (err != CL_SUCCESS)
+		{
+			fprintf(stderr, "clHelper: Failed to set argument #%d! %d\n",
+				i, err);
+			if (entry)
+				entry->arg_set[i] = 0;
+			return (-CLH_INV_ARG);
+		}
+
+		if (entry)
+		{
+			entry->args[i] = args[i];
+			entry->arg_set[i] = 1;
+		}
+	}
+
+	return (CLH_OK);
+}
+
+/**
+ * Forgets the last bound argument values of a kernel, so that the
+ * next clhSetKernelArgs sends all of them again, and the tracked
+ * buffers bound to it, so that launches do not bind them anymore.
+ * @param chc Context.
+ * @param kernel Kernel.
+ * @returns Always CLH_OK.
+ */
+int clhInvalidateArgs(struct cl_helper_context *chc, cl_kernel kernel)
+{
+	struct clh_kernel_entry *entry;
+
+	trackedUnbind(chc, kernel, NULL);
+	for (int i = chc->num_split_args - 1; i >= 0; i--)
+		if (chc->split_args[i].kernel == kernel)
+			chc->split_args[i] = chc->split_args[--chc->num_split_args];
+
+	entry = findKernel(chc, kernel);
+	if (entry && entry->num_args > 0)
+		memset(entry->arg_set, 0, entry->num_args);
+	return (CLH_OK);
+}
+
+/**
+ * Reads the kernel from a specified file.
+ * @param chc Context.
+ * @param path File to be read.
+ * @param kernel_name Kernel name.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhLoadKernel(struct cl_helper_context *chc, char const *path,
+	char const *kernel_name)
+{
+	int rc;
+
+	if ((rc = clhLoadProgram(chc, path)) != CLH_OK)
+		return (rc);
+
+	/* Create the compute kernel in the program we wish to run. */
+	chc->kernel = clhGetKernel(chc, kernel_name);
+	if (!chc->kernel)
+		return (-CLH_KERN_FAIL);
+
+	return (CLH_OK);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Device probing and selection.                                             *
+ * ------------------------------------------------------------------------- */
+
+/**
+ * Queries all the info clHelper needs from a device.
+ * @param platform Platform the device belongs to.
+ * @param device Device.
+ * @param info Device info.
+ */
+static void probeDevice(cl_platform_id platform, cl_device_id device,
+	struct clh_device_info *info)
+{
+	memset(info, 0, sizeof(*info));
+	info->platform = platform;
+	info->id = device;
+
+	clGetPlatformInfo(platform, CL_PLATFORM_NAME, sizeof(info->platform_name),
+		info->platform_name, NULL);
+	clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(info->name), info->name,
+		NULL);
+	clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(info->type), &info->type,
+		NULL);
+	clGetDeviceInfo(device, CL_DEVICE_GLOBAL_MEM_SIZE,
+		sizeof(info->global_mem_size), &info->global_mem_size, NULL);
+	clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE,
+		sizeof(info->local_mem_size), &info->local_mem_size, NULL);
+	clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE,
+		sizeof(info->max_group_size), &info->max_group_size, NULL);
+	clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS,
+		sizeof(info->max_items_dimensions), &info->max_items_dimensions, NULL);
+	clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_SIZES,
+		sizeof(info->max_work_item_size), &info->max_work_item_size, NULL);
+	clGetDeviceInfo(device, CL_DEVICE_ADDRESS_BITS,
+		sizeof(info->global_work_size), &info->global_work_size, NULL);
+	clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS,
+		sizeof(info->compute_units), &info->compute_units, NULL);
+	clGetDeviceInfo(device, CL_DEVICE_MAX_CLOCK_FREQUENCY,
+		sizeof(info->clock_mhz), &info->clock_mhz, NULL);
+}
+
+#ifdef CL_DEBUG
+/**
+ * Dumps the device info.
+ * @param idx Device index.
+ * @param info Device info.
+ */
+static void dumpDevice(int idx, const struct clh_device_info *info)
+{
+	fprintf(stderr, "  Device #%d: %s (%s)\n", idx, info->name,
+		info->platform_name);
+
+	switch (info->type)
+	{
+		case CL_DEVICE_TYPE_CPU:
+			fprintf(stderr, "    Device type: CL_DEVICE_TYPE_CPU\n");
+			break;
+
+		case CL_DEVICE_TYPE_GPU:
+			fprintf(stderr, "    Device type: CL_DEVICE_TYPE_GPU\n");
+			break;
+
+		case CL_DEVICE_TYPE_ACCELERATOR:
+			fprintf(stderr, "    Device type: CL_DEVICE_TYPE_ACCELERATOR\n");
+			break;
+
+		default:
+			fprintf(stderr, "    Device type: NOT_RECOGNIZED\n");
+			break;
+	}
+
+	fprintf(stderr, "    Global memory size: %zd MiB\n",
+		(size_t)(info->global_mem_size/MB));
+	fprintf(stderr, "    Local memory size: %zd KiB\n",
+		(size_t)(info->local_mem_size/KB));
+	fprintf(stderr, "    Max work-items: %zd\n", info->max_group_size);
+	fprintf(stderr, "    Max work-items dimensions: %d\n",
+		info->max_items_dimensions);
+	fprintf(stderr, "    Max work-items size for dimensions: (%zd, %zd, %zd)\n",
+		info->max_work_item_size[0], info->max_work_item_size[1],
+		info->max_work_item_size[2]);
+	fprintf(stderr, "    Global work size: %d bits\n", info->global_work_size);
+	fprintf(stderr, "    Compute units: %d @ %d MHz\n", info->compute_units,
+		info->clock_mhz);
+}
+#endif
+
+/*
+ * Process-wide device info cache: probing is slow (dozens of queries per
+ * device), so it is done once, by the first context, and shared by all
+ * the contexts created afterwards.
+ */
+static struct
+{
+	pthread_mutex_t lock;
+	struct clh_device_info *devices;
+	int count;
+	int ready;
+} deviceCache = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0};
+
+/**
+ * Platform probe job, one thread per platform.
+ */
+struct probe_job
+{
+	cl_platform_id platform;
+	struct clh_device_info *devices;
+	int count;
+};
+
+/**
+ * Probes all the devices of a platform.
+ * @param arg Probe job.
+ * @returns Always NULL.
+ */
+static void *probePlatform(void *arg)
+{
+	struct probe_job *job = arg;
+	cl_uint deviceCount;
+	cl_device_id *ids;
+
+	job->devices = NULL;
+	job->count = 0;
+
+	if (clGetDeviceIDs(job->platform, CL_DEVICE_TYPE_ALL, 0, NULL,
+		&deviceCount) != CL_SUCCESS || deviceCount == 0)
+	{
+		return (NULL);
+	}
+
+	ids = malloc(sizeof(cl_device_id) * deviceCount);
+	job->devices = malloc(sizeof(struct clh_device_info) * deviceCount);
+	if (ids == NULL || job->devices == NULL)
+	{
+		free(ids);
+		free(job->devices);
+		job->devices = NULL;
+		return (NULL);
+	}
+
+	clGetDeviceIDs(job->platform, CL_DEVICE_TYPE_ALL, deviceCount, ids, NULL);
+	for (cl_uint j = 0; j < deviceCount; j++)
+		probeDevice(job->platform, ids[j], &job->devices[j]);
+
+	job->count = deviceCount;
+	free(ids);
+	return (NULL);
+}
+
+/**
+ * Probes all the devices of all the platforms, the platforms are
+ * probed in parallel.
+ * @param devices Returned device list.
+ * @param count Number of devices.
+ * @returns Returns CLH_OK if success and a negative number otherwise.
+ */
+static int probeAll(struct clh_device_info **devices, int *count)
+{
+	cl_uint platformCount;
+	cl_platform_id* platform_ids;
+	struct clh_device_info *list;
+	struct probe_job *jobs;
+	pthread_t *threads;
+	int *started;
+	int num;
+
+	*devices = NULL;
+	*count = 0;
+
+#ifdef CL_DEBUG
+	fprintf(stderr, "Initializing OpenCL device...\n"); 
+#endif
+
+	if (clGetPlatformIDs(0, 0, &platformCount) != CL_SUCCESS ||
+		platformCount == 0)
+	{
+		return (-CLH_GPU_NOT_FOUND);
+	}
+
+#ifdef CL_DEBUG
+	fprintf(stderr, "Found %d platforms(s)...\n\n", platformCount);
+#endif
+
+	/*
+	 * Get the platforms available.
+	 */
+	platform_ids = malloc(sizeof(cl_platform_id) * platformCount);
+	jobs    = calloc(platformCount, sizeof(struct probe_job));
+	threads = malloc(sizeof(pthread_t) * platformCount);
+	started = calloc(platformCount, sizeof(int));
+	if (!platform_ids || !jobs || !threads || !started)
+	{
+		free(platform_ids);
+		free(jobs);
+		free(threads);
+		free(started);
+		return (-CLH_GPU_NOT_FOUND);
+	}
+	clGetPlatformIDs(platformCount, platform_ids, NULL);
+
+	/*
+	 * For each platform, probe its devices in its own thread, or in
+	 * this one, if a thread cannot be created.
+	 */
+	for (cl_uint i = 0; i < platformCount; i++)
+	{
+		jobs[i].platform = platform_ids[i];
+		if (i + 1 < platformCount &&
+			pthread_create(&threads[i], NULL, probePlatform, &jobs[i]) == 0)
+		{
+			started[i] = 1;
+		}
+		else
+			probePlatform(&jobs[i]);
+	}
+
+	/* Gather the results, in platform order. */
+	num = 0;
+	for (cl_uint i = 0; i < platformCount; i++)
+	{
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		num += jobs[i].count;
+	}
+
+	list = num ? malloc(sizeof(*list) * num) : NULL;
+	num = 0;
+	for (cl_uint i = 0; i < platformCount; i++)
+	{
+		if (list)
+		{
+			memcpy(list + num, jobs[i].devices, sizeof(*list) * jobs[i].count);
+			num += jobs[i].count;
+		}
+		free(jobs[i].devices);
+	}
+
+#ifdef CL_DEBUG
+	for (int i = 0; i < num; i++)
+		dumpDevice(i, &list[i]);
+#endif
+
+	free(platform_ids);
+	free(jobs);
+	free(threads);
+	free(started);
+
+	*devices = list;
+	*count = num;
+	return (num ? CLH_OK : -CLH_GPU_NOT_FOUND);
+}
+
+/**
+ * Gets the devices of all the platforms, from the process-wide cache,
+ * probing them first if this is the first call. A failed probe is
+ * cached too, as an empty list, so later contexts fail fast.
+ * @param devices Returned device list, must be freed by the caller.
+ * @param count Number of devices.
+ * @param cached Set to 1 if the list came from the cache, 0 if probed.
+ * @returns Returns CLH_OK if success and a negative number otherwise.
+ */
+static int probeDevices(struct clh_device_info **devices, int *count,
+	int *cached)
+{
+	int ret;
+
+	*devices = NULL;
+	*count = 0;
+	*cached = 1;
+
+	pthread_mutex_lock(&deviceCache.lock);
+	if (!deviceCache.ready)
+	{
+		*cached = 0;
+		if (probeAll(&deviceCache.devices, &deviceCache.count) != CLH_OK)
+		{
+			free(deviceCache.devices);
+			deviceCache.devices = NULL;
+			deviceCache.count = 0;
+		}
+		deviceCache.ready = 1;
+	}
+
+	ret = -CLH_GPU_NOT_FOUND;
+	if (deviceCache.count)
+	{
+		*devices = malloc(sizeof(struct clh_device_info) * deviceCache.count);
+		if (*devices)
+		{
+			memcpy(*devices, deviceCache.devices,
+				sizeof(struct clh_device_info) * deviceCache.count);
+			*count = deviceCache.count;
+			ret = CLH_OK;
+		}
+	}
+	pthread_mutex_unlock(&deviceCache.lock);
+	return (ret);
+}
+
+/**
+ * Case-insensitive substring search.
+ * @param haystack String to be searched.
+ * @param needle Substring.
+ * @returns 1 if found, 0 otherwise.
+ */
+static int hasSubstring(const char *haystack, const char *needle)
+{
+	size_t len = strlen(needle);
+
+	for (; *haystack; haystack++)
+	{
+		size_t i;
+		for (i = 0; i < len; i++)
+		{
+			int a = haystack[i], b = needle[i];
+			if (a >= 'A' && a <= 'Z') a += 'a' - 'A';
+			if (b >= 'A' && b <= 'Z') b += 'a' - 'A';
+			if (a != b)
+				break;
+		}
+		if (i == len)
+			return (1);
+	}
+	return (len == 0);
+}
+
+/**
+ * Checks if a device matches the selection filter.
+ * @param info Device info.
+ * @param filter Selection filter.
+ * @returns 1 if matches, 0 otherwise.
+ */
+static int matchDevice(const struct clh_device_info *info,
+	const struct clh_device_filter *filter)
+{
+	/* Zeroed type means 'do not care', as CL_DEVICE_TYPE_ALL. */
+	if (filter->type && filter->type != CL_DEVICE_TYPE_ALL &&
+		!(info->type & filter->type))
+	{
+		return (0);
+	}
+	if (filter->platform_name && !hasSubstring(info->platform_name,
+		filter->platform_name))
+	{
+		return (0);
+	}
+	if (filter->device_name && !hasSubstring(info->name, filter->device_name))
+		return (0);
+	if (info->global_mem_size < filter->min_global_mem)
+		return (0);
+	if (info->local_mem_size < filter->min_local_mem)
+		return (0);
+	return (1);
+}
+
+/**
+ * Device score used by the ranking: compute units x clock.
+ * @param info Device info.
+ * @returns Device score.
+ */
+static double deviceScore(const struct clh_device_info *info)
+{
+	return ((double)info->compute_units * info->clock_mhz);
+}
+
+/**
+ * Applies the CLH_DEVICE environment variable over a filter. The
+ * variable is a comma-separated list of:
+ *   gpu|cpu|accel|any  device type
+ *   platform=<str>     platform name substring
+ *   name=<str>         device name substring
+ *   mem=<MiB>          minimum global memory
+ *   local=<KiB>        minimum local memory
+ *   fastest            rank by compute units x clock
+ *   host               run on the host, see clhRegisterNative
+ *
+ * @param filter Filter to be changed.
+ * @param env Copy of the environment variable, changed in place, the
+ * filter points to it afterwards.
+ */
+static void applyDeviceEnv(struct clh_device_filter *filter, char *env)
+{
+	char *tok, *save;
+
+	for (tok = strtok_r(env, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+	{
+		if (!strcmp(tok, "gpu"))
+			filter->type = CL_DEVICE_TYPE_GPU;
+		else if (!strcmp(tok, "cpu"))
+			filter->type = CL_DEVICE_TYPE_CPU;
+		else if (!strcmp(tok, "accel"))
+			filter->type = CL_DEVICE_TYPE_ACCELERATOR;
+		else if (!strcmp(tok, "any"))
+			filter->type = CL_DEVICE_TYPE_ALL;
+		else if (!strcmp(tok, "fastest"))
+			filter->rank = 1;
+		else if (!strcmp(tok, "host"))
+			filter->fallback = CLH_FALLBACK_FORCE;
+		else if (!strncmp(tok, "platform=", 9))
+			filter->platform_name = tok + 9;
+		else if (!strncmp(tok, "name=", 5))
+			filter->device_name = tok + 5;
+		else if (!strncmp(tok, "mem=", 4))
+			filter->min_global_mem = strtoull(tok + 4, NULL, 10) * MB;
+		else if (!strncmp(tok, "local=", 6))
+			filter->min_local_mem = strtoull(tok + 6, NULL, 10) * KB;
+		else
+			fprintf(stderr, "clHelper: Unknown CLH_DEVICE option: %s\n", tok);
+	}
+}
+
+/**
+ * Selects a device from the list.
+ * @param devices Device list.
+ * @param count Number of devices.
+ * @param filter Selection filter.
+ * @returns The device index, or -1 if none matches.
+ */
+static int selectDevice(const struct clh_device_info *devices, int count,
+	const struct clh_device_filter *filter)
+{
+	int best = -1;
+
+	for (int i = 0; i < count; i++)
+	{
+		if (!matchDevice(&devices[i], filter))
+			continue;
+
+		if (best < 0)
+			best = i;
+		else if (!filter->rank)
+			break;
+		else if (deviceScore(&devices[i]) > deviceScore(&devices[best]))
+			best = i;
+	}
+	return (best);
+}
+
+/**
+ * Copies the device info into the legacy context fields.
+ * @param chc Context.
+ * @param info Device info.
+ */
+static void setDeviceInfo(struct cl_helper_context *chc,
+	const struct clh_device_info *info)
+{
+	chc->device = *info;
+
+	/* Some context. */
+	chc->device_id = info->id;
+
+	/* Device info. */
+	chc->device_type = info->type;
+	chc->max_group_size = info->max_group_size;
+	chc->max_items_dimensions = info->max_items_dimensions;
+	chc->max_work_item_size[0] = info->max_work_item_size[0];
+	chc->max_work_item_size[1] = info->max_work_item_size[1];
+	chc->max_work_item_size[2] = info->max_work_item_size[2];
+	chc->global_work_size = info->global_work_size;
+	chc->global_mem_size = info->global_mem_size;
+	chc->local_mem_size = info->local_mem_size;
+}
+
+/**
+ * Creates the compute context and one command queue per device, the
+ * first one being chc->command_queue.
+ * @param chc Context, with the device info already set.
+ * @param ids Devices.
+ * @param n Number of devices.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+static int createContext(struct cl_helper_context *chc,
+	const cl_device_id *ids, int n)
+{
+	int err;
+
+	/* Host and device share the memory? (CPUs and integrated GPUs). */
+	{
+		cl_bool unified = CL_FALSE;
+		clGetDeviceInfo(chc->device_id, CL_DEVICE_HOST_UNIFIED_MEMORY,
+			sizeof(unified), &unified, NULL);
+		chc->host_unified = (unified || chc->device_type == CL_DEVICE_TYPE_CPU);
+	}
+
+	chc->devices = malloc(sizeof(cl_device_id) * n);
+	chc->queues  = calloc(n, sizeof(cl_command_queue));
+	chc->weights = malloc(sizeof(double) * n);
+	if (!chc->devices || !chc->queues || !chc->weights)
+		return (-CLH_NOT_COM_CONT);
+
+	memcpy(chc->devices, ids, sizeof(cl_device_id) * n);
+	for (int i = 0; i < n; i++)
+		chc->weights[i] = 1.0;
+	chc->num_devices = n;
+
+	/* Create a compute context. */
+	chc->context = clCreateContext(0, n, ids, NULL, NULL, &err);
+	if (!chc->context)
+	{
+		fprintf(stderr, "clHelper: Failed to create a compute context!\n");
+		return (-CLH_NOT_COM_CONT);
+	}
+
+	/* Create the command queues. */
+	for (int i = 0; i < n; i++)
+	{
+		chc->queues[i] = clCreateCommandQueue(chc->context, ids[i],
+			CL_QUEUE_PROFILING_ENABLE, &err);
+
+		if (!chc->queues[i])
+		{
+			fprintf(stderr, "clHelper: Failed to create a command queue!\n");
+			return (-CLH_NOT_COM_QUEUE);
+		}
+	}
+	chc->command_queue = chc->queues[0];
+
+	/* Binary cache, if requested by the environment. */
+	if (getenv("CLH_CACHE_DIR"))
+		clhSetCacheDir(chc, getenv("CLH_CACHE_DIR"));
+
+	return (CLH_OK);
+}
+
+/**
+ * Starts the clHelper context on the first GPU found, or on the device
+ * given by the CLH_DEVICE environment variable, if set.
+ * Contexts can be started from several threads at once, the device
+ * info is probed only once per process and shared by all of them.
+ * If no device is found and the CLH_FALLBACK environment variable is
+ * set, the context runs the native kernels on the host instead.
+ * @param chc Context.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhStartContext(struct cl_helper_context *chc)
+{
+	struct clh_device_filter filter;
+
+	memset(&filter, 0, sizeof(filter));
+	filter.type = CL_DEVICE_TYPE_GPU;
+	return (clhStartContextEx(chc, &filter));
+}
+
+/**
+ * Starts the clHelper context on the device that matches the given
+ * filter: the first one found or, if filter->rank is set, the one with
+ * the most compute units x clock. The CLH_DEVICE environment variable,
+ * if set, overrides the filter fields.
+ * With filter->fallback set, a context with no matching device runs
+ * the native kernels on the host, see clhRegisterNative.
+ * @param chc Context.
+ * @param filter Selection filter, NULL means any device.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhStartContextEx(struct cl_helper_context *chc,
+	const struct clh_device_filter *filter)
+{
+	struct clh_device_info *devices;
+	struct clh_device_info host;
+	struct clh_device_filter f;
+	double start;
+	char *env;
+	int count;
+	int sel;
+	int ret;
+
+	/* Clean the context structure. */
+	memset(chc, 0, sizeof(struct cl_helper_context));
+	start = nowMs();
+
+	memset(&f, 0, sizeof(f));
+	f.type = CL_DEVICE_TYPE_ALL;
+	if (filter)
+		f = *filter;
+
+	/* Environment override. */
+	env = getenv("CLH_DEVICE") ? strDup(getenv("CLH_DEVICE")) : NULL;
+	if (env)
+		applyDeviceEnv(&f, env);
+
+	sel = -1;
+	devices = NULL;
+	if (f.fallback != CLH_FALLBACK_FORCE &&
+		probeDevices(&devices, &count, &chc->probe_cached) == CLH_OK)
+	{
+		sel = selectDevice(devices, count, &f);
+	}
+
+	if (sel >= 0)
+		setDeviceInfo(chc, &devices[sel]);
+
+	free(devices);
+	free(env);
+
+	if (chc->device_id == NULL)
+	{
+		/* Keep serving from the host, if allowed. */
+		if (!f.fallback && !getenv("CLH_FALLBACK"))
+		{
+			fprintf(stderr, "clHelper: No device matching the selection was"
+				" found in the system\n");
+			return (-CLH_GPU_NOT_FOUND);
+		}
+
+		if (f.fallback != CLH_FALLBACK_FORCE)
+			fprintf(stderr, "clHelper: No device found, running kernels on the"
+				" host\n");
+
+		if ((ret = cpuStart(chc, &host)) != CLH_OK)
+			return (ret);
+
+		setDeviceInfo(chc, &host);
+		chc->startup_ms = nowMs() - start;
+		return (CLH_OK);
+	}
+
+#ifdef CL_DEBUG
+	fprintf(stderr, "\nSelected device: %s (%s)\n", chc->device.name,
+		chc->device.platform_name);
+#endif
+
+	ret = createContext(chc, &chc->device_id, 1);
+	chc->startup_ms = nowMs() - start;
+	return (ret);
+}
+
+/**
+ * Starts the clHelper context on several devices at once, all the
+ * devices that match the filter (up to @p max_devices) on the platform
+ * with the most matching devices, since a context cannot span
+ * platforms. There is one command queue per device (chc->queues), the
+ * first one is also chc->command_queue, and the programs are built for
+ * all of them. The legacy device fields hold the most restrictive
+ * limits among the devices, so block sizes valid for one are valid for
+ * all.
+ * @param chc Context.
+ * @param filter Selection filter, NULL means any device.
+ * @param max_devices Maximum number of devices, 0 for all.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhStartContextMulti(struct cl_helper_context *chc,
+	const struct clh_device_filter *filter, int max_devices)
+{
+	struct clh_device_info *devices, *sel;
+	struct clh_device_filter f;
+	cl_platform_id platform;
+	cl_device_id *ids;
+	int count, best, n;
+	double total;
+	double start;
+	char *env;
+	int ret;
+
+	memset(chc, 0, sizeof(struct cl_helper_context));
+	start = nowMs();
+
+	memset(&f, 0, sizeof(f));
+	f.type = CL_DEVICE_TYPE_ALL;
+	if (filter)
+		f = *filter;
+
+	env = getenv("CLH_DEVICE") ? strDup(getenv("CLH_DEVICE")) : NULL;
+	if (env)
+		applyDeviceEnv(&f, env);
+
+	ret = -CLH_GPU_NOT_FOUND;
+	sel = NULL;
+	ids = NULL;
+	if (probeDevices(&devices, &count, &chc->probe_cached) != CLH_OK)
+		goto out;
+
+	/* Platform with the most matching devices. */
+	best = 0;
+	platform = NULL;
+	for (int i = 0; i < count; i++)
+	{
+		int matches = 0;
+		if (!matchDevice(&devices[i], &f))
+			continue;
+		for (int j = 0; j < count; j++)
+			matches += (devices[j].platform == devices[i].platform &&
+				matchDevice(&devices[j], &f));
+		if (matches > best)
+		{
+			best = matches;
+			platform = devices[i].platform;
+		}
+	}
+
+	if (!best)
+		goto out;
+
+	/* Collect them, fastest first if ranking. */
+	sel = malloc(sizeof(*sel) * best);
+	ids = malloc(sizeof(cl_device_id) * best);
+	if (!sel || !ids)
+		goto out;
+
+	n = 0;
+	for (int i = 0; i < count; i++)
+		if (devices[i].platform == platform && matchDevice(&devices[i], &f))
+			sel[n++] = devices[i];
+
+	for (int i = 1; f.rank && i < n; i++)
+	{
+		for (int j = i; j > 0 && deviceScore(&sel[j]) > deviceScore(&sel[j-1]);
+			j--)
+		{
+			struct clh_device_info tmp = sel[j];
+			sel[j] = sel[j-1];
+			sel[j-1] = tmp;
+		}
+	}
+
+	if (max_devices > 0 && n > max_devices)
+		n = max_devices;
+
+	/* Most restrictive limits. */
+	setDeviceInfo(chc, &sel[0]);
+	for (int i = 0; i < n; i++)
+	{
+		ids[i] = sel[i].id;
+#ifdef CL_DEBUG
+		fprintf(stderr, "\nSelected device #%d: %s (%s)\n", i, sel[i].name,
+			sel[i].platform_name);
+#endif
+		if (sel[i].max_group_size < chc->max_group_size)
+			chc->max_group_size = sel[i].max_group_size;
+		for (int d = 0; d < 3; d++)
+			if (sel[i].max_work_item_size[d] < chc->max_work_item_size[d])
+				chc->max_work_item_size[d] = sel[i].max_work_item_size[d];
+		if (sel[i].global_mem_size < chc->global_mem_size)
+			chc->global_mem_size = sel[i].global_mem_size;
+		if (sel[i].local_mem_size < chc->local_mem_size)
+			chc->local_mem_size = sel[i].local_mem_size;
+	}
+
+	ret = createContext(chc, ids, n);
+
+	/* Declared throughput: compute units x clock. */
+	total = 0;
+	for (int i = 0; ret == CLH_OK && i < n; i++)
+		total += deviceScore(&sel[i]);
+	for (int i = 0; ret == CLH_OK && total > 0 && i < n; i++)
+		chc->weights[i] = deviceScore(&sel[i]) / total;
+
+out:
+	if (ret == -CLH_GPU_NOT_FOUND)
+	{
+		fprintf(stderr, "clHelper: No device matching the selection was found"
+			" in the system\n");
+	}
+	free(devices);
+	free(env);
+	free(sel);
+	free(ids);
+	chc->startup_ms = nowMs() - start;
+	return (ret);
+}
+
+/**
+ * Rounds a work size according to the context size mode: to the next
+ * power of two (CLH_SIZE_POW2), to the next multiple of the local
+ * size (CLH_SIZE_EXACT) or not at all (CLH_SIZE_SPLIT).
+ * @param chc Context.
+ * @param size Size to be rounded.
+ * @param local Local size in the same axis, 0 if unknown.
+ * @returns The rounded size.
+ */
+static size_t roundSize(struct cl_helper_context *chc, size_t size,
+	size_t local)
+{
+	switch (chc->size_mode)
+	{
+		case CLH_SIZE_EXACT:
+			if (local)
+				return (((size + local - 1) / local) * local);
+			return (size);
+		case CLH_SIZE_SPLIT:
+			return (size);
+		default:
+			return (roundPower(size));
+	}
+}
+
+/**
+ * Sets how the global (and local) sizes are rounded. CLH_SIZE_POW2
+ * (the default) rounds everything to powers of two. CLH_SIZE_EXACT
+ * keeps the local size as is and rounds the global size only up to
+ * the next multiple of the local size. CLH_SIZE_SPLIT keeps the exact
+ * global size, and the launches run the aligned body and the ragged
+ * remainder as separate enqueues.
+ * @param chc Context.
+ * @param mode Size mode.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhSetSizeMode(struct cl_helper_context *chc, int mode)
+{
+	if (mode != CLH_SIZE_POW2 && mode != CLH_SIZE_EXACT &&
+		mode != CLH_SIZE_SPLIT)
+	{
+		return (-CLH_INV_ARG);
+	}
+	chc->size_mode = mode;
+	return (CLH_OK);
+}
+
+/**
+ * Lets the runtime choose the local size (local = NULL), only the
+ * number of dimensions is set. Use clhSetGlobalSize afterwards.
+ * @param chc Context.
+ * @param dimensions Number of dimensions (1, 2 or 3).
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhSetAutoLocalSize(struct cl_helper_context *chc, int dimensions)
+{
+	if (dimensions < 1 || dimensions > 3)
+	{
+		fprintf(stderr, "clHelper: Invalid number of dimensions!\n");
+		return (-CLH_INV_DIM);
+	}
+
+	free(chc->localWorkSize);
+	chc->localWorkSize = NULL;
+	chc->dimensions = dimensions;
+	return (CLH_OK);
+}
+
+/**
+ * Sets the local work size, i.e: the block size.
+ * @param x X-Axis.
+ * @param y Y-Axis.
+ * @param z Z-Axis.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise. 
+ */
+int clhSetBlockSize(struct cl_helper_context *chc, size_t x, size_t y, size_t z)
+{
+	int dimensions;
+	size_t xx = (x == 0) ? 1 : x;
+	size_t yy = (y == 0) ? 1 : y;
+	size_t zz = (z == 0) ? 1 : z;
+	
+	/* Check bounds. */
+	if (xx*yy*zz > chc->max_group_size  || xx > chc->max_work_item_size[0] ||
+		yy > chc->max_work_item_size[1] || zz > chc->max_work_item_size[2])
+	{
+		fprintf(stderr, "clHelper: Invalid work-item/block size!!\n");
+		return (-CLH_INV_WORK_ITEM);
+	}
+	
+	/* Check first dimension. */
+	if (!x)
+	{
+		fprintf(stderr, "clHelper: Invalid dimension, X should be at least 1\n");
+		return (-CLH_INV_DIM);
+	}
+	
+	/* Get number of dimensions. */
+	dimensions = 1;
+	if (y != 0) dimensions++;
+	if (z != 0) dimensions++;
+	chc->dimensions = dimensions;
+
+	/* Allocate and set local work sizes. */
+	if (chc->localWorkSize != NULL)
+		free(chc->localWorkSize);
+	
+	chc->localWorkSize = malloc(sizeof(size_t) * dimensions);
+	chc->localWorkSize[0] = (chc->size_mode == CLH_SIZE_POW2) ? roundPower(x) : x;
+	if (y)
+		chc->localWorkSize[1] = (chc->size_mode == CLH_SIZE_POW2) ? roundPower(y) : y;
+	if (z)
+		chc->localWorkSize[2] = (chc->size_mode == CLH_SIZE_POW2) ? roundPower(z) : z;
+		
+	return (CLH_OK);
+}
+
+/**
+ * Sets the local work size. It's the same thing as the function
+ * above, just an alias.
+ * @param chc Context.
+ * @param x X-Axis.
+ * @param y Y-Axis.
+ * @param z Z-Axis.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhSetLocalSize(struct cl_helper_context *chc, size_t x, size_t y, size_t z)
+{
+	return clhSetBlockSize(chc, x, y, z);
+}
+
+/**
+ * Configures the global work size, i.e: the grid size.
+ * @param chc Context.
+ * @param x X-Axis.
+ * @param y Y-Axis.
+ * @param z Z-Axis.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhSetGridSize(struct cl_helper_context *chc, size_t x, size_t y, size_t z)
+{
+	/* Check if local size was already set. */
+	if (chc->dimensions <= 0 || !chc->localWorkSize)
+	{
+		fprintf(stderr, "clHelper: The grid size should be set *after*"
+			" blockSize!\n");
+		return (-CLH_INV_GRID);
+	}
+	
+	int dimensions;
+	/* Check first dimension. */
+	if (!x)
+	{
+		fprintf(stderr, "clHelper: Invalid dimension, X should be at least 1\n");
+		return (-CLH_INV_DIM);
+	}
+	
+	/* Get number of dimensions. */
+	dimensions = 1;
+	if (y != 0) dimensions++;
+	if (z != 0) dimensions++;
+	
+	if (chc->dimensions != dimensions)
+	{
+		fprintf(stderr, "clHelper: Grid size should be the same dimension as"
+			" the block size!\n");
+		return (-CLH_INV_DIM);
+	}
+	
+	/* Allocate and set local work sizes. */
+	if (chc->globalWorkSize != NULL)
+		free(chc->globalWorkSize);
+	
+	chc->globalWorkSize = malloc(sizeof(size_t) * dimensions);
+	chc->globalWorkSize[0] = roundSize(chc, chc->localWorkSize[0] * x, 0);
+	if (y)
+		chc->globalWorkSize[1] = roundSize(chc, chc->localWorkSize[1] * y, 0);
+	if (z)
+		chc->globalWorkSize[2] = roundSize(chc, chc->localWorkSize[2] * z, 0);
+		
+#ifdef CL_DEBUG
+	fprintf(stderr, "\nLocal size: ( ");
+	for (int i = 0; i < dimensions; i++)
+		fprintf(stderr, "%zd ", chc->localWorkSize[0]);
+	fprintf(stderr, ")\n");
+	
+	fprintf(stderr, "Global size: ( ");
+	for (int i = 0; i < dimensions; i++)
+		fprintf(stderr, "%zd ", chc->globalWorkSize[0]);
+	fprintf(stderr, ")\n");
+#endif
+
+	return (CLH_OK);
+}
+
+/**
+ * Sets the global size, i.e: the total number of work-items in each axis.
+ * @param chc Context.
+ * @param x X-Axis.
+ * @param y Y-Axis.
+ * @param z Z-Axis.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhSetGlobalSize(struct cl_helper_context *chc, size_t x, size_t y, size_t z)
+{
+	int dimensions;
+	/* Check first dimension. */
+	if (!x)
+	{
+		fprintf(stderr, "clHelper: Invalid dimension, X should be at least 1\n");
+		return (-CLH_INV_DIM);
+	}
+	
+	/* Get number of dimensions. */
+	dimensions = 1;
+	if (y != 0) dimensions++;
+	if (z != 0) dimensions++;
+	
+	if (chc->dimensions != dimensions)
+	{
+		fprintf(stderr, "clHelper: Global size should be the same dimension as"
+			" the local size!\n");
+		return (-CLH_INV_DIM);
+	}
+	
+	/* Allocate and set local work sizes. */
+	if (chc->globalWorkSize != NULL)
+		free(chc->globalWorkSize);
+	
+	chc->globalWorkSize = malloc(sizeof(size_t) * dimensions);
+	for (int i = 0; i < dimensions; i++)
+	{
+		size_t sz = (i == 0) ? x : (i == 1) ? y : z;
+		chc->globalWorkSize[i] = roundSize(chc, sz,
+			chc->localWorkSize ? chc->localWorkSize[i] : 0);
+	}
+		
+	return (CLH_OK);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Profiling recorder.                                                       *
+ * ------------------------------------------------------------------------- */
+
+/**
+ * Enables the profiling recorder: every enqueued command (kernels and
+ * transfers) made through clHelper is kept in a ring buffer of
+ * @p capacity records, with its queued, submit, start and end times.
+ * To keep the overhead low in production, only one every
+ * @p sample_every commands is recorded.
+ * @param chc Context.
+ * @param capacity Ring buffer size, 0 disables the recorder.
+ * @param sample_every Sampling rate, 1 records everything.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhProfilerEnable(struct cl_helper_context *chc, int capacity,
+	int sample_every)
+{
+	struct clh_profiler *prof = &chc->prof;
+
+	clhProfilerReset(chc);
+	free(prof->ring);
+	memset(prof, 0, sizeof(*prof));
+
+	if (capacity <= 0)
+		return (CLH_OK);
+
+	prof->ring = calloc(capacity, sizeof(struct clh_prof_record));
+	if (prof->ring == NULL)
+		return (-CLH_OUT_OF_MEM);
+
+	prof->capacity = capacity;
+	prof->sample_every = (sample_every > 0) ? sample_every : 1;
+	return (CLH_OK);
+}
+
+/**
+ * Decides if the next command should be recorded.
+ * @param chc Context.
+ * @returns 1 if the command should be recorded, 0 otherwise.
+ */
+static int profSample(struct cl_helper_context *chc)
+{
+	struct clh_profiler *prof = &chc->prof;
+
+	if (!prof->capacity)
+		return (0);
+	return ((prof->seen++ % prof->sample_every) == 0);
+}
+
+/**
+ * Reads the profiling info of a record and releases its event.
+ * @param rec Record.
+ */
+static void profResolve(struct clh_prof_record *rec)
+{
+	if (!rec->event)
+		return;
+
+	clWaitForEvents(1, &rec->event);
+	clGetEventProfilingInfo(rec->event, CL_PROFILING_COMMAND_QUEUED,
+		sizeof(cl_ulong), &rec->queued, NULL);
+	clGetEventProfilingInfo(rec->event, CL_PROFILING_COMMAND_SUBMIT,
+		sizeof(cl_ulong), &rec->submit, NULL);
+	clGetEventProfilingInfo(rec->event, CL_PROFILING_COMMAND_START,
+		sizeof(cl_ulong), &rec->start, NULL);
+	clGetEventProfilingInfo(rec->event, CL_PROFILING_COMMAND_END,
+		sizeof(cl_ulong), &rec->end, NULL);
+
+	clReleaseEvent(rec->event);
+	rec->event = NULL;
+}
+
+/**
+ * Adds a command to the ring buffer. The profiling info is only read
+ * when exported, so recording never waits for a command: the record
+ * overwritten is dropped, and counted if its command did not finish.
+ * @param chc Context.
+ * @param event Command event, retained by the recorder.
+ * @param queue Queue the command was enqueued to.
+ * @param kind Command kind (CLH_PROF_*).
+ * @param kernel Kernel, for CLH_PROF_KERNEL, NULL otherwise.
+ * @param bytes Bytes moved, for transfers.
+ */
+static void profAdd(struct cl_helper_context *chc, cl_event event,
+	cl_command_queue queue, int kind, cl_kernel kernel, size_t bytes)
+{
+	struct clh_profiler *prof = &chc->prof;
+	struct clh_kernel_entry *entry;
+	struct clh_prof_record *rec;
+	cl_int status;
+
+	if (!prof->capacity || !event)
+		return;
+
+	rec = &prof->ring[prof->count % prof->capacity];
+	if (rec->event)
+	{
+		if (clGetEventInfo(rec->event, CL_EVENT_COMMAND_EXECUTION_STATUS,
+			sizeof(status), &status, NULL) != CL_SUCCESS ||
+			status != CL_COMPLETE)
+		{
+			prof->dropped++;
+		}
+		clReleaseEvent(rec->event);
+	}
+	memset(rec, 0, sizeof(*rec));
+
+	clRetainEvent(event);
+	rec->event = event;
+	rec->queue = queue;
+	rec->kind  = kind;
+	rec->bytes = bytes;
+
+	if (kernel)
+	{
+		if ((entry = findKernel(chc, kernel)) != NULL)
+			snprintf(rec->name, sizeof(rec->name), "%s", entry->name);
+		else
+			clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, sizeof(rec->name),
+				rec->name, NULL);
+	}
+	else
+	{
+		snprintf(rec->name, sizeof(rec->name), "%s",
+			kind == CLH_PROF_WRITE ? "write" : kind == CLH_PROF_READ ? "read" :
+			"copy");
+	}
+
+	prof->count++;
+}
+
+/**
+ * Drops all the records.
+ * @param chc Context.
+ * @returns Always CLH_OK.
+ */
+int clhProfilerReset(struct cl_helper_context *chc)
+{
+	struct clh_profiler *prof = &chc->prof;
+
+	for (int i = 0; i < prof->capacity; i++)
+	{
+		if (prof->ring[i].event)
+			clReleaseEvent(prof->ring[i].event);
+		memset(&prof->ring[i], 0, sizeof(struct clh_prof_record));
+	}
+	prof->count   = 0;
+	prof->seen    = 0;
+	prof->dropped = 0;
+	return (CLH_OK);
+}
+
+/**
+ * Exports the recorded commands as Chrome trace-event JSON (open it
+ * in chrome://tracing or ui.perfetto.dev). Each queue is a track: the
+ * command execution (start to end) is shown as a slice, and the time
+ * it spent waiting in the queue (queued to start) as a slice in a
+ * companion track.
+ * @param chc Context.
+ * @param path Output file.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhProfilerExport(struct cl_helper_context *chc, const char *path)
+{
+	static const char *kinds[] = {"kernel", "write", "read", "copy"};
+	struct clh_profiler *prof = &chc->prof;
+	cl_command_queue queues[64];
+	struct clh_prof_record *rec;
+	cl_ulong base;
+	int nqueues;
+	int first;
+	int n, tid;
+	FILE *fp;
+
+	if ((fp = fopen(path, "w")) == NULL)
+		return (-CLH_FILE_ERROR);
+
+	n = (prof->count < (unsigned long)prof->capacity) ?
+		(int)prof->count : prof->capacity;
+
+	/* Resolve pending records and find the time base. */
+	base = 0;
+	for (int i = 0; i < n; i++)
+	{
+		profResolve(&prof->ring[i]);
+		if (i == 0 || prof->ring[i].queued < base)
+			base = prof->ring[i].queued;
+	}
+
+	fprintf(fp, "{\"traceEvents\":[\n");
+	first = 1;
+	nqueues = 0;
+	for (int i = 0; i < n; i++)
+	{
+		rec = &prof->ring[i];
+
+		/* Queue track. */
+		for (tid = 0; tid < nqueues && queues[tid] != rec->queue; tid++);
+		if (tid == nqueues && nqueues < 64)
+		{
+			queues[nqueues++] = rec->queue;
+			fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,"
+				"\"tid\":%d,\"args\":{\"name\":\"queue %d\"}},\n"
+				"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,"
+				"\"tid\":%d,\"args\":{\"name\":\"queue %d (waiting)\"}}",
+				first ? "" : ",\n", tid * 2, tid, tid * 2 + 1, tid);
+			first = 0;
+		}
+
+		/* Execution. */
+		fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+			"\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+			"\"args\":{\"bytes\":%zu,\"queued_us\":%.3f,\"submit_us\":%.3f}}",
+			rec->name, kinds[rec->kind & 3], tid * 2,
+			(rec->start - base) / 1000.0, (rec->end - rec->start) / 1000.0,
+			rec->bytes, (rec->queued - base) / 1000.0,
+			(rec->submit - base) / 1000.0);
+
+		/* Queueing latency. */
+		fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"queued\",\"ph\":\"X\","
+			"\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+			rec->name, tid * 2 + 1, (rec->queued - base) / 1000.0,
+			(rec->start - rec->queued) / 1000.0);
+	}
+	fprintf(fp, "\n]}\n");
+
+	if (fclose(fp) == EOF)
+		return (-CLH_FILE_ERROR);
+	return (CLH_OK);
+}
+
+/**
+ * Enqueues a kernel in CLH_SIZE_SPLIT mode: the aligned body (the
+ * largest region multiple of the local size) runs with the local
+ * size, and each ragged remainder runs as a separate enqueue, with
+ * its global offset and a runtime-chosen local size.
+ * @param chc Context.
+ * @param queue Command queue.
+ * @param kernel Kernel to be enqueued.
+ * @param dims Number of dimensions.
+ * @param gws Global work size.
+ * @param lws Local work size.
+ * @param num_wait Number of events in the wait list.
+ * @param wait_list Events to be waited before the kernel starts.
+ * @param event Returned event, signaled when all the parts finish,
+ * may be NULL.
+ * @param span_ms If not NULL, waits for the parts and returns the
+ * time between the first start and the last end.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+static int enqueueSplit(struct cl_helper_context *chc, cl_command_queue queue,
+	cl_kernel kernel, int dims, const size_t *gws, const size_t *lws,
+	cl_uint num_wait, const cl_event *wait_list, cl_event *event,
+	double *span_ms)
+{
+	size_t body[3], offset[3], global[3];
+	cl_ulong start, end, t;
+	cl_event parts[8];
+	int nparts;
+	int err;
+
+	for (int i = 0; i < dims; i++)
+		body[i] = (gws[i] / lws[i]) * lws[i];
+
+	/* Each bit of the mask selects the remainder (1) or body (0). */
+	err = CL_SUCCESS;
+	nparts = 0;
+	for (int mask = 0; mask < (1 << dims) && err == CL_SUCCESS; mask++)
+	{
+		int empty = 0;
+		for (int i = 0; i < dims; i++)
+		{
+			offset[i] = (mask & (1 << i)) ? body[i] : 0;
+			global[i] = (mask & (1 << i)) ?
+				gws[i] - body[i] : body[i];
+			empty |= (global[i] == 0);
+		}
+		if (empty)
+			continue;
+
+		err = clEnqueueNDRangeKernel(queue, kernel, dims, offset, global,
+			mask ? NULL : lws, num_wait, wait_list,
+			&parts[nparts]);
+		if (err != CL_SUCCESS)
+			break;
+
+		if (profSample(chc))
+			profAdd(chc, parts[nparts], queue, CLH_PROF_KERNEL, kernel, 0);
+		nparts++;
+	}
+
+	if (err != CL_SUCCESS)
+		fprintf(stderr, "clHelper: Failed to execute kernel! %d\n", err);
+
+	/* Merged event. */
+	if (err == CL_SUCCESS && event)
+	{
+		if (nparts == 1)
+			clRetainEvent(*event = parts[0]);
+		else
+			err = clEnqueueMarkerWithWaitList(queue, nparts, parts, event);
+	}
+
+	if (span_ms)
+	{
+		start = end = 0;
+		clhWaitEvents(nparts, parts);
+		for (int i = 0; i < nparts; i++)
+		{
+			clGetEventProfilingInfo(parts[i], CL_PROFILING_COMMAND_START,
+				sizeof(t), &t, NULL);
+			if (i == 0 || t < start)
+				start = t;
+			clGetEventProfilingInfo(parts[i], CL_PROFILING_COMMAND_END,
+				sizeof(t), &t, NULL);
+			if (t > end)
+				end = t;
+		}
+		*span_ms = (end - start) / 1000000.0;
+	}
+
+	for (int i = 0; i < nparts; i++)
+		clReleaseEvent(parts[i]);
+
+	return ((err == CL_SUCCESS) ? CLH_OK : -CLH_KERN_FAIL);
+}
+
+/**
+ * Enqueues a kernel with the current NDRange configuration.
+ * @param chc Context.
+ * @param queue Command queue.
+ * @param kernel Kernel to be enqueued.
+ * @param num_wait Number of events in the wait list.
+ * @param wait_list Events to be waited before the kernel starts.
+ * @param event Returned kernel event, may be NULL.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+static int enqueueKernel(struct cl_helper_context *chc, cl_command_queue queue,
+	cl_kernel kernel, cl_uint num_wait, const cl_event *wait_list,
+	cl_event *event)
+{
+	cl_event tmp;
+	int rec;
+	int err;
+
+	if ((err = trackedLaunch(chc, kernel, queue)) != CLH_OK)
+	{
+		trackedLaunched(chc, kernel);
+		return (err);
+	}
+
+	if (chc->size_mode == CLH_SIZE_SPLIT && chc->localWorkSize)
+	{
+		err = enqueueSplit(chc, queue, kernel, chc->dimensions,
+			chc->globalWorkSize, chc->localWorkSize, num_wait, wait_list,
+			event, NULL);
+		trackedLaunched(chc, kernel);
+		return (err);
+	}
+
+	/* Sampled by the profiler? Then an event is needed anyway. */
+	rec = profSample(chc);
+	tmp = NULL;
+
+	err = clEnqueueNDRangeKernel(queue, kernel, chc->dimensions, NULL,
+		chc->globalWorkSize, chc->localWorkSize, num_wait, wait_list,
+		event ? event : (rec ? &tmp : NULL));
+	trackedLaunched(chc, kernel);
+
+	if (err != CL_SUCCESS)
+	{
+		fprintf(stderr, "clHelper: Failed to execute kernel! %d\n", err);
+		return (-CLH_KERN_FAIL);
+	}
+
+	if (rec)
+		profAdd(chc, event ? *event : tmp, queue, CLH_PROF_KERNEL, kernel, 0);
+	if (tmp)
+		clReleaseEvent(tmp);
+	return (CLH_OK);
+}
+
+/**
+ * Launch a given kernel and measures the time spent.
+ * @param chc Context.
+ * @param kernel Kernel to be launched, as returned by clhGetKernel.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhLaunchKernelHandle(struct cl_helper_context *chc, cl_kernel kernel)
+{
+	int err; /* Error code. */
+
+	if (chc->fallback)
+		return (cpuLaunch(chc, kernel));
+
+	/* Previous launch event is no longer needed. */
+	if (chc->event)
+	{
+		clReleaseEvent(chc->event);
+		chc->event = NULL;
+	}
+
+	/* Split launches are timed from the first part to the last one. */
+	if (chc->size_mode == CLH_SIZE_SPLIT && chc->localWorkSize)
+	{
+		err = trackedLaunch(chc, kernel, chc->command_queue);
+		if (err == CLH_OK)
+		{
+			err = enqueueSplit(chc, chc->command_queue, kernel,
+				chc->dimensions, chc->globalWorkSize, chc->localWorkSize, 0,
+				NULL, &chc->event, &chc->time_ms);
+		}
+		trackedLaunched(chc, kernel);
+		return (err);
+	}
+
+	/* Launches the kernel. */
+	err = enqueueKernel(chc, chc->command_queue, kernel, 0, NULL, &chc->event);
+	if (err != CLH_OK)
+		return (err);
+
+	/* Wait finishes and save the time spent. */
+	return (clhEventTime(chc->event, &chc->time_ms));
+}
+
+/**
+ * Launch a given kernel without waiting it finishes. The kernel is
+ * flushed to the device and the function returns immediately, so the
+ * host can keep working or enqueue more work in the meantime.
+ * @param chc Context.
+ * @param kernel Kernel to be launched.
+ * @param num_wait Number of events in the wait list.
+ * @param wait_list Events that must complete before the kernel
+ * starts, may be NULL.
+ * @param event Returned kernel event, may be NULL. The caller owns
+ * the event and must release it with clReleaseEvent.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhLaunchKernelAsync(struct cl_helper_context *chc, cl_kernel kernel,
+	cl_uint num_wait, const cl_event *wait_list, cl_event *event)
+{
+	int err;
+
+	/* Host launches are synchronous, no event to wait for. */
+	if (chc->fallback)
+	{
+		if (event)
+			*event = NULL;
+		return (cpuLaunch(chc, kernel));
+	}
+
+	err = enqueueKernel(chc, chc->command_queue, kernel, num_wait, wait_list,
+		event);
+	if (err != CLH_OK)
+		return (err);
+
+	/* Make sure the device starts working without waiting. */
+	clFlush(chc->command_queue);
+	return (CLH_OK);
+}
+
+/**
+ * Waits for a list of events. NULL entries (e.g. launches of the host
+ * fallback, which have no event) are skipped.
+ * @param num Number of events.
+ * @param events Event list.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhWaitEvents(cl_uint num, const cl_event *events)
+{
+	cl_uint first, count;
+	int err;
+
+	err = CL_SUCCESS;
+	for (first = 0; first < num && err == CL_SUCCESS; first += count)
+	{
+		/* Run of valid events, waited at once. */
+		for (count = 0; first + count < num && events[first + count]; count++)
+			;
+		if (count)
+			err = clWaitForEvents(count, events + first);
+		else
+			count = 1;
+	}
+
+	if (err != CL_SUCCESS)
+	{
+		fprintf(stderr, "clHelper: Failed to wait for events!\n");
+		return (-CLH_KERN_FAIL);
+	}
+	return (CLH_OK);
+}
+
+/**
+ * Waits until all the work submitted to the context queue finishes.
+ * @param chc Context.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhFinish(struct cl_helper_context *chc)
+{
+	if (chc->fallback)
+		return (CLH_OK);
+	if (clFinish(chc->command_queue) != CL_SUCCESS)
+		return (-CLH_KERN_FAIL);
+	return (CLH_OK);
+}
+
+/**
+ * Gets the time spent by an event, waiting for it if needed. Since
+ * the profiling info is only read here, launches that are never
+ * asked for their time do not pay for it.
+ * @param event Event to be queried.
+ * @param time_ms Time spent, in milliseconds.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhEventTime(cl_event event, double *time_ms)
+{
+	cl_ulong time_start; /* Kernel start time. */
+	cl_ulong time_end;   /* Kernel stop time.  */
+
+	if (clhWaitEvents(1, &event) != CLH_OK)
+		return (-CLH_KERN_FAIL);
+
+	/* Execution time. */
+	if (clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START,
+		sizeof(time_start), &time_start, NULL) != CL_SUCCESS ||
+		clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END,
+		sizeof(time_end), &time_end, NULL) != CL_SUCCESS)
+	{
+		return (-CLH_KERN_FAIL);
+	}
+
+	*time_ms = (time_end - time_start) / 1000000.0;
+	return (CLH_OK);
+}
+
+/**
+ * Launch the kernel and measures the time spent.
+ * @param chc Context.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise. 
+ */
+int clhLaunchKernel(struct cl_helper_context *chc)
+{
+	return (clhLaunchKernelHandle(chc, chc->kernel));
+}
+
+/* ------------------------------------------------------------------------- *
+ * Launch graphs.                                                            *
+ * ------------------------------------------------------------------------- */
+
+/**
+ * Creates an empty launch graph.
+ * @returns The graph, or NULL if error.
+ */
+struct clh_graph *clhGraphCreate(void)
+{
+	return (calloc(1, sizeof(struct clh_graph)));
+}
+
+/**
+ * Records a kernel launch into the graph, with the context NDRange
+ * configuration (dimensions, global and local sizes) at the moment of
+ * the call and the given arguments. Arguments are copied, except the
+ * data pointed by CLH_RAW, which must outlive the graph. Ragged sizes
+ * recorded in CLH_SIZE_SPLIT mode are replayed as split launches.
+ *
+ * Dependencies refer to previously recorded nodes. Since the graph is
+ * replayed in recording order on the in-order context queue, they are
+ * always honored.
+ *
+ * @param chc Context.
+ * @param g Graph.
+ * @param kernel Kernel.
+ * @param args Kernel arguments.
+ * @param nargs Number of arguments.
+ * @param ndeps Number of dependencies.
+ * @param deps Node indexes this launch depends on.
+ * @returns The node index if success and a negative number otherwise.
+ */
+int clhGraphAddLaunch(struct cl_helper_context *chc, struct clh_graph *g,
+	cl_kernel kernel, const struct clh_arg *args, int nargs, int ndeps,
+	const int *deps)
+{
+	struct clh_graph_node *node;
+	int capacity;
+
+	if (chc->dimensions <= 0 || !chc->globalWorkSize)
+		return (-CLH_INV_DIM);
+
+	for (int i = 0; i < ndeps; i++)
+		if (deps[i] < 0 || deps[i] >= g->num_nodes)
+			return (-CLH_INV_ARG);
+
+	if (g->num_nodes == g->max_nodes)
+	{
+		capacity = g->max_nodes ? g->max_nodes * 2 : 8;
+		node = realloc(g->nodes, sizeof(*node) * capacity);
+		if (node == NULL)
+			return (-CLH_OUT_OF_MEM);
+		g->nodes = node;
+		g->max_nodes = capacity;
+	}
+
+	node = &g->nodes[g->num_nodes];
+	memset(node, 0, sizeof(*node));
+	node->kernel = kernel;
+	node->dims = chc->dimensions;
+	node->has_local = (chc->localWorkSize != NULL);
+	for (int i = 0; i < node->dims; i++)
+	{
+		node->global[i] = chc->globalWorkSize[i];
+		node->local[i]  = node->has_local ? chc->localWorkSize[i] : 0;
+
+		/* Ragged sizes (CLH_SIZE_SPLIT), body and remainder apart. */
+		if (node->has_local && node->global[i] % node->local[i])
+			node->split = 1;
+	}
+
+	node->args = malloc(sizeof(struct clh_arg) * (nargs ? nargs : 1));
+	node->deps = malloc(sizeof(int) * (ndeps ? ndeps : 1));
+	if (!node->args || !node->deps)
+	{
+		free(node->args);
+		free(node->deps);
+		return (-CLH_OUT_OF_MEM);
+	}
+
+	memcpy(node->args, args, sizeof(struct clh_arg) * nargs);
+	memcpy(node->deps, deps, sizeof(int) * ndeps);
+	node->nargs = nargs;
+	node->ndeps = ndeps;
+	return (g->num_nodes++);
+}
+
+/**
+ * Patches an argument of a recorded launch, the new value is used by
+ * the next replays.
+ * @param g Graph.
+ * @param node Node index.
+ * @param idx Argument index.
+ * @param arg New argument value.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhGraphSetArg(struct clh_graph *g, int node, int idx, struct clh_arg arg)
+{
+	if (node < 0 || node >= g->num_nodes || idx < 0 ||
+		idx >= g->nodes[node].nargs)
+	{
+		return (-CLH_INV_ARG);
+	}
+
+	g->nodes[node].args[idx] = arg;
+	return (CLH_OK);
+}
+
+/**
+ * Replays all the recorded launches back to back, with a single
+ * flush at the end. Arguments that did not change since the last
+ * launch of the same kernel are not sent again.
+ *
+ * The host time spent to submit the graph is stored in g->submit_ms.
+ *
+ * @param chc Context.
+ * @param g Graph.
+ * @param event Event of the last launch, may be NULL. If NULL, the
+ * function waits for the graph and stores the wall time in
+ * chc->time_ms. Set to NULL if error or if the graph is empty.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhGraphReplay(struct cl_helper_context *chc, struct clh_graph *g,
+	cl_event *event)
+{
+	struct clh_graph_node *node;
+	cl_event ev;
+	double start;
+	int rec;
+	int ret;
+	int err;
+
+	if (event)
+		*event = NULL;
+
+	if (chc->fallback)
+		return (noDevice("clhGraphReplay"));
+
+	start = nowMs();
+	ret = CLH_OK;
+
+	for (int i = 0; i < g->num_nodes && ret == CLH_OK; i++)
+	{
+		node = &g->nodes[i];
+		ret = clhSetKernelArgs(chc, node->kernel, node->args, node->nargs);
+		if (ret != CLH_OK)
+			break;
+
+		rec = 0;
+		ev  = NULL;
+
+		if ((ret = trackedLaunch(chc, node->kernel, chc->command_queue)) !=
+			CLH_OK)
+		{
+			trackedLaunched(chc, node->kernel);
+			break;
+		}
+
+		/* Split launches sample each of their parts. */
+		if (node->split)
+		{
+			ret = enqueueSplit(chc, chc->command_queue, node->kernel,
+				node->dims, node->global, node->local, 0, NULL,
+				(event && i == g->num_nodes - 1) ? &ev : NULL, NULL);
+			trackedLaunched(chc, node->kernel);
+			if (ret != CLH_OK)
+				break;
+			if (event && i == g->num_nodes - 1)
+				*event = ev;
+			continue;
+		}
+
+		rec = profSample(chc);
+		err = clEnqueueNDRangeKernel(chc->command_queue, node->kernel,
+			node->dims, NULL, node->global, node->has_local ? node->local : NULL,
+			0, NULL, (rec || (event && i == g->num_nodes - 1)) ? &ev : NULL);
+		trackedLaunched(chc, node->kernel);
+
+		if (err != CL_SUCCESS)
+		{
+			fprintf(stderr, "clHelper: Failed to replay node #%d! %d\n", i, err);
+			ret = -CLH_KERN_FAIL;
+			break;
+		}
+
+		if (rec)
+			profAdd(chc, ev, chc->command_queue, CLH_PROF_KERNEL, node->kernel, 0);
+
+		if (event && i == g->num_nodes - 1)
+			*event = ev;
+		else if (ev)
+			clReleaseEvent(ev);
+	}
+
+	clFlush(chc->command_queue);
+	g->submit_ms = nowMs() - start;
+	g->replays++;
+
+	if (!event)
+	{
+		clFinish(chc->command_queue);
+		chc->time_ms = nowMs() - start;
+	}
+	return (ret);
+}
+
+/**
+ * Releases a launch graph.
+ * @param g Graph.
+ */
+void clhGraphRelease(struct clh_graph *g)
+{
+	if (g == NULL)
+		return;
+
+	for (int i = 0; i < g->num_nodes; i++)
+	{
+		free(g->nodes[i].args);
+		free(g->nodes[i].deps);
+	}
+	free(g->nodes);
+	free(g);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Work-group size tuner.                                                    *
+ * ------------------------------------------------------------------------- */
+
+/* Tuning table file name, inside the cache directory. */
+#define TUNE_FILE "clh_tune.txt"
+
+/* Timed runs per candidate, after one warm-up. */
+#define TUNE_RUNS 3
+
+/**
+ * Hashes the program of a kernel: its sources (with the included
+ * files) and build options, so a tuned size is not reused by an edited
+ * or differently built kernel.
+ * @param chc Context.
+ * @param kernel Kernel.
+ * @returns The program hash.
+ */
+static uint64_t tuneProgram(struct cl_helper_context *chc, cl_kernel kernel)
+{
+	struct clh_program_entry *entry;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	cl_program program;
+	size_t size;
+	char *buf;
+
+	if (clGetKernelInfo(kernel, CL_KERNEL_PROGRAM, sizeof(program), &program,
+		NULL) != CL_SUCCESS)
+	{
+		return (hash);
+	}
+
+	/* Built by clHelper: already hashed. */
+	for (entry = chc->programs; entry; entry = entry->next)
+	{
+		if (entry->program == program)
+		{
+			hash = fnv1a(hash, &entry->source_hash, sizeof(entry->source_hash));
+			return (fnv1a(hash, entry->options, strlen(entry->options)));
+		}
+	}
+
+	/* Otherwise, ask the runtime. */
+	if (clGetProgramInfo(program, CL_PROGRAM_SOURCE, 0, NULL, &size) ==
+		CL_SUCCESS && (buf = malloc(size + 1)) != NULL)
+	{
+		if (clGetProgramInfo(program, CL_PROGRAM_SOURCE, size, buf, NULL) ==
+			CL_SUCCESS)
+		{
+			hash = fnv1a(hash, buf, size);
+		}
+		free(buf);
+	}
+	hash = fnv1a(hash, "", 1);
+	if (clGetProgramBuildInfo(program, chc->device_id, CL_PROGRAM_BUILD_OPTIONS,
+		0, NULL, &size) == CL_SUCCESS && (buf = malloc(size + 1)) != NULL)
+	{
+		if (clGetProgramBuildInfo(program, chc->device_id,
+			CL_PROGRAM_BUILD_OPTIONS, size, buf, NULL) == CL_SUCCESS)
+		{
+			hash = fnv1a(hash, buf, size);
+		}
+		free(buf);
+	}
+	return (hash);
+}
+
+/**
+ * Parses a line of the tuning table and checks if it holds the given
+ * configuration.
+ * @param line Line.
+ * @param dev Device and program key.
+ * @param name Kernel name.
+ * @param dims Dimensions.
+ * @param glb Global size, in the three axes.
+ * @param local Returned local size, if it matches.
+ * @returns 1 if it matches, 0 otherwise.
+ */
+static int tuneLine(const char *line, uint64_t dev, const char *name,
+	int dims, const size_t *glb, size_t *local)
+{
+	unsigned long long key, g[3], l[3];
+	char kname[256];
+	int d;
+
+	if (sscanf(line, "%llx %255s %d %llu %llu %llu %llu %llu %llu", &key,
+		kname, &d, &g[0], &g[1], &g[2], &l[0], &l[1], &l[2]) != 9)
+	{
+		return (0);
+	}
+
+	if (key != dev || d != dims || strcmp(kname, name) ||
+		g[0] != glb[0] || g[1] != glb[1] || g[2] != glb[2])
+	{
+		return (0);
+	}
+
+	for (int i = 0; i < 3; i++)
+		local[i] = (size_t)l[i];
+	return (1);
+}
+
+/**
+ * Looks up (or saves) a tuned configuration in the on-disk table.
+ * Each line holds: device and program key, kernel name, dimensions,
+ * global size and the best local size found, in the three axes, plus
+ * its time. Saving rewrites the table into a temporary and renames
+ * it, replacing the previous entry of the same configuration, so the
+ * table does not grow and concurrent processes never see a partial
+ * one.
+ * @param chc Context.
+ * @param program Program hash, see tuneProgram.
+ * @param name Kernel name.
+ * @param local Local size, read if @p save is 0, written otherwise.
+ * @param ms Time of the configuration, when saving.
+ * @param save 1 to save, 0 to lookup.
+ * @returns Returns CLH_OK if found/saved and a negative number
+ * otherwise.
+ */
+static int tuneTable(struct cl_helper_context *chc, uint64_t program,
+	const char *name, size_t *local, double ms, int save)
+{
+	char path[4096], tmp[4128];
+	char line[1024];
+	size_t glb[3], old[3];
+	uint64_t dev;
+	FILE *fp, *out;
+	int ret;
+
+	if (!chc->cache_dir)
+		return (-CLH_FILE_ERROR);
+
+	snprintf(path, sizeof(path), "%s/%s", chc->cache_dir, TUNE_FILE);
+	dev = hashDevice(chc, program);
+
+	for (int i = 0; i < 3; i++)
+		glb[i] = (i < chc->dimensions) ? chc->globalWorkSize[i] : 0;
+
+	if (save)
+	{
+		snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long)getpid());
+		if ((out = fopen(tmp, "w")) == NULL)
+			return (-CLH_FILE_ERROR);
+
+		/* Keep the other entries. */
+		if ((fp = fopen(path, "r")) != NULL)
+		{
+			while (fgets(line, sizeof(line), fp))
+				if (!tuneLine(line, dev, name, chc->dimensions, glb, old))
+					fputs(line, out);
+			fclose(fp);
+		}
+
+		fprintf(out, "%016llx %s %d %zu %zu %zu %zu %zu %zu %.6f\n",
+			(unsigned long long)dev, name, chc->dimensions, glb[0], glb[1],
+			glb[2], local[0], chc->dimensions > 1 ? local[1] : 0,
+			chc->dimensions > 2 ? local[2] : 0, ms);
+
+		if (fclose(out) == EOF || rename(tmp, path) != 0)
+		{
+			unlink(tmp);
+			return (-CLH_FILE_ERROR);
+		}
+		return (CLH_OK);
+	}
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return (-CLH_FILE_ERROR);
+
+	ret = -CLH_FILE_ERROR;
+	while (ret != CLH_OK && fgets(line, sizeof(line), fp))
+		if (tuneLine(line, dev, name, chc->dimensions, glb, old))
+			ret = CLH_OK;
+
+	fclose(fp);
+	for (int i = 0; ret == CLH_OK && i < chc->dimensions; i++)
+		local[i] = old[i];
+	return (ret);
+}
+
+/**
+ * Next X candidate: powers of two, then, once past the preferred
+ * work-group size multiple, the multiple times powers of two.
+ * @param x Current candidate.
+ * @param multiple Preferred work-group size multiple.
+ * @returns The next candidate.
+ */
+static size_t tuneNext(size_t x, size_t multiple)
+{
+	if (x < multiple && x * 2 > multiple)
+		return (multiple);
+	return (x * 2);
+}
+
+/**
+ * Measures a local size candidate.
+ * @param chc Context.
+ * @param kernel Kernel.
+ * @param local Local size.
+ * @param ms Best time among the runs.
+ * @returns Returns CLH_OK if the candidate ran and a negative number
+ * otherwise.
+ */
+static int tuneRun(struct cl_helper_context *chc, cl_kernel kernel,
+	const size_t *local, double *ms)
+{
+	cl_event event;
+	double t;
+	int err;
+
+	*ms = -1;
+	for (int run = 0; run <= TUNE_RUNS; run++)
+	{
+		err = trackedLaunch(chc, kernel, chc->command_queue);
+		if (err == CLH_OK && clEnqueueNDRangeKernel(chc->command_queue, kernel,
+			chc->dimensions, NULL, chc->globalWorkSize, local, 0, NULL,
+			&event) != CL_SUCCESS)
+		{
+			err = -CLH_KERN_FAIL;
+		}
+		trackedLaunched(chc, kernel);
+		if (err != CLH_OK)
+			return (err);
+
+		if (clhEventTime(event, &t) != CLH_OK)
+		{
+			clReleaseEvent(event);
+			return (-CLH_KERN_FAIL);
+		}
+		clReleaseEvent(event);
+
+		/* First run is the warm-up. */
+		if (run > 0 && (*ms < 0 || t < *ms))
+			*ms = t;
+	}
+	return (CLH_OK);
+}
+
+/**
+ * Finds the best local size (block size) for a kernel and the
+ * current global size, and sets it in the context.
+ *
+ * The candidates are the sizes that fit both CL_KERNEL_WORK_GROUP_SIZE
+ * and the device limits and divide the global size: along X, powers
+ * of two up to the preferred work-group size multiple and then that
+ * multiple times powers of two, along Y and Z powers of two, and no
+ * work-group smaller than the multiple. Each one is
+ * benchmarked with the event profiling and the fastest wins. If a cache
+ * directory is set (see clhSetCacheDir), the winner is stored in a
+ * small table keyed by device, program (sources and build options),
+ * kernel name and global size, and later runs reuse it without
+ * searching again, unless it does not fit the kernel limits anymore.
+ *
+ * The dimensions and global size must be already set, as well as the
+ * kernel arguments.
+ *
+ * @param chc Context.
+ * @param kernel Kernel to be tuned.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhAutoTuneLocalSize(struct cl_helper_context *chc, cl_kernel kernel)
+{
+	size_t limit, multiple, kernel_wg;
+	size_t local[3], best[3];
+	size_t x, y, z;
+	double ms, best_ms;
+	uint64_t program;
+	char name[256];
+	int dims;
+	int ok;
+
+	if (chc->fallback)
+		return (noDevice("clhAutoTuneLocalSize"));
+
+	dims = chc->dimensions;
+	if (dims <= 0 || !chc->globalWorkSize)
+	{
+		fprintf(stderr, "clHelper: Global size should be set before tuning!\n");
+		return (-CLH_INV_DIM);
+	}
+
+	if (clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, sizeof(name), name,
+		NULL) != CL_SUCCESS)
+	{
+		return (-CLH_KERN_FAIL);
+	}
+
+	kernel_wg = chc->max_group_size;
+	multiple  = 1;
+	clGetKernelWorkGroupInfo(kernel, chc->device_id, CL_KERNEL_WORK_GROUP_SIZE,
+		sizeof(kernel_wg), &kernel_wg, NULL);
+	clGetKernelWorkGroupInfo(kernel, chc->device_id,
+		CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(multiple),
+		&multiple, NULL);
+
+	limit = (kernel_wg < chc->max_group_size) ? kernel_wg : chc->max_group_size;
+	if (multiple == 0)
+		multiple = 1;
+
+	/* Already tuned? Only if this kernel can still run it. */
+	program = tuneProgram(chc, kernel);
+	if (tuneTable(chc, program, name, local, 0, 0) == CLH_OK)
+	{
+		ok = 1;
+		x  = 1;
+		for (int i = 0; i < dims && ok; i++)
+		{
+			x *= local[i];
+			ok = (local[i] && x <= limit &&
+				local[i] <= chc->max_work_item_size[i] &&
+				chc->globalWorkSize[i] % local[i] == 0);
+		}
+
+#ifdef CL_DEBUG
+		fprintf(stderr, "clHelper: tuned local size for '%s' found%s\n", name,
+			ok ? "" : ", but not valid anymore");
+#endif
+		if (ok)
+			goto set;
+	}
+
+	best_ms = -1;
+	for (z = 1; z <= (dims > 2 ? limit : 1); z <<= 1)
+	{
+		for (y = 1; y <= (dims > 1 ? limit : 1); y <<= 1)
+		{
+			for (x = 1; x <= limit; x = tuneNext(x, multiple))
+			{
+				size_t xyz[3] = {x, y, z};
+				ok = (x * y * z <= limit);
+
+				/* Skip the sizes below the preferred multiple. */
+				if (x * y * z < multiple && x * y * z < limit)
+					ok = 0;
+
+				for (int i = 0; i < dims && ok; i++)
+				{
+					ok = (xyz[i] <= chc->max_work_item_size[i] &&
+						chc->globalWorkSize[i] % xyz[i] == 0);
+				}
+				if (!ok)
+					continue;
+
+				if (tuneRun(chc, kernel, xyz, &ms) != CLH_OK)
+					continue;
+
+#ifdef CL_DEBUG
+				fprintf(stderr, "clHelper: tune (%zu, %zu, %zu): %.4f ms\n",
+					x, y, z, ms);
+#endif
+				if (best_ms < 0 || ms < best_ms)
+				{
+					best_ms = ms;
+					memcpy(best, xyz, sizeof(best));
+				}
+			}
+		}
+	}
+
+	if (best_ms < 0)
+	{
+		fprintf(stderr, "clHelper: No valid local size found for '%s'!\n",
+			name);
+		return (-CLH_INV_WORK_ITEM);
+	}
+
+	memcpy(local, best, sizeof(local));
+	chc->time_ms = best_ms;
+	tuneTable(chc, program, name, local, best_ms, 1);
+
+set:
+	if (!chc->localWorkSize)
+		chc->localWorkSize = malloc(sizeof(size_t) * dims);
+	if (!chc->localWorkSize)
+		return (-CLH_OUT_OF_MEM);
+
+	for (int i = 0; i < dims; i++)
+		chc->localWorkSize[i] = local[i];
+	return (CLH_OK);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Multi-device work partitioning.                                           *
+ * ------------------------------------------------------------------------- */
+
+/**
+ * Sets the throughput weight of each device, used to split the
+ * NDRange in clhLaunchKernelMulti. Weights are relative, e.g: {2, 1}
+ * gives 2/3 of the work to the first device.
+ * @param chc Context.
+ * @param weights One weight per device (chc->num_devices).
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhSetDeviceWeights(struct cl_helper_context *chc, const double *weights)
+{
+	double total = 0;
+
+	for (int i = 0; i < chc->num_devices; i++)
+	{
+		if (weights[i] < 0)
+			return (-CLH_INV_ARG);
+		total += weights[i];
+	}
+
+	if (total <= 0)
+		return (-CLH_INV_ARG);
+
+	for (int i = 0; i < chc->num_devices; i++)
+		chc->weights[i] = weights[i] / total;
+	return (CLH_OK);
+}
+
+/**
+ * Measures the throughput weight of each device by running the
+ * whole NDRange of a kernel on each one of them. The kernel arguments
+ * must be already set.
+ * @param chc Context.
+ * @param kernel Kernel used as benchmark.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhMeasureDeviceWeights(struct cl_helper_context *chc, cl_kernel kernel)
+{
+	double *weights;
+	cl_event event;
+	double ms;
+	int ret;
+
+	if (chc->fallback)
+		return (noDevice("clhMeasureDeviceWeights"));
+
+	if ((weights = malloc(sizeof(double) * chc->num_devices)) == NULL)
+		return (-CLH_OUT_OF_MEM);
+
+	ret = CLH_OK;
+	for (int i = 0; i < chc->num_devices && ret == CLH_OK; i++)
+	{
+		ms = 0;
+
+		/* Warm-up, then measure. */
+		for (int run = 0; run < 2 && ret == CLH_OK; run++)
+		{
+			ret = enqueueKernel(chc, chc->queues[i], kernel, 0, NULL, &event);
+			if (ret != CLH_OK)
+				break;
+			ret = clhEventTime(event, &ms);
+			clReleaseEvent(event);
+		}
+		weights[i] = (ms > 0) ? 1.0 / ms : 1.0;
+	}
+
+	if (ret == CLH_OK)
+		ret = clhSetDeviceWeights(chc, weights);
+
+	free(weights);
+	return (ret);
+}
+
+/**
+ * Local size used to split the NDRange across devices.
+ * @param chc Context.
+ * @returns The local size, or NULL if the global sizes are not
+ * multiple of it (CLH_SIZE_SPLIT) or the runtime chooses it.
+ */
+static const size_t *splitLocal(struct cl_helper_context *chc)
+{
+	const size_t *local = chc->localWorkSize;
+
+	for (int i = 0; local && i < chc->dimensions; i++)
+		if (chc->globalWorkSize[i] % local[i])
+			local = NULL;
+	return (local);
+}
+
+/**
+ * Share of a device when splitting work across the context devices.
+ * @param chc Context.
+ * @param i Device index.
+ * @param total Total units of work.
+ * @param done Units already given to the previous devices.
+ * @returns Units of work for the device.
+ */
+static size_t devicePart(struct cl_helper_context *chc, int i, size_t total,
+	size_t done)
+{
+	size_t part;
+
+	/* Last device takes the rest. */
+	if (i == chc->num_devices - 1)
+		part = total - done;
+	else
+		part = (size_t)(total * chc->weights[i] + 0.5);
+
+	if (part > total - done)
+		part = total - done;
+	return (part);
+}
+
+/**
+ * Binds, for one device part of a split launch, the rows of each split
+ * buffer argument of a kernel (a sub-buffer) and migrates them to the
+ * device.
+ * @param chc Context.
+ * @param kernel Kernel.
+ * @param queue Device queue.
+ * @param first First row of the part.
+ * @param rows Rows of the part.
+ * @param subs Sub-buffers created, to be released once the part is
+ * enqueued.
+ * @param nsubs Number of sub-buffers created.
+ * @returns Returns CLH_OK if success and a negative number otherwise.
+ */
+static int splitPart(struct cl_helper_context *chc, cl_kernel kernel,
+	cl_command_queue queue, size_t first, size_t rows, cl_mem *subs,
+	int *nsubs)
+{
+	struct clh_split_arg *s;
+	cl_buffer_region region;
+	size_t size, total;
+	int err;
+
+	total = chc->globalWorkSize[chc->dimensions - 1];
+	for (int i = 0; i < chc->num_split_args; i++)
+	{
+		s = &chc->split_args[i];
+		if (s->kernel != kernel)
+			continue;
+
+		if (clGetMemObjectInfo(s->mem, CL_MEM_SIZE, sizeof(size), &size,
+			NULL) != CL_SUCCESS)
+		{
+			return (-CLH_INV_ARG);
+		}
+
+		/* The last part also takes the bytes that do not make a row. */
+		region.origin = first * (size / total);
+		region.size   = (first + rows == total) ? size - region.origin :
+			rows * (size / total);
+
+		subs[*nsubs] = clCreateSubBuffer(s->mem, 0,
+			CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
+		if (!subs[*nsubs] || err != CL_SUCCESS)
+		{
+			fprintf(stderr, "clHelper: Failed to split argument #%d! %d\n",
+				s->idx, err);
+			return (-CLH_INV_ARG);
+		}
+		(*nsubs)++;
+
+		err = clSetKernelArg(kernel, s->idx, sizeof(cl_mem), &subs[*nsubs - 1]);
+		if (err == CL_SUCCESS)
+		{
+			err = clEnqueueMigrateMemObjects(queue, 1, &subs[*nsubs - 1], 0,
+				0, NULL, NULL);
+		}
+		if (err != CL_SUCCESS)
+			return (-CLH_INV_ARG);
+	}
+	return (CLH_OK);
+}
+
+/**
+ * Launches a kernel split across all the context devices. The
+ * outermost dimension (X for 1D, Y for 2D and Z for 3D) is split, in
+ * whole work-groups, proportionally to the device weights, and each
+ * part runs on its device queue with the proper global offset, so
+ * get_global_id() gives the same values as a single launch.
+ *
+ * Devices must not write to the same buffer: runtimes move whole
+ * buffers between devices, so a device may overwrite the results of
+ * another. Buffers written by the kernel are set with CLH_SPLIT: each
+ * device gets a sub-buffer with the rows of its part only (size /
+ * global size bytes per index of the split dimension), so the kernel
+ * indexes them from the part start, i.e: get_global_id() -
+ * get_global_offset(), which also works for single launches. The part
+ * boundaries must meet CL_DEVICE_MEM_BASE_ADDR_ALIGN.
+ *
+ * @param chc Context.
+ * @param kernel Kernel to be launched.
+ * @param event Merged completion event, signaled when all the parts
+ * finish, NULL if error. If NULL, the function waits for them and
+ * sets chc->time_ms with the wall time spent.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhLaunchKernelMulti(struct cl_helper_context *chc, cl_kernel kernel,
+	cl_event *event)
+{
+	size_t offset[3], global[3];
+	size_t unit, groups, done;
+	const size_t *local;
+	cl_event *events;
+	cl_mem *subs;
+	double start;
+	int nevents, nsubs;
+	int d, ret;
+
+	if (event)
+		*event = NULL;
+
+	if (chc->fallback)
+		return (noDevice("clhLaunchKernelMulti"));
+
+	if (chc->dimensions <= 0 || !chc->globalWorkSize)
 		return (-CLH_INV_DIM);
+
+	/* A tracked buffer resides on one device at a time. */
+	for (int i = 0; i < chc->num_tracked_args; i++)
+	{
+		if (chc->tracked_args[i].kernel == kernel)
+		{
+			fprintf(stderr, "clHelper: Tracked buffers cannot be split across"
+				" devices!\n");
+			return (-CLH_INV_ARG);
+		}
+	}
+
+	events = calloc(chc->num_devices, sizeof(cl_event));
+	subs   = calloc(chc->num_split_args + 1, sizeof(cl_mem));
+	if (events == NULL || subs == NULL)
+	{
+		free(events);
+		free(subs);
+		return (-CLH_OUT_OF_MEM);
+	}
+
+	start  = nowMs();
+	d      = chc->dimensions - 1;
+	local  = splitLocal(chc);
+	unit   = local ? local[d] : 1;
+	groups = chc->globalWorkSize[d] / unit;
+
+	for (int i = 0; i < chc->dimensions; i++)
+	{
+		offset[i] = 0;
+		global[i] = chc->globalWorkSize[i];
+	}
+
+	ret = CLH_OK;
+	done = 0;
+	nevents = 0;
+	for (int i = 0; i < chc->num_devices && done < groups; i++)
+	{
+		size_t part;
+
+		if ((part = devicePart(chc, i, groups, done)) == 0)
+			continue;
+
+		offset[d] = done * unit;
+		global[d] = part * unit;
+
+		nsubs = 0;
+		ret = splitPart(chc, kernel, chc->queues[i], offset[d], global[d],
+			subs, &nsubs);
+		if (ret == CLH_OK && clEnqueueNDRangeKernel(chc->queues[i], kernel,
+			chc->dimensions, offset, global, local, 0, NULL,
+			&events[nevents]) != CL_SUCCESS)
+		{
+			fprintf(stderr, "clHelper: Failed to execute kernel on device #%d!\n",
+				i);
+			ret = -CLH_KERN_FAIL;
+		}
+
+		/* Arguments are taken at enqueue, the sub-buffers can go. */
+		for (int j = 0; j < nsubs; j++)
+			clReleaseMemObject(subs[j]);
+		if (ret != CLH_OK)
+			break;
+
+		if (profSample(chc))
+			profAdd(chc, events[nevents], chc->queues[i], CLH_PROF_KERNEL, kernel,
+				0);
+
+		clFlush(chc->queues[i]);
+		nevents++;
+		done += part;
+	}
+
+	/* Single launches see the whole buffers again. */
+	for (int j = 0; j < chc->num_split_args; j++)
+	{
+		if (chc->split_args[j].kernel == kernel)
+		{
+			clSetKernelArg(kernel, chc->split_args[j].idx, sizeof(cl_mem),
+				&chc->split_args[j].mem);
+		}
+	}
+
+	/* Merged completion event. */
+	if (ret == CLH_OK && event)
+	{
+		if (clEnqueueMarkerWithWaitList(chc->command_queue, nevents, events,
+			event) != CL_SUCCESS)
+		{
+			*event = NULL;
+			ret = -CLH_KERN_FAIL;
+		}
+		clFlush(chc->command_queue);
+	}
+	else
+	{
+		clhWaitEvents(nevents, events);
+		chc->time_ms = nowMs() - start;
+	}
+
+	for (int i = 0; i < nevents; i++)
+		clReleaseEvent(events[i]);
+	free(events);
+	free(subs);
+	return (ret);
+}
+
+/**
+ * Partitions the context device into sub-devices (clCreateSubDevices),
+ * one per NUMA node (CLH_PARTITION_NUMA) or with @p units compute
+ * units each (CLH_PARTITION_EQUALLY). The context is then recreated
+ * with the sub-devices, as a multi-device context: one queue per
+ * sub-device in chc->queues, weighted by compute units, so
+ * clhLaunchKernelMulti splits the NDRange among them and
+ * clhAllocSplitBuffer places each part of a buffer on the memory of the
+ * sub-device that works on it. Meant for CPU runtimes on multi-socket
+ * hosts, where a single device spans all the sockets.
+ * It must be called right after the context start, before loading
+ * programs, allocating memory (tracked buffers included) or creating
+ * streams. chc->device still describes the
+ * whole device, but chc->command_queue is the queue of the first
+ * sub-device: clhLaunchKernel and the other single queue functions
+ * only use that sub-device (one NUMA node), clhLaunchKernelMulti uses
+ * them all. If it fails, the context is left as it was.
+ * @param chc Context.
+ * @param mode CLH_PARTITION_NUMA or CLH_PARTITION_EQUALLY.
+ * @param units Compute units per sub-device, for CLH_PARTITION_EQUALLY.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhPartitionDevice(struct cl_helper_context *chc, int mode,
+	cl_uint units)
+{
+	cl_device_partition_property props[3];
+	cl_command_queue *queues;
+	cl_context context;
+	cl_device_id *subs;
+	double *weights;
+	cl_uint cu, n, q;
+	double total;
+	int err;
+
+	if (chc->fallback)
+		return (noDevice("clhPartitionDevice"));
+
+	/* Per-device state is sized for the original device. */
+	if (chc->num_devices != 1 || chc->programs || chc->streams ||
+		chc->host_allocs || chc->pool_stats.allocs || chc->tracked ||
+		chc->resident || chc->ooo_queue)
+	{
+		fprintf(stderr, "clHelper: Devices must be partitioned right after"
+			" the context start!\n");
+		return (-CLH_INV_ARG);
+	}
+
+	switch (mode)
+	{
+		case CLH_PARTITION_NUMA:
+			props[0] = CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN;
+			props[1] = CL_DEVICE_AFFINITY_DOMAIN_NUMA;
+			break;
+		case CLH_PARTITION_EQUALLY:
+			if (units == 0)
+				return (-CLH_INV_ARG);
+			props[0] = CL_DEVICE_PARTITION_EQUALLY;
+			props[1] = units;
+			break;
+		default:
+			return (-CLH_INV_ARG);
+	}
+	props[2] = 0;
+
+	n = 0;
+	if (clCreateSubDevices(chc->device_id, props, 0, NULL, &n) != CL_SUCCESS
+		|| n == 0)
+	{
+		fprintf(stderr, "clHelper: Device cannot be partitioned this way!\n");
+		return (-CLH_DEVICE_NOT_FOUND);
+	}
+
+	if ((subs = malloc(sizeof(cl_device_id) * n)) == NULL)
+		return (-CLH_OUT_OF_MEM);
+
+	if (clCreateSubDevices(chc->device_id, props, n, subs, NULL) != CL_SUCCESS)
+	{
+		free(subs);
+		return (-CLH_DEVICE_NOT_FOUND);
+	}
+
+	/* Contexts cannot get new devices: build a new one first. */
+	queues  = calloc(n, sizeof(cl_command_queue));
+	weights = malloc(sizeof(double) * n);
+	context = NULL;
+	if (queues && weights)
+		context = clCreateContext(0, n, subs, NULL, NULL, &err);
+	for (q = 0; context && q < n; q++)
+	{
+		queues[q] = clCreateCommandQueue(context, subs[q],
+			CL_QUEUE_PROFILING_ENABLE, &err);
+		if (!queues[q])
+			break;
+	}
+
+	if (!context || q < n)
+	{
+		fprintf(stderr, "clHelper: Failed to create the sub-devices context!\n");
+		for (cl_uint i = 0; i < q; i++)
+			clReleaseCommandQueue(queues[i]);
+		if (context)
+			clReleaseContext(context);
+		for (cl_uint i = 0; i < n; i++)
+			clReleaseDevice(subs[i]);
+		free(queues);
+		free(weights);
+		free(subs);
+		return (-CLH_NOT_COM_CONT);
+	}
+
+	/* Weights: compute units of each sub-device. */
+	total = 0;
+	for (cl_uint i = 0; i < n; i++)
+	{
+		cu = 1;
+		clGetDeviceInfo(subs[i], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cu), &cu,
+			NULL);
+		weights[i] = cu;
+		total += cu;
+	}
+	for (cl_uint i = 0; i < n; i++)
+		weights[i] /= total;
+
+	/* Swap. */
+	clReleaseCommandQueue(chc->command_queue);
+	clReleaseContext(chc->context);
+	free(chc->devices);
+	free(chc->queues);
+	free(chc->weights);
+	chc->context       = context;
+	chc->devices       = subs;
+	chc->queues        = queues;
+	chc->weights       = weights;
+	chc->num_devices   = n;
+	chc->command_queue = queues[0];
+	chc->sub_devices   = 1;
+
+#ifdef CL_DEBUG
+	fprintf(stderr, "\nPartitioned into %u sub-devices\n", n);
+#endif
+
+	/* Queries need a device of the context. */
+	chc->device_id = subs[0];
+	return (CLH_OK);
+}
+
+/**
+ * Allocates a buffer split across the context devices the same way
+ * clhLaunchKernelMulti splits the current NDRange: the part of each
+ * device is first written by the device itself, so runtimes that place
+ * memory on first touch (CPU runtimes) put it on the NUMA node of the
+ * sub-device that will work on it, see clhPartitionDevice. The buffer
+ * is viewed as rows along the split dimension (X for 1D, Y for 2D, Z
+ * for 3D), i.e: size / global size bytes per index.
+ * Each part is written through a sub-buffer, so the part boundaries
+ * must meet CL_DEVICE_MEM_BASE_ADDR_ALIGN, and the buffer is meant to
+ * be bound with CLH_SPLIT.
+ * The NDRange must be set before, and the buffer released with
+ * clReleaseMemObject (it is not pooled: a reused buffer would not be
+ * local anymore).
+ * @param chc Context.
+ * @param flags Memory flags, CL_MEM_USE_HOST_PTR is not supported.
+ * @param size Buffer size, in bytes.
+ * @param host_ptr Data to be copied if CL_MEM_COPY_HOST_PTR is set.
+ * @returns The buffer, or NULL if error.
+ */
+cl_mem clhAllocSplitBuffer(struct cl_helper_context *chc, cl_mem_flags flags,
+	size_t size, const void *host_ptr)
+{
+	size_t unit, groups, row, done, part;
+	cl_buffer_region region;
+	const size_t *local;
+	cl_uchar zero;
+	cl_mem mem, sub;
+	int err, fin, d;
+
+	if (chc->fallback)
+	{
+		noDevice("clhAllocSplitBuffer");
+		return (NULL);
+	}
+
+	if (chc->dimensions <= 0 || !chc->globalWorkSize || size == 0 ||
+		(flags & CL_MEM_USE_HOST_PTR))
+	{
+		fprintf(stderr, "clHelper: Invalid split buffer allocation!\n");
+		return (NULL);
+	}
+
+	mem = clCreateBuffer(chc->context, flags & ~CL_MEM_COPY_HOST_PTR, size,
+		NULL, &err);
+	if (!mem || err != CL_SUCCESS)
+	{
+		fprintf(stderr, "clHelper: Failed to allocate buffer! %d\n", err);
+		return (NULL);
+	}
+
+	/* Same split as clhLaunchKernelMulti. */
+	d      = chc->dimensions - 1;
+	local  = splitLocal(chc);
+	unit   = local ? local[d] : 1;
+	groups = chc->globalWorkSize[d] / unit;
+	row    = size / chc->globalWorkSize[d];
+
+	zero = 0;
+	done = 0;
+	err  = CL_SUCCESS;
+	for (int i = 0; i < chc->num_devices && done < groups; i++)
+	{
+		if ((part = devicePart(chc, i, groups, done)) == 0)
+			continue;
+
+		region.origin = done * unit * row;
+		region.size   = (done + part == groups) ? size - region.origin :
+			part * unit * row;
+		done += part;
+		if (region.size == 0)
+			continue;
+
+		/* Devices write their own part only, as the split launches. */
+		sub = clCreateSubBuffer(mem, 0, CL_BUFFER_CREATE_TYPE_REGION, &region,
+			&err);
+		if (err != CL_SUCCESS)
+			break;
+
+		/* First touch, then the data. */
+		err = clEnqueueFillBuffer(chc->queues[i], sub, &zero, 1, 0,
+			region.size, 0, NULL, NULL);
+		if (err == CL_SUCCESS && (flags & CL_MEM_COPY_HOST_PTR) && host_ptr)
+		{
+			err = clEnqueueWriteBuffer(chc->queues[i], sub, CL_FALSE, 0,
+				region.size, (const char *)host_ptr + region.origin, 0, NULL,
+				NULL);
+		}
+		clReleaseMemObject(sub);
+		if (err != CL_SUCCESS)
+			break;
+	}
+
+	/* Every queue is drained, the first error is kept. */
+	for (int i = 0; i < chc->num_devices; i++)
+	{
+		fin = clFinish(chc->queues[i]);
+		if (err == CL_SUCCESS)
+			err = fin;
+	}
+
+	if (err != CL_SUCCESS)
+	{
+		fprintf(stderr, "clHelper: Failed to initialize split buffer! %d\n",
+			err);
+		clReleaseMemObject(mem);
+		return (NULL);
+	}
+	return (mem);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Buffer pool.                                                              *
+ * ------------------------------------------------------------------------- */
+
+/* Flags that are not part of the buffer identity. */
+#define POOL_IGNORED_FLAGS (CL_MEM_COPY_HOST_PTR)
+
+/**
+ * Gets the size class of a given (power of two) size.
+ * @param size Buffer size.
+ * @returns The size class, i.e: log2(size).
+ */
+static int poolClass(size_t size)
+{
+	int cls = 0;
+	while (size > 1)
+	{
+		size >>= 1;
+		cls++;
+	}
+	return (cls);
+}
+
+/**
+ * Slot of a buffer in the set of buffers handed out by the pool.
+ * @param chc Context.
+ * @param mem Buffer.
+ * @returns The slot holding mem, or the empty slot where it goes.
+ */
+static size_t poolSlot(struct cl_helper_context *chc, cl_mem mem)
+{
+	size_t mask = chc->pool_live_cap - 1;
+	size_t i;
+
+	i = (size_t)(((uintptr_t)mem >> 4) * 0x9E3779B97F4A7C15ull) & mask;
+	while (chc->pool_live[i] && chc->pool_live[i] != mem)
+		i = (i + 1) & mask;
+	return (i);
+}
+
+/**
+ * Adds a buffer to the set of buffers handed out by the pool.
+ * @param chc Context.
+ * @param mem Buffer.
+ * @returns Returns CLH_OK if success and a negative number otherwise.
+ */
+static int poolOwn(struct cl_helper_context *chc, cl_mem mem)
+{
+	cl_mem *old;
+	size_t cap;
+
+	/* Keep it at most half full. */
+	if (2 * (chc->pool_live_num + 1) > chc->pool_live_cap)
+	{
+		old = chc->pool_live;
+		cap = chc->pool_live_cap;
+		chc->pool_live_cap = cap ? cap * 2 : 64;
+		chc->pool_live = calloc(chc->pool_live_cap, sizeof(cl_mem));
+		if (!chc->pool_live)
+		{
+			chc->pool_live = old;
+			chc->pool_live_cap = cap;
+			return (-CLH_OUT_OF_MEM);
+		}
+		for (size_t i = 0; i < cap; i++)
+			if (old[i])
+				chc->pool_live[poolSlot(chc, old[i])] = old[i];
+		free(old);
+	}
+
+	chc->pool_live[poolSlot(chc, mem)] = mem;
+	chc->pool_live_num++;
+	return (CLH_OK);
+}
+
+/**
+ * Removes a buffer from the set of buffers handed out by the pool.
+ * @param chc Context.
+ * @param mem Buffer.
+ * @returns 1 if the buffer was in the set, 0 otherwise.
+ */
+static int poolDisown(struct cl_helper_context *chc, cl_mem mem)
+{
+	size_t mask, i, j, k;
+
+	if (!chc->pool_live_num)
+		return (0);
+
+	mask = chc->pool_live_cap - 1;
+	i = poolSlot(chc, mem);
+	if (!chc->pool_live[i])
+		return (0);
+
+	/* Linear probing: shift back the entries after the hole. */
+	chc->pool_live[i] = NULL;
+	for (j = (i + 1) & mask; chc->pool_live[j]; j = (j + 1) & mask)
+	{
+		k = (size_t)(((uintptr_t)chc->pool_live[j] >> 4) *
+			0x9E3779B97F4A7C15ull) & mask;
+		if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j))
+		{
+			chc->pool_live[i] = chc->pool_live[j];
+			chc->pool_live[j] = NULL;
+			i = j;
+		}
+	}
+	chc->pool_live_num--;
+	return (1);
+}
+
+/**
+ * Releases cached buffers, from the largest classes to the smallest
+ * ones, until at least @p bytes were released.
+ * @param chc Context.
+ * @param bytes Amount of bytes to be released, 0 releases everything.
+ */
+static void poolRelease(struct cl_helper_context *chc, cl_ulong bytes)
+{
+	struct clh_pool_entry *entry;
+	cl_ulong released = 0;
+
+	for (int cls = CLH_POOL_CLASSES - 1; cls >= 0; cls--)
+	{
+		while ((entry = chc->pool[cls]) != NULL)
+		{
+			if (bytes && released >= bytes)
+				return;
+
+			chc->pool[cls] = entry->next;
+			clReleaseMemObject(entry->mem);
+			free(entry);
+
+			released += (cl_ulong)1 << cls;
+			chc->pool_stats.cached_bytes -= (cl_ulong)1 << cls;
+		}
+	}
+}
+
+/**
+ * Gets the device memory budget of tracked buffers.
+ * @param chc Context.
+ * @returns The budget, in bytes, unlimited if the device memory size
+ * is not known.
+ */
+static cl_ulong memBudget(struct cl_helper_context *chc)
+{
+	if (chc->mem_budget)
+		return (chc->mem_budget);
+	return (chc->global_mem_size ? chc->global_mem_size : (cl_ulong)-1);
+}
+
+/**
+ * Gets the device memory in use: resident tracked buffers, plus the
+ * buffer pool, accounted on the first device.
+ * @param chc Context.
+ * @param device Device index.
+ * @returns Bytes in use.
+ */
+static cl_ulong memUsed(struct cl_helper_context *chc, int device)
+{
+	cl_ulong used;
+
+	used = chc->resident ? chc->resident[device] : 0;
+	if (device == 0)
+		used += chc->pool_stats.live_bytes + chc->pool_stats.cached_bytes;
+	return (used);
+}
+
+/**
+ * Evicts a tracked buffer: the device copy is read back if kernels may
+ * have written it, and released. Kernels bound to it get the new copy
+ * on their next launch.
+ * @param chc Context.
+ * @param t Tracked buffer.
+ * @returns Returns CLH_OK if success and a negative number otherwise,
+ * the buffer stays resident then.
+ */
+static int trackedEvict(struct cl_helper_context *chc, struct clh_tracked *t)
+{
+	/* Last used by a launch in another queue. */
+	if (t->queue)
+		clFinish(t->queue);
+
+	if (t->device_newer)
+	{
+		if (clEnqueueReadBuffer(deviceQueue(chc, t->device), t->mem, CL_TRUE,
+			0, t->size, t->host, 0, NULL, NULL) != CL_SUCCESS)
+		{
+			fprintf(stderr, "clHelper: Failed to evict a tracked buffer!\n");
+			return (-CLH_OUT_OF_MEM);
+		}
+		t->device_newer = 0;
+		chc->mem_stats.readbacks++;
+		chc->mem_stats.readback_bytes += t->size;
+	}
+
+	clReleaseMemObject(t->mem);
+	t->mem = NULL;
+	chc->resident[t->device] -= t->size;
+	chc->mem_stats.evictions++;
+	return (CLH_OK);
+}
+
+/**
+ * Frees some device memory: the buffers cached by the pool first, then
+ * the least recently used tracked buffer of the device that is not
+ * bound to a kernel waiting for its launch.
+ * @param chc Context.
+ * @param device Device index.
+ * @returns Returns CLH_OK if something was freed and a negative
+ * number otherwise.
+ */
+static int memReclaimOne(struct cl_helper_context *chc, int device)
+{
+	struct clh_tracked *t, *lru;
+
+	if (device == 0 && chc->pool_stats.cached_bytes)
+	{
+		poolRelease(chc, 0);
+		return (CLH_OK);
+	}
+
+	lru = NULL;
+	for (t = chc->tracked; t; t = t->next)
+	{
+		if (t->mem && t->device == device && !t->bound &&
+			(!lru || t->last_use < lru->last_use))
+		{
+			lru = t;
+		}
+	}
+
+	if (!lru)
+		return (-CLH_OUT_OF_MEM);
+	return (trackedEvict(chc, lru));
+}
+
+/**
+ * Frees device memory until a new allocation fits in the budget.
+ * @param chc Context.
+ * @param device Device index.
+ * @param bytes Allocation size.
+ * @returns Returns CLH_OK if it fits and a negative number otherwise.
+ */
+static int memReclaim(struct cl_helper_context *chc, int device,
+	cl_ulong bytes)
+{
+	while (memUsed(chc, device) + bytes > memBudget(chc))
+		if (memReclaimOne(chc, device) != CLH_OK)
+			return (-CLH_OUT_OF_MEM);
+	return (CLH_OK);
+}
+
+/**
+ * Allocates a device buffer from the context buffer pool. Sizes are
+ * rounded up to the next power of two, and buffers released with
+ * clhFreeBuffer are reused by later allocations of the same class and
+ * flags, instead of going back to the driver.
+ *
+ * The pool never holds more than chc->global_mem_size bytes (live plus
+ * cached), cached buffers are released first when the limit is reached.
+ *
+ * @param chc Context.
+ * @param flags Memory flags, CL_MEM_USE_HOST_PTR is not supported.
+ * @param size Buffer size, in bytes.
+ * @param host_ptr Data to be copied if CL_MEM_COPY_HOST_PTR is set.
+ * @returns The buffer, or NULL if error.
+ */
+cl_mem clhAllocBuffer(struct cl_helper_context *chc, cl_mem_flags flags,
+	size_t size, void *host_ptr)
+{
+	struct clh_pool_entry **prev, *entry;
+	struct clh_pool_stats *st;
+	cl_mem_flags pool_flags;
+	size_t class_size;
+	cl_ulong total;
+	cl_mem mem;
+	int cls;
+	int err;
+
+	st = &chc->pool_stats;
+	if (size == 0 || (flags & CL_MEM_USE_HOST_PTR))
+	{
+		fprintf(stderr, "clHelper: Invalid buffer pool allocation!\n");
+		return (NULL);
+	}
+
+	if (chc->fallback)
+		return (cpuAllocBuffer(chc, flags, size, host_ptr));
+
+	class_size = roundPower(size);
+	cls = poolClass(class_size);
+	pool_flags = flags & ~POOL_IGNORED_FLAGS;
+	st->allocs++;
+
+	/* Search for a free buffer with the same flags. */
+	mem = NULL;
+	for (prev = &chc->pool[cls]; (entry = *prev) != NULL; prev = &entry->next)
+	{
+		if (entry->flags == pool_flags)
+		{
+			*prev = entry->next;
+			mem = entry->mem;
+			free(entry);
+
+			st->cached_bytes -= class_size;
+			st->reuses++;
+			break;
+		}
+	}
+
+	/* None available, ask the driver. */
+	if (mem == NULL)
+	{
+		total = st->live_bytes + st->cached_bytes + class_size;
+		if (chc->global_mem_size && total > chc->global_mem_size)
+			poolRelease(chc, total - chc->global_mem_size);
+
+		total = st->live_bytes + st->cached_bytes + class_size;
+		if (chc->global_mem_size && total > chc->global_mem_size)
+		{
+			fprintf(stderr, "clHelper: Buffer pool exceeds device memory!\n");
+			return (NULL);
+		}
+
+		/* Make room, tracked buffers go back to the host. */
+		if (chc->tracked)
+			memReclaim(chc, 0, class_size);
+
+		for (;;)
+		{
+			mem = clCreateBuffer(chc->context, pool_flags, class_size, NULL,
+				&err);
+			if (mem && err == CL_SUCCESS)
+				break;
+
+			if ((err != CL_MEM_OBJECT_ALLOCATION_FAILURE &&
+				err != CL_OUT_OF_RESOURCES) || memReclaimOne(chc, 0) != CLH_OK)
+			{
+				fprintf(stderr, "clHelper: Failed to allocate buffer! %d\n", err);
+				return (NULL);
+			}
+		}
+	}
+
+	if (poolOwn(chc, mem) != CLH_OK)
+	{
+		clReleaseMemObject(mem);
+		return (NULL);
+	}
+
+	st->live_bytes += class_size;
+	if (st->live_bytes + st->cached_bytes > st->peak_bytes)
+		st->peak_bytes = st->live_bytes + st->cached_bytes;
+
+	/* Initial data. */
+	if ((flags & CL_MEM_COPY_HOST_PTR) && host_ptr)
+	{
+		err = clEnqueueWriteBuffer(chc->command_queue, mem, CL_TRUE, 0, size,
+			host_ptr, 0, NULL, NULL);
+
+		if (err != CL_SUCCESS)
+		{
+			clhFreeBuffer(chc, mem);
+			return (NULL);
+		}
+	}
+
+	return (mem);
+}
+
+/**
+ * Gives a buffer allocated by clhAllocBuffer back to the pool. Buffers
+ * that do not come from the pool are just released.
+ * @param chc Context.
+ * @param mem Buffer to be released.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhFreeBuffer(struct cl_helper_context *chc, cl_mem mem)
+{
+	struct clh_pool_entry *entry;
+	cl_mem_flags flags;
+	size_t size;
+	int cls;
+
+	if (mem == NULL)
+		return (CLH_OK);
+
+	if (chc->fallback)
+	{
+		cpuFreeBuffer(chc, mem);
+		return (CLH_OK);
+	}
+
+	/* Not ours, the statistics do not know it. */
+	if (!poolDisown(chc, mem))
+	{
+		clReleaseMemObject(mem);
+		return (CLH_OK);
+	}
+
+	if (clGetMemObjectInfo(mem, CL_MEM_SIZE, sizeof(size), &size,
+		NULL) != CL_SUCCESS || clGetMemObjectInfo(mem, CL_MEM_FLAGS,
+		sizeof(flags), &flags, NULL) != CL_SUCCESS)
+	{
+		poolOwn(chc, mem);
+		return (-CLH_OUT_OF_MEM);
+	}
+
+	cls = poolClass(size);
+	chc->pool_stats.live_bytes -= size;
+
+	if ((entry = malloc(sizeof(*entry))) == NULL)
+	{
+		clReleaseMemObject(mem);
+		return (CLH_OK);
+	}
+
+	entry->mem   = mem;
+	entry->flags = flags & ~POOL_IGNORED_FLAGS;
+	entry->next  = chc->pool[cls];
+	chc->pool[cls] = entry;
+	chc->pool_stats.cached_bytes += size;
+	return (CLH_OK);
+}
+
+/**
+ * Releases all the cached (free) buffers back to the driver.
+ * @param chc Context.
+ * @returns Always CLH_OK.
+ */
+int clhTrimBufferPool(struct cl_helper_context *chc)
+{
+	poolRelease(chc, 0);
+	return (CLH_OK);
+}
+
+/**
+ * Gets the buffer pool statistics.
+ * @param chc Context.
+ * @param stats Statistics.
+ * @returns Always CLH_OK.
+ */
+int clhBufferPoolStats(struct cl_helper_context *chc,
+	struct clh_pool_stats *stats)
+{
+	*stats = chc->pool_stats;
+	stats->reuse_ratio = (stats->allocs) ?
+		(double)stats->reuses / stats->allocs : 0.0;
+	return (CLH_OK);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Tracked buffers.                                                          *
+ * ------------------------------------------------------------------------- */
+
+/**
+ * Allocates a tracked buffer: a device buffer that knows its host
+ * backing. It takes no device memory until a kernel uses it (bound with
+ * CLH_TRACKED in clhSetKernelArgs/clhSetArgs), and when a new tracked
+ * buffer or pool buffer does not fit in the memory budget, the least
+ * recently used tracked buffers go back to their host memory and are
+ * uploaded again on their next use. Working sets larger than the
+ * device memory then run, more slowly, instead of failing.
+ *
+ * Kernels are assumed to write the buffer, so evictions read it back,
+ * unless it is CL_MEM_READ_ONLY.
+ *
+ * @param chc Context.
+ * @param flags Device buffer flags (CL_MEM_READ_WRITE, _READ_ONLY or
+ * _WRITE_ONLY).
+ * @param size Size, in bytes.
+ * @param host Host backing, size bytes, that must outlive the buffer,
+ * or NULL to allocate it (zeroed).
+ * @returns The tracked buffer, or NULL if error.
+ */
+struct clh_tracked *clhTrackedAlloc(struct cl_helper_context *chc,
+	cl_mem_flags flags, size_t size, void *host)
+{
+	struct clh_tracked *t;
+	int ndev;
+
+	if (!size)
+		return (NULL);
+
+	ndev = chc->num_devices ? chc->num_devices : 1;
+	if (!chc->resident && (chc->resident = calloc(ndev,
+		sizeof(cl_ulong))) == NULL)
+	{
+		return (NULL);
+	}
+
+	if ((t = calloc(1, sizeof(*t))) == NULL)
+		return (NULL);
+
+	t->size  = size;
+	t->flags = flags & (CL_MEM_READ_WRITE | CL_MEM_READ_ONLY |
+		CL_MEM_WRITE_ONLY);
+	t->host  = host;
+	if (!host)
+	{
+		if ((t->host = calloc(1, size)) == NULL)
+		{
+			free(t);
+			return (NULL);
+		}
+		t->owns_host = 1;
+	}
+
+	/* Host memory is the device memory. */
+	if (chc->fallback && (t->mem = cpuWrapBuffer(t->host, size)) == NULL)
+	{
+		if (t->owns_host)
+			free(t->host);
+		free(t);
+		return (NULL);
+	}
+
+	t->host_newer = 1;
+	t->next = chc->tracked;
+	chc->tracked = t;
+	chc->mem_stats.tracked_bytes += size;
+	return (t);
+}
+
+/**
+ * Frees a tracked buffer, and its host backing if allocated by
+ * clhTrackedAlloc.
+ * @param chc Context.
+ * @param t Tracked buffer.
+ * @returns Always CLH_OK.
+ */
+int clhTrackedFree(struct cl_helper_context *chc, struct clh_tracked *t)
+{
+	struct clh_tracked **prev;
+
+	if (!t)
+		return (CLH_OK);
+
+	for (prev = &chc->tracked; *prev; prev = &(*prev)->next)
+	{
+		if (*prev == t)
+		{
+			*prev = t->next;
+			break;
+		}
+	}
+
+	trackedUnbind(chc, NULL, t);
+	if (t->queue)
+		clReleaseCommandQueue(t->queue);
+
+	if (chc->fallback)
+		free(t->mem);
+	else if (t->mem)
+	{
+		clReleaseMemObject(t->mem);
+		chc->resident[t->device] -= t->size;
+	}
+
+	chc->mem_stats.tracked_bytes -= t->size;
+	if (t->owns_host)
+		free(t->host);
+	free(t);
+	return (CLH_OK);
+}
+
+/**
+ * Makes a tracked buffer resident on a device, evicting others if
+ * needed, and uploads the host data if the device copy is missing or
+ * stale. The upload does not wait.
+ * @param chc Context.
+ * @param t Tracked buffer.
+ * @param device Device index, or -1 for the device it already resides
+ * on (the first one if none).
+ * @returns Returns CLH_OK if success and a negative number otherwise.
+ */
+int clhTrackedPrefetch(struct cl_helper_context *chc, struct clh_tracked *t,
+	int device)
+{
+	cl_command_queue queue;
+	cl_mem mem;
+	int err;
+
+	if (chc->fallback)
+		return (CLH_OK);
+
+	if (device < 0 || device >= (chc->num_devices ? chc->num_devices : 1))
+		device = t->mem ? t->device : 0;
+
+	t->last_use = ++chc->mem_clock;
+
+	/* Resident somewhere else: move it. */
+	if (t->mem && t->device != device && trackedEvict(chc, t) != CLH_OK)
+		return (-CLH_OUT_OF_MEM);
+
+	queue = deviceQueue(chc, device);
+	if (t->mem)
+	{
+		if (t->host_newer)
+		{
+			if (clEnqueueWriteBuffer(queue, t->mem, CL_FALSE, 0, t->size,
+				t->host, 0, NULL, NULL) != CL_SUCCESS)
+			{
+				return (-CLH_OUT_OF_MEM);
+			}
+			t->host_newer = 0;
+			chc->mem_stats.uploads++;
+			chc->mem_stats.upload_bytes += t->size;
+		}
+		return (CLH_OK);
+	}
+
+	if (memReclaim(chc, device, t->size) != CLH_OK)
+	{
+		fprintf(stderr, "clHelper: Tracked buffers exceed the memory budget!\n");
+		return (-CLH_OUT_OF_MEM);
+	}
+
+	/* The driver may run out before the budget: free more and retry. */
+	for (;;)
+	{
+		mem = clCreateBuffer(chc->context, t->flags, t->size, NULL, &err);
+		if (mem && err == CL_SUCCESS)
+		{
+			err = clEnqueueWriteBuffer(queue, mem, CL_FALSE, 0, t->size,
+				t->host, 0, NULL, NULL);
+			if (err == CL_SUCCESS)
+				break;
+			clReleaseMemObject(mem);
+		}
+
+		if ((err != CL_MEM_OBJECT_ALLOCATION_FAILURE &&
+			err != CL_OUT_OF_RESOURCES) || memReclaimOne(chc, device) != CLH_OK)
+		{
+			fprintf(stderr, "clHelper: Failed to upload a tracked buffer! %d\n",
+				err);
+			return (-CLH_OUT_OF_MEM);
+		}
+	}
+
+	t->mem = mem;
+	t->device = device;
+	t->host_newer = 0;
+	chc->resident[device] += t->size;
+	chc->mem_stats.uploads++;
+	chc->mem_stats.upload_bytes += t->size;
+	return (CLH_OK);
+}
+
+/**
+ * Gets the host memory of a tracked buffer, up to date: the device
+ * copy is read back first if kernels may have written it. With
+ * CL_MAP_WRITE, the host changes are uploaded on the next use. There
+ * is no unmap, but the host memory must not be changed while kernels
+ * using the buffer may still run.
+ * @param chc Context.
+ * @param t Tracked buffer.
+ * @param flags CL_MAP_READ and/or CL_MAP_WRITE.
+ * @returns The host memory, or NULL if error.
+ */
+void *clhTrackedMap(struct cl_helper_context *chc, struct clh_tracked *t,
+	cl_map_flags flags)
+{
+	cl_command_queue queue;
+
+	if (!chc->fallback && t->mem)
+	{
+		queue = deviceQueue(chc, t->device);
+		if (t->queue)
+			clFinish(t->queue);
+		if (t->device_newer)
+		{
+			if (clEnqueueReadBuffer(queue, t->mem, CL_TRUE, 0, t->size,
+				t->host, 0, NULL, NULL) != CL_SUCCESS)
+			{
+				return (NULL);
+			}
+			t->device_newer = 0;
+			chc->mem_stats.readbacks++;
+			chc->mem_stats.readback_bytes += t->size;
+		}
+		else
+			clFinish(queue);
+	}
+
+	if (flags & (CL_MAP_WRITE | CL_MAP_WRITE_INVALIDATE_REGION))
+		t->host_newer = 1;
+	return (t->host);
+}
+
+/**
+ * Sets the device memory budget: tracked buffers are evicted when the
+ * resident ones, plus the buffer pool, would exceed it. Lowering the
+ * budget evicts right away.
+ * @param chc Context.
+ * @param bytes Budget per device, in bytes, 0 for the device global
+ * memory size.
+ * @returns Returns CLH_OK if success and a negative number if the
+ * resident buffers still exceed the budget.
+ */
+int clhSetMemoryBudget(struct cl_helper_context *chc, cl_ulong bytes)
+{
+	int ret = CLH_OK;
+
+	chc->mem_budget = bytes;
+	if (chc->fallback || !chc->resident)
+		return (CLH_OK);
+
+	for (int i = 0; i < (chc->num_devices ? chc->num_devices : 1); i++)
+		if (memReclaim(chc, i, 0) != CLH_OK)
+			ret = -CLH_OUT_OF_MEM;
+	return (ret);
+}
+
+/**
+ * Gets the device memory statistics.
+ * @param chc Context.
+ * @param device Device index.
+ * @param stats Statistics.
+ * @returns Always CLH_OK.
+ */
+int clhMemoryStats(struct cl_helper_context *chc, int device,
+	struct clh_mem_stats *stats)
+{
+	*stats = chc->mem_stats;
+	stats->budget = memBudget(chc);
+	stats->resident_bytes = chc->resident ? chc->resident[device] : 0;
+	stats->pool_bytes = (device == 0) ? chc->pool_stats.live_bytes +
+		chc->pool_stats.cached_bytes : 0;
+	return (CLH_OK);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Pinned / zero-copy host memory.                                           *
+ * ------------------------------------------------------------------------- */
+
+/* Page size used to align zero-copy allocations. */
+#define HOST_ALIGN 4096
+
+/**
+ * Finds the host allocation that contains a given pointer.
+ * @param chc Context.
+ * @param ptr Host pointer.
+ * @param size Range size that must be inside the allocation.
+ * @returns The allocation, or NULL if not found.
+ */
+static struct clh_host_alloc *findHostAlloc(struct cl_helper_context *chc,
+	const void *ptr, size_t size)
+{
+	struct clh_host_alloc *ha;
+	const char *p = ptr;
+
+	for (ha = chc->host_allocs; ha != NULL; ha = ha->next)
+	{
+		const char *base = ha->ptr;
+		if (p >= base && p + size <= base + ha->size)
+			return (ha);
+	}
+	return (NULL);
+}
+
+/**
+ * Allocates host memory suitable for fast (or no) transfers.
+ *
+ * On devices that share the memory with the host (CPUs, integrated
+ * GPUs), the memory is page aligned and wrapped in a CL_MEM_USE_HOST_PTR
+ * buffer, so the device works directly on it (zero copy). On discrete
+ * devices the memory comes from a persistently mapped
+ * CL_MEM_ALLOC_HOST_PTR (pinned) buffer, which allows DMA transfers to
+ * a device buffer allocated alongside.
+ *
+ * In both cases clhHostBuffer gives the device buffer to be used by the
+ * kernels, and clhWriteBuffer/clhReadBuffer move the data.
+ *
+ * @param chc Context.
+ * @param size Allocation size, in bytes.
+ * @returns The host pointer, or NULL if error.
+ */
+void *clhAllocHost(struct cl_helper_context *chc, size_t size)
+{
+	struct clh_host_alloc *ha;
+	size_t alloc_size;
+	int err;
+
+	if (size == 0 || (ha = calloc(1, sizeof(*ha))) == NULL)
+		return (NULL);
+
+	alloc_size = (size + HOST_ALIGN - 1) & ~((size_t)HOST_ALIGN - 1);
+	ha->size = size;
+
+	if (chc->host_unified)
+	{
+		if (posix_memalign(&ha->ptr, HOST_ALIGN, alloc_size) != 0)
+			goto err0;
+
+		/* Host fallback: the memory is the buffer itself. */
+		if (chc->fallback)
+		{
+			if ((ha->dev_mem = cpuWrapBuffer(ha->ptr, size)) == NULL)
+				goto err1;
+			ha->host_mem = ha->dev_mem;
+			goto done;
+		}
+
+		ha->host_mem = clCreateBuffer(chc->context,
+			CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, size, ha->ptr, &err);
+		if (!ha->host_mem)
+			goto err1;
+
+		ha->dev_mem = ha->host_mem;
+		clRetainMemObject(ha->dev_mem);
+	}
+	else
+	{
+		ha->host_mem = clCreateBuffer(chc->context,
+			CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size, NULL, &err);
+		if (!ha->host_mem)
+			goto err0;
+
+		ha->ptr = clEnqueueMapBuffer(chc->command_queue, ha->host_mem, CL_TRUE,
+			CL_MAP_READ | CL_MAP_WRITE, 0, size, 0, NULL, NULL, &err);
+		if (!ha->ptr || err != CL_SUCCESS)
+			goto err1;
+
+		ha->mapped = 1;
+		ha->dev_mem = clCreateBuffer(chc->context, CL_MEM_READ_WRITE, size,
+			NULL, &err);
+		if (!ha->dev_mem)
+			goto err1;
+	}
+
+done:
+	ha->next = chc->host_allocs;
+	chc->host_allocs = ha;
+	return (ha->ptr);
+
+err1:
+	if (ha->mapped)
+	{
+		clEnqueueUnmapMemObject(chc->command_queue, ha->host_mem, ha->ptr,
+			0, NULL, NULL);
+		clFinish(chc->command_queue);
+	}
+	if (ha->host_mem)
+		clReleaseMemObject(ha->host_mem);
+	if (chc->host_unified)
+		free(ha->ptr);
+err0:
+	free(ha);
+	fprintf(stderr, "clHelper: Failed to allocate host memory!\n");
+	return (NULL);
+}
+
+/**
+ * Releases a host allocation and its buffers.
+ * @param chc Context.
+ * @param ha Host allocation.
+ */
+static void releaseHostAlloc(struct cl_helper_context *chc,
+	struct clh_host_alloc *ha)
+{
+	if (chc->fallback)
+	{
+		free(ha->dev_mem);
+		free(ha->ptr);
+		free(ha);
+		return;
+	}
+
+	if (ha->mapped)
+	{
+		clEnqueueUnmapMemObject(chc->command_queue, ha->host_mem, ha->ptr,
+			0, NULL, NULL);
+		clFinish(chc->command_queue);
+	}
+
+	clReleaseMemObject(ha->dev_mem);
+	clReleaseMemObject(ha->host_mem);
+
+	if (!ha->mapped)
+		free(ha->ptr);
+	free(ha);
+}
+
+/**
+ * Frees memory allocated by clhAllocHost.
+ * @param chc Context.
+ * @param ptr Host pointer.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhFreeHost(struct cl_helper_context *chc, void *ptr)
+{
+	struct clh_host_alloc **prev, *ha;
+
+	for (prev = &chc->host_allocs; (ha = *prev) != NULL; prev = &ha->next)
+	{
+		if (ha->ptr == ptr)
+		{
+			*prev = ha->next;
+			releaseHostAlloc(chc, ha);
+			return (CLH_OK);
+		}
+	}
+	return (-CLH_INV_ARG);
+}
+
+/**
+ * Gets the device buffer of a host allocation, i.e: the buffer that
+ * should be passed to the kernels. On zero-copy devices it is the host
+ * memory itself.
+ * @param chc Context.
+ * @param ptr Host pointer, as returned by clhAllocHost.
+ * @returns The buffer, or NULL if not found.
+ */
+cl_mem clhHostBuffer(struct cl_helper_context *chc, void *ptr)
+{
+	struct clh_host_alloc *ha;
+
+	ha = findHostAlloc(chc, ptr, 0);
+	if (ha == NULL || ha->ptr != ptr)
+		return (NULL);
+	return (ha->dev_mem);
+}
+
+/**
+ * Maps a device buffer into the host address space (blocking).
+ * @param chc Context.
+ * @param mem Buffer.
+ * @param flags Map flags (CL_MAP_READ, CL_MAP_WRITE...).
+ * @param size Size to be mapped.
+ * @returns The mapped pointer, or NULL if error.
+ */
+void *clhMapBuffer(struct cl_helper_context *chc, cl_mem mem,
+	cl_map_flags flags, size_t size)
+{
+	void *ptr;
+	int err;
+
+	if (chc->fallback)
+		return (cpuBufferPtr(mem));
+
+	ptr = clEnqueueMapBuffer(chc->command_queue, mem, CL_TRUE, flags, 0, size,
+		0, NULL, NULL, &err);
+	if (err != CL_SUCCESS)
+		return (NULL);
+	return (ptr);
+}
+
+/**
+ * Unmaps a buffer previously mapped by clhMapBuffer.
+ * @param chc Context.
+ * @param mem Buffer.
+ * @param ptr Mapped pointer.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhUnmapBuffer(struct cl_helper_context *chc, cl_mem mem, void *ptr)
+{
+	if (chc->fallback)
+		return (CLH_OK);
+	if (clEnqueueUnmapMemObject(chc->command_queue, mem, ptr, 0, NULL,
+		NULL) != CL_SUCCESS)
+	{
+		return (-CLH_OUT_OF_MEM);
+	}
+	return (CLH_OK);
+}
+
+/**
+ * Synchronizes a zero-copy allocation with its device buffer, without
+ * copying anything on runtimes that really share the memory.
+ * @param chc Context.
+ * @param ha Host allocation.
+ * @param offset Offset inside the allocation.
+ * @param size Size to be synchronized.
+ * @param flags CL_MAP_READ (device to host) or
+ * CL_MAP_WRITE_INVALIDATE_REGION (host to device).
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+static int syncZeroCopy(struct cl_helper_context *chc,
+	struct clh_host_alloc *ha, size_t offset, size_t size, cl_map_flags flags)
+{
+	void *ptr;
+	int err;
+
+	/* Same memory, really. */
+	if (chc->fallback)
+		return (CLH_OK);
+
+	ptr = clEnqueueMapBuffer(chc->command_queue, ha->host_mem, CL_TRUE, flags,
+		offset, size, 0, NULL, NULL, &err);
+	if (err != CL_SUCCESS)
+		return (-CLH_OUT_OF_MEM);
+
+	clEnqueueUnmapMemObject(chc->command_queue, ha->host_mem, ptr, 0, NULL,
+		NULL);
+	clFinish(chc->command_queue);
+	return (CLH_OK);
+}
+
+/**
+ * Copies data from the host to a device buffer (blocking). If the
+ * source is a zero-copy allocation and the destination is its own
+ * device buffer, no copy is made at all.
+ * @param chc Context.
+ * @param dst Device buffer.
+ * @param src Host memory.
+ * @param size Bytes to be copied.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhWriteBuffer(struct cl_helper_context *chc, cl_mem dst,
+	const void *src, size_t size)
+{
+	struct clh_host_alloc *ha;
+	cl_event ev;
+	int rec;
+
+	ha = findHostAlloc(chc, src, size);
+	if (ha && ha->dev_mem == dst && ha->dev_mem == ha->host_mem)
+	{
+		return (syncZeroCopy(chc, ha, (const char *)src - (char *)ha->ptr,
+			size, CL_MAP_WRITE_INVALIDATE_REGION));
+	}
+
+	if (chc->fallback)
+	{
+		memcpy(cpuBufferPtr(dst), src, size);
+		return (CLH_OK);
+	}
+
+	rec = profSample(chc);
+	ev  = NULL;
+	if (clEnqueueWriteBuffer(chc->command_queue, dst, CL_TRUE, 0, size, src,
+		0, NULL, rec ? &ev : NULL) != CL_SUCCESS)
+	{
+		fprintf(stderr, "clHelper: Failed to write buffer!\n");
+		return (-CLH_OUT_OF_MEM);
+	}
+
+	if (ev)
+	{
+		profAdd(chc, ev, chc->command_queue, CLH_PROF_WRITE, NULL, size);
+		clReleaseEvent(ev);
+	}
+	return (CLH_OK);
+}
+
+/**
+ * Copies data from a device buffer to the host (blocking). If the
+ * destination is a zero-copy allocation and the source is its own
+ * device buffer, no copy is made at all.
+ * @param chc Context.
+ * @param dst Host memory.
+ * @param src Device buffer.
+ * @param size Bytes to be copied.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhReadBuffer(struct cl_helper_context *chc, void *dst, cl_mem src,
+	size_t size)
+{
+	struct clh_host_alloc *ha;
+	cl_event ev;
+	int rec;
+
+	ha = findHostAlloc(chc, dst, size);
+	if (ha && ha->dev_mem == src && ha->dev_mem == ha->host_mem)
+	{
+		return (syncZeroCopy(chc, ha, (char *)dst - (char *)ha->ptr,
+			size, CL_MAP_READ));
+	}
+
+	if (chc->fallback)
+	{
+		memcpy(dst, cpuBufferPtr(src), size);
+		return (CLH_OK);
+	}
+
+	rec = profSample(chc);
+	ev  = NULL;
+	if (clEnqueueReadBuffer(chc->command_queue, src, CL_TRUE, 0, size, dst,
+		0, NULL, rec ? &ev : NULL) != CL_SUCCESS)
+	{
+		fprintf(stderr, "clHelper: Failed to read buffer!\n");
+		return (-CLH_OUT_OF_MEM);
+	}
+
+	if (ev)
+	{
+		profAdd(chc, ev, chc->command_queue, CLH_PROF_READ, NULL, size);
+		clReleaseEvent(ev);
+	}
+	return (CLH_OK);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Streams.                                                                  *
+ * ------------------------------------------------------------------------- */
+
+/**
+ * Creates a stream: an independent sequence of commands. Commands in
+ * the same stream run in order, commands in different streams may run
+ * concurrently, unless ordered with clhStreamWait.
+ *
+ * By default (CLH_STREAM_IN_ORDER) each stream has its own in-order
+ * queue. With CLH_STREAM_OUT_OF_ORDER all the streams of the context
+ * share a single out-of-order queue, and the order inside each stream
+ * is kept with events; if the device does not support out-of-order
+ * queues, an in-order queue is used instead.
+ * @param chc Context.
+ * @param flags CLH_STREAM_IN_ORDER or CLH_STREAM_OUT_OF_ORDER.
+ * @returns The stream, or NULL if error.
+ */
+struct clh_stream *clhStreamCreate(struct cl_helper_context *chc, int flags)
+{
+	cl_command_queue_properties props;
+	struct clh_stream *s;
+	int err;
+
+	if (chc->fallback)
+	{
+		noDevice("clhStreamCreate");
+		return (NULL);
+	}
+
+	s = calloc(1, sizeof(struct clh_stream));
+	if (s == NULL)
+		return (NULL);
+
+	if (flags & CLH_STREAM_OUT_OF_ORDER)
+	{
+		props = 0;
+		clGetDeviceInfo(chc->device_id, CL_DEVICE_QUEUE_PROPERTIES,
+			sizeof(props), &props, NULL);
+
+		if ((props & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) &&
+			!chc->ooo_queue)
+		{
+			chc->ooo_queue = clCreateCommandQueue(chc->context, chc->device_id,
+				CL_QUEUE_PROFILING_ENABLE |
+				CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, &err);
+		}
+
+		if (chc->ooo_queue)
+		{
+			clRetainCommandQueue(chc->ooo_queue);
+			s->queue = chc->ooo_queue;
+			s->out_of_order = 1;
+		}
+#ifdef CL_DEBUG
+		else
+			fprintf(stderr, "clHelper: no out-of-order queues, "
+				"using an in-order one\n");
+#endif
+	}
+
+	if (!s->queue)
+	{
+		s->queue = clCreateCommandQueue(chc->context, chc->device_id,
+			CL_QUEUE_PROFILING_ENABLE, &err);
+		if (!s->queue)
+		{
+			fprintf(stderr, "clHelper: Failed to create a command queue!\n");
+			free(s);
+			return (NULL);
+		}
+	}
+
+	s->next = chc->streams;
+	chc->streams = s;
+	return (s);
+}
+
+/**
+ * Waits for all the commands of a stream.
+ * @param chc Context.
+ * @param s Stream.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhStreamSynchronize(struct cl_helper_context *chc, struct clh_stream *s)
+{
+	((void)chc);
+
+	if (s->out_of_order)
+	{
+		clFlush(s->queue);
+		return (s->last ? clhWaitEvents(1, &s->last) : CLH_OK);
+	}
+
+	if (clFinish(s->queue) != CL_SUCCESS)
+		return (-CLH_KERN_FAIL);
+	return (CLH_OK);
+}
+
+/**
+ * Releases a stream, waiting for its commands first.
+ * @param chc Context.
+ * @param s Stream.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhStreamRelease(struct cl_helper_context *chc, struct clh_stream *s)
+{
+	struct clh_stream **p;
+
+	for (p = &chc->streams; *p && *p != s; p = &(*p)->next);
+	if (!*p)
+		return (-CLH_INV_ARG);
+	*p = s->next;
+
+	clhStreamSynchronize(chc, s);
+	if (s->last)
+		clReleaseEvent(s->last);
+	clReleaseCommandQueue(s->queue);
+	free(s);
+	return (CLH_OK);
+}
+
+/**
+ * Builds the wait list of a stream command: the caller events plus,
+ * in out-of-order streams, the previous command of the stream.
+ * @param s Stream.
+ * @param num_wait Number of caller events.
+ * @param wait_list Caller events.
+ * @param list Returned wait list, to be freed with free() if it is
+ * not @p wait_list.
+ * @param num Returned wait list size.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+static int streamWaitList(struct clh_stream *s, cl_uint num_wait,
+	const cl_event *wait_list, cl_event **list, cl_uint *num)
+{
+	*list = (cl_event *)wait_list;
+	*num  = num_wait;
+
+	if (!s->out_of_order || !s->last)
+		return (CLH_OK);
+
+	*list = malloc(sizeof(cl_event) * (num_wait + 1));
+	if (*list == NULL)
+		return (-CLH_OUT_OF_MEM);
+
+	if (num_wait)
+		memcpy(*list, wait_list, sizeof(cl_event) * num_wait);
+	(*list)[num_wait] = s->last;
+	*num = num_wait + 1;
+	return (CLH_OK);
+}
+
+/**
+ * Finishes a stream command: keeps its event as the last command of
+ * out-of-order streams, and hands it to the caller, if requested.
+ * @param s Stream.
+ * @param list Wait list used.
+ * @param wait_list Caller wait list.
+ * @param ev Command event, may be NULL.
+ * @param event Caller event, may be NULL.
+ */
+static void streamEnd(struct clh_stream *s, cl_event *list,
+	const cl_event *wait_list, cl_event ev, cl_event *event)
+{
+	if (list != wait_list)
+		free(list);
+
+	if (s->out_of_order && ev)
+	{
+		if (s->last)
+			clReleaseEvent(s->last);
+		clRetainEvent(ev);
+		s->last = ev;
+	}
+
+	if (event)
+		*event = ev;
+	else if (ev)
+		clReleaseEvent(ev);
+
+	clFlush(s->queue);
+}
+
+/**
+ * Launches a kernel in a stream, without waiting it finishes.
+ * @param chc Context.
+ * @param s Stream.
+ * @param kernel Kernel to be launched.
+ * @param num_wait Number of events in the wait list.
+ * @param wait_list Events that must complete before the kernel
+ * starts, may be NULL.
+ * @param event Returned kernel event, may be NULL. The caller owns
+ * the event and must release it with clReleaseEvent.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhStreamLaunch(struct cl_helper_context *chc, struct clh_stream *s,
+	cl_kernel kernel, cl_uint num_wait, const cl_event *wait_list,
+	cl_event *event)
+{
+	cl_event *list;
+	cl_event ev;
+	cl_uint num;
+	int ret;
+
+	if ((ret = streamWaitList(s, num_wait, wait_list, &list, &num)) != CLH_OK)
+		return (ret);
+
+	ev  = NULL;
+	ret = enqueueKernel(chc, s->queue, kernel, num, list,
+		(event || s->out_of_order) ? &ev : NULL);
+
+	streamEnd(s, list, wait_list, ret == CLH_OK ? ev : NULL, event);
+	return (ret);
+}
+
+/**
+ * Enqueues a transfer in a stream.
+ * @param chc Context.
+ * @param s Stream.
+ * @param kind CLH_PROF_WRITE, CLH_PROF_READ or CLH_PROF_COPY.
+ * @param buf Device buffer (destination, except for reads).
+ * @param src Source buffer, for copies.
+ * @param ptr Host pointer, for writes and reads.
+ * @param size Transfer size, in bytes.
+ * @param num_wait Number of events in the wait list.
+ * @param wait_list Wait list.
+ * @param event Returned event, may be NULL.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+static int streamTransfer(struct cl_helper_context *chc,
+	struct clh_stream *s, int kind, cl_mem buf, cl_mem src, void *ptr,
+	size_t size, cl_uint num_wait, const cl_event *wait_list,
+	cl_event *event)
+{
+	cl_event *list;
+	cl_event ev;
+	cl_uint num;
+	int ret;
+	int rec;
+	int err;
+
+	if ((ret = streamWaitList(s, num_wait, wait_list, &list, &num)) != CLH_OK)
+		return (ret);
+
+	rec = profSample(chc);
+	ev  = NULL;
+
+	if (kind == CLH_PROF_WRITE)
+		err = clEnqueueWriteBuffer(s->queue, buf, CL_FALSE, 0, size, ptr, num,
+			list, &ev);
+	else if (kind == CLH_PROF_READ)
+		err = clEnqueueReadBuffer(s->queue, buf, CL_FALSE, 0, size, ptr, num,
+			list, &ev);
+	else
+		err = clEnqueueCopyBuffer(s->queue, src, buf, 0, 0, size, num, list,
+			&ev);
+
+	ret = CLH_OK;
+	if (err != CL_SUCCESS)
+	{
+		fprintf(stderr, "clHelper: Failed to enqueue transfer! %d\n", err);
+		ev  = NULL;
+		ret = -CLH_OUT_OF_MEM;
+	}
+	else if (rec)
+		profAdd(chc, ev, s->queue, kind, NULL, size);
+
+	streamEnd(s, list, wait_list, ev, event);
+	return (ret);
+}
+
+/**
+ * Writes to a device buffer in a stream, without waiting. The host
+ * memory must stay valid until the write finishes.
+ * @param chc Context.
+ * @param s Stream.
+ * @param dst Device buffer.
+ * @param src Host memory.
+ * @param size Size, in bytes.
+ * @param num_wait Number of events in the wait list.
+ * @param wait_list Wait list, may be NULL.
+ * @param event Returned event, may be NULL.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhStreamWrite(struct cl_helper_context *chc, struct clh_stream *s,
+	cl_mem dst, const void *src, size_t size, cl_uint num_wait,
+	const cl_event *wait_list, cl_event *event)
+{
+	return (streamTransfer(chc, s, CLH_PROF_WRITE, dst, NULL, (void *)src,
+		size, num_wait, wait_list, event));
+}
+
+/**
+ * Reads from a device buffer in a stream, without waiting. The host
+ * memory is only valid after the read finishes.
+ * @param chc Context.
+ * @param s Stream.
+ * @param dst Host memory.
+ * @param src Device buffer.
+ * @param size Size, in bytes.
+ * @param num_wait Number of events in the wait list.
+ * @param wait_list Wait list, may be NULL.
+ * @param event Returned event, may be NULL.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhStreamRead(struct cl_helper_context *chc, struct clh_stream *s,
+	void *dst, cl_mem src, size_t size, cl_uint num_wait,
+	const cl_event *wait_list, cl_event *event)
+{
+	return (streamTransfer(chc, s, CLH_PROF_READ, src, NULL, dst, size,
+		num_wait, wait_list, event));
+}
+
+/**
+ * Copies between device buffers in a stream, without waiting.
+ * @param chc Context.
+ * @param s Stream.
+ * @param dst Destination buffer.
+ * @param src Source buffer.
+ * @param size Size, in bytes.
+ * @param num_wait Number of events in the wait list.
+ * @param wait_list Wait list, may be NULL.
+ * @param event Returned event, may be NULL.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhStreamCopy(struct cl_helper_context *chc, struct clh_stream *s,
+	cl_mem dst, cl_mem src, size_t size, cl_uint num_wait,
+	const cl_event *wait_list, cl_event *event)
+{
+	return (streamTransfer(chc, s, CLH_PROF_COPY, dst, src, NULL, size,
+		num_wait, wait_list, event));
+}
+
+/**
+ * Records an event that completes when all the commands enqueued so
+ * far in the stream complete, e.g: to make another stream wait.
+ * @param chc Context.
+ * @param s Stream.
+ * @param event Returned event, owned by the caller.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhStreamRecord(struct cl_helper_context *chc, struct clh_stream *s,
+	cl_event *event)
+{
+	((void)chc);
+
+	/*
+	 * Out-of-order: the last command already stands for the stream;
+	 * an empty stream gets a marker, which waits for the whole queue.
+	 */
+	if (s->out_of_order)
+	{
+		if (s->last)
+		{
+			clRetainEvent(s->last);
+			*event = s->last;
+			return (CLH_OK);
+		}
+		*event = NULL;
+		return (clEnqueueMarkerWithWaitList(s->queue, 0, NULL, event) ==
+			CL_SUCCESS ? CLH_OK : -CLH_KERN_FAIL);
+	}
+
+	if (clEnqueueMarkerWithWaitList(s->queue, 0, NULL, event) != CL_SUCCESS)
+		return (-CLH_KERN_FAIL);
+	return (CLH_OK);
+}
+
+/**
+ * Makes the next commands of a stream wait for a list of events,
+ * typically recorded in other streams (see clhStreamRecord).
+ * @param chc Context.
+ * @param s Stream.
+ * @param num Number of events.
+ * @param events Events.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhStreamWait(struct cl_helper_context *chc, struct clh_stream *s,
+	cl_uint num, const cl_event *events)
+{
+	cl_event *list;
+	cl_event ev;
+	cl_uint n;
+	int ret;
+
+	((void)chc);
+
+	if (num == 0)
+		return (CLH_OK);
+
+	/* In-order: a barrier holds every later command of the queue. */
+	if (!s->out_of_order)
+	{
+		if (clEnqueueBarrierWithWaitList(s->queue, num, events, NULL) !=
+			CL_SUCCESS)
+		{
+			return (-CLH_KERN_FAIL);
+		}
+		return (CLH_OK);
+	}
+
+	/*
+	 * Out-of-order: a barrier would hold the other streams too, so a
+	 * marker with the events becomes the last command of the stream.
+	 */
+	if ((ret = streamWaitList(s, num, events, &list, &n)) != CLH_OK)
+		return (ret);
+
+	ev = NULL;
+	if (clEnqueueMarkerWithWaitList(s->queue, n, list, &ev) != CL_SUCCESS)
+		ret = -CLH_KERN_FAIL;
+
+	streamEnd(s, list, events, ev, NULL);
+	return (ret);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Launch service.                                                           *
+ * ------------------------------------------------------------------------- */
+
+/**
+ * Completion of a posted request, see clhServicePost.
+ */
+struct clh_future
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int done;                  /* Completed.            */
+	int status;                /* CLH_OK or error.      */
+	double time_ms;            /* Kernel time.          */
+	int refs;                  /* Caller + service.     */
+	struct clh_service *svc;   /* Service.              */
+	cl_event kernel_ev;        /* Kernel event.         */
+	void (*callback)(int status, double time_ms, void *user);
+	void *user;                /* Callback data.        */
+};
+
+/**
+ * Submission ring slot.
+ */
+struct svc_slot
+{
+	size_t seq;                /* Slot sequence.        */
+	struct clh_request req;    /* Request.              */
+	struct clh_future *fut;    /* Its future.           */
+};
+
+/**
+ * Kernel of the caller and the dispatcher own copy: kernel arguments
+ * are not thread-safe, so each dispatcher sets them in its own kernel.
+ */
+struct svc_kernel
+{
+	cl_kernel orig;            /* Caller kernel.        */
+	cl_kernel own;             /* Dispatcher kernel.    */
+};
+
+/**
+ * Dispatcher: one thread per device, the only one that uses its
+ * queue. Fed by a bounded lock-free multi-producer ring (Vyukov).
+ */
+struct svc_dispatcher
+{
+	struct clh_service *svc;   /* Service.              */
+	pthread_t thread;          /* Thread.               */
+	cl_command_queue queue;    /* Device queue.         */
+
+	/* Ring. */
+	struct svc_slot *slots;    /* Slots.                */
+	size_t mask;               /* Capacity - 1.         */
+	size_t head;               /* Next push (producers).*/
+	size_t tail;               /* Next pop (dispatcher).*/
+
+	/* Sleep when idle. */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int sleeping;              /* Waiting for work.     */
+
+	struct svc_kernel *kernels;/* Kernel copies.        */
+	int num_kernels;
+
+	/* Statistics. */
+	unsigned long submitted;   /* Requests submitted.   */
+	unsigned long flushes;     /* Flushes.              */
+};
+
+/**
+ * Launch service, see clhServiceStart.
+ */
+struct clh_service
+{
+	struct cl_helper_context *chc;
+	struct svc_dispatcher *disp;  /* One per device.    */
+	int num_disp;
+	unsigned next;             /* Round-robin counter.  */
+	int quit;                  /* Stopping.             */
+	unsigned long posted;      /* Requests posted.      */
+	unsigned long completed;   /* Requests completed.   */
+};
+
+/* Requests submitted per flush, at most. */
+#define SVC_BATCH 64
+
+/**
+ * Pushes a request into a dispatcher ring.
+ * @param d Dispatcher.
+ * @param req Request.
+ * @param fut Future.
+ * @returns 1 if pushed, 0 if the ring is full.
+ */
+static int svcPush(struct svc_dispatcher *d, const struct clh_request *req,
+	struct clh_future *fut)
+{
+	struct svc_slot *slot;
+	size_t pos, seq;
+	intptr_t diff;
+
+	pos = __atomic_load_n(&d->head, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		slot = &d->slots[pos & d->mask];
+		seq  = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (intptr_t)seq - (intptr_t)pos;
+
+		/* Free slot, claim it. */
+		if (diff == 0)
+		{
+			if (__atomic_compare_exchange_n(&d->head, &pos, pos + 1, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+		}
+		else if (diff < 0)
+			return (0);
+		else
+			pos = __atomic_load_n(&d->head, __ATOMIC_RELAXED);
+	}
+
+	slot->req = *req;
+	slot->fut = fut;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	return (1);
+}
+
+/**
+ * Pops a request from a dispatcher ring, dispatcher thread only.
+ * @param d Dispatcher.
+ * @param req Returned request.
+ * @param fut Returned future.
+ * @returns 1 if a request was taken, 0 if the ring is empty.
+ */
+static int svcPop(struct svc_dispatcher *d, struct clh_request *req,
+	struct clh_future **fut)
+{
+	struct svc_slot *slot;
+	size_t seq;
+
+	slot = &d->slots[d->tail & d->mask];
+	seq  = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	if ((intptr_t)seq - (intptr_t)(d->tail + 1) < 0)
+		return (0);
+
+	*req = slot->req;
+	*fut = slot->fut;
+	__atomic_store_n(&slot->seq, d->tail + d->mask + 1, __ATOMIC_RELEASE);
+	d->tail++;
+	return (1);
+}
+
+/**
+ * Drops a reference to a future, freeing it on the last one.
+ * @param f Future.
+ */
+static void futureUnref(struct clh_future *f)
+{
+	if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	pthread_mutex_destroy(&f->lock);
+	pthread_cond_destroy(&f->cond);
+	free(f);
+}
+
+/**
+ * Completes a future: wakes the waiters and calls the callback.
+ * @param svc Service.
+ * @param f Future.
+ * @param status CLH_OK or error.
+ */
+static void futureComplete(struct clh_service *svc, struct clh_future *f,
+	int status)
+{
+	cl_ulong t0, t1;
+
+	f->time_ms = 0;
+	if (f->kernel_ev)
+	{
+		if (status == CLH_OK &&
+			clGetEventProfilingInfo(f->kernel_ev, CL_PROFILING_COMMAND_START,
+			sizeof(t0), &t0, NULL) == CL_SUCCESS &&
+			clGetEventProfilingInfo(f->kernel_ev, CL_PROFILING_COMMAND_END,
+			sizeof(t1), &t1, NULL) == CL_SUCCESS)
+		{
+			f->time_ms = (t1 - t0) / 1000000.0;
+		}
+		clReleaseEvent(f->kernel_ev);
+		f->kernel_ev = NULL;
+	}
+
+	if (f->callback)
+		f->callback(status, f->time_ms, f->user);
+
+	pthread_mutex_lock(&f->lock);
+	f->status = status;
+	f->done = 1;
+	pthread_cond_broadcast(&f->cond);
+	pthread_mutex_unlock(&f->lock);
+
+	__atomic_add_fetch(&svc->completed, 1, __ATOMIC_RELAXED);
+	futureUnref(f);
+}
+
+/**
+ * Completion callback of the last command of a request, called by the
+ * OpenCL runtime.
+ * @param event Event.
+ * @param status Execution status.
+ * @param data Future.
+ */
+static void CL_CALLBACK svcEventDone(cl_event event, cl_int status,
+	void *data)
+{
+	struct clh_future *f = data;
+
+	clReleaseEvent(event);
+	futureComplete(f->svc, f, status == CL_COMPLETE ? CLH_OK :
+		-CLH_KERN_FAIL);
+}
+
+/**
+ * Creates a new kernel object for the same function of a kernel, the
+ * arguments are not copied.
+ * @param kernel Kernel.
+ * @returns The new kernel, or NULL if error.
+ */
+static cl_kernel cloneKernel(cl_kernel kernel)
+{
+	cl_program program;
+	char name[256];
+	cl_kernel own;
+	int err;
+
+	if (clGetKernelInfo(kernel, CL_KERNEL_PROGRAM, sizeof(program), &program,
+		NULL) != CL_SUCCESS || clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME,
+		sizeof(name), name, NULL) != CL_SUCCESS)
+	{
+		return (NULL);
+	}
+
+	own = clCreateKernel(program, name, &err);
+	if (!own || err != CL_SUCCESS)
+		return (NULL);
+	return (own);
+}
+
+/**
+ * Gets the dispatcher copy of a kernel, creating it on first use.
+ * @param d Dispatcher.
+ * @param kernel Caller kernel.
+ * @returns The dispatcher kernel, or NULL if error.
+ */
+static cl_kernel svcKernel(struct svc_dispatcher *d, cl_kernel kernel)
+{
+	struct svc_kernel *kernels;
+	cl_kernel own;
+
+	for (int i = 0; i < d->num_kernels; i++)
+		if (d->kernels[i].orig == kernel)
+			return (d->kernels[i].own);
+
+	if ((own = cloneKernel(kernel)) == NULL)
+		return (NULL);
+
+	kernels = realloc(d->kernels, sizeof(*kernels) * (d->num_kernels + 1));
+	if (kernels == NULL)
+	{
+		clReleaseKernel(own);
+		return (NULL);
+	}
+
+	d->kernels = kernels;
+	d->kernels[d->num_kernels].orig = kernel;
+	d->kernels[d->num_kernels].own = own;
+	d->num_kernels++;
+	return (own);
+}
+
+/**
+ * Enqueues a request: upload, kernel and download, without flushing.
+ * The future is completed by the runtime when the last command ends.
+ * @param d Dispatcher.
+ * @param req Request.
+ * @param f Future.
+ * @returns Returns CLH_OK if success and a negative number otherwise,
+ * the future is not completed then, but nothing of the request is
+ * still queued.
+ */
+static int svcSubmit(struct svc_dispatcher *d, const struct clh_request *req,
+	struct clh_future *f)
+{
+	cl_event last;
+	cl_kernel kernel;
+	int err;
+
+	if ((kernel = svcKernel(d, req->kernel)) == NULL)
+		return (-CLH_KERN_FAIL);
+
+	err = CL_SUCCESS;
+	for (int i = 0; i < req->nargs && err == CL_SUCCESS; i++)
+		err = clSetKernelArg(kernel, i, req->args[i].size,
+			argValue(&req->args[i]));
+
+	if (err == CL_SUCCESS && req->write_buf)
+	{
+		err = clEnqueueWriteBuffer(d->queue, req->write_buf, CL_FALSE, 0,
+			req->write_size, req->write_src, 0, NULL, NULL);
+	}
+
+	if (err == CL_SUCCESS)
+	{
+		err = clEnqueueNDRangeKernel(d->queue, kernel, req->dims, NULL,
+			req->global, req->local[0] ? req->local : NULL, 0, NULL,
+			&f->kernel_ev);
+	}
+	if (err != CL_SUCCESS)
+	{
+		/* The upload may be queued: the caller memory is in use. */
+		clFinish(d->queue);
+		return (-CLH_KERN_FAIL);
+	}
+
+	/* In-order queue: the last command ends the request. */
+	last = f->kernel_ev;
+	clRetainEvent(last);
+	if (req->read_buf)
+	{
+		clReleaseEvent(last);
+		if (clEnqueueReadBuffer(d->queue, req->read_buf, CL_FALSE, 0,
+			req->read_size, req->read_dst, 0, NULL, &last) != CL_SUCCESS)
+		{
+			clFinish(d->queue);
+			clReleaseEvent(f->kernel_ev);
+			f->kernel_ev = NULL;
+			return (-CLH_OUT_OF_MEM);
+		}
+	}
+
+	if (clSetEventCallback(last, CL_COMPLETE, svcEventDone, f) != CL_SUCCESS)
+	{
+		/* Already enqueued: wait here instead. */
+		clWaitForEvents(1, &last);
+		clReleaseEvent(last);
+		futureComplete(d->svc, f, CLH_OK);
+	}
+	return (CLH_OK);
+}
+
+/**
+ * Dispatcher thread: takes the posted requests, enqueues them and
+ * flushes the queue once per batch, not once per request.
+ * @param arg Dispatcher.
+ * @returns Always NULL.
+ */
+static void *svcDispatcher(void *arg)
+{
+	struct svc_dispatcher *d = arg;
+	struct clh_service *svc = d->svc;
+	struct clh_request req;
+	struct clh_future *f;
+	int ret;
+	int n;
+
+	for (;;)
+	{
+		n = 0;
+		while (n < SVC_BATCH && svcPop(d, &req, &f))
+		{
+			if ((ret = svcSubmit(d, &req, f)) != CLH_OK)
+				futureComplete(svc, f, ret);
+			n++;
+		}
+
+		if (n)
+		{
+			clFlush(d->queue);
+			__atomic_add_fetch(&d->submitted, n, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&d->flushes, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		/* Nothing to do: sleep, unless something arrived meanwhile. */
+		pthread_mutex_lock(&d->lock);
+		__atomic_store_n(&d->sleeping, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		if (__atomic_load_n(&svc->quit, __ATOMIC_ACQUIRE) &&
+			__atomic_load_n(&d->slots[d->tail & d->mask].seq,
+			__ATOMIC_ACQUIRE) != d->tail + 1)
+		{
+			pthread_mutex_unlock(&d->lock);
+			break;
+		}
+
+		while (__atomic_load_n(&d->slots[d->tail & d->mask].seq,
+			__ATOMIC_ACQUIRE) != d->tail + 1 &&
+			!__atomic_load_n(&svc->quit, __ATOMIC_ACQUIRE))
+		{
+			pthread_cond_wait(&d->cond, &d->lock);
+		}
+		__atomic_store_n(&d->sleeping, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&d->lock);
+	}
+
+	/* Everything submitted must complete before the queue goes away. */
+	clFinish(d->queue);
+	return (NULL);
+}
+
+/**
+ * Starts a launch service: one dispatcher thread per context device,
+ * each one owning its own command queue, fed by a lock-free ring. Any
+ * number of threads can then post kernel launches with clhServicePost,
+ * without locks and without their own contexts.
+ * The context itself must not be released before the service, and
+ * programs, kernels and buffers are still created through it.
+ * @param chc Context.
+ * @param capacity Ring size per device, rounded up to a power of two,
+ * 0 for 1024. Posts wait while the ring is full.
+ * @returns The service, or NULL if error.
+ */
+struct clh_service *clhServiceStart(struct cl_helper_context *chc,
+	int capacity)
+{
+	struct clh_service *svc;
+	struct svc_dispatcher *d;
+	size_t cap;
+	int err;
+
+	if (chc->fallback)
+	{
+		noDevice("clhServiceStart");
+		return (NULL);
+	}
+
+	cap = roundPower(capacity > 0 ? (size_t)capacity : 1024);
+
+	if ((svc = calloc(1, sizeof(*svc))) == NULL)
+		return (NULL);
+	svc->chc = chc;
+	svc->num_disp = chc->num_devices ? chc->num_devices : 1;
+	if ((svc->disp = calloc(svc->num_disp, sizeof(*d))) == NULL)
+	{
+		free(svc);
+		return (NULL);
+	}
+
+	for (int i = 0; i < svc->num_disp; i++)
+	{
+		d = &svc->disp[i];
+		d->svc = svc;
+		d->mask = cap - 1;
+		pthread_mutex_init(&d->lock, NULL);
+		pthread_cond_init(&d->cond, NULL);
+
+		if ((d->slots = malloc(sizeof(struct svc_slot) * cap)) == NULL)
+			goto err;
+		for (size_t j = 0; j < cap; j++)
+			d->slots[j].seq = j;
+
+		d->queue = clCreateCommandQueue(chc->context, chc->devices ?
+			chc->devices[i] : chc->device_id, CL_QUEUE_PROFILING_ENABLE, &err);
+		if (!d->queue)
+			goto err;
+
+		if (pthread_create(&d->thread, NULL, svcDispatcher, d) != 0)
+		{
+			clReleaseCommandQueue(d->queue);
+			d->queue = NULL;
+			goto err;
+		}
+	}
+	return (svc);
+
+err:
+	fprintf(stderr, "clHelper: Failed to start the launch service!\n");
+	clhServiceStop(svc);
+	return (NULL);
+}
+
+/**
+ * Posts a kernel launch to the service. The request is copied, so it
+ * can be reused right away; the memory it points to (upload source,
+ * download destination and CLH_RAW data) must stay valid until the
+ * request completes. Lock-free, callable from any thread. Tracked
+ * (CLH_TRACKED) and split (CLH_SPLIT) buffers are not supported.
+ * @param svc Service.
+ * @param req Request.
+ * @param future Returned future, wait for it with clhFutureWait. May
+ * be NULL, e.g. when a callback is used instead.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhServicePost(struct clh_service *svc, const struct clh_request *req,
+	struct clh_future **future)
+{
+	struct svc_dispatcher *d;
+	struct clh_future *f;
+	int idx;
+
+	if (!req->kernel || req->nargs < 0 || req->nargs > CLH_SERVICE_MAX_ARGS ||
+		req->dims < 1 || req->dims > 3)
+	{
+		return (-CLH_INV_ARG);
+	}
+
+	/* Dispatchers have no context state to bind them. */
+	if (contextArgs(req->args, req->nargs))
+	{
+		fprintf(stderr, "clHelper: Tracked and split buffers cannot be"
+			" posted to the service!\n");
+		return (-CLH_INV_ARG);
+	}
+
+	if ((f = calloc(1, sizeof(*f))) == NULL)
+		return (-CLH_OUT_OF_MEM);
+	pthread_mutex_init(&f->lock, NULL);
+	pthread_cond_init(&f->cond, NULL);
+	f->svc = svc;
+	f->callback = req->callback;
+	f->user = req->user;
+	f->refs = future ? 2 : 1;
+
+	/* Pinned to a device or round-robin. */
+	if (req->device >= 0 && req->device < svc->num_disp)
+		idx = req->device;
+	else
+		idx = __atomic_fetch_add(&svc->next, 1, __ATOMIC_RELAXED) %
+			svc->num_disp;
+	d = &svc->disp[idx];
+
+	while (!svcPush(d, req, f))
+		sched_yield();
+	__atomic_add_fetch(&svc->posted, 1, __ATOMIC_RELAXED);
+
+	/* Wake the dispatcher up, if sleeping. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&d->sleeping, __ATOMIC_RELAXED))
+	{
+		pthread_mutex_lock(&d->lock);
+		pthread_cond_signal(&d->cond);
+		pthread_mutex_unlock(&d->lock);
+	}
+
+	if (future)
+		*future = f;
+	return (CLH_OK);
+}
+
+/**
+ * Waits for a posted request and releases its future.
+ * @param f Future, as returned by clhServicePost.
+ * @param time_ms Kernel time, in ms, may be NULL.
+ * @returns The request status: CLH_OK or a negative number.
+ */
+int clhFutureWait(struct clh_future *f, double *time_ms)
+{
+	int status;
+
+	pthread_mutex_lock(&f->lock);
+	while (!f->done)
+		pthread_cond_wait(&f->cond, &f->lock);
+	status = f->status;
+	if (time_ms)
+		*time_ms = f->time_ms;
+	pthread_mutex_unlock(&f->lock);
+
+	futureUnref(f);
+	return (status);
+}
+
+/**
+ * Gets the service statistics.
+ * @param svc Service.
+ * @param stats Statistics.
+ * @returns Always CLH_OK.
+ */
+int clhServiceStats(struct clh_service *svc, struct clh_service_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->posted = __atomic_load_n(&svc->posted, __ATOMIC_RELAXED);
+	stats->completed = __atomic_load_n(&svc->completed, __ATOMIC_RELAXED);
+	for (int i = 0; i < svc->num_disp; i++)
+	{
+		stats->submitted += __atomic_load_n(&svc->disp[i].submitted,
+			__ATOMIC_RELAXED);
+		stats->flushes += __atomic_load_n(&svc->disp[i].flushes,
+			__ATOMIC_RELAXED);
+	}
+	stats->avg_batch = stats->flushes ?
+		(double)stats->submitted / stats->flushes : 0;
+	return (CLH_OK);
+}
+
+/**
+ * Stops a launch service: the requests already posted are run, and the
+ * call returns when all of them completed. No request can be posted
+ * during or after the call.
+ * @param svc Service.
+ * @returns Always CLH_OK.
+ */
+int clhServiceStop(struct clh_service *svc)
+{
+	struct svc_dispatcher *d;
+
+	if (!svc)
+		return (CLH_OK);
+
+	__atomic_store_n(&svc->quit, 1, __ATOMIC_RELEASE);
+	for (int i = 0; i < svc->num_disp; i++)
+	{
+		d = &svc->disp[i];
+		if (!d->queue)
+			continue;
+		pthread_mutex_lock(&d->lock);
+		pthread_cond_signal(&d->cond);
+		pthread_mutex_unlock(&d->lock);
+	}
+
+	for (int i = 0; i < svc->num_disp; i++)
+		if (svc->disp[i].queue)
+			pthread_join(svc->disp[i].thread, NULL);
+
+	/* Completion callbacks may still run after clFinish returns. */
+	while (__atomic_load_n(&svc->completed, __ATOMIC_ACQUIRE) <
+		__atomic_load_n(&svc->posted, __ATOMIC_RELAXED))
+	{
+		sched_yield();
+	}
+
+	for (int i = 0; i < svc->num_disp; i++)
+	{
+		d = &svc->disp[i];
+		if (!d->svc)
+			continue;
+		if (d->queue)
+			clReleaseCommandQueue(d->queue);
+		for (int k = 0; k < d->num_kernels; k++)
+			clReleaseKernel(d->kernels[k].own);
+		free(d->kernels);
+		free(d->slots);
+		pthread_mutex_destroy(&d->lock);
+		pthread_cond_destroy(&d->cond);
+	}
+
+	free(svc->disp);
+	free(svc);
+	return (CLH_OK);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Micro-batching.                                                           *
+ * ------------------------------------------------------------------------- */
+
+/**
+ * Request waiting in a micro-batcher, lives in the caller stack.
+ */
+struct batch_req
+{
+	const void *in;            /* Input.                */
+	size_t n_in;               /* Input elements.       */
+	void *out;                 /* Output.               */
+	size_t n_out;              /* Output elements.      */
+	double t_post;             /* Submit time, in ms.   */
+	int done;                  /* Results available.    */
+	int status;                /* CLH_OK or error.      */
+	struct batch_req *next;    /* Next request.         */
+};
+
+/**
+ * Micro-batcher, see clhBatcherCreate.
+ */
+struct clh_batcher
+{
+	struct clh_batch_config cfg;
+	cl_kernel kernel;          /* Own kernel copy.      */
+	cl_command_queue queue;    /* Own queue.            */
+	cl_context context;        /* Context.              */
+	pthread_t thread;          /* Batching thread.      */
+
+	/* Waiting requests, protected by lock. */
+	pthread_mutex_t lock;
+	pthread_cond_t arrived;    /* Request posted.       */
+	pthread_cond_t finished;   /* Batch completed.      */
+	struct batch_req *head;
+	struct batch_req *tail;
+	int pending;               /* Requests waiting.     */
+	size_t pending_elems;      /* Their input elements. */
+	int quit;                  /* Stopping.             */
+
+	/* Packed batch, host and device side. */
+	unsigned char *h_in;
+	unsigned char *h_out;
+	cl_uint *h_offs;           /* In and out offsets.   */
+	size_t in_cap;             /* Elements.             */
+	size_t out_cap;            /* Elements.             */
+	int offs_cap;              /* Requests.             */
+	cl_mem d_in;
+	cl_mem d_out;
+	cl_mem d_in_offs;
+	cl_mem d_out_offs;
+
+	/* Statistics, protected by lock. */
+	unsigned long requests;
+	unsigned long batches;
+	unsigned long full;
+	double elems;
+	double wait_ms;
+	double latency_ms;
+	double max_latency_ms;
+	double kernel_ms;
+};
+
+/* Batch kernel arguments, the user ones follow them. */
+#define BATCH_ARGS 5
+
+/**
+ * Makes sure a device buffer holds at least a given size.
+ * @param b Batcher.
+ * @param mem Buffer, replaced if too small.
+ * @param cap Current size, in elements.
+ * @param need Needed size, in elements.
+ * @param elem_size Element size.
+ * @returns Returns CLH_OK if success and a negative number otherwise.
+ */
+static int batchGrow(struct clh_batcher *b, cl_mem *mem, size_t cap,
+	size_t need, size_t elem_size)
+{
+	int err;
+
+	if (*mem && need <= cap)
+		return (CLH_OK);
+	if (*mem)
+		clReleaseMemObject(*mem);
+
+	*mem = clCreateBuffer(b->context, CL_MEM_READ_WRITE,
+		(need ? need : 1) * elem_size, NULL, &err);
+	return (*mem && err == CL_SUCCESS ? CLH_OK : -CLH_OUT_OF_MEM);
+}
+
+/**
+ * Runs a batch: packs the inputs, launches the kernel once and scatters
+ * the outputs back to the requests.
+ * @param b Batcher.
+ * @param list First request.
+ * @param count Requests.
+ * @param kernel_ms Kernel time.
+ * @returns Returns CLH_OK if success and a negative number otherwise.
+ */
+static int batchRun(struct clh_batcher *b, struct batch_req *list,
+	int count, double *kernel_ms)
+{
+	struct batch_req *r;
+	size_t n_in, n_out;
+	size_t global, local;
+	size_t in_sz, out_sz;
+	cl_uint items;
+	cl_event ev;
+	void *p;
+	int err;
+
+	in_sz  = b->cfg.in_elem_size;
+	out_sz = b->cfg.out_elem_size;
+
+	/* Offsets of every request, plus the end. */
+	n_in = n_out = 0;
+	r = list;
+	for (int i = 0; i < count; i++, r = r->next)
+	{
+		n_in  += r->n_in;
+		n_out += r->n_out;
 	}
-	
-	/* Get number of dimensions. */
-	dimensions = 1;
-	if (y != 0) dimensions++;
-	if (z != 0) dimensions++;
-	
-	if (chc->dimensions != dimensions)
+
+	if (n_in > b->in_cap)
+	{
+		if ((p = realloc(b->h_in, n_in * in_sz)) == NULL)
+			return (-CLH_OUT_OF_MEM);
+		b->h_in = p;
+	}
+	if (n_out > b->out_cap)
+	{
+		if ((p = realloc(b->h_out, (n_out ? n_out : 1) * out_sz)) == NULL)
+			return (-CLH_OUT_OF_MEM);
+		b->h_out = p;
+	}
+	if (count > b->offs_cap)
+	{
+		if ((p = realloc(b->h_offs, sizeof(cl_uint) * 2 * (count + 1))) == NULL)
+			return (-CLH_OUT_OF_MEM);
+		b->h_offs = p;
+	}
+
+	if (batchGrow(b, &b->d_in, b->in_cap, n_in, in_sz) != CLH_OK ||
+		batchGrow(b, &b->d_out, b->out_cap, n_out, out_sz) != CLH_OK ||
+		batchGrow(b, &b->d_in_offs, b->offs_cap + 1, count + 1,
+			sizeof(cl_uint)) != CLH_OK ||
+		batchGrow(b, &b->d_out_offs, b->offs_cap + 1, count + 1,
+			sizeof(cl_uint)) != CLH_OK)
+	{
+		b->in_cap = b->out_cap = 0;
+		b->offs_cap = 0;
+		return (-CLH_OUT_OF_MEM);
+	}
+	if (n_in > b->in_cap)
+		b->in_cap = n_in;
+	if (n_out > b->out_cap)
+		b->out_cap = n_out;
+	if (count > b->offs_cap)
+		b->offs_cap = count;
+
+	/* Pack. */
+	n_in = n_out = 0;
+	r = list;
+	for (int i = 0; i < count; i++, r = r->next)
+	{
+		b->h_offs[i] = n_in;
+		b->h_offs[count + 1 + i] = n_out;
+		memcpy(b->h_in + n_in * in_sz, r->in, r->n_in * in_sz);
+		n_in  += r->n_in;
+		n_out += r->n_out;
+	}
+	b->h_offs[count] = n_in;
+	b->h_offs[2 * count + 1] = n_out;
+
+	/* Single NDRange over all the input elements. */
+	local  = b->cfg.local_size;
+	global = local ? ((n_in + local - 1) / local) * local : n_in;
+	items  = count;
+
+	err  = clEnqueueWriteBuffer(b->queue, b->d_in, CL_FALSE, 0, n_in * in_sz,
+		b->h_in, 0, NULL, NULL);
+	err |= clEnqueueWriteBuffer(b->queue, b->d_in_offs, CL_FALSE, 0,
+		sizeof(cl_uint) * (count + 1), b->h_offs, 0, NULL, NULL);
+	err |= clEnqueueWriteBuffer(b->queue, b->d_out_offs, CL_FALSE, 0,
+		sizeof(cl_uint) * (count + 1), b->h_offs + count + 1, 0, NULL, NULL);
+
+	err |= clSetKernelArg(b->kernel, 0, sizeof(cl_mem), &b->d_in);
+	err |= clSetKernelArg(b->kernel, 1, sizeof(cl_mem), &b->d_in_offs);
+	err |= clSetKernelArg(b->kernel, 2, sizeof(cl_mem), &b->d_out);
+	err |= clSetKernelArg(b->kernel, 3, sizeof(cl_mem), &b->d_out_offs);
+	err |= clSetKernelArg(b->kernel, 4, sizeof(cl_uint), &items);
+	if (err != CL_SUCCESS)
+	{
+		/* Uploads still read the staging buffers. */
+		clFinish(b->queue);
+		return (-CLH_KERN_FAIL);
+	}
+
+	if (clEnqueueNDRangeKernel(b->queue, b->kernel, 1, NULL, &global,
+		local ? &local : NULL, 0, NULL, &ev) != CL_SUCCESS)
+	{
+		clFinish(b->queue);
+		return (-CLH_KERN_FAIL);
+	}
+
+	err = CL_SUCCESS;
+	if (n_out)
+	{
+		err = clEnqueueReadBuffer(b->queue, b->d_out, CL_TRUE, 0,
+			n_out * out_sz, b->h_out, 0, NULL, NULL);
+	}
+	else
+		err = clFinish(b->queue);
+
+	*kernel_ms = 0;
+	clhEventTime(ev, kernel_ms);
+	clReleaseEvent(ev);
+	if (err != CL_SUCCESS)
+	{
+		clFinish(b->queue);
+		return (-CLH_KERN_FAIL);
+	}
+
+	/* Scatter. */
+	r = list;
+	for (int i = 0; i < count; i++, r = r->next)
+	{
+		memcpy(r->out, b->h_out + b->h_offs[count + 1 + i] * out_sz,
+			r->n_out * out_sz);
+	}
+	return (CLH_OK);
+}
+
+/**
+ * Batching thread: waits for the first request, keeps the batch open
+ * until it is full or the first request waited max_wait_ms, and runs it.
+ * @param arg Batcher.
+ * @returns Always NULL.
+ */
+static void *batchThread(void *arg)
+{
+	struct clh_batcher *b = arg;
+	struct batch_req *list, *r, *next;
+	struct timespec ts;
+	double deadline;
+	double kernel_ms;
+	double t_run;
+	size_t elems;
+	int count;
+	int full;
+	int ret;
+
+	pthread_mutex_lock(&b->lock);
+	for (;;)
+	{
+		while (!b->head && !b->quit)
+			pthread_cond_wait(&b->arrived, &b->lock);
+		if (!b->head)
+			break;
+
+		/* Wait for more, within the latency budget. */
+		deadline = b->head->t_post + b->cfg.max_wait_ms;
+		while (!b->quit && b->pending < b->cfg.max_batch &&
+			(!b->cfg.max_elems || b->pending_elems < b->cfg.max_elems) &&
+			nowMs() < deadline)
+		{
+			ts.tv_sec  = (time_t)(deadline / 1000.0);
+			ts.tv_nsec = (long)((deadline - ts.tv_sec * 1000.0) * 1000000.0);
+			pthread_cond_timedwait(&b->arrived, &b->lock, &ts);
+		}
+
+		/* Take what fits, at least one request. */
+		list  = b->head;
+		count = 0;
+		elems = 0;
+		for (r = b->head; r && count < b->cfg.max_batch; r = r->next)
+		{
+			if (count && b->cfg.max_elems && elems + r->n_in > b->cfg.max_elems)
+				break;
+			elems += r->n_in;
+			count++;
+			b->tail = (r->next) ? b->tail : NULL;
+			b->head = r->next;
+		}
+		full = r != NULL || count == b->cfg.max_batch ||
+			(b->cfg.max_elems && elems >= b->cfg.max_elems);
+		b->pending -= count;
+		b->pending_elems -= elems;
+		pthread_mutex_unlock(&b->lock);
+
+		t_run = nowMs();
+		ret = batchRun(b, list, count, &kernel_ms);
+
+		pthread_mutex_lock(&b->lock);
+		b->batches++;
+		b->requests += count;
+		b->full += full;
+		b->elems += elems;
+		b->kernel_ms += kernel_ms;
+		r = list;
+		for (int i = 0; i < count; i++, r = next)
+		{
+			next = r->next;
+			b->wait_ms += t_run - r->t_post;
+			r->status = ret;
+			r->done = 1;
+		}
+		pthread_cond_broadcast(&b->finished);
+	}
+	pthread_mutex_unlock(&b->lock);
+	return (NULL);
+}
+
+/**
+ * Creates a micro-batcher: many threads submit small, independent
+ * requests for the same kernel, and the batcher packs the requests
+ * that arrive within a latency budget into a single launch.
+ *
+ * The kernel opts in with the batch convention, its first arguments
+ * being:
+ *   0: __global const in_type *in      Packed inputs.
+ *   1: __global const uint *in_offs    First input element of each
+ *                                      request, num_items + 1 entries.
+ *   2: __global out_type *out          Packed outputs.
+ *   3: __global const uint *out_offs   Same, for the outputs.
+ *   4: uint num_items                  Requests in the batch.
+ * One work-item runs per input element (global size rounded up to the
+ * local size, so check against in_offs[num_items]), the request of an
+ * element is found by a binary search in in_offs. The arguments in
+ * cfg->args follow them, and are the same for every request; they
+ * cannot be tracked (CLH_TRACKED) or split (CLH_SPLIT) buffers.
+ *
+ * Larger max_wait_ms and max_batch give larger batches, so more
+ * throughput, at the cost of latency; see clhBatcherStats.
+ *
+ * @param chc Context, must outlive the batcher.
+ * @param cfg Configuration, copied.
+ * @returns The batcher, or NULL if error.
+ */
+struct clh_batcher *clhBatcherCreate(struct cl_helper_context *chc,
+	const struct clh_batch_config *cfg)
+{
+	struct clh_batcher *b;
+	pthread_condattr_t attr;
+	int err;
+
+	if (chc->fallback)
+	{
+		noDevice("clhBatcherCreate");
+		return (NULL);
+	}
+
+	if (!cfg->kernel || !cfg->in_elem_size || !cfg->out_elem_size ||
+		cfg->nargs < 0 || cfg->max_wait_ms < 0)
+	{
+		return (NULL);
+	}
+
+	/* Set once on a private kernel, out of the context state. */
+	if (contextArgs(cfg->args, cfg->nargs))
+	{
+		fprintf(stderr, "clHelper: Tracked and split buffers cannot be"
+			" batched!\n");
+		return (NULL);
+	}
+
+	if ((b = calloc(1, sizeof(*b))) == NULL)
+		return (NULL);
+	b->cfg = *cfg;
+	b->cfg.args = NULL;
+	b->cfg.nargs = 0;
+	if (b->cfg.max_batch <= 0)
+		b->cfg.max_batch = 64;
+	b->context = chc->context;
+
+	if ((b->kernel = cloneKernel(cfg->kernel)) == NULL)
+		goto err;
+
+	/* User arguments never change, set once. */
+	for (int i = 0; i < cfg->nargs; i++)
+	{
+		if (clSetKernelArg(b->kernel, BATCH_ARGS + i, cfg->args[i].size,
+			argValue(&cfg->args[i])) != CL_SUCCESS)
+		{
+			goto err;
+		}
+	}
+
+	b->queue = clCreateCommandQueue(chc->context, chc->device_id,
+		CL_QUEUE_PROFILING_ENABLE, &err);
+	if (!b->queue)
+		goto err;
+
+	/* Deadlines come from nowMs. */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&b->arrived, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&b->finished, NULL);
+	pthread_mutex_init(&b->lock, NULL);
+
+	if (pthread_create(&b->thread, NULL, batchThread, b) != 0)
+	{
+		pthread_mutex_destroy(&b->lock);
+		pthread_cond_destroy(&b->arrived);
+		pthread_cond_destroy(&b->finished);
+		goto err;
+	}
+	return (b);
+
+err:
+	fprintf(stderr, "clHelper: Failed to create the batcher!\n");
+	if (b->queue)
+		clReleaseCommandQueue(b->queue);
+	if (b->kernel)
+		clReleaseKernel(b->kernel);
+	free(b);
+	return (NULL);
+}
+
+/**
+ * Submits a request to a micro-batcher and waits for its results.
+ * Callable from any thread.
+ * @param b Batcher.
+ * @param in Input, n_in elements.
+ * @param n_in Input elements, at least 1.
+ * @param out Output, n_out elements.
+ * @param n_out Output elements, may be 0.
+ * @returns Returns CLH_OK if success and a negative number otherwise.
+ */
+int clhBatchSubmit(struct clh_batcher *b, const void *in, size_t n_in,
+	void *out, size_t n_out)
+{
+	struct batch_req req;
+	double latency;
+	int wake;
+
+	if (!in || !n_in || (n_out && !out))
+		return (-CLH_INV_ARG);
+
+	memset(&req, 0, sizeof(req));
+	req.in     = in;
+	req.n_in   = n_in;
+	req.out    = out;
+	req.n_out  = n_out;
+	req.t_post = nowMs();
+
+	pthread_mutex_lock(&b->lock);
+	if (b->quit)
+	{
+		pthread_mutex_unlock(&b->lock);
+		return (-CLH_INV_ARG);
+	}
+
+	if (b->tail)
+		b->tail->next = &req;
+	else
+		b->head = &req;
+	b->tail = &req;
+	b->pending++;
+	b->pending_elems += n_in;
+
+	/* Only the first request and a full batch matter to the thread. */
+	wake = b->pending == 1 || b->pending >= b->cfg.max_batch ||
+		(b->cfg.max_elems && b->pending_elems >= b->cfg.max_elems);
+	if (wake)
+		pthread_cond_signal(&b->arrived);
+
+	while (!req.done)
+		pthread_cond_wait(&b->finished, &b->lock);
+
+	latency = nowMs() - req.t_post;
+	b->latency_ms += latency;
+	if (latency > b->max_latency_ms)
+		b->max_latency_ms = latency;
+	pthread_mutex_unlock(&b->lock);
+	return (req.status);
+}
+
+/**
+ * Gets the micro-batcher statistics.
+ * @param b Batcher.
+ * @param stats Statistics.
+ * @returns Always CLH_OK.
+ */
+int clhBatcherStats(struct clh_batcher *b, struct clh_batch_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	pthread_mutex_lock(&b->lock);
+	stats->requests = b->requests;
+	stats->batches  = b->batches;
+	stats->full     = b->full;
+	if (b->batches)
+	{
+		stats->avg_batch = (double)b->requests / b->batches;
+		stats->avg_elems = b->elems / b->batches;
+		stats->avg_kernel_ms = b->kernel_ms / b->batches;
+	}
+	if (b->requests)
+	{
+		stats->avg_wait_ms = b->wait_ms / b->requests;
+		stats->avg_latency_ms = b->latency_ms / b->requests;
+	}
+	stats->max_latency_ms = b->max_latency_ms;
+	pthread_mutex_unlock(&b->lock);
+	return (CLH_OK);
+}
+
+/**
+ * Resets the micro-batcher statistics, e.g. after a warm-up.
+ * @param b Batcher.
+ * @returns Always CLH_OK.
+ */
+int clhBatcherResetStats(struct clh_batcher *b)
+{
+	pthread_mutex_lock(&b->lock);
+	b->requests = b->batches = b->full = 0;
+	b->elems = b->wait_ms = b->latency_ms = 0;
+	b->max_latency_ms = b->kernel_ms = 0;
+	pthread_mutex_unlock(&b->lock);
+	return (CLH_OK);
+}
+
+/**
+ * Releases a micro-batcher, the requests already submitted are run
+ * first. No request can be submitted during or after the call.
+ * @param b Batcher.
+ * @returns Always CLH_OK.
+ */
+int clhBatcherRelease(struct clh_batcher *b)
+{
+	if (!b)
+		return (CLH_OK);
+
+	pthread_mutex_lock(&b->lock);
+	b->quit = 1;
+	pthread_cond_signal(&b->arrived);
+	pthread_mutex_unlock(&b->lock);
+	pthread_join(b->thread, NULL);
+
+	if (b->d_in)       clReleaseMemObject(b->d_in);
+	if (b->d_out)      clReleaseMemObject(b->d_out);
+	if (b->d_in_offs)  clReleaseMemObject(b->d_in_offs);
+	if (b->d_out_offs) clReleaseMemObject(b->d_out_offs);
+	clReleaseCommandQueue(b->queue);
+	clReleaseKernel(b->kernel);
+
+	pthread_mutex_destroy(&b->lock);
+	pthread_cond_destroy(&b->arrived);
+	pthread_cond_destroy(&b->finished);
+	free(b->h_in);
+	free(b->h_out);
+	free(b->h_offs);
+	free(b);
+	return (CLH_OK);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Streaming pipeline.                                                       *
+ * ------------------------------------------------------------------------- */
+
+/**
+ * Events of a chunk in flight.
+ */
+struct pipeline_slot
+{
+	cl_event write;  /* Upload event.   */
+	cl_event kernel; /* Compute event.  */
+	cl_event read;   /* Download event. */
+};
+
+/**
+ * Gets the time spent by an already finished event, in ms.
+ * @param event Event, may be NULL.
+ * @returns Time spent or 0 if no event.
+ */
+static double eventMs(cl_event event)
+{
+	cl_ulong start, end;
+
+	if (event == NULL)
+		return (0.0);
+
+	if (clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START,
+		sizeof(start), &start, NULL) != CL_SUCCESS ||
+		clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END,
+		sizeof(end), &end, NULL) != CL_SUCCESS)
+	{
+		return (0.0);
+	}
+	return ((end - start) / 1000000.0);
+}
+
+/**
+ * Waits for the chunk in a slot, accounts its stage times and
+ * releases its events.
+ * @param slot Pipeline slot.
+ * @param stats Stage statistics.
+ */
+static void pipelineRetire(struct pipeline_slot *slot,
+	struct clh_pipeline_stats *stats)
+{
+	cl_event *evs[3] = {&slot->write, &slot->kernel, &slot->read};
+
+	for (int i = 0; i < 3; i++)
+		if (*evs[i])
+			clWaitForEvents(1, evs[i]);
+
+	stats->upload_ms   += eventMs(slot->write);
+	stats->compute_ms  += eventMs(slot->kernel);
+	stats->download_ms += eventMs(slot->read);
+
+	for (int i = 0; i < 3; i++)
+	{
+		if (*evs[i])
+			clReleaseEvent(*evs[i]);
+		*evs[i] = NULL;
+	}
+}
+
+/**
+ * Processes a host input range in chunks, overlapping transfers and
+ * computation. N device buffers are rotated across an upload queue,
+ * the context (compute) queue and a download queue, so the upload of
+ * chunk i+1, the compute of chunk i and the download of chunk i-1 can
+ * run at the same time.
+ *
+ * For each chunk the kernel receives the chunk input and output
+ * buffers at the p->arg_in and p->arg_out indexes and, if p->arg_count
+ * is not negative, the number of elements of the chunk (as uint). The
+ * remaining arguments must be set before. The kernel is launched with
+ * one work-item per element (1D), rounded up to p->local_size.
+ *
+ * @param chc Context.
+ * @param p Pipeline description.
+ * @param stats Per-stage times, may be NULL.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhRunPipeline(struct cl_helper_context *chc,
+	const struct clh_pipeline *p, struct clh_pipeline_stats *stats)
+{
+	struct clh_pipeline_stats st;
+	struct pipeline_slot *slots, next;
+	cl_command_queue q_up, q_down;
+	cl_mem *d_in, *d_out;
+	size_t global, local, n;
+	size_t num_chunks;
+	double start;
+	int nbuf;
+	int ret;
+	int err;
+
+	if (chc->fallback)
+		return (noDevice("clhRunPipeline"));
+
+	if (!p->input || !p->num_elems || !p->chunk_elems || !p->in_elem_size ||
+		(p->output && !p->out_elem_size))
+	{
+		fprintf(stderr, "clHelper: Invalid pipeline description!\n");
+		return (-CLH_INV_ARG);
+	}
+
+	memset(&st, 0, sizeof(st));
+	memset(&next, 0, sizeof(next));
+	nbuf  = (p->num_buffers > 0) ? p->num_buffers : 3;
+	num_chunks = (p->num_elems + p->chunk_elems - 1) / p->chunk_elems;
+	start = nowMs();
+	ret   = -CLH_OUT_OF_MEM;
+
+	q_up   = clCreateCommandQueue(chc->context, chc->device_id,
+		CL_QUEUE_PROFILING_ENABLE, &err);
+	q_down = clCreateCommandQueue(chc->context, chc->device_id,
+		CL_QUEUE_PROFILING_ENABLE, &err);
+
+	slots = calloc(nbuf, sizeof(*slots));
+	d_in  = calloc(nbuf, sizeof(cl_mem));
+	d_out = calloc(nbuf, sizeof(cl_mem));
+	if (!q_up || !q_down || !slots || !d_in || !d_out)
+		goto out;
+
+	/* Device buffers. */
+	for (int i = 0; i < nbuf; i++)
+	{
+		d_in[i] = clCreateBuffer(chc->context, CL_MEM_READ_ONLY,
+			p->chunk_elems * p->in_elem_size, NULL, &err);
+		if (!d_in[i])
+			goto out;
+
+		d_out[i] = clCreateBuffer(chc->context, CL_MEM_READ_WRITE,
+			p->chunk_elems * (p->output ? p->out_elem_size : 1), NULL, &err);
+		if (!d_out[i])
+			goto out;
+	}
+
+	ret = -CLH_KERN_FAIL;
+	for (size_t c = 0; c < num_chunks; c++)
+	{
+		struct pipeline_slot *slot;
+		cl_event waits[2];
+		cl_uint nwaits;
+		cl_uint count;
+		int s;
+
+		s    = (int)(c % nbuf);
+		slot = &slots[s];
+		n    = p->chunk_elems;
+		if ((c + 1) * p->chunk_elems > p->num_elems)
+			n = p->num_elems - c * p->chunk_elems;
+
+		memset(&next, 0, sizeof(next));
+
+		/* Upload: input buffer is free once the old kernel is done. */
+		err = clEnqueueWriteBuffer(q_up, d_in[s], CL_FALSE, 0,
+			n * p->in_elem_size,
+			(const char *)p->input + c * p->chunk_elems * p->in_elem_size,
+			slot->kernel ? 1 : 0, slot->kernel ? &slot->kernel : NULL,
+			&next.write);
+		if (err != CL_SUCCESS)
+			goto out;
+
+		/* Compute: wait the upload and the old download. */
+		nwaits = 0;
+		waits[nwaits++] = next.write;
+		if (slot->read)
+			waits[nwaits++] = slot->read;
+
+		count = (cl_uint)n;
+		clSetKernelArg(p->kernel, p->arg_in, sizeof(cl_mem), &d_in[s]);
+		clSetKernelArg(p->kernel, p->arg_out, sizeof(cl_mem), &d_out[s]);
+		if (p->arg_count >= 0)
+			clSetKernelArg(p->kernel, p->arg_count, sizeof(cl_uint), &count);
+
+		local  = p->local_size;
+		global = local ? ((n + local - 1) / local) * local : n;
+		err = clEnqueueNDRangeKernel(chc->command_queue, p->kernel, 1, NULL,
+			&global, local ? &local : NULL, nwaits, waits, &next.kernel);
+		if (err != CL_SUCCESS)
+			goto out;
+
+		/* Download. */
+		if (p->output)
+		{
+			err = clEnqueueReadBuffer(q_down, d_out[s], CL_FALSE, 0,
+				n * p->out_elem_size,
+				(char *)p->output + c * p->chunk_elems * p->out_elem_size,
+				1, &next.kernel, &next.read);
+			if (err != CL_SUCCESS)
+				goto out;
+		}
+
+		clFlush(q_up);
+		clFlush(chc->command_queue);
+		clFlush(q_down);
+
+		/* Three commands, each one sampled. */
+		if (profSample(chc))
+			profAdd(chc, next.write, q_up, CLH_PROF_WRITE, NULL,
+				n * p->in_elem_size);
+		if (profSample(chc))
+			profAdd(chc, next.kernel, chc->command_queue, CLH_PROF_KERNEL,
+				p->kernel, 0);
+		if (next.read && profSample(chc))
+			profAdd(chc, next.read, q_down, CLH_PROF_READ, NULL,
+				n * p->out_elem_size);
+
+		/* Retire the chunk that used this slot before. */
+		pipelineRetire(slot, &st);
+		*slot = next;
+		memset(&next, 0, sizeof(next));
+		st.chunks++;
+	}
+	ret = CLH_OK;
+
+out:
+	if (ret != CLH_OK)
+		fprintf(stderr, "clHelper: Pipeline failed! %d\n", err);
+
+	/* Drain. */
+	pipelineRetire(&next, &st);
+	for (int i = 0; slots && i < nbuf; i++)
+		pipelineRetire(&slots[i], &st);
+
+	for (int i = 0; i < nbuf; i++)
+	{
+		if (d_in && d_in[i])
+			clReleaseMemObject(d_in[i]);
+		if (d_out && d_out[i])
+			clReleaseMemObject(d_out[i]);
+	}
+
+	if (q_up)
+		clReleaseCommandQueue(q_up);
+	if (q_down)
+		clReleaseCommandQueue(q_down);
+
+	free(slots);
+	free(d_in);
+	free(d_out);
+
+	/* Kernel arguments were changed behind the argument cache. */
+	clhInvalidateArgs(chc, p->kernel);
+
+	st.total_ms = nowMs() - start;
+	if (stats)
+		*stats = st;
+	return (ret);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Kernel library.                                                           *
+ * ------------------------------------------------------------------------- */
+
+/**
+ * Builds a library kernel (a variant of an embedded source) and gets
+ * it from the registry, without touching the user program.
+ * @param chc Context.
+ * @param source Embedded kernel source.
+ * @param options Build options of the variant.
+ * @param name Kernel name.
+ * @returns The kernel, or NULL if error.
+ */
+static cl_kernel libKernel(struct cl_helper_context *chc, const char *source,
+	const char *options, const char *name)
+{
+	cl_program user;
+	cl_kernel kernel;
+
+	user = chc->program;
+	kernel = NULL;
+
+	if (buildProgram(chc, source, options) == CLH_OK)
+		kernel = clhGetKernel(chc, name);
+
+	chc->program = user;
+	return (kernel);
+}
+
+/**
+ * Launches a library kernel with its own NDRange (the context sizes
+ * are left alone), waits it finishes and saves the time spent.
+ * @param chc Context.
+ * @param kernel Kernel.
+ * @param dims Number of dimensions.
+ * @param global Global size.
+ * @param local Local size.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+static int libLaunch(struct cl_helper_context *chc, cl_kernel kernel,
+	cl_uint dims, const size_t *global, const size_t *local)
+{
+	int err;
+
+	if (chc->event)
+	{
+		clReleaseEvent(chc->event);
+		chc->event = NULL;
+	}
+
+	err = clEnqueueNDRangeKernel(chc->command_queue, kernel, dims, NULL,
+		global, local, 0, NULL, &chc->event);
+
+	if (err != CL_SUCCESS)
+	{
+		fprintf(stderr, "clHelper: Failed to execute kernel! %d\n", err);
+		return (-CLH_KERN_FAIL);
+	}
+
+	if (profSample(chc))
+		profAdd(chc, chc->event, chc->command_queue, CLH_PROF_KERNEL, kernel, 0);
+
+	return (clhEventTime(chc->event, &chc->time_ms));
+}
+
+/**
+ * Checks if the device supports a given element type.
+ * @param chc Context.
+ * @param type CLH_ARG_INT, CLH_ARG_FLOAT or CLH_ARG_DOUBLE.
+ * @returns Returns CLH_OK if supported and a negative number
+ * otherwise.
+ */
+static int libCheckType(struct cl_helper_context *chc, int type)
+{
+	cl_device_fp_config fp64;
+
+	if (type != CLH_ARG_INT && type != CLH_ARG_FLOAT &&
+		type != CLH_ARG_DOUBLE)
 	{
-		fprintf(stderr, "clHelper: Grid size should be the same dimension as"
-			" the block size!\n");
-		return (-CLH_INV_DIM);
+		return (-CLH_INV_ARG);
 	}
-	
-	/* Allocate and set local work sizes. */
-	if (chc->globalWorkSize != NULL)
-		free(chc->globalWorkSize);
-	
-	chc->globalWorkSize = malloc(sizeof(size_t) * dimensions);
-	chc->globalWorkSize[0] = roundPower(chc->localWorkSize[0] * x);
-	if (y)
-		chc->globalWorkSize[1] = roundPower(chc->localWorkSize[1] * y);
-	if (z)
-		chc->globalWorkSize[2] = roundPower(chc->localWorkSize[2] * z);
-		
-#ifdef CL_DEBUG
-	fprintf(stderr, "\nLocal size: ( ");
-	for (int i = 0; i < dimensions; i++)
-		fprintf(stderr, "%zd ", chc->localWorkSize[0]);
-	fprintf(stderr, ")\n");
-	
-	fprintf(stderr, "Global size: ( ");
-	for (int i = 0; i < dimensions; i++)
-		fprintf(stderr, "%zd ", chc->globalWorkSize[0]);
-	fprintf(stderr, ")\n");
-#endif
 
+	/* Library kernels have no native version. */
+	if (chc->fallback)
+		return (noDevice("The kernel library"));
+
+	if (type == CLH_ARG_DOUBLE)
+	{
+		fp64 = 0;
+		clGetDeviceInfo(chc->device_id, CL_DEVICE_DOUBLE_FP_CONFIG,
+			sizeof(fp64), &fp64, NULL);
+		if (!fp64)
+		{
+			fprintf(stderr, "clHelper: Device does not support doubles!\n");
+			return (-CLH_INV_ARG);
+		}
+	}
 	return (CLH_OK);
 }
 
+/*
+ * Tiled GEMM, C = A * B, row-major. Each work-group computes a TS x TS
+ * tile of C, walking K in steps of TSK: the tiles of A and B are staged
+ * in local memory (loaded with VW-wide vector loads), and each
+ * work-item accumulates a WPT x WPT block of C in registers.
+ */
+static const char *gemmSource =
+	"#ifdef USE_DOUBLE\n"
+	"#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n"
+	"#endif\n"
+	"#define RTS (TS / WPT)\n"
+	"#define CAT(a, b) a##b\n"
+	"#define XCAT(a, b) CAT(a, b)\n"
+	"#if VW > 1\n"
+	"#define LOADV(p, t) XCAT(vstore, VW)(XCAT(vload, VW)(0, (p)), 0, (t))\n"
+	"#else\n"
+	"#define LOADV(p, t) ((t)[0] = *(p))\n"
+	"#endif\n"
+	"\n"
+	"__kernel __attribute__((reqd_work_group_size(RTS, RTS, 1)))\n"
+	"void clhGemm(const int M, const int N, const int K,\n"
+	"	const __global REAL *A, const __global REAL *B, __global REAL *C)\n"
+	"{\n"
+	"	__local REAL As[TSK][TS];\n"
+	"	__local REAL Bs[TSK][TS];\n"
+	"	REAL acc[WPT][WPT];\n"
+	"	REAL a[WPT], b[WPT], t[VW];\n"
+	"	const int tx = get_local_id(0);\n"
+	"	const int ty = get_local_id(1);\n"
+	"	const int tid = ty * RTS + tx;\n"
+	"	const int col0 = get_group_id(0) * TS;\n"
+	"	const int row0 = get_group_id(1) * TS;\n"
+	"\n"
+	"	for (int i = 0; i < WPT; i++)\n"
+	"		for (int j = 0; j < WPT; j++)\n"
+	"			acc[i][j] = 0;\n"
+	"\n"
+	"	for (int k0 = 0; k0 < K; k0 += TSK)\n"
+	"	{\n"
+	"		/* A tile: TS rows x TSK columns, stored transposed. */\n"
+	"		for (int i = tid; i < TS * TSK / VW; i += RTS * RTS)\n"
+	"		{\n"
+	"			int r = i / (TSK / VW), k = (i % (TSK / VW)) * VW;\n"
+	"			int gr = row0 + r, gk = k0 + k;\n"
+	"			if (gr < M && gk + VW <= K)\n"
+	"				LOADV(A + gr * K + gk, t);\n"
+	"			else\n"
+	"				for (int v = 0; v < VW; v++)\n"
+	"					t[v] = (gr < M && gk + v < K) ? A[gr * K + gk + v] : 0;\n"
+	"			for (int v = 0; v < VW; v++)\n"
+	"				As[k + v][r] = t[v];\n"
+	"		}\n"
+	"\n"
+	"		/* B tile: TSK rows x TS columns. */\n"
+	"		for (int i = tid; i < TSK * TS / VW; i += RTS * RTS)\n"
+	"		{\n"
+	"			int k = i / (TS / VW), c = (i % (TS / VW)) * VW;\n"
+	"			int gk = k0 + k, gc = col0 + c;\n"
+	"			if (gk < K && gc + VW <= N)\n"
+	"				LOADV(B + gk * N + gc, t);\n"
+	"			else\n"
+	"				for (int v = 0; v < VW; v++)\n"
+	"					t[v] = (gk < K && gc + v < N) ? B[gk * N + gc + v] : 0;\n"
+	"			for (int v = 0; v < VW; v++)\n"
+	"				Bs[k][c + v] = t[v];\n"
+	"		}\n"
+	"\n"
+	"		barrier(CLK_LOCAL_MEM_FENCE);\n"
+	"\n"
+	"		for (int k = 0; k < TSK; k++)\n"
+	"		{\n"
+	"			for (int w = 0; w < WPT; w++)\n"
+	"			{\n"
+	"				a[w] = As[k][ty + w * RTS];\n"
+	"				b[w] = Bs[k][tx + w * RTS];\n"
+	"			}\n"
+	"			for (int i = 0; i < WPT; i++)\n"
+	"				for (int j = 0; j < WPT; j++)\n"
+	"					acc[i][j] += a[i] * b[j];\n"
+	"		}\n"
+	"\n"
+	"		barrier(CLK_LOCAL_MEM_FENCE);\n"
+	"	}\n"
+	"\n"
+	"	for (int i = 0; i < WPT; i++)\n"
+	"	{\n"
+	"		int r = row0 + ty + i * RTS;\n"
+	"		for (int j = 0; j < WPT; j++)\n"
+	"		{\n"
+	"			int c = col0 + tx + j * RTS;\n"
+	"			if (r < M && c < N)\n"
+	"				C[r * N + c] = acc[i][j];\n"
+	"		}\n"
+	"	}\n"
+	"}\n";
+
 /**
- * Sets the global size, i.e: the total number of work-items in each axis.
+ * Tile configurations, from the largest one: tile size (TS), tile
+ * depth (TSK) and work per work-item in each axis (WPT).
+ */
+static const int gemmConfigs[][3] = {
+	{64, 16, 4}, {64, 8, 4}, {32, 16, 4}, {32, 16, 2}, {32, 8, 2},
+	{16, 8, 2}, {8, 8, 1}
+};
+
+/**
+ * Gets the GEMM kernel for a given type, picking the largest tile
+ * that fits the device local memory and work-group limits, and that
+ * the built kernel itself accepts (register blocking may lower its
+ * work-group size below the device one).
  * @param chc Context.
- * @param x X-Axis.
- * @param y Y-Axis.
- * @param z Z-Axis.
+ * @param type CLH_ARG_FLOAT or CLH_ARG_DOUBLE.
+ * @returns The GEMM plan, or NULL if error.
+ */
+static struct clh_gemm_plan *gemmPlan(struct cl_helper_context *chc,
+	int type)
+{
+	struct clh_gemm_plan *plan;
+	char options[256];
+	size_t esize;
+	size_t rts;
+	size_t max;
+	int i, n;
+
+	plan = &chc->gemm[type == CLH_ARG_DOUBLE];
+	if (plan->kernel)
+		return (plan);
+
+	esize = (type == CLH_ARG_DOUBLE) ? sizeof(cl_double) : sizeof(cl_float);
+	n = (int)(sizeof(gemmConfigs) / sizeof(gemmConfigs[0]));
+
+	for (i = 0; i < n; i++)
+	{
+		rts = gemmConfigs[i][0] / gemmConfigs[i][2];
+		if (2 * gemmConfigs[i][0] * gemmConfigs[i][1] * esize >
+			chc->local_mem_size || rts * rts > chc->max_group_size ||
+			rts > chc->max_work_item_size[0] ||
+			rts > chc->max_work_item_size[1])
+		{
+			continue;
+		}
+
+		plan->ts  = gemmConfigs[i][0];
+		plan->tsk = gemmConfigs[i][1];
+		plan->wpt = gemmConfigs[i][2];
+		plan->vw  = (type == CLH_ARG_DOUBLE) ? 2 : 4;
+
+		snprintf(options, sizeof(options), "-D REAL=%s%s -D TS=%d -D TSK=%d "
+			"-D WPT=%d -D VW=%d -cl-mad-enable",
+			type == CLH_ARG_DOUBLE ? "double" : "float",
+			type == CLH_ARG_DOUBLE ? " -D USE_DOUBLE" : "", plan->ts, plan->tsk,
+			plan->wpt, plan->vw);
+
+		plan->kernel = libKernel(chc, gemmSource, options, "clhGemm");
+		if (!plan->kernel)
+			continue;
+
+		/* The kernel may allow less than the device, try the next tile. */
+		max = rts * rts;
+		clGetKernelWorkGroupInfo(plan->kernel, chc->device_id,
+			CL_KERNEL_WORK_GROUP_SIZE, sizeof(max), &max, NULL);
+		if (max >= rts * rts)
+			return (plan);
+		plan->kernel = NULL;
+	}
+
+	fprintf(stderr, "clHelper: No GEMM tile fits this device!\n");
+	return (NULL);
+}
+
+/**
+ * Matrix multiplication, C = A * B, with row-major matrices: A is
+ * @p m x @p k, B is @p k x @p n and C is @p m x @p n. Uses a tiled
+ * kernel with local memory and register blocking, and saves the time
+ * spent in chc->time_ms.
+ * @param chc Context.
+ * @param type CLH_ARG_FLOAT or CLH_ARG_DOUBLE.
+ * @param m Rows of A and C.
+ * @param n Columns of B and C.
+ * @param k Columns of A and rows of B.
+ * @param a Matrix A.
+ * @param b Matrix B.
+ * @param c Matrix C.
  * @returns Returns a positive number if success and a negative
  * number otherwise.
  */
-int clhSetGlobalSize(struct cl_helper_context *chc, size_t x, size_t y, size_t z)
+int clhGemm(struct cl_helper_context *chc, int type, int m, int n, int k,
+	cl_mem a, cl_mem b, cl_mem c)
 {
-	int dimensions;
-	/* Check first dimension. */
-	if (!x)
+	struct clh_gemm_plan *plan;
+	size_t global[2];
+	size_t local[2];
+	int ret;
+
+	if (type == CLH_ARG_INT || m <= 0 || n <= 0 || k <= 0)
+		return (-CLH_INV_ARG);
+	if ((ret = libCheckType(chc, type)) != CLH_OK)
+		return (ret);
+	if ((plan = gemmPlan(chc, type)) == NULL)
+		return (-CLH_NOT_COMP_PROG);
+
+	ret = clhSetArgsFor(chc, plan->kernel, CLH_INT(m), CLH_INT(n), CLH_INT(k),
+		CLH_BUF(a), CLH_BUF(b), CLH_BUF(c));
+	if (ret != CLH_OK)
+		return (ret);
+
+	local[0]  = local[1] = plan->ts / plan->wpt;
+	global[0] = ((n + plan->ts - 1) / plan->ts) * local[0];
+	global[1] = ((m + plan->ts - 1) / plan->ts) * local[1];
+
+	return (libLaunch(chc, plan->kernel, 2, global, local));
+}
+
+/*
+ * Reduction and exclusive scan. clhReduce does a grid-stride pass per
+ * work-item, then a work-group reduction (sub-groups first, when the
+ * device supports them, then a tree in local memory), leaving one
+ * partial per group, which a second single-group pass reduces.
+ * clhScanBlocks scans blocks of WG * SCAN_ITEMS elements and saves the
+ * block totals, which are scanned recursively and added back by
+ * clhScanAdd.
+ */
+static const char *primSource =
+	"#ifdef USE_DOUBLE\n"
+	"#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n"
+	"#endif\n"
+	"#ifdef KHR_SUBGROUPS\n"
+	"#pragma OPENCL EXTENSION cl_khr_subgroups : enable\n"
+	"#endif\n"
+	"#define SCAN_ITEMS 4\n"
+	"\n"
+	"#if OP == 0\n"
+	"#define ACC(v, i, x, xi) ((v) += (x))\n"
+	"#define SG_REDUCE sub_group_reduce_add\n"
+	"#elif OP == 1\n"
+	"#define ACC(v, i, x, xi) ((v) = min((v), (x)))\n"
+	"#define SG_REDUCE sub_group_reduce_min\n"
+	"#elif OP == 2\n"
+	"#define ACC(v, i, x, xi) ((v) = max((v), (x)))\n"
+	"#define SG_REDUCE sub_group_reduce_max\n"
+	"#else\n"
+	"#define ACC(v, i, x, xi) \\\n"
+	"	do { \\\n"
+	"		if ((x) > (v) || ((x) == (v) && (xi) < (i))) \\\n"
+	"			{ (v) = (x); (i) = (xi); } \\\n"
+	"	} while (0)\n"
+	"#endif\n"
+	"\n"
+	"__kernel void clhReduce(const __global T *in,\n"
+	"	const __global ulong *in_idx, const int has_idx, const ulong n,\n"
+	"	__global T *out, __global ulong *out_idx)\n"
+	"{\n"
+	"	__local T lv[WG];\n"
+	"	__local ulong li[WG];\n"
+	"	const uint lid = get_local_id(0);\n"
+	"	T v = IDENT;\n"
+	"	ulong idx = ULONG_MAX;\n"
+	"	uint cnt;\n"
+	"\n"
+	"	for (ulong i = get_global_id(0); i < n; i += get_global_size(0))\n"
+	"	{\n"
+	"		T x = in[i];\n"
+	"		ulong xi = has_idx ? in_idx[i] : i;\n"
+	"		ACC(v, idx, x, xi);\n"
+	"	}\n"
+	"\n"
+	"#ifdef USE_SUBGROUPS\n"
+	"#if OP == 3\n"
+	"	{\n"
+	"		T m = sub_group_reduce_max(v);\n"
+	"		idx = sub_group_reduce_min(v == m ? idx : (ulong)ULONG_MAX);\n"
+	"		v = m;\n"
+	"	}\n"
+	"#else\n"
+	"	v = SG_REDUCE(v);\n"
+	"#endif\n"
+	"	if (get_sub_group_local_id() == 0)\n"
+	"	{\n"
+	"		lv[get_sub_group_id()] = v;\n"
+	"		li[get_sub_group_id()] = idx;\n"
+	"	}\n"
+	"	cnt = get_num_sub_groups();\n"
+	"#else\n"
+	"	lv[lid] = v;\n"
+	"	li[lid] = idx;\n"
+	"	cnt = WG;\n"
+	"#endif\n"
+	"	barrier(CLK_LOCAL_MEM_FENCE);\n"
+	"\n"
+	"	for (uint s = WG / 2; s > 0; s >>= 1)\n"
+	"	{\n"
+	"		if (lid < s && lid + s < cnt)\n"
+	"			ACC(lv[lid], li[lid], lv[lid + s], li[lid + s]);\n"
+	"		barrier(CLK_LOCAL_MEM_FENCE);\n"
+	"	}\n"
+	"\n"
+	"	if (lid == 0)\n"
+	"	{\n"
+	"		out[get_group_id(0)] = lv[0];\n"
+	"		out_idx[get_group_id(0)] = li[0];\n"
+	"	}\n"
+	"}\n"
+	"\n"
+	"__kernel void clhScanBlocks(const __global T *in, __global T *out,\n"
+	"	const ulong n, const T init, __global T *sums)\n"
+	"{\n"
+	"	__local T lv[WG];\n"
+	"#ifdef USE_SUBGROUPS\n"
+	"	__local T total;\n"
+	"#endif\n"
+	"	const uint lid = get_local_id(0);\n"
+	"	const ulong base = (get_group_id(0) * WG + lid) * SCAN_ITEMS;\n"
+	"	T x[SCAN_ITEMS];\n"
+	"	T s = 0, pre, sum;\n"
+	"\n"
+	"	for (int j = 0; j < SCAN_ITEMS; j++)\n"
+	"	{\n"
+	"		x[j] = (base + j < n) ? in[base + j] : 0;\n"
+	"		s += x[j];\n"
+	"	}\n"
+	"\n"
+	"#ifdef USE_SUBGROUPS\n"
+	"	pre = sub_group_scan_exclusive_add(s);\n"
+	"	sum = sub_group_reduce_add(s);\n"
+	"	if (get_sub_group_local_id() == 0)\n"
+	"		lv[get_sub_group_id()] = sum;\n"
+	"	barrier(CLK_LOCAL_MEM_FENCE);\n"
+	"	if (lid == 0)\n"
+	"	{\n"
+	"		sum = 0;\n"
+	"		for (uint g = 0; g < get_num_sub_groups(); g++)\n"
+	"		{\n"
+	"			T t = lv[g];\n"
+	"			lv[g] = sum;\n"
+	"			sum += t;\n"
+	"		}\n"
+	"		total = sum;\n"
+	"	}\n"
+	"	barrier(CLK_LOCAL_MEM_FENCE);\n"
+	"	pre += lv[get_sub_group_id()];\n"
+	"	sum = total;\n"
+	"#else\n"
+	"	lv[lid] = s;\n"
+	"	barrier(CLK_LOCAL_MEM_FENCE);\n"
+	"	for (uint off = 1; off < WG; off <<= 1)\n"
+	"	{\n"
+	"		T t = (lid >= off) ? lv[lid - off] : 0;\n"
+	"		barrier(CLK_LOCAL_MEM_FENCE);\n"
+	"		lv[lid] += t;\n"
+	"		barrier(CLK_LOCAL_MEM_FENCE);\n"
+	"	}\n"
+	"	pre = lid ? lv[lid - 1] : 0;\n"
+	"	sum = lv[WG - 1];\n"
+	"#endif\n"
+	"\n"
+	"	pre += init;\n"
+	"	for (int j = 0; j < SCAN_ITEMS; j++)\n"
+	"	{\n"
+	"		if (base + j < n)\n"
+	"			out[base + j] = pre;\n"
+	"		pre += x[j];\n"
+	"	}\n"
+	"\n"
+	"	if (lid == 0)\n"
+	"		sums[get_group_id(0)] = sum;\n"
+	"}\n"
+	"\n"
+	"__kernel void clhScanAdd(__global T *out, const ulong n,\n"
+	"	const ulong block, const __global T *sums)\n"
+	"{\n"
+	"	ulong i = get_global_id(0);\n"
+	"	if (i < n)\n"
+	"		out[i] += sums[i / block];\n"
+	"}\n";
+
+/* Elements scanned per work-item, must match SCAN_ITEMS. */
+#define SCAN_ITEMS 4
+
+/**
+ * Index of an element type, in the primitive kernel tables.
+ * @param type CLH_ARG_INT, CLH_ARG_FLOAT or CLH_ARG_DOUBLE.
+ * @returns The index.
+ */
+static int primType(int type)
+{
+	return (type == CLH_ARG_INT ? 0 : type == CLH_ARG_FLOAT ? 1 : 2);
+}
+
+/**
+ * Gets an element size.
+ * @param type CLH_ARG_INT, CLH_ARG_FLOAT or CLH_ARG_DOUBLE.
+ * @returns The element size, in bytes.
+ */
+static size_t primSize(int type)
+{
+	return (type == CLH_ARG_INT ? sizeof(cl_int) :
+		type == CLH_ARG_FLOAT ? sizeof(cl_float) : sizeof(cl_double));
+}
+
+/**
+ * Gets the work-group size a kernel allows, capped.
+ * @param chc Context.
+ * @param kernel Kernel.
+ * @param cap Largest size wanted.
+ * @returns The smallest of the kernel limit and cap.
+ */
+static size_t primGroupSize(struct cl_helper_context *chc, cl_kernel kernel,
+	size_t cap)
+{
+	size_t max = cap;
+
+	clGetKernelWorkGroupInfo(kernel, chc->device_id, CL_KERNEL_WORK_GROUP_SIZE,
+		sizeof(max), &max, NULL);
+	return (max < cap ? max : cap);
+}
+
+/**
+ * Builds the primitive kernels for a given type and operation (the
+ * scan kernels live in the CLH_REDUCE_SUM variant). The work-group size
+ * is the largest power of two allowed by the device and by every one of
+ * the kernels.
+ * @param chc Context.
+ * @param type Element type.
+ * @param op Operation (CLH_REDUCE_*).
+ * @returns Returns CLH_OK if success and a negative number otherwise.
+ */
+static int primBuild(struct cl_helper_context *chc, int type, int op)
+{
+	static const char *idents[3][4] = {
+		{"0", "INT_MAX", "INT_MIN", "INT_MIN"},
+		{"0", "INFINITY", "-INFINITY", "-INFINITY"},
+		{"0", "INFINITY", "-INFINITY", "-INFINITY"}
+	};
+	static const char *names[3] = {"int", "float", "double"};
+	struct clh_lib_kernel *red, *scan;
+	char options[256];
+	char ext[4096];
+	char ver[64];
+	char sg[64];
+	size_t wg, max;
+	int t;
+
+	t = primType(type);
+	red = &chc->reduce[t][op];
+	if (red->kernel)
+		return (CLH_OK);
+
+	/* Sub-groups, if supported. */
+	ext[0] = ver[0] = '\0';
+	clGetDeviceInfo(chc->device_id, CL_DEVICE_EXTENSIONS, sizeof(ext), ext,
+		NULL);
+	clGetDeviceInfo(chc->device_id, CL_DEVICE_OPENCL_C_VERSION, sizeof(ver),
+		ver, NULL);
+
+	sg[0] = '\0';
+	if (strstr(ext, "cl_intel_subgroups"))
+		snprintf(sg, sizeof(sg), " -D USE_SUBGROUPS");
+	else if (strstr(ext, "cl_khr_subgroups") && ver[9] >= '2')
 	{
-		fprintf(stderr, "clHelper: Invalid dimension, X should be at least 1\n");
-		return (-CLH_INV_DIM);
+		snprintf(sg, sizeof(sg), " -D USE_SUBGROUPS -D KHR_SUBGROUPS "
+			"-cl-std=CL%c.0", ver[9]);
 	}
-	
-	/* Get number of dimensions. */
-	dimensions = 1;
-	if (y != 0) dimensions++;
-	if (z != 0) dimensions++;
-	
-	if (chc->dimensions != dimensions)
+
+	/* Largest power of two that fits the device and the kernel. */
+	max = chc->max_group_size < 1024 ? chc->max_group_size : 1024;
+	for (wg = 1; wg * 2 <= max; wg *= 2);
+	while (wg > 1 && wg * (primSize(type) + sizeof(cl_ulong)) >
+		chc->local_mem_size)
 	{
-		fprintf(stderr, "clHelper: Global size should be the same dimension as"
-			" the local size!\n");
-		return (-CLH_INV_DIM);
+		wg /= 2;
 	}
-	
-	/* Allocate and set local work sizes. */
-	if (chc->globalWorkSize != NULL)
-		free(chc->globalWorkSize);
-	
-	chc->globalWorkSize = malloc(sizeof(size_t) * dimensions);
-	chc->globalWorkSize[0] = roundPower(x);
-	if (y)
-		chc->globalWorkSize[1] = roundPower(y);
-	if (z)
-		chc->globalWorkSize[2] = roundPower(z);
-		
+
+	scan = chc->scan[t];
+	for (;;)
+	{
+		snprintf(options, sizeof(options), "-D T=%s -D OP=%d -D IDENT=%s "
+			"-D WG=%zu%s%s", names[t], op, idents[t][op], wg,
+			type == CLH_ARG_DOUBLE ? " -D USE_DOUBLE" : "", sg);
+
+		red->kernel = libKernel(chc, primSource, options, "clhReduce");
+		if (op == CLH_REDUCE_SUM)
+		{
+			scan[0].kernel = libKernel(chc, primSource, options,
+				"clhScanBlocks");
+			scan[1].kernel = libKernel(chc, primSource, options, "clhScanAdd");
+		}
+		if (!red->kernel || (op == CLH_REDUCE_SUM &&
+			(!scan[0].kernel || !scan[1].kernel)))
+		{
+			red->kernel = NULL;
+			return (-CLH_NOT_COMP_PROG);
+		}
+
+		/* Each kernel may allow less than the device, take the least. */
+		max = primGroupSize(chc, red->kernel, wg);
+		if (op == CLH_REDUCE_SUM)
+		{
+			max = primGroupSize(chc, scan[0].kernel, max);
+			max = primGroupSize(chc, scan[1].kernel, max);
+		}
+		if (max >= wg || wg == 1)
+			break;
+		wg /= 2;
+	}
+
+	red->wg = wg;
+	if (op == CLH_REDUCE_SUM)
+		scan[0].wg = scan[1].wg = wg;
 	return (CLH_OK);
 }
 
 /**
- * Launch the kernel and measures the time spent.
+ * Reduces a device buffer: sum, min, max or argmax, the time spent
+ * in the kernels is saved in chc->time_ms.
  * @param chc Context.
+ * @param type CLH_ARG_INT, CLH_ARG_FLOAT or CLH_ARG_DOUBLE.
+ * @param op CLH_REDUCE_SUM, CLH_REDUCE_MIN, CLH_REDUCE_MAX or
+ * CLH_REDUCE_ARGMAX.
+ * @param in Input buffer.
+ * @param n Number of elements.
+ * @param value Returned value, of the given type.
+ * @param index Returned index of the max value (the first one), for
+ * CLH_REDUCE_ARGMAX, may be NULL.
  * @returns Returns a positive number if success and a negative
- * number otherwise. 
+ * number otherwise.
  */
-int clhLaunchKernel(struct cl_helper_context *chc)
+int clhReduce(struct cl_helper_context *chc, int type, int op, cl_mem in,
+	size_t n, void *value, cl_ulong *index)
 {
-	int err;             /* Error code.        */
-	cl_ulong time_start; /* Kernel start time. */ 
-	cl_ulong time_end;   /* Kernel stop time.  */
-	
-	/* Launches the kernel. */
-	err = clEnqueueNDRangeKernel(chc->command_queue, chc->kernel,
-		chc->dimensions, NULL, chc->globalWorkSize, chc->localWorkSize,
-		0, NULL, &chc->event);
+	struct clh_lib_kernel *red;
+	cl_mem vals, idxs;
+	size_t global, groups;
+	double ms;
+	int ret;
 
-	/* Wait finishes. */
-	clWaitForEvents(1, &chc->event);
-	clFinish(chc->command_queue);
+	if (n == 0 || op < CLH_REDUCE_SUM || op > CLH_REDUCE_ARGMAX)
+		return (-CLH_INV_ARG);
+	if ((ret = libCheckType(chc, type)) != CLH_OK)
+		return (ret);
+	if ((ret = primBuild(chc, type, op)) != CLH_OK)
+		return (ret);
 
-	/* Execution time. */
-	clGetEventProfilingInfo(chc->event, CL_PROFILING_COMMAND_START,
-		sizeof(time_start), &time_start, NULL);
+	red = &chc->reduce[primType(type)][op];
 
-	clGetEventProfilingInfo(chc->event, CL_PROFILING_COMMAND_END,
-		sizeof(time_end), &time_end, NULL);
+	/* One partial per group, few enough for a single group. */
+	groups = (n + red->wg - 1) / red->wg;
+	if (groups > red->wg)
+		groups = red->wg;
 
-	/* Save the time spent. */
-	chc->time_ms = (time_end - time_start) / 1000000.0;
+	vals = clhAllocBuffer(chc, CL_MEM_READ_WRITE, groups * primSize(type),
+		NULL);
+	idxs = clhAllocBuffer(chc, CL_MEM_READ_WRITE, groups * sizeof(cl_ulong),
+		NULL);
+	if (!vals || !idxs)
+	{
+		ret = -CLH_OUT_OF_MEM;
+		goto out;
+	}
 
-	if (err != CL_SUCCESS)
+	/* First pass: the input. */
+	global = groups * red->wg;
+	ret = clhSetArgsFor(chc, red->kernel, CLH_BUF(in), CLH_BUF(idxs),
+		CLH_INT(0), CLH_ULONG(n), CLH_BUF(vals), CLH_BUF(idxs));
+	if (ret != CLH_OK ||
+		(ret = libLaunch(chc, red->kernel, 1, &global, &red->wg)) != CLH_OK)
 	{
-		fprintf(stderr, "clHelper: Failed to execute kernel! %d\n", err);
-		return (-CLH_KERN_FAIL);
+		goto out;
 	}
-	
-	return (CLH_OK);
+	ms = chc->time_ms;
+
+	/* Second pass: the partials, in place. */
+	if (groups > 1)
+	{
+		global = red->wg;
+		ret = clhSetArgsFor(chc, red->kernel, CLH_BUF(vals), CLH_BUF(idxs),
+			CLH_INT(1), CLH_ULONG(groups), CLH_BUF(vals), CLH_BUF(idxs));
+		if (ret != CLH_OK ||
+			(ret = libLaunch(chc, red->kernel, 1, &global, &red->wg)) != CLH_OK)
+		{
+			goto out;
+		}
+		ms += chc->time_ms;
+	}
+
+	ret = clhReadBuffer(chc, value, vals, primSize(type));
+	if (ret == CLH_OK && index)
+		ret = clhReadBuffer(chc, index, idxs, sizeof(cl_ulong));
+	chc->time_ms = ms;
+
+out:
+	if (vals)
+		clhFreeBuffer(chc, vals);
+	if (idxs)
+		clhFreeBuffer(chc, idxs);
+	return (ret);
+}
+
+/**
+ * Zero, as a scalar argument of a given element type.
+ * @param type Element type.
+ * @returns The argument.
+ */
+static struct clh_arg primZero(int type)
+{
+	if (type == CLH_ARG_INT)
+		return (CLH_INT(0));
+	if (type == CLH_ARG_FLOAT)
+		return (CLH_FLOAT(0));
+	return (CLH_DOUBLE(0));
+}
+
+/**
+ * Exclusive scan of a device buffer, starting from a given value.
+ * @param chc Context.
+ * @param type Element type.
+ * @param in Input buffer.
+ * @param out Output buffer, may be the input one.
+ * @param n Number of elements.
+ * @param init Initial value.
+ * @param ms Accumulated kernel time.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+static int scanDevice(struct cl_helper_context *chc, int type, cl_mem in,
+	cl_mem out, size_t n, const struct clh_arg *init, double *ms)
+{
+	struct clh_lib_kernel *scan;
+	struct clh_arg zero;
+	size_t global, block, nblocks;
+	cl_mem sums;
+	int ret;
+
+	scan = chc->scan[primType(type)];
+	block = scan[0].wg * SCAN_ITEMS;
+	nblocks = (n + block - 1) / block;
+
+	sums = clhAllocBuffer(chc, CL_MEM_READ_WRITE, nblocks * primSize(type),
+		NULL);
+	if (!sums)
+		return (-CLH_OUT_OF_MEM);
+
+	/* Blocks. */
+	global = nblocks * scan[0].wg;
+	ret = clhSetArgsFor(chc, scan[0].kernel, CLH_BUF(in), CLH_BUF(out),
+		CLH_ULONG(n), *init, CLH_BUF(sums));
+	if (ret != CLH_OK ||
+		(ret = libLaunch(chc, scan[0].kernel, 1, &global, &scan[0].wg)) !=
+		CLH_OK)
+	{
+		goto out;
+	}
+	*ms += chc->time_ms;
+
+	/* Block totals, then add them back. */
+	if (nblocks > 1)
+	{
+		zero = primZero(type);
+		if ((ret = scanDevice(chc, type, sums, sums, nblocks, &zero, ms)) !=
+			CLH_OK)
+		{
+			goto out;
+		}
+
+		global = ((n + scan[1].wg - 1) / scan[1].wg) * scan[1].wg;
+		ret = clhSetArgsFor(chc, scan[1].kernel, CLH_BUF(out), CLH_ULONG(n),
+			CLH_ULONG(block), CLH_BUF(sums));
+		if (ret != CLH_OK ||
+			(ret = libLaunch(chc, scan[1].kernel, 1, &global, &scan[1].wg)) !=
+			CLH_OK)
+		{
+			goto out;
+		}
+		*ms += chc->time_ms;
+	}
+
+out:
+	clhFreeBuffer(chc, sums);
+	return (ret);
+}
+
+/**
+ * Exclusive prefix sum of a device buffer: out[i] = in[0] + ... +
+ * in[i - 1], and out[0] = 0. The time spent in the kernels is saved in
+ * chc->time_ms.
+ * @param chc Context.
+ * @param type CLH_ARG_INT, CLH_ARG_FLOAT or CLH_ARG_DOUBLE.
+ * @param in Input buffer.
+ * @param out Output buffer, may be the input one.
+ * @param n Number of elements.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhScan(struct cl_helper_context *chc, int type, cl_mem in, cl_mem out,
+	size_t n)
+{
+	struct clh_arg init;
+	int ret;
+
+	if (n == 0)
+		return (CLH_OK);
+	if ((ret = libCheckType(chc, type)) != CLH_OK)
+		return (ret);
+	if ((ret = primBuild(chc, type, CLH_REDUCE_SUM)) != CLH_OK)
+		return (ret);
+
+	init = primZero(type);
+	chc->time_ms = 0;
+	return (scanDevice(chc, type, in, out, n, &init, &chc->time_ms));
+}
+
+/**
+ * Elements per chunk for the host versions: bounded by the largest
+ * allocation and by a fraction of the device memory.
+ * @param chc Context.
+ * @param type Element type.
+ * @param n Number of elements.
+ * @returns The chunk size, in elements.
+ */
+static size_t primChunk(struct cl_helper_context *chc, int type, size_t n)
+{
+	cl_ulong max_alloc;
+	size_t chunk;
+
+	max_alloc = chc->global_mem_size / 4;
+	clGetDeviceInfo(chc->device_id, CL_DEVICE_MAX_MEM_ALLOC_SIZE,
+		sizeof(max_alloc), &max_alloc, NULL);
+	if (max_alloc > chc->global_mem_size / 4)
+		max_alloc = chc->global_mem_size / 4;
+
+	chunk = (size_t)(max_alloc / primSize(type));
+	return (n < chunk ? n : chunk);
+}
+
+/**
+ * Combines the result of a chunk into the accumulated one.
+ * @param type Element type.
+ * @param op Operation.
+ * @param acc Accumulated value.
+ * @param acc_idx Accumulated index.
+ * @param x Chunk value.
+ * @param xi Chunk index.
+ */
+static void primCombine(int type, int op, void *acc, cl_ulong *acc_idx,
+	const void *x, cl_ulong xi)
+{
+#define COMBINE(T) \
+	do { \
+		T *a = acc; \
+		T b = *(const T *)x; \
+		if (op == CLH_REDUCE_SUM) \
+			*a += b; \
+		else if ((op == CLH_REDUCE_MIN && b < *a) || \
+			(op != CLH_REDUCE_MIN && b > *a)) \
+		{ \
+			*a = b; \
+			*acc_idx = xi; \
+		} \
+	} while (0)
+
+	if (type == CLH_ARG_INT)
+		COMBINE(cl_int);
+	else if (type == CLH_ARG_FLOAT)
+		COMBINE(cl_float);
+	else
+		COMBINE(cl_double);
+
+#undef COMBINE
+}
+
+/**
+ * Reduces a host array of any size, possibly larger than the device
+ * memory: the array is sent and reduced in chunks, and the chunk
+ * results combined. See clhReduce.
+ * @param chc Context.
+ * @param type CLH_ARG_INT, CLH_ARG_FLOAT or CLH_ARG_DOUBLE.
+ * @param op CLH_REDUCE_* operation.
+ * @param in Host array.
+ * @param n Number of elements.
+ * @param value Returned value, of the given type.
+ * @param index Returned index, for CLH_REDUCE_ARGMAX, may be NULL.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhReduceHost(struct cl_helper_context *chc, int type, int op,
+	const void *in, size_t n, void *value, cl_ulong *index)
+{
+	union { cl_int i; cl_float f; cl_double d; } part;
+	cl_ulong idx, acc_idx;
+	size_t chunk, esize;
+	double ms;
+	cl_mem buf;
+	int ret;
+
+	if (n == 0)
+		return (-CLH_INV_ARG);
+
+	esize = primSize(type);
+	chunk = primChunk(chc, type, n);
+	buf = clhAllocBuffer(chc, CL_MEM_READ_ONLY, chunk * esize, NULL);
+	if (!buf)
+		return (-CLH_OUT_OF_MEM);
+
+	ms = 0;
+	acc_idx = 0;
+	ret = CLH_OK;
+	for (size_t off = 0; off < n && ret == CLH_OK; off += chunk)
+	{
+		size_t len = (n - off < chunk) ? n - off : chunk;
+
+		if ((ret = clhWriteBuffer(chc, buf, (const char *)in + off * esize,
+			len * esize)) != CLH_OK)
+		{
+			break;
+		}
+		if ((ret = clhReduce(chc, type, op, buf, len, &part, &idx)) != CLH_OK)
+			break;
+		ms += chc->time_ms;
+
+		if (off == 0)
+		{
+			memcpy(value, &part, esize);
+			acc_idx = idx;
+		}
+		else
+			primCombine(type, op, value, &acc_idx, &part, off + idx);
+	}
+
+	if (index)
+		*index = acc_idx;
+	chc->time_ms = ms;
+	clhFreeBuffer(chc, buf);
+	return (ret);
+}
+
+/**
+ * Exclusive prefix sum of a host array of any size, possibly larger
+ * than the device memory: each chunk is scanned starting from the
+ * total of the previous ones. See clhScan.
+ * @param chc Context.
+ * @param type CLH_ARG_INT, CLH_ARG_FLOAT or CLH_ARG_DOUBLE.
+ * @param in Input array.
+ * @param out Output array, may be the input one.
+ * @param n Number of elements.
+ * @returns Returns a positive number if success and a negative
+ * number otherwise.
+ */
+int clhScanHost(struct cl_helper_context *chc, int type, const void *in,
+	void *out, size_t n)
+{
+	union { cl_int i; cl_float f; cl_double d; } last;
+	struct clh_arg carry;
+	size_t chunk, esize;
+	double ms;
+	cl_mem buf;
+	int ret;
+
+	if (n == 0)
+		return (CLH_OK);
+	if ((ret = libCheckType(chc, type)) != CLH_OK)
+		return (ret);
+	if ((ret = primBuild(chc, type, CLH_REDUCE_SUM)) != CLH_OK)
+		return (ret);
+
+	esize = primSize(type);
+	chunk = primChunk(chc, type, n);
+	buf = clhAllocBuffer(chc, CL_MEM_READ_WRITE, chunk * esize, NULL);
+	if (!buf)
+		return (-CLH_OUT_OF_MEM);
+
+	carry = primZero(type);
+
+	ms = 0;
+	for (size_t off = 0; off < n; off += chunk)
+	{
+		size_t len = (n - off < chunk) ? n - off : chunk;
+		char *dst = (char *)out + off * esize;
+
+		/* The input may be overwritten (in place). */
+		memcpy(&last, (const char *)in + (off + len - 1) * esize, esize);
+
+		if ((ret = clhWriteBuffer(chc, buf, (const char *)in + off * esize,
+			len * esize)) != CLH_OK ||
+			(ret = scanDevice(chc, type, buf, buf, len, &carry, &ms)) != CLH_OK ||
+			(ret = clhReadBuffer(chc, dst, buf, len * esize)) != CLH_OK)
+		{
+			break;
+		}
+
+		/* Next carry: last output + last input. */
+		if (type == CLH_ARG_INT)
+			carry.v.i = ((cl_int *)dst)[len - 1] + last.i;
+		else if (type == CLH_ARG_FLOAT)
+			carry.v.f = ((cl_float *)dst)[len - 1] + last.f;
+		else
+			carry.v.d = ((cl_double *)dst)[len - 1] + last.d;
+	}
+
+	chc->time_ms = ms;
+	clhFreeBuffer(chc, buf);
+	return (ret);
 }
 
 /**
@@ -580,23 +9103,82 @@ int clhLaunchKernel(struct cl_helper_context *chc)
  */
 int clhReleaseContext(struct cl_helper_context *chc)
 {
+	/* Kernel registry, chc->kernel lives here too. */
+	for (int i = 0; i < chc->num_kernels; i++)
+	{
+		clReleaseKernel(chc->kernels[i].kernel);
+		free(chc->kernels[i].name);
+		free(chc->kernels[i].arg_qual);
+		free(chc->kernels[i].arg_set);
+		free(chc->kernels[i].args);
+	}
+	free(chc->kernels);
+
+	/* Host executor and native kernels. */
+	cpuStop(chc);
+
+	/* Profiling records. */
+	clhProfilerEnable(chc, 0, 0);
+
+	/* Streams. */
+	while (chc->streams)
+		clhStreamRelease(chc, chc->streams);
+	if (chc->ooo_queue)
+		clReleaseCommandQueue(chc->ooo_queue);
+
+	/* Tracked and cached buffers. */
+	while (chc->tracked)
+		clhTrackedFree(chc, chc->tracked);
+	free(chc->tracked_args);
+	free(chc->resident);
+	poolRelease(chc, 0);
+	free(chc->pool_live);
+
+	/* Host allocations. */
+	while (chc->host_allocs)
+	{
+		struct clh_host_alloc *ha = chc->host_allocs;
+		chc->host_allocs = ha->next;
+		releaseHostAlloc(chc, ha);
+	}
+
 	/* OpenCL stuffs. */
-	if (chc->program)
-		clReleaseProgram(chc->program);
-	if (chc->kernel)
-		clReleaseKernel(chc->kernel);
+	if (chc->event)
+		clReleaseEvent(chc->event);
+	while (chc->programs)
+	{
+		struct clh_program_entry *entry = chc->programs;
+		chc->programs = entry->next;
+		clReleaseProgram(entry->program);
+		free(entry->options);
+		free(entry);
+	}
+	for (int i = 1; i < chc->num_devices; i++)
+		if (chc->queues[i])
+			clReleaseCommandQueue(chc->queues[i]);
 	if (chc->command_queue)
 		clReleaseCommandQueue(chc->command_queue);
 	if (chc->context)
 		clReleaseContext(chc->context);
+	for (int i = 0; chc->sub_devices && i < chc->num_devices; i++)
+		clReleaseDevice(chc->devices[i]);
 		
 	/* clHelper stuffs. */
+	free(chc->devices);
+	free(chc->queues);
+	free(chc->weights);
+	free(chc->split_args);
+	if (chc->cache_dir)
+		free(chc->cache_dir);
 	if (chc->globalWorkSize)
 		free(chc->globalWorkSize);
 	if (chc->localWorkSize)
 		free(chc->localWorkSize);
 	if (chc->buffer)
 		free(chc->buffer);
+	free(chc->build_options);
+	free(chc->include_opts);
+	free(chc->build_log);
 		
 	/* Clear the structure. */
 	memset(chc, 0, sizeof(struct cl_helper_context));
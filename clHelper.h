@@ -32,6 +32,7 @@
  */
 #define CLH_OK             0
 #define CLH_GPU_NOT_FOUND  1
+#define CLH_DEVICE_NOT_FOUND CLH_GPU_NOT_FOUND
 #define CLH_NOT_COM_CONT   2
 #define CLH_NOT_COM_QUEUE  3
 #define CLH_NOT_COMP_PROG  4
@@ -40,6 +41,545 @@
 #define CLH_INV_GRID       7
 #define CLH_KERN_FAIL      8
 #define CLH_FILE_ERROR     9
+#define CLH_OUT_OF_MEM     10
+#define CLH_INV_ARG        11
+
+/*
+ * NDRange size modes, see clhSetSizeMode.
+ */
+#define CLH_SIZE_POW2      0
+#define CLH_SIZE_EXACT     1
+#define CLH_SIZE_SPLIT     2
+
+/*
+ * Profiling record kinds.
+ */
+#define CLH_PROF_KERNEL    0
+#define CLH_PROF_WRITE     1
+#define CLH_PROF_READ      2
+#define CLH_PROF_COPY      3
+
+/*
+ * Reduction operations.
+ */
+#define CLH_REDUCE_SUM     0
+#define CLH_REDUCE_MIN     1
+#define CLH_REDUCE_MAX     2
+#define CLH_REDUCE_ARGMAX  3
+
+/*
+ * Stream flags.
+ */
+#define CLH_STREAM_IN_ORDER     0
+#define CLH_STREAM_OUT_OF_ORDER 1
+
+/*
+ * Host fallback modes, see clh_device_filter.
+ */
+#define CLH_FALLBACK_OFF   0
+#define CLH_FALLBACK_AUTO  1
+#define CLH_FALLBACK_FORCE 2
+
+/*
+ * Device partitioning, see clhPartitionDevice.
+ */
+#define CLH_PARTITION_NUMA    0
+#define CLH_PARTITION_EQUALLY 1
+
+/* Buffer pool size classes, one per power of two. */
+#define CLH_POOL_CLASSES   64
+
+/**
+ * Device info, as probed at the context start.
+ */
+struct clh_device_info
+{
+	cl_platform_id platform;         /* Platform.               */
+	cl_device_id id;                 /* Device.                 */
+	char platform_name[128];         /* Platform name.          */
+	char name[128];                  /* Device name.            */
+	cl_device_type type;             /* Device type.            */
+	size_t max_group_size;           /* Max work-group size.    */
+	cl_uint max_items_dimensions;    /* Max dimensions.         */
+	size_t max_work_item_size[3];    /* Max work-item sizes.    */
+	cl_uint global_work_size;        /* Address bits.           */
+	cl_ulong global_mem_size;        /* Global memory size.     */
+	cl_ulong local_mem_size;         /* Local memory size.      */
+	cl_uint compute_units;           /* Compute units.          */
+	cl_uint clock_mhz;               /* Max clock, in MHz.      */
+};
+
+/**
+ * Device selection filter, see clhStartContextEx. Zeroed fields
+ * mean 'do not care'.
+ */
+struct clh_device_filter
+{
+	cl_device_type type;             /* CL_DEVICE_TYPE_GPU, _CPU,
+	                                    _ACCELERATOR or _ALL.   */
+	const char *platform_name;       /* Platform name substring.*/
+	const char *device_name;         /* Device name substring.  */
+	cl_ulong min_global_mem;         /* Min global memory.      */
+	cl_ulong min_local_mem;          /* Min local memory.       */
+	int rank;                        /* Pick the fastest device
+	                                    (compute units x clock)
+	                                    instead of the first.   */
+	int fallback;                    /* CLH_FALLBACK_AUTO runs the
+	                                    native kernels on the host
+	                                    if no device matches,
+	                                    _FORCE always does.     */
+};
+
+/*
+ * Kernel argument types.
+ */
+#define CLH_ARG_BUF        1
+#define CLH_ARG_INT        2
+#define CLH_ARG_UINT       3
+#define CLH_ARG_LONG       4
+#define CLH_ARG_ULONG      5
+#define CLH_ARG_FLOAT      6
+#define CLH_ARG_DOUBLE     7
+#define CLH_ARG_LOCAL      8
+#define CLH_ARG_RAW        9
+#define CLH_ARG_TRACKED    10
+#define CLH_ARG_SPLIT      11
+
+/**
+ * Typed kernel argument, see the CLH_BUF, CLH_INT... macros below.
+ */
+struct clh_arg
+{
+	int type;                        /* Argument type.          */
+	size_t size;                     /* Argument size.          */
+	union
+	{
+		cl_mem mem;
+		cl_int i;
+		cl_uint u;
+		cl_long l;
+		cl_ulong ul;
+		cl_float f;
+		cl_double d;
+	} v;                             /* Argument value.         */
+	const void *ptr;                 /* CLH_ARG_RAW data, or the
+	                                    CLH_ARG_TRACKED buffer. */
+};
+
+#define CLH_BUF(x) \
+	((struct clh_arg){CLH_ARG_BUF, sizeof(cl_mem), {.mem = (x)}, NULL})
+#define CLH_INT(x) \
+	((struct clh_arg){CLH_ARG_INT, sizeof(cl_int), {.i = (x)}, NULL})
+#define CLH_UINT(x) \
+	((struct clh_arg){CLH_ARG_UINT, sizeof(cl_uint), {.u = (x)}, NULL})
+#define CLH_LONG(x) \
+	((struct clh_arg){CLH_ARG_LONG, sizeof(cl_long), {.l = (x)}, NULL})
+#define CLH_ULONG(x) \
+	((struct clh_arg){CLH_ARG_ULONG, sizeof(cl_ulong), {.ul = (x)}, NULL})
+#define CLH_FLOAT(x) \
+	((struct clh_arg){CLH_ARG_FLOAT, sizeof(cl_float), {.f = (x)}, NULL})
+#define CLH_DOUBLE(x) \
+	((struct clh_arg){CLH_ARG_DOUBLE, sizeof(cl_double), {.d = (x)}, NULL})
+#define CLH_LOCAL(size) \
+	((struct clh_arg){CLH_ARG_LOCAL, (size), {.l = 0}, NULL})
+#define CLH_RAW(p, size) \
+	((struct clh_arg){CLH_ARG_RAW, (size), {.l = 0}, (p)})
+#define CLH_TRACKED(t) \
+	((struct clh_arg){CLH_ARG_TRACKED, sizeof(cl_mem), {.l = 0}, (t)})
+#define CLH_SPLIT(x) \
+	((struct clh_arg){CLH_ARG_SPLIT, sizeof(cl_mem), {.mem = (x)}, NULL})
+
+/**
+ * Work-group run by a native kernel, see clhRegisterNative. Unused
+ * dimensions have size 1.
+ */
+struct clh_group
+{
+	int dims;                        /* NDRange dimensions.     */
+	size_t group_id[3];              /* Work-group id.          */
+	size_t offset[3];                /* Global id of the first
+	                                    work-item.              */
+	size_t local_size[3];            /* Work-items, smaller than
+	                                    the block size at the end
+	                                    of ragged NDRanges.     */
+	size_t global_size[3];           /* Global size.            */
+	size_t num_groups[3];            /* Work-groups.            */
+};
+
+/**
+ * Native kernel: host implementation of a kernel, called once per
+ * work-group. args[i] points to the data of buffer and local memory
+ * arguments, and to the value of the other ones.
+ */
+typedef void (*clh_native_fn)(const struct clh_group *group, void **args);
+
+/**
+ * Native kernel of a host fallback context, what its cl_kernel
+ * handles point to.
+ */
+struct clh_native_kernel
+{
+	const char *name;                /* Kernel name.            */
+	clh_native_fn fn;                /* Native code.            */
+	struct clh_arg *args;            /* Bound arguments.        */
+	void **raw;                      /* Copies of raw args.     */
+	int nargs;                       /* Number of arguments.    */
+	struct clh_native_kernel *next;  /* Next kernel.            */
+};
+
+/**
+ * Launch graph node: a recorded kernel launch.
+ */
+struct clh_graph_node
+{
+	cl_kernel kernel;                /* Kernel.                 */
+	struct clh_arg *args;            /* Arguments.              */
+	int nargs;                       /* Number of arguments.    */
+	int dims;                        /* NDRange dimensions.     */
+	size_t global[3];                /* Global size.            */
+	size_t local[3];                 /* Local size.             */
+	int has_local;                   /* 0 if runtime-chosen.    */
+	int split;                       /* Ragged, body/remainder. */
+	int *deps;                       /* Nodes it depends on.    */
+	int ndeps;                       /* Number of dependencies. */
+};
+
+/**
+ * Launch graph: a sequence of kernel launches recorded once and
+ * replayed many times, see clhGraphReplay.
+ */
+struct clh_graph
+{
+	struct clh_graph_node *nodes;    /* Recorded launches.      */
+	int num_nodes;                   /* Number of launches.     */
+	int max_nodes;                   /* Capacity.               */
+	double submit_ms;                /* Host time of the last
+	                                    replay submission.      */
+	unsigned long replays;           /* Number of replays.      */
+};
+
+/**
+ * Kernel registry entry, kernels are created once per program and
+ * looked up by name afterwards.
+ */
+struct clh_kernel_entry
+{
+	char *name;                      /* Kernel name.            */
+	cl_program program;              /* Program it belongs to.  */
+	cl_kernel kernel;                /* Kernel object.          */
+
+	/* Argument state. */
+	int num_args;                    /* Kernel arguments, -1 if
+	                                    not queried yet.        */
+	int arg_info;                    /* Arg info is available.  */
+	cl_kernel_arg_address_qualifier *arg_qual; /* Qualifiers.   */
+	struct clh_arg *args;            /* Last bound values.      */
+	char *arg_set;                   /* Arg was bound already.  */
+};
+
+/**
+ * Free buffer kept by the buffer pool.
+ */
+struct clh_pool_entry
+{
+	cl_mem mem;                      /* Buffer.                 */
+	cl_mem_flags flags;              /* Flags it was created.   */
+	struct clh_pool_entry *next;     /* Next in the same class. */
+};
+
+/**
+ * Buffer pool statistics.
+ */
+struct clh_pool_stats
+{
+	cl_ulong live_bytes;             /* Bytes in use.           */
+	cl_ulong cached_bytes;           /* Free bytes kept.        */
+	cl_ulong peak_bytes;             /* Peak of live + cached.  */
+	unsigned long allocs;            /* Allocations requested.  */
+	unsigned long reuses;            /* Served by the pool.     */
+	double reuse_ratio;              /* reuses / allocs.        */
+};
+
+/**
+ * Tracked buffer: device buffer with a host backing, moved to the
+ * device on use and back to the host when evicted, see
+ * clhTrackedAlloc.
+ */
+struct clh_tracked
+{
+	void *host;                      /* Host backing.           */
+	size_t size;                     /* Size, in bytes.         */
+	cl_mem_flags flags;              /* Device buffer flags.    */
+	int owns_host;                   /* host allocated by us.   */
+	cl_mem mem;                      /* Device copy, NULL if not
+	                                    resident.               */
+	int device;                      /* Device it resides on.   */
+	int device_newer;                /* Kernels may have written
+	                                    the device copy.        */
+	int host_newer;                  /* Host copy was changed.  */
+	unsigned long last_use;          /* LRU clock at last use.  */
+	int bound;                       /* Kernel args bound and not
+	                                    launched yet.           */
+	cl_command_queue queue;          /* Last launch queue if not
+	                                    the device one, retained.*/
+	struct clh_tracked *next;        /* Next tracked buffer.    */
+};
+
+/**
+ * Kernel argument bound to a split buffer (CLH_SPLIT): each device of
+ * clhLaunchKernelMulti gets the rows of its part only.
+ */
+struct clh_split_arg
+{
+	cl_kernel kernel;                /* Kernel.                 */
+	int idx;                         /* Argument index.         */
+	cl_mem mem;                      /* Whole buffer.           */
+};
+
+/**
+ * Kernel argument bound to a tracked buffer, the buffer is made
+ * resident and bound again on each launch of the kernel.
+ */
+struct clh_tracked_arg
+{
+	cl_kernel kernel;                /* Kernel.                 */
+	int idx;                         /* Argument index.         */
+	struct clh_tracked *t;           /* Tracked buffer.         */
+	int pending;                     /* Not launched yet.       */
+};
+
+/**
+ * Device memory statistics, see clhMemoryStats.
+ */
+struct clh_mem_stats
+{
+	cl_ulong budget;                 /* Bytes per device.       */
+	cl_ulong resident_bytes;         /* Tracked, on the device. */
+	cl_ulong pool_bytes;             /* Buffer pool, live and
+	                                    cached (device 0).      */
+	cl_ulong tracked_bytes;          /* All tracked buffers.    */
+	unsigned long uploads;           /* Host to device copies.  */
+	unsigned long readbacks;         /* Device to host copies.  */
+	unsigned long evictions;         /* Buffers evicted.        */
+	cl_ulong upload_bytes;           /* Bytes uploaded.         */
+	cl_ulong readback_bytes;         /* Bytes read back.        */
+};
+
+/**
+ * Host memory allocated by clhAllocHost.
+ */
+struct clh_host_alloc
+{
+	void *ptr;                       /* Host pointer.           */
+	size_t size;                     /* Allocation size.        */
+	cl_mem host_mem;                 /* Buffer backing ptr.     */
+	cl_mem dev_mem;                  /* Device view, same as
+	                                    host_mem if zero-copy.  */
+	int mapped;                      /* ptr is a mapping of
+	                                    host_mem.               */
+	struct clh_host_alloc *next;     /* Next allocation.        */
+};
+
+/**
+ * Streaming pipeline description, see clhRunPipeline.
+ */
+struct clh_pipeline
+{
+	cl_kernel kernel;                /* Kernel run per chunk.   */
+	int arg_in;                      /* Chunk input arg index.  */
+	int arg_out;                     /* Chunk output arg index. */
+	int arg_count;                   /* Chunk size arg index, or
+	                                    -1 if not used.         */
+	const void *input;               /* Host input.             */
+	size_t in_elem_size;             /* Input element size.     */
+	void *output;                    /* Host output, may be
+	                                    NULL.                   */
+	size_t out_elem_size;            /* Output element size.    */
+	size_t num_elems;                /* Total elements.         */
+	size_t chunk_elems;              /* Elements per chunk.     */
+	int num_buffers;                 /* Buffers in flight (2 for
+	                                    double buffering, 3 for
+	                                    triple...), 0 for 3.    */
+	size_t local_size;               /* Work-group size, 0 lets
+	                                    the runtime choose.     */
+};
+
+/**
+ * Streaming pipeline statistics, stage times are the sum over all
+ * chunks, so the largest one is the bottleneck.
+ */
+struct clh_pipeline_stats
+{
+	double upload_ms;                /* Host to device.         */
+	double compute_ms;               /* Kernel.                 */
+	double download_ms;              /* Device to host.         */
+	double total_ms;                 /* Wall time.              */
+	int chunks;                      /* Chunks processed.       */
+};
+
+/* Launch service, see clhServiceStart. */
+#define CLH_SERVICE_MAX_ARGS 16
+
+struct clh_service;
+struct clh_future;
+
+/**
+ * Kernel launch posted to a launch service, see clhServicePost. The
+ * upload runs before the kernel and the download after it; both are
+ * optional (NULL buffer).
+ */
+struct clh_request
+{
+	cl_kernel kernel;                /* Kernel.                 */
+	struct clh_arg args[CLH_SERVICE_MAX_ARGS];
+	int nargs;                       /* Arguments.              */
+	int dims;                        /* Dimensions, 1 to 3.     */
+	size_t global[3];                /* Global size.            */
+	size_t local[3];                 /* Local size, local[0] = 0
+	                                    lets the runtime choose.*/
+	cl_mem write_buf;                /* Upload destination.     */
+	const void *write_src;           /* Upload source.          */
+	size_t write_size;               /* Upload size.            */
+	cl_mem read_buf;                 /* Download source.        */
+	void *read_dst;                  /* Download destination.   */
+	size_t read_size;                /* Download size.          */
+	void (*callback)(int status, double time_ms, void *user);
+	                                 /* Completion callback, may
+	                                    be NULL.                */
+	void *user;                      /* Callback data.          */
+	int device;                      /* Device index, or -1 for
+	                                    round-robin.            */
+};
+
+/**
+ * Launch service statistics.
+ */
+struct clh_service_stats
+{
+	unsigned long posted;            /* Requests posted.        */
+	unsigned long submitted;         /* Requests enqueued.      */
+	unsigned long completed;         /* Requests completed.     */
+	unsigned long flushes;           /* Queue flushes.          */
+	double avg_batch;                /* Requests per flush.     */
+};
+
+struct clh_batcher;
+
+/**
+ * Micro-batcher configuration, see clhBatcherCreate.
+ */
+struct clh_batch_config
+{
+	cl_kernel kernel;                /* Batch kernel.           */
+	size_t in_elem_size;             /* Input element size.     */
+	size_t out_elem_size;            /* Output element size.    */
+	int max_batch;                   /* Requests per launch, 0
+	                                    for 64.                 */
+	size_t max_elems;                /* Input elements per
+	                                    launch, 0 for no limit. */
+	double max_wait_ms;              /* Time the first request
+	                                    of a batch waits for
+	                                    others.                 */
+	size_t local_size;               /* Work-group size, 0 lets
+	                                    the runtime choose.     */
+	const struct clh_arg *args;      /* Arguments after the
+	                                    batch ones, may be NULL.*/
+	int nargs;                       /* Their count.            */
+};
+
+/**
+ * Micro-batcher statistics.
+ */
+struct clh_batch_stats
+{
+	unsigned long requests;          /* Requests run.           */
+	unsigned long batches;           /* Launches.               */
+	unsigned long full;              /* Launches of a full batch,
+	                                    the others timed out.   */
+	double avg_batch;                /* Requests per launch.    */
+	double avg_elems;                /* Elements per launch.    */
+	double avg_wait_ms;              /* Wait for the batch.     */
+	double avg_latency_ms;           /* Submit to results.      */
+	double max_latency_ms;           /* Worst request.          */
+	double avg_kernel_ms;            /* Kernel per launch.      */
+};
+
+/**
+ * Profiling record: one enqueued command.
+ */
+struct clh_prof_record
+{
+	char name[32];                   /* Kernel name or transfer.*/
+	int kind;                        /* CLH_PROF_* kind.        */
+	size_t bytes;                    /* Bytes, for transfers.   */
+	cl_command_queue queue;          /* Queue.                  */
+	cl_event event;                  /* Pending event, NULL once
+	                                    the times were read.    */
+	cl_ulong queued;                 /* CL_PROFILING_COMMAND_*  */
+	cl_ulong submit;                 /* times, in ns.           */
+	cl_ulong start;
+	cl_ulong end;
+};
+
+/**
+ * Profiling recorder, see clhProfilerEnable.
+ */
+struct clh_profiler
+{
+	struct clh_prof_record *ring;    /* Ring buffer.            */
+	int capacity;                    /* Ring size, 0 if off.    */
+	int sample_every;                /* Sampling rate.          */
+	unsigned long seen;              /* Commands seen.          */
+	unsigned long count;             /* Commands recorded.      */
+	unsigned long dropped;           /* Overwritten unfinished. */
+};
+
+/**
+ * Program variant: a program built from a given source with a given
+ * set of build options.
+ */
+struct clh_program_entry
+{
+	cl_ulong source_hash;            /* Source hash.            */
+	char *options;                   /* Build options.          */
+	cl_program program;              /* Program.                */
+	struct clh_program_entry *next;  /* Next variant.           */
+};
+
+/**
+ * GEMM kernel and its tile configuration, see clhGemm.
+ */
+struct clh_gemm_plan
+{
+	cl_kernel kernel;                /* Kernel, NULL if not built. */
+	int ts;                          /* Tile size.              */
+	int tsk;                         /* Tile depth.             */
+	int wpt;                         /* Work per work-item.     */
+	int vw;                          /* Vector width.           */
+};
+
+/**
+ * Library kernel and its work-group size.
+ */
+struct clh_lib_kernel
+{
+	cl_kernel kernel;                /* Kernel, NULL if not built. */
+	size_t wg;                       /* Work-group size.        */
+};
+
+/**
+ * Stream: an independent sequence of commands, see clhStreamCreate.
+ */
+struct clh_stream
+{
+	cl_command_queue queue;          /* Queue, shared by all the
+	                                    out-of-order streams.   */
+	cl_event last;                   /* Last command, if out of
+	                                    order.                  */
+	int out_of_order;                /* Shares the out-of-order
+	                                    queue.                  */
+	struct clh_stream *next;         /* Next stream.            */
+};
 
 /**
  * Data stuff.
@@ -54,10 +594,29 @@ struct cl_helper_context
 	cl_context context;              /* Compute context.        */
 	cl_command_queue command_queue;  /* Compute command queue.  */
 	cl_program program;              /* Compute program.        */
+	struct clh_program_entry *programs; /* Programs built.      */
+	char *build_options;             /* Build options.          */
+	char *include_opts;              /* -I options.             */
+	char *build_log;                 /* Last failed build log.  */
 	cl_kernel kernel;                /* Compute kernel.         */
+	struct clh_kernel_entry *kernels;/* Kernel registry.        */
+	int num_kernels;                 /* Registered kernels.     */
+	int max_kernels;                 /* Registry capacity.      */
 	cl_event event;                  /* Time.                   */
+
+	/* Devices, more than one if started by clhStartContextMulti. */
+	int num_devices;                 /* Number of devices.      */
+	cl_device_id *devices;           /* Devices in the context. */
+	cl_command_queue *queues;        /* One queue per device.   */
+	double *weights;                 /* Device work share.      */
+	struct clh_split_arg *split_args;/* Split kernel args.      */
+	int num_split_args;              /* Split kernel args.      */
+	int max_split_args;              /* Split args capacity.    */
+	int sub_devices;                 /* Devices are sub-devices
+	                                    of chc->device.         */
 	
 	/* Device data. */
+	struct clh_device_info device;   /* Selected device info.        */
    	cl_device_type device_type;      /* Device type.                 */
 	size_t max_group_size;           /* Max work-group size, (equivalent to
 	                                    threads per block, in CUDA.  */
@@ -72,15 +631,71 @@ struct cl_helper_context
 	cl_ulong global_mem_size;        /* Global memory size.          */
 	
 	cl_ulong local_mem_size;         /* Local memory size.           */
+
+	int host_unified;                /* Device shares the memory with
+	                                    the host (zero copy).        */
+
+	/* Startup. */
+	double startup_ms;               /* Context startup time.        */
+	int probe_cached;                /* Device info came from the
+	                                    process-wide cache (warm).   */
 	                                  
 	/* Kernel data. */
 	size_t *localWorkSize;           /* Local work array.           */
 	size_t *globalWorkSize;          /* Global work array.          */
 	int dimensions;
+	int size_mode;                   /* CLH_SIZE_* rounding mode.   */
 	
 	/* Profilling. */
 	double time_ms;                  /* Time spent to execute the
 	                                    kernel.                     */
+
+	/* Profiling recorder. */
+	struct clh_profiler prof;
+
+	/* Kernel library. */
+	struct clh_gemm_plan gemm[2];    /* Float and double GEMM.  */
+	struct clh_lib_kernel reduce[3][4]; /* Reductions, per type
+	                                       and operation.       */
+	struct clh_lib_kernel scan[3][2];   /* Scans, per type.     */
+
+	/* Host fallback, no OpenCL device. */
+	int fallback;                    /* Kernels run on the host.*/
+	struct clh_cpu_exec *cpu;        /* Host thread pool.       */
+	struct clh_native_kernel *natives; /* Kernels in use.       */
+
+	/* Streams. */
+	struct clh_stream *streams;      /* Streams created.        */
+	cl_command_queue ooo_queue;      /* Out-of-order queue.     */
+
+	/* Buffer pool. */
+	struct clh_pool_entry *pool[CLH_POOL_CLASSES]; /* Free lists.  */
+	struct clh_pool_stats pool_stats;              /* Statistics.  */
+	cl_mem *pool_live;               /* Buffers handed out, hash
+	                                    set.                    */
+	size_t pool_live_cap;            /* Set capacity, power of 2.*/
+	size_t pool_live_num;            /* Buffers in the set.     */
+
+	/* Pinned/zero-copy host allocations. */
+	struct clh_host_alloc *host_allocs;
+
+	/* Tracked buffers. */
+	struct clh_tracked *tracked;     /* Tracked buffers.        */
+	cl_ulong mem_budget;             /* Device bytes, 0 for the
+	                                    global memory size.     */
+	cl_ulong *resident;              /* Resident bytes, per
+	                                    device.                 */
+	struct clh_tracked_arg *tracked_args; /* Bound kernel args. */
+	int num_tracked_args;            /* Bound kernel args.      */
+	int max_tracked_args;            /* Bound args capacity.    */
+	unsigned long mem_clock;         /* LRU clock.              */
+	struct clh_mem_stats mem_stats;  /* Statistics.             */
+
+	/* Program binary cache. */
+	char *cache_dir;                 /* Cache directory, NULL if
+	                                    disabled.                   */
+	unsigned cache_hits;             /* Programs loaded from cache. */
+	unsigned cache_misses;           /* Programs built from source. */
 };
 
 /* -- External declarations. -- */
@@ -89,9 +704,87 @@ struct cl_helper_context
 extern int clhLoadKernel(struct cl_helper_context *chc, char const *path,
 	char const *kernel_name);
 
+/* Load and build a program, without creating kernels. */
+extern int clhLoadProgram(struct cl_helper_context *chc, char const *path);
+extern int clhLoadProgramFiles(struct cl_helper_context *chc,
+	const char **paths, int count);
+extern int clhAddIncludeDir(struct cl_helper_context *chc, const char *dir);
+
+/* Sets the build options of the next program loads. */
+extern int clhSetBuildOptions(struct cl_helper_context *chc,
+	const char *options);
+
+/* Adds a compile-time constant to the build options. */
+extern int clhDefine(struct cl_helper_context *chc, const char *name,
+	const char *value);
+
+/* Adds an integer compile-time constant to the build options. */
+extern int clhDefineInt(struct cl_helper_context *chc, const char *name,
+	long value);
+
+/* Gets (or creates) a kernel from the current program by name. */
+extern cl_kernel clhGetKernel(struct cl_helper_context *chc,
+	char const *kernel_name);
+
+/* Creates all the kernels from the current program. */
+extern int clhCreateAllKernels(struct cl_helper_context *chc);
+
+/* Sets kernel arguments from a typed argument array. */
+extern int clhSetKernelArgs(struct cl_helper_context *chc, cl_kernel kernel,
+	const struct clh_arg *args, int nargs);
+
+/* Forgets the cached argument values of a kernel. */
+extern int clhInvalidateArgs(struct cl_helper_context *chc,
+	cl_kernel kernel);
+
+/*
+ * Sets the arguments of chc->kernel (or a given kernel), e.g:
+ *   clhSetArgs(&chc, CLH_BUF(d_C), CLH_BUF(d_A), CLH_INT(width));
+ */
+#define clhSetArgs(chc, ...) \
+	clhSetArgsFor((chc), (chc)->kernel, __VA_ARGS__)
+
+#define clhSetArgsFor(chc, kernel, ...) \
+	clhSetKernelArgs((chc), (kernel), (struct clh_arg[]){__VA_ARGS__}, \
+		(int)(sizeof((struct clh_arg[]){__VA_ARGS__}) / sizeof(struct clh_arg)))
+
 /* Starts the clHelper context. */
 extern int clhStartContext(struct cl_helper_context *chc);
 
+/* Starts the clHelper context on a device matching the filter. */
+extern int clhStartContextEx(struct cl_helper_context *chc,
+	const struct clh_device_filter *filter);
+
+/* Starts the clHelper context on several devices. */
+extern int clhStartContextMulti(struct cl_helper_context *chc,
+	const struct clh_device_filter *filter, int max_devices);
+
+/* Registers the host implementation of a kernel, for device-less runs. */
+extern int clhRegisterNative(const char *kernel_name, clh_native_fn fn);
+
+/* Sets the throughput weight of each device. */
+extern int clhSetDeviceWeights(struct cl_helper_context *chc,
+	const double *weights);
+
+/* Partitions the device into sub-devices (NUMA nodes...). */
+extern int clhPartitionDevice(struct cl_helper_context *chc, int mode,
+	cl_uint units);
+
+/* Allocates a buffer placed on the device that works on each part. */
+extern cl_mem clhAllocSplitBuffer(struct cl_helper_context *chc,
+	cl_mem_flags flags, size_t size, const void *host_ptr);
+
+/* Measures the throughput weight of each device. */
+extern int clhMeasureDeviceWeights(struct cl_helper_context *chc,
+	cl_kernel kernel);
+
+/* Launches a kernel split across all the context devices. */
+extern int clhLaunchKernelMulti(struct cl_helper_context *chc,
+	cl_kernel kernel, cl_event *event);
+
+/* Sets the program binary cache directory. */
+extern int clhSetCacheDir(struct cl_helper_context *chc, const char *dir);
+
 /* Sets the block size. */
 extern int clhSetBlockSize(struct cl_helper_context *chc, size_t x, size_t y,
 	size_t z);
@@ -100,6 +793,13 @@ extern int clhSetBlockSize(struct cl_helper_context *chc, size_t x, size_t y,
 extern int clhSetLocalSize(struct cl_helper_context *chc, size_t x, size_t y,
 	size_t z);
 
+/* Sets how the NDRange sizes are rounded. */
+extern int clhSetSizeMode(struct cl_helper_context *chc, int mode);
+
+/* Lets the runtime choose the local size. */
+extern int clhSetAutoLocalSize(struct cl_helper_context *chc,
+	int dimensions);
+
 /* Sets the grid size. */
 extern int clhSetGridSize(struct cl_helper_context *chc, size_t x, size_t y,
 	size_t z);
@@ -111,6 +811,221 @@ extern int clhSetGlobalSize(struct cl_helper_context *chc, size_t x, size_t y,
 /* Launches the kernel. */
 extern int clhLaunchKernel(struct cl_helper_context *chc);
 
+/* Launches a given kernel. */
+extern int clhLaunchKernelHandle(struct cl_helper_context *chc,
+	cl_kernel kernel);
+
+/* Creates an empty launch graph. */
+extern struct clh_graph *clhGraphCreate(void);
+
+/* Records a kernel launch into a graph. */
+extern int clhGraphAddLaunch(struct cl_helper_context *chc,
+	struct clh_graph *g, cl_kernel kernel, const struct clh_arg *args,
+	int nargs, int ndeps, const int *deps);
+
+/* Patches an argument of a recorded launch. */
+extern int clhGraphSetArg(struct clh_graph *g, int node, int idx,
+	struct clh_arg arg);
+
+/* Replays a launch graph. */
+extern int clhGraphReplay(struct cl_helper_context *chc,
+	struct clh_graph *g, cl_event *event);
+
+/* Releases a launch graph. */
+extern void clhGraphRelease(struct clh_graph *g);
+
+/* Finds and sets the best local size for a kernel. */
+extern int clhAutoTuneLocalSize(struct cl_helper_context *chc,
+	cl_kernel kernel);
+
+/* Launches a given kernel without waiting for it. */
+extern int clhLaunchKernelAsync(struct cl_helper_context *chc,
+	cl_kernel kernel, cl_uint num_wait, const cl_event *wait_list,
+	cl_event *event);
+
+/* Waits for a list of events. */
+extern int clhWaitEvents(cl_uint num, const cl_event *events);
+
+/* Waits for all the work in the context queue. */
+extern int clhFinish(struct cl_helper_context *chc);
+
+/* Gets the time spent by an event, in ms. */
+extern int clhEventTime(cl_event event, double *time_ms);
+
+/* Enables (or disables) the profiling recorder. */
+extern int clhProfilerEnable(struct cl_helper_context *chc, int capacity,
+	int sample_every);
+
+/* Drops all the profiling records. */
+extern int clhProfilerReset(struct cl_helper_context *chc);
+
+/* Exports the profiling records as Chrome trace-event JSON. */
+extern int clhProfilerExport(struct cl_helper_context *chc,
+	const char *path);
+
+/* Creates a stream. */
+extern struct clh_stream *clhStreamCreate(struct cl_helper_context *chc,
+	int flags);
+
+/* Waits for all the commands of a stream. */
+extern int clhStreamSynchronize(struct cl_helper_context *chc,
+	struct clh_stream *s);
+
+/* Releases a stream. */
+extern int clhStreamRelease(struct cl_helper_context *chc,
+	struct clh_stream *s);
+
+/* Launches a kernel in a stream. */
+extern int clhStreamLaunch(struct cl_helper_context *chc,
+	struct clh_stream *s, cl_kernel kernel, cl_uint num_wait,
+	const cl_event *wait_list, cl_event *event);
+
+/* Writes to a device buffer in a stream. */
+extern int clhStreamWrite(struct cl_helper_context *chc,
+	struct clh_stream *s, cl_mem dst, const void *src, size_t size,
+	cl_uint num_wait, const cl_event *wait_list, cl_event *event);
+
+/* Reads from a device buffer in a stream. */
+extern int clhStreamRead(struct cl_helper_context *chc,
+	struct clh_stream *s, void *dst, cl_mem src, size_t size,
+	cl_uint num_wait, const cl_event *wait_list, cl_event *event);
+
+/* Copies between device buffers in a stream. */
+extern int clhStreamCopy(struct cl_helper_context *chc,
+	struct clh_stream *s, cl_mem dst, cl_mem src, size_t size,
+	cl_uint num_wait, const cl_event *wait_list, cl_event *event);
+
+/* Records an event for the work enqueued so far in a stream. */
+extern int clhStreamRecord(struct cl_helper_context *chc,
+	struct clh_stream *s, cl_event *event);
+
+/* Makes a stream wait for events of other streams. */
+extern int clhStreamWait(struct cl_helper_context *chc,
+	struct clh_stream *s, cl_uint num, const cl_event *events);
+
+/* Allocates a buffer from the buffer pool. */
+extern cl_mem clhAllocBuffer(struct cl_helper_context *chc,
+	cl_mem_flags flags, size_t size, void *host_ptr);
+
+/* Gives a buffer back to the buffer pool. */
+extern int clhFreeBuffer(struct cl_helper_context *chc, cl_mem mem);
+
+/* Releases the free buffers kept by the pool. */
+extern int clhTrimBufferPool(struct cl_helper_context *chc);
+
+/* Gets the buffer pool statistics. */
+extern int clhBufferPoolStats(struct cl_helper_context *chc,
+	struct clh_pool_stats *stats);
+
+/* Allocates a tracked buffer, evicted to its host memory on demand. */
+extern struct clh_tracked *clhTrackedAlloc(struct cl_helper_context *chc,
+	cl_mem_flags flags, size_t size, void *host);
+
+/* Frees a tracked buffer. */
+extern int clhTrackedFree(struct cl_helper_context *chc,
+	struct clh_tracked *t);
+
+/* Makes a tracked buffer resident on a device. */
+extern int clhTrackedPrefetch(struct cl_helper_context *chc,
+	struct clh_tracked *t, int device);
+
+/* Gets the up to date host memory of a tracked buffer. */
+extern void *clhTrackedMap(struct cl_helper_context *chc,
+	struct clh_tracked *t, cl_map_flags flags);
+
+/* Sets the device memory budget of tracked buffers. */
+extern int clhSetMemoryBudget(struct cl_helper_context *chc,
+	cl_ulong bytes);
+
+/* Gets the device memory statistics. */
+extern int clhMemoryStats(struct cl_helper_context *chc, int device,
+	struct clh_mem_stats *stats);
+
+/* Allocates pinned or zero-copy host memory. */
+extern void *clhAllocHost(struct cl_helper_context *chc, size_t size);
+
+/* Frees memory allocated by clhAllocHost. */
+extern int clhFreeHost(struct cl_helper_context *chc, void *ptr);
+
+/* Gets the device buffer of a clhAllocHost allocation. */
+extern cl_mem clhHostBuffer(struct cl_helper_context *chc, void *ptr);
+
+/* Maps a buffer into the host address space. */
+extern void *clhMapBuffer(struct cl_helper_context *chc, cl_mem mem,
+	cl_map_flags flags, size_t size);
+
+/* Unmaps a buffer. */
+extern int clhUnmapBuffer(struct cl_helper_context *chc, cl_mem mem,
+	void *ptr);
+
+/* Copies data from the host to the device. */
+extern int clhWriteBuffer(struct cl_helper_context *chc, cl_mem dst,
+	const void *src, size_t size);
+
+/* Copies data from the device to the host. */
+extern int clhReadBuffer(struct cl_helper_context *chc, void *dst,
+	cl_mem src, size_t size);
+
+/* Runs a chunked, overlapped host-to-device streaming pipeline. */
+extern int clhRunPipeline(struct cl_helper_context *chc,
+	const struct clh_pipeline *p, struct clh_pipeline_stats *stats);
+
+/* Starts a launch service, one dispatcher thread per device. */
+extern struct clh_service *clhServiceStart(struct cl_helper_context *chc,
+	int capacity);
+
+/* Posts a kernel launch to a launch service, from any thread. */
+extern int clhServicePost(struct clh_service *svc,
+	const struct clh_request *req, struct clh_future **future);
+
+/* Waits for a posted request and releases its future. */
+extern int clhFutureWait(struct clh_future *f, double *time_ms);
+
+/* Gets the launch service statistics. */
+extern int clhServiceStats(struct clh_service *svc,
+	struct clh_service_stats *stats);
+
+/* Runs the pending requests and stops a launch service. */
+extern int clhServiceStop(struct clh_service *svc);
+
+/* Creates a micro-batcher for a batch-convention kernel. */
+extern struct clh_batcher *clhBatcherCreate(struct cl_helper_context *chc,
+	const struct clh_batch_config *cfg);
+
+/* Submits a request to a micro-batcher and waits for its results. */
+extern int clhBatchSubmit(struct clh_batcher *b, const void *in,
+	size_t n_in, void *out, size_t n_out);
+
+/* Gets the micro-batcher statistics. */
+extern int clhBatcherStats(struct clh_batcher *b,
+	struct clh_batch_stats *stats);
+
+/* Resets the micro-batcher statistics. */
+extern int clhBatcherResetStats(struct clh_batcher *b);
+
+/* Runs the pending requests and releases a micro-batcher. */
+extern int clhBatcherRelease(struct clh_batcher *b);
+
+/* Matrix multiplication, C = A * B. */
+extern int clhGemm(struct cl_helper_context *chc, int type, int m, int n,
+	int k, cl_mem a, cl_mem b, cl_mem c);
+
+/* Reduces a device buffer (sum, min, max, argmax). */
+extern int clhReduce(struct cl_helper_context *chc, int type, int op,
+	cl_mem in, size_t n, void *value, cl_ulong *index);
+
+/* Exclusive prefix sum of a device buffer. */
+extern int clhScan(struct cl_helper_context *chc, int type, cl_mem in,
+	cl_mem out, size_t n);
+
+/* Reduces a host array of any size, in chunks. */
+extern int clhReduceHost(struct cl_helper_context *chc, int type, int op,
+	const void *in, size_t n, void *value, cl_ulong *index);
+
+/* Exclusive prefix sum of a host array of any size, in chunks. */
+extern int clhScanHost(struct cl_helper_context *chc, int type,
+	const void *in, void *out, size_t n);
+
 /* Releases the context. */
 extern int clhReleaseContext(struct cl_helper_context *chc);
 
@@ -0,0 +1,275 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018 Davidson Francis <davidsondfgl@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * batch.c
+ * N threads send many tiny requests (a few hundred elements each) for
+ * the same kernel, first one launch per request through a shared
+ * context guarded by a mutex, then through a micro-batcher with
+ * several latency budgets. Reports throughput, latency percentiles and
+ * the batch sizes reached.
+ *
+ * Usage: ./batch [-t threads] [-r requests per thread]
+ *                [-s elements per request] [-w max wait, ms]
+ *                [-b max batch]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <clHelper.h>
+
+/* Work-group size. */
+#define BLOCK 64
+
+/* Producer thread. */
+struct producer
+{
+	pthread_t thread;
+	float *in;           /* Request input.     */
+	float *out;          /* Request output.    */
+	double *lat;         /* Latencies, in us.  */
+	int failed;
+};
+
+static struct cl_helper_context chc;
+static struct clh_batcher *batcher;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static cl_mem d_in, d_out;
+static int requests;
+static size_t size;
+
+/* Current time, in us. */
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e6 + ts.tv_nsec / 1e3);
+}
+
+/* Checks a request output. */
+static int check(const struct producer *p)
+{
+	for (size_t i = 0; i < size; i++)
+		if (p->out[i] != p->in[i] * 2.0f)
+			return (1);
+	return (0);
+}
+
+/* Baseline: one launch per request, under the context lock. */
+static void *singleLoop(void *arg)
+{
+	struct producer *p = arg;
+	double t0;
+	int ret;
+
+	for (int i = 0; i < requests; i++)
+	{
+		t0 = now();
+		pthread_mutex_lock(&lock);
+		ret  = clhWriteBuffer(&chc, d_in, p->in, sizeof(float) * size);
+		ret |= clhLaunchKernel(&chc);
+		ret |= clhReadBuffer(&chc, p->out, d_out, sizeof(float) * size);
+		pthread_mutex_unlock(&lock);
+		p->lat[i] = now() - t0;
+		if (ret != CLH_OK || check(p))
+			p->failed = 1;
+	}
+	return (NULL);
+}
+
+/* Micro-batcher: submit and wait, no lock. */
+static void *batchLoop(void *arg)
+{
+	struct producer *p = arg;
+	double t0;
+
+	for (int i = 0; i < requests; i++)
+	{
+		t0 = now();
+		if (clhBatchSubmit(batcher, p->in, size, p->out, size) != CLH_OK ||
+			check(p))
+		{
+			p->failed = 1;
+		}
+		p->lat[i] = now() - t0;
+	}
+	return (NULL);
+}
+
+static int cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return ((x > y) - (x < y));
+}
+
+/* Runs the producers and prints the results. */
+static int run(const char *name, struct producer *p, int threads,
+	void *(*loop)(void *))
+{
+	struct clh_batch_stats stats;
+	double t0, total, *all;
+	int failed;
+	size_t n;
+
+	t0 = now();
+	for (int i = 0; i < threads; i++)
+		pthread_create(&p[i].thread, NULL, loop, &p[i]);
+	for (int i = 0; i < threads; i++)
+		pthread_join(p[i].thread, NULL);
+	total = now() - t0;
+
+	failed = 0;
+	n = (size_t)threads * requests;
+	all = malloc(sizeof(double) * n);
+	for (int i = 0; i < threads; i++)
+	{
+		failed |= p[i].failed;
+		memcpy(all + (size_t)i * requests, p[i].lat, sizeof(double) * requests);
+	}
+	qsort(all, n, sizeof(double), cmp);
+
+	printf("%-10s %10.0f req/s   p50 %8.1f us   p99 %8.1f us", name,
+		n / (total / 1e6), all[n / 2], all[n * 99 / 100]);
+	if (batcher)
+	{
+		clhBatcherStats(batcher, &stats);
+		printf("   %6.1f req/launch, %3.0f%% full", stats.avg_batch,
+			100.0 * stats.full / stats.batches);
+	}
+	printf("%s\n", failed ? "   FAILED" : "");
+	free(all);
+	return (failed);
+}
+
+int main(int argc, char **argv)
+{
+	static const double waits[] = {0, 0.1, 0.5, 2};
+	struct clh_batch_config cfg;
+	struct producer *p;
+	cl_kernel k_batch;
+	double max_wait;
+	int max_batch;
+	int threads;
+	int failed;
+	char name[32];
+	int opt;
+
+	threads = 16;
+	requests = 1000;
+	size = 256;
+	max_wait = -1;
+	max_batch = 64;
+	while ((opt = getopt(argc, argv, "t:r:s:w:b:")) != -1)
+	{
+		switch (opt)
+		{
+			case 't': threads = atoi(optarg); break;
+			case 'r': requests = atoi(optarg); break;
+			case 's': size = strtoull(optarg, NULL, 10); break;
+			case 'w': max_wait = atof(optarg); break;
+			case 'b': max_batch = atoi(optarg); break;
+			default:
+				fprintf(stderr, "Usage: %s [-t threads] [-r requests] [-s size] "
+					"[-w max wait ms] [-b max batch]\n", argv[0]);
+				return (1);
+		}
+	}
+	if (threads < 1 || requests < 1 || !size || max_batch < 1)
+		return (1);
+
+	if (clhStartContext(&chc) != CLH_OK)
+		return (1);
+	if (clhLoadKernel(&chc, "batch_kernel.cl", "scale") != CLH_OK)
+		return (1);
+	if ((k_batch = clhGetKernel(&chc, "scale_batch")) == NULL)
+		return (1);
+
+	/* Baseline launch. */
+	d_in  = clhAllocBuffer(&chc, CL_MEM_READ_ONLY, sizeof(float) * size, NULL);
+	d_out = clhAllocBuffer(&chc, CL_MEM_WRITE_ONLY, sizeof(float) * size, NULL);
+	if (!d_in || !d_out)
+		return (1);
+	clhSetBlockSize(&chc, BLOCK, 0, 0);
+	clhSetGlobalSize(&chc, size, 0, 0);
+	clhSetArgs(&chc, CLH_BUF(d_in), CLH_BUF(d_out), CLH_UINT(size),
+		CLH_FLOAT(2.0f));
+
+	p = calloc(threads, sizeof(*p));
+	for (int i = 0; i < threads; i++)
+	{
+		p[i].in  = malloc(sizeof(float) * size);
+		p[i].out = malloc(sizeof(float) * size);
+		p[i].lat = malloc(sizeof(double) * requests);
+		if (!p[i].in || !p[i].out || !p[i].lat)
+			return (1);
+		for (size_t j = 0; j < size; j++)
+			p[i].in[j] = (float)(i + j);
+	}
+
+	printf("%s, %d threads x %d requests, %zu elements\n", chc.device.name,
+		threads, requests, size);
+
+	failed = run("single", p, threads, singleLoop);
+
+	/* One batcher per latency budget. */
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.kernel = k_batch;
+	cfg.in_elem_size  = sizeof(float);
+	cfg.out_elem_size = sizeof(float);
+	cfg.max_batch  = max_batch;
+	cfg.local_size = BLOCK;
+	cfg.args  = (struct clh_arg[]){CLH_FLOAT(2.0f)};
+	cfg.nargs = 1;
+
+	for (int i = 0; i < 4; i++)
+	{
+		cfg.max_wait_ms = max_wait >= 0 ? max_wait : waits[i];
+		if ((batcher = clhBatcherCreate(&chc, &cfg)) == NULL)
+			return (1);
+		snprintf(name, sizeof(name), "wait %.1fms", cfg.max_wait_ms);
+		failed |= run(name, p, threads, batchLoop);
+		clhBatcherRelease(batcher);
+		batcher = NULL;
+		if (max_wait >= 0)
+			break;
+	}
+
+	for (int i = 0; i < threads; i++)
+	{
+		free(p[i].in);
+		free(p[i].out);
+		free(p[i].lat);
+	}
+	free(p);
+	clhFreeBuffer(&chc, d_in);
+	clhFreeBuffer(&chc, d_out);
+	clhReleaseContext(&chc);
+	return (failed);
+}
@@ -0,0 +1,73 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018 Davidson Francis <davidsondfgl@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* 
+ * batch_kernel.cl 
+ * y = x * factor, as a plain kernel (one request per launch) and as a
+ * batch-convention kernel (many requests per launch).
+ * Device code.
+ */
+
+/* One request. */
+__kernel void
+scale(__global const float* in,
+      __global float* out,
+      uint count,
+      float factor)
+{
+	uint i = get_global_id(0);
+
+	if (i < count)
+		out[i] = in[i] * factor;
+}
+
+/* Many requests, packed, see clhBatcherCreate. */
+__kernel void
+scale_batch(__global const float* in,
+            __global const uint* in_offs,
+            __global float* out,
+            __global const uint* out_offs,
+            uint num_items,
+            float factor)
+{
+	uint i = get_global_id(0);
+	uint lo, hi, mid;
+
+	if (i >= in_offs[num_items])
+		return;
+
+	/* Request of the element. */
+	lo = 0;
+	hi = num_items;
+	while (hi - lo > 1)
+	{
+		mid = (lo + hi) / 2;
+		if (in_offs[mid] <= i)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	out[out_offs[lo] + (i - in_offs[lo])] = in[i] * factor;
+}
@@ -0,0 +1,535 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018 Davidson Francis <davidsondfgl@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * bench.c
+ * Kernel benchmark harness: runs a kernel with warm-up and measured
+ * iterations and reports the kernel and end-to-end time statistics,
+ * as CSV or JSON.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <clHelper.h>
+
+#define MAX_ARGS  32
+#define MAX_SIZES 32
+
+/* Argument spec. */
+struct arg_spec
+{
+	const char *type;  /* buf, int, uint, long, ulong, float, double, local. */
+	const char *elem;  /* Buffer element type. */
+	const char *value; /* Value, buffer count or local bytes. */
+};
+
+/* Statistics, in ms. */
+struct stats
+{
+	double min, median, p95, p99, mean, stddev;
+};
+
+/* Benchmark sizes. */
+static size_t sizes[MAX_SIZES][3];
+static int size_dims[MAX_SIZES];
+static int num_sizes;
+
+/* Wall time, in ms. */
+static double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0);
+}
+
+/*
+ * Evaluates a size term: an optional number followed by any number of
+ * N (total work items), X, Y and Z (global size of each dimension)
+ * factors, e.g: 1024, 2N, 2XXX.
+ */
+static double eval(const char *term, const size_t *global, int *ok)
+{
+	double value;
+	char *end;
+
+	value = strtod(term, &end);
+	if (end == term)
+		value = 1;
+
+	for (; *end; end++)
+	{
+		switch (toupper(*end))
+		{
+			case 'N':
+				value *= global[0] * global[1] * global[2];
+				break;
+			case 'X':
+				value *= global[0];
+				break;
+			case 'Y':
+				value *= global[1];
+				break;
+			case 'Z':
+				value *= global[2];
+				break;
+			default:
+				*ok = 0;
+				return (0);
+		}
+	}
+	return (value);
+}
+
+/* Parses a size list: X[,Y[,Z]]. */
+static int parse_size(const char *str, size_t *size)
+{
+	char *end;
+
+	size[0] = size[1] = size[2] = 1;
+	for (int i = 0; i < 3; i++)
+	{
+		size[i] = strtoul(str, &end, 10);
+		if (end == str || !size[i])
+			return (-1);
+		if (*end != ',')
+			return (*end ? -1 : i + 1);
+		str = end + 1;
+	}
+	return (-1);
+}
+
+/* Element size of a buffer type. */
+static size_t elem_size(const char *type)
+{
+	if (!strcmp(type, "char") || !strcmp(type, "uchar"))
+		return (1);
+	if (!strcmp(type, "short") || !strcmp(type, "ushort"))
+		return (2);
+	if (!strcmp(type, "int") || !strcmp(type, "uint") ||
+		!strcmp(type, "float"))
+		return (4);
+	if (!strcmp(type, "long") || !strcmp(type, "ulong") ||
+		!strcmp(type, "double"))
+		return (8);
+	return (0);
+}
+
+/* Fills a host buffer with ones of the given type. */
+static void fill_ones(void *buf, const char *type, size_t count)
+{
+	size_t size = elem_size(type);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (!strcmp(type, "float"))
+			((float *)buf)[i] = 1.0f;
+		else if (!strcmp(type, "double"))
+			((double *)buf)[i] = 1.0;
+		else
+		{
+			memset((char *)buf + i * size, 0, size);
+			((char *)buf)[i * size] = 1; /* Little endian. */
+		}
+	}
+}
+
+/* Creates the kernel arguments for a given size. */
+static int make_args(struct cl_helper_context *chc, struct arg_spec *spec,
+	int nspec, const size_t *global, struct clh_arg *args, size_t *bytes)
+{
+	double value;
+	size_t count;
+	void *host;
+	int ok = 1;
+
+	*bytes = 0;
+	for (int i = 0; i < nspec; i++)
+	{
+		value = eval(spec[i].value, global, &ok);
+		if (!ok)
+		{
+			fprintf(stderr, "bench: invalid value: %s\n", spec[i].value);
+			return (-1);
+		}
+
+		if (!strcmp(spec[i].type, "buf"))
+		{
+			count = (size_t)value;
+			host  = malloc(count * elem_size(spec[i].elem));
+			if (!host)
+				return (-1);
+
+			fill_ones(host, spec[i].elem, count);
+			args[i] = CLH_BUF(clhAllocBuffer(chc, CL_MEM_READ_WRITE |
+				CL_MEM_COPY_HOST_PTR, count * elem_size(spec[i].elem), host));
+			free(host);
+
+			if (!args[i].v.mem)
+				return (-1);
+			*bytes += count * elem_size(spec[i].elem);
+		}
+		else if (!strcmp(spec[i].type, "int"))
+			args[i] = CLH_INT((cl_int)value);
+		else if (!strcmp(spec[i].type, "uint"))
+			args[i] = CLH_UINT((cl_uint)value);
+		else if (!strcmp(spec[i].type, "long"))
+			args[i] = CLH_LONG((cl_long)value);
+		else if (!strcmp(spec[i].type, "ulong"))
+			args[i] = CLH_ULONG((cl_ulong)value);
+		else if (!strcmp(spec[i].type, "float"))
+			args[i] = CLH_FLOAT((cl_float)value);
+		else if (!strcmp(spec[i].type, "double"))
+			args[i] = CLH_DOUBLE((cl_double)value);
+		else
+			args[i] = CLH_LOCAL((size_t)value);
+	}
+	return (0);
+}
+
+/* Releases the buffers of the kernel arguments. */
+static void free_args(struct cl_helper_context *chc, struct clh_arg *args,
+	int nargs)
+{
+	for (int i = 0; i < nargs; i++)
+		if (args[i].type == CLH_ARG_BUF && args[i].v.mem)
+			clhFreeBuffer(chc, args[i].v.mem);
+}
+
+/* Sort helper. */
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return ((x > y) - (x < y));
+}
+
+/* Nearest-rank percentile of a sorted array. */
+static double percentile(const double *v, int n, double p)
+{
+	int idx = (int)ceil(p * n) - 1;
+	return (v[idx < 0 ? 0 : idx]);
+}
+
+/* Computes the statistics of a sample (sorts it). */
+static void compute_stats(double *v, int n, struct stats *st)
+{
+	double sum, sq;
+
+	qsort(v, n, sizeof(double), cmp_double);
+	sum = 0;
+	for (int i = 0; i < n; i++)
+		sum += v[i];
+
+	st->min    = v[0];
+	st->median = (n & 1) ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+	st->p95    = percentile(v, n, 0.95);
+	st->p99    = percentile(v, n, 0.99);
+	st->mean   = sum / n;
+
+	sq = 0;
+	for (int i = 0; i < n; i++)
+		sq += (v[i] - st->mean) * (v[i] - st->mean);
+	st->stddev = (n > 1) ? sqrt(sq / (n - 1)) : 0;
+}
+
+/* Prints a set of statistics. */
+static void print_stats(const char *prefix, const struct stats *st, int json)
+{
+	if (json)
+	{
+		printf(",\n    \"%s\": {\"min\": %.6f, \"median\": %.6f, \"p95\": %.6f, "
+			"\"p99\": %.6f, \"mean\": %.6f, \"stddev\": %.6f}", prefix, st->min,
+			st->median, st->p95, st->p99, st->mean, st->stddev);
+	}
+	else
+	{
+		printf(",%.6f,%.6f,%.6f,%.6f,%.6f,%.6f", st->min, st->median, st->p95,
+			st->p99, st->mean, st->stddev);
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] <kernel.cl> <kernel name> [arg spec...]\n"
+		"Options:\n"
+		"  -g X[,Y[,Z]]  Global size, may be repeated to sweep sizes\n"
+		"  -l X[,Y[,Z]]  Local size (default: auto)\n"
+		"  -w <n>        Warm-up iterations (default: 5)\n"
+		"  -n <n>        Measured iterations (default: 50)\n"
+		"  -f <term>     Floating point operations per launch\n"
+		"  -b <term>     Bytes moved per launch (default: buffer sizes)\n"
+		"  -j            JSON output (default: CSV)\n"
+		"Argument specs:\n"
+		"  buf:<type>[:<count>]   Buffer of <count> elements (default: N)\n"
+		"  int|uint|long|ulong|float|double:<value>\n"
+		"  local:<bytes>          Local memory\n"
+		"Terms: a number optionally followed by N (work items), X, Y and Z\n"
+		"(global size of each dimension), e.g: 2N, 2XXX, X.\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct arg_spec spec[MAX_ARGS];
+	struct clh_arg args[MAX_ARGS];
+	struct cl_helper_context chc;
+	struct stats st_kern, st_e2e;
+	const char *flops, *bytes;
+	double *t_kern, *t_e2e;
+	char driver[128];
+	size_t local[3];
+	size_t moved;
+	int warmup, iters, json;
+	int nspec, dims, ldims;
+	double start, v;
+	char *tok, *save;
+	int ok, opt;
+
+	warmup = 5;
+	iters  = 50;
+	json   = 0;
+	ldims  = 0;
+	flops  = NULL;
+	bytes  = NULL;
+	num_sizes = 0;
+
+	/* Options. */
+	for (opt = 1; opt < argc && argv[opt][0] == '-'; opt++)
+	{
+		char o = argv[opt][1];
+		if (o == 'j')
+		{
+			json = 1;
+			continue;
+		}
+		if (opt + 1 >= argc)
+		{
+			usage(argv[0]);
+			return (1);
+		}
+
+		switch (o)
+		{
+			case 'g':
+				if (num_sizes == MAX_SIZES ||
+					(size_dims[num_sizes] = parse_size(argv[++opt],
+					sizes[num_sizes])) < 0)
+				{
+					usage(argv[0]);
+					return (1);
+				}
+				num_sizes++;
+				break;
+			case 'l':
+				if ((ldims = parse_size(argv[++opt], local)) < 0)
+				{
+					usage(argv[0]);
+					return (1);
+				}
+				break;
+			case 'w':
+				warmup = atoi(argv[++opt]);
+				break;
+			case 'n':
+				iters = atoi(argv[++opt]);
+				break;
+			case 'f':
+				flops = argv[++opt];
+				break;
+			case 'b':
+				bytes = argv[++opt];
+				break;
+			default:
+				usage(argv[0]);
+				return (1);
+		}
+	}
+
+	if (argc - opt < 2 || argc - opt - 2 > MAX_ARGS || iters <= 0 ||
+		warmup < 0 || !num_sizes)
+	{
+		usage(argv[0]);
+		return (1);
+	}
+
+	/* Argument specs. */
+	nspec = 0;
+	for (int i = opt + 2; i < argc; i++, nspec++)
+	{
+		spec[nspec].type  = strtok_r(argv[i], ":", &save);
+		spec[nspec].elem  = NULL;
+		spec[nspec].value = "N";
+
+		if (!strcmp(spec[nspec].type, "buf"))
+		{
+			spec[nspec].elem = strtok_r(NULL, ":", &save);
+			if (!spec[nspec].elem || !elem_size(spec[nspec].elem))
+			{
+				usage(argv[0]);
+				return (1);
+			}
+			if ((tok = strtok_r(NULL, ":", &save)) != NULL)
+				spec[nspec].value = tok;
+		}
+		else if ((tok = strtok_r(NULL, ":", &save)) != NULL)
+			spec[nspec].value = tok;
+		else
+		{
+			usage(argv[0]);
+			return (1);
+		}
+	}
+
+	/* Start context and load the kernel. */
+	if (clhStartContext(&chc) != CLH_OK)
+		return (1);
+	if (clhLoadKernel(&chc, argv[opt], argv[opt + 1]) != CLH_OK)
+		return (1);
+
+	clGetDeviceInfo(chc.device.id, CL_DRIVER_VERSION, sizeof(driver), driver,
+		NULL);
+
+	t_kern = malloc(iters * sizeof(double));
+	t_e2e  = malloc(iters * sizeof(double));
+	if (!t_kern || !t_e2e)
+		return (1);
+
+	clhSetSizeMode(&chc, CLH_SIZE_EXACT);
+
+	if (json)
+		printf("[");
+	else
+	{
+		printf("kernel,device,driver,global,local,iterations");
+		printf(",kern_min_ms,kern_median_ms,kern_p95_ms,kern_p99_ms,"
+			"kern_mean_ms,kern_stddev_ms");
+		printf(",e2e_min_ms,e2e_median_ms,e2e_p95_ms,e2e_p99_ms,"
+			"e2e_mean_ms,e2e_stddev_ms");
+		printf(",gflops,gbs\n");
+	}
+
+	for (int s = 0; s < num_sizes; s++)
+	{
+		size_t *global = sizes[s];
+		dims = size_dims[s];
+
+		/* Sizes and arguments. */
+		if (ldims)
+		{
+			clhSetBlockSize(&chc, local[0], ldims > 1 ? local[1] : 0,
+				ldims > 2 ? local[2] : 0);
+		}
+		else
+			clhSetAutoLocalSize(&chc, dims);
+
+		if (clhSetGlobalSize(&chc, global[0], dims > 1 ? global[1] : 0,
+			dims > 2 ? global[2] : 0) != CLH_OK)
+		{
+			return (1);
+		}
+
+		if (make_args(&chc, spec, nspec, global, args, &moved) < 0 ||
+			clhSetKernelArgs(&chc, chc.kernel, args, nspec) != CLH_OK)
+		{
+			return (1);
+		}
+
+		/* Warm-up. */
+		for (int i = 0; i < warmup; i++)
+			clhLaunchKernel(&chc);
+
+		/* Measured iterations. */
+		for (int i = 0; i < iters; i++)
+		{
+			start = now_ms();
+			if (clhLaunchKernel(&chc) != CLH_OK)
+				return (1);
+			t_e2e[i]  = now_ms() - start;
+			t_kern[i] = chc.time_ms;
+		}
+
+		compute_stats(t_kern, iters, &st_kern);
+		compute_stats(t_e2e, iters, &st_e2e);
+
+		/* Report. */
+		if (json)
+		{
+			printf("%s\n  {\n    \"kernel\": \"%s\", \"device\": \"%s\", "
+				"\"driver\": \"%s\",\n    \"global\": [%zu, %zu, %zu], "
+				"\"local\": [%zu, %zu, %zu], \"iterations\": %d",
+				s ? "," : "", argv[opt + 1], chc.device.name, driver, global[0],
+				global[1], global[2], ldims ? local[0] : 0,
+				ldims ? local[1] : 0, ldims ? local[2] : 0, iters);
+		}
+		else
+		{
+			printf("%s,\"%s\",\"%s\",%zux%zux%zu,", argv[opt + 1],
+				chc.device.name, driver, global[0], global[1], global[2]);
+			if (ldims)
+				printf("%zux%zux%zu", local[0], local[1], local[2]);
+			else
+				printf("auto");
+			printf(",%d", iters);
+		}
+
+		print_stats("kernel_ms", &st_kern, json);
+		print_stats("e2e_ms", &st_e2e, json);
+
+		/* Derived throughput, from the median kernel time. */
+		ok = 1;
+		v  = flops ? eval(flops, global, &ok) / 1e9 /
+			(st_kern.median / 1000.0) : 0;
+		if (json)
+			printf(",\n    \"gflops\": %.3f", ok && flops ? v : 0);
+		else if (ok && flops)
+			printf(",%.3f", v);
+		else
+			printf(",");
+
+		ok = 1;
+		v  = (bytes ? eval(bytes, global, &ok) : moved) / 1e9 /
+			(st_kern.median / 1000.0);
+		if (json)
+			printf(", \"gbs\": %.3f\n  }", ok ? v : 0);
+		else
+			printf(",%.3f\n", ok ? v : 0);
+
+		free_args(&chc, args, nspec);
+	}
+
+	if (json)
+		printf("\n]\n");
+
+	/* Release. */
+	free(t_kern);
+	free(t_e2e);
+	clhReleaseContext(&chc);
+	return (0);
+}
@@ -0,0 +1,162 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018 Davidson Francis <davidsondfgl@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <clHelper.h>
+
+#define BLOCK 256
+
+/*
+ * Host versions of the kernels in fallback.cl, used when there is no
+ * device. Each call runs one work-group.
+ */
+static void saxpy(const struct clh_group *g, void **args)
+{
+	float *y = args[0];
+	const float *x = args[1];
+	float a = *(cl_float *)args[2];
+	size_t n = *(cl_int *)args[3];
+
+	for (size_t i = g->offset[0]; i < g->offset[0] + g->local_size[0]; i++)
+		if (i < n)
+			y[i] = a * x[i] + y[i];
+}
+
+static void blockSum(const struct clh_group *g, void **args)
+{
+	const float *in = args[0];
+	float *out = args[1];
+	float *tmp = args[2];
+	size_t n = *(cl_int *)args[3];
+
+	/* Same steps as the device: load into local memory, then reduce. */
+	for (size_t l = 0; l < g->local_size[0]; l++)
+		tmp[l] = (g->offset[0] + l < n) ? in[g->offset[0] + l] : 0.0f;
+
+	for (size_t s = 1; s < g->local_size[0]; s++)
+		tmp[0] += tmp[s];
+
+	out[g->group_id[0]] = tmp[0];
+}
+
+int main(int argc, char **argv)
+{
+	struct cl_helper_context chc;
+	struct clh_device_filter filter;
+	float *h_x, *h_y, *h_sums;
+	cl_mem d_x, d_y, d_sums;
+	cl_kernel k_saxpy, k_sum;
+	double sum, expected;
+	int n, groups, errors;
+
+	n = (argc > 1) ? atoi(argv[1]) : 16 * 1024 * 1024 + 7;
+	if (n <= 0)
+		return (1);
+	groups = (n + BLOCK - 1) / BLOCK;
+
+	/* Native kernels first, the context may need them. */
+	clhRegisterNative("saxpy", saxpy);
+	clhRegisterNative("blockSum", blockSum);
+
+	/* Any GPU, or the host if there is none (CLH_DEVICE=host forces it). */
+	memset(&filter, 0, sizeof(filter));
+	filter.type = CL_DEVICE_TYPE_GPU;
+	filter.fallback = CLH_FALLBACK_AUTO;
+	if (clhStartContextEx(&chc, &filter) != CLH_OK)
+		return (1);
+
+	printf("Running on: %s%s\n", chc.device.name,
+		chc.fallback ? " (native kernels)" : "");
+
+	if (clhLoadProgram(&chc, "fallback.cl") != CLH_OK)
+		return (1);
+	k_saxpy = clhGetKernel(&chc, "saxpy");
+	k_sum   = clhGetKernel(&chc, "blockSum");
+	if (!k_saxpy || !k_sum)
+		return (1);
+
+	h_x = malloc(sizeof(float) * n);
+	h_y = malloc(sizeof(float) * n);
+	h_sums = malloc(sizeof(float) * groups);
+	for (int i = 0; i < n; i++)
+	{
+		h_x[i] = (float)(i % 100);
+		h_y[i] = 1.0f;
+	}
+
+	d_x = clhAllocBuffer(&chc, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		sizeof(float) * n, h_x);
+	d_y = clhAllocBuffer(&chc, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+		sizeof(float) * n, h_y);
+	d_sums = clhAllocBuffer(&chc, CL_MEM_WRITE_ONLY, sizeof(float) * groups,
+		NULL);
+
+	/* Same launch API on both paths. */
+	clhSetSizeMode(&chc, CLH_SIZE_EXACT);
+	clhSetBlockSize(&chc, BLOCK, 0, 0);
+	clhSetGlobalSize(&chc, n, 0, 0);
+
+	clhSetArgsFor(&chc, k_saxpy, CLH_BUF(d_y), CLH_BUF(d_x), CLH_FLOAT(2.0f),
+		CLH_INT(n));
+	if (clhLaunchKernelHandle(&chc, k_saxpy) != CLH_OK)
+		return (1);
+	printf("saxpy:    %8.3f ms\n", chc.time_ms);
+
+	clhSetArgsFor(&chc, k_sum, CLH_BUF(d_y), CLH_BUF(d_sums),
+		CLH_LOCAL(sizeof(float) * BLOCK), CLH_INT(n));
+	if (clhLaunchKernelHandle(&chc, k_sum) != CLH_OK)
+		return (1);
+	printf("blockSum: %8.3f ms\n", chc.time_ms);
+
+	clhReadBuffer(&chc, h_y, d_y, sizeof(float) * n);
+	clhReadBuffer(&chc, h_sums, d_sums, sizeof(float) * groups);
+
+	/* Check. */
+	errors = 0;
+	sum = 0;
+	for (int i = 0; i < n; i++)
+		if (h_y[i] != 2.0f * (i % 100) + 1.0f)
+			errors++;
+	for (int i = 0; i < groups; i++)
+		sum += h_sums[i];
+
+	expected = 0;
+	for (int i = 0; i < n; i++)
+		expected += 2.0 * (i % 100) + 1.0;
+
+	printf("saxpy %s, sum %s\n", errors ? "FAILED" : "ok",
+		fabs(sum - expected) <= 1e-5 * expected ? "ok" : "FAILED");
+
+	clhFreeBuffer(&chc, d_x);
+	clhFreeBuffer(&chc, d_y);
+	clhFreeBuffer(&chc, d_sums);
+	free(h_x);
+	free(h_y);
+	free(h_sums);
+	clhReleaseContext(&chc);
+	return (errors != 0);
+}
@@ -0,0 +1,27 @@
+__kernel void saxpy(__global float *y, __global const float *x, float a,
+	int n)
+{
+	int i = get_global_id(0);
+	if (i < n)
+		y[i] = a * x[i] + y[i];
+}
+
+__kernel void blockSum(__global const float *in, __global float *out,
+	__local float *tmp, int n)
+{
+	int i = get_global_id(0);
+	int l = get_local_id(0);
+
+	tmp[l] = (i < n) ? in[i] : 0.0f;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int s = get_local_size(0) / 2; s > 0; s >>= 1)
+	{
+		if (l < s)
+			tmp[l] += tmp[l + s];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (l == 0)
+		out[get_group_id(0)] = tmp[0];
+}
@@ -0,0 +1,156 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018 Davidson Francis <davidsondfgl@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * gemm.c
+ * Tiled matrix multiplication (clhGemm), in float and double, checked
+ * against a CPU reference and compared with the naive kernel from
+ * example/matrix.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <clHelper.h>
+
+/* Max relative error between the device result and a CPU reference. */
+static double check(const double *a, const double *b, const void *c,
+	int is_float, int n)
+{
+	double err, ref, val;
+
+	err = 0;
+	for (int i = 0; i < n; i++)
+	{
+		for (int j = 0; j < n; j++)
+		{
+			ref = 0;
+			for (int k = 0; k < n; k++)
+				ref += a[i * n + k] * b[k * n + j];
+
+			val = is_float ? ((const float *)c)[i * n + j] :
+				((const double *)c)[i * n + j];
+			if (fabs(val - ref) / (fabs(ref) + 1) > err)
+				err = fabs(val - ref) / (fabs(ref) + 1);
+		}
+	}
+	return (err);
+}
+
+int main(int argc, char **argv)
+{
+	struct cl_helper_context chc;
+	double *h_A, *h_B, *h_C;
+	float *f_A, *f_B, *f_C;
+	cl_mem d_A, d_B, d_C;
+	double flop;
+	size_t size;
+	int width;
+
+	/* Non multiples of the tile size work too, e.g: 1000. */
+	width = (argc > 1) ? atoi(argv[1]) : 1024;
+	size  = (size_t)width * width;
+	flop  = 2.0 * width * width * width;
+
+	h_A = malloc(size * sizeof(double));
+	h_B = malloc(size * sizeof(double));
+	h_C = malloc(size * sizeof(double));
+	f_A = malloc(size * sizeof(float));
+	f_B = malloc(size * sizeof(float));
+	f_C = malloc(size * sizeof(float));
+
+	for (size_t i = 0; i < size; i++)
+	{
+		h_A[i] = f_A[i] = (float)(rand() % 100) / 100.0f;
+		h_B[i] = f_B[i] = (float)(rand() % 100) / 100.0f;
+	}
+
+	if (clhStartContext(&chc) != CLH_OK)
+		return (1);
+
+	/* Naive kernel (double). */
+	d_A = clhAllocBuffer(&chc, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		size * sizeof(double), h_A);
+	d_B = clhAllocBuffer(&chc, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		size * sizeof(double), h_B);
+	d_C = clhAllocBuffer(&chc, CL_MEM_READ_WRITE, size * sizeof(double), NULL);
+
+	if (clhLoadKernel(&chc, "../matrix/matrixmul_kernel.cl",
+		"matrixMul") != CLH_OK)
+	{
+		return (1);
+	}
+	clhSetArgs(&chc, CLH_BUF(d_C), CLH_BUF(d_A), CLH_BUF(d_B), CLH_INT(width));
+	clhSetSizeMode(&chc, CLH_SIZE_EXACT);
+	clhSetBlockSize(&chc, 16, 16, 0);
+	clhSetGlobalSize(&chc, width, width, 0);
+	clhLaunchKernel(&chc);
+	printf("naive  (double): %10.4f ms, %8.2f GFLOP/s\n", chc.time_ms,
+		flop / (chc.time_ms * 1e6));
+
+	/* Tiled kernel (double). */
+	if (clhGemm(&chc, CLH_ARG_DOUBLE, width, width, width, d_A, d_B, d_C) ==
+		CLH_OK)
+	{
+		clhReadBuffer(&chc, h_C, d_C, size * sizeof(double));
+		printf("tiled  (double): %10.4f ms, %8.2f GFLOP/s, max error %g "
+			"(tile %d, %dx%d per work-item)\n", chc.time_ms,
+			flop / (chc.time_ms * 1e6), check(h_A, h_B, h_C, 0, width),
+			chc.gemm[1].ts, chc.gemm[1].wpt, chc.gemm[1].wpt);
+	}
+
+	clhFreeBuffer(&chc, d_A);
+	clhFreeBuffer(&chc, d_B);
+	clhFreeBuffer(&chc, d_C);
+
+	/* Tiled kernel (float). */
+	d_A = clhAllocBuffer(&chc, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		size * sizeof(float), f_A);
+	d_B = clhAllocBuffer(&chc, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		size * sizeof(float), f_B);
+	d_C = clhAllocBuffer(&chc, CL_MEM_READ_WRITE, size * sizeof(float), NULL);
+
+	if (clhGemm(&chc, CLH_ARG_FLOAT, width, width, width, d_A, d_B, d_C) ==
+		CLH_OK)
+	{
+		clhReadBuffer(&chc, f_C, d_C, size * sizeof(float));
+		printf("tiled  (float):  %10.4f ms, %8.2f GFLOP/s, max error %g "
+			"(tile %d, %dx%d per work-item)\n", chc.time_ms,
+			flop / (chc.time_ms * 1e6), check(h_A, h_B, f_C, 1, width),
+			chc.gemm[0].ts, chc.gemm[0].wpt, chc.gemm[0].wpt);
+	}
+
+	clhFreeBuffer(&chc, d_A);
+	clhFreeBuffer(&chc, d_B);
+	clhFreeBuffer(&chc, d_C);
+
+	free(h_A);
+	free(h_B);
+	free(h_C);
+	free(f_A);
+	free(f_B);
+	free(f_C);
+	clhReleaseContext(&chc);
+	return (0);
+}
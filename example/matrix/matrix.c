@@ -26,10 +26,30 @@
 #include <stdlib.h>
 #include <clHelper.h>
 
-int main()
+/* Launches the kernel with a given size mode, returns the time spent. */
+static double launch(struct cl_helper_context *chc, int mode, int width)
+{
+	/* Block and global size. */
+	clhSetSizeMode(chc, mode);
+	clhSetBlockSize(chc, 32, 32, 0);
+	clhSetGlobalSize(chc, width, width, 0);
+
+	/* Launch kernel. */
+	clhLaunchKernel(chc);
+
+	printf("%-6s global (%zu, %zu): %10.4f ms, %7.2f GFLOP/s\n",
+		mode == CLH_SIZE_POW2 ? "pow2" : mode == CLH_SIZE_EXACT ? "exact" :
+		"split", chc->globalWorkSize[0], chc->globalWorkSize[1], chc->time_ms,
+		(2.0 * width * width * width) / (chc->time_ms * 1e6));
+
+	return (chc->time_ms);
+}
+
+int main(int argc, char **argv)
 {
 	int err;
-	int width, size;
+	int width;
+	size_t size;
 	struct cl_helper_context chc;
 
 	/* OpenCL device memory for matrices. */
@@ -37,8 +57,9 @@ int main()
 	cl_mem d_B;
 	cl_mem d_C;
 	
-	width = 2048;
-	size = width * width * sizeof(double);
+	/* Try a non power of two width, e.g: 3000, to see the difference. */
+	width = (argc > 1) ? atoi(argv[1]) : 2048;
+	size = (size_t)width * width * sizeof(double);
 	double* h_A = (double*) malloc(size);
 	double* h_B = (double*) malloc(size);
 	double* h_C = (double*) malloc(size);
@@ -57,30 +78,39 @@ int main()
 	clhStartContext(&chc);
 	
 	/* Load kernel from file. */
-	clhLoadKernel(&chc, "matrixmul_kernel.cl", "matrixMul");
+	if (clhLoadKernel(&chc, "matrixmul_kernel.cl", "matrixMul") != CLH_OK)
+		return (1);
 	
 	/* Create the input and output arrays in device memory for our calculation. */
-	d_C = clCreateBuffer(chc.context, CL_MEM_READ_WRITE, size, NULL, &err);
-	d_A = clCreateBuffer(chc.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, size, h_A, &err);
-	d_B = clCreateBuffer(chc.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, size, h_B, &err);
-	
-	/* Block and grid size. */
-	clhSetBlockSize(&chc, 32, 32, 0);
-	clhSetGridSize(&chc, 64, 64, 0);
+	d_C = clhAllocBuffer(&chc, CL_MEM_READ_WRITE, size, NULL);
+	d_A = clhAllocBuffer(&chc, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, size, h_A);
+	d_B = clhAllocBuffer(&chc, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, size, h_B);
 	
 	/* Kernel arguments. */
-	clSetKernelArg(chc.kernel, 0, sizeof(cl_mem), (void *)&d_C);
-	clSetKernelArg(chc.kernel, 1, sizeof(cl_mem), (void *)&d_A);
-	clSetKernelArg(chc.kernel, 2, sizeof(cl_mem), (void *)&d_B);
-	clSetKernelArg(chc.kernel, 3, sizeof(int), (void *)&width);
+	clhSetArgs(&chc, CLH_BUF(d_C), CLH_BUF(d_A), CLH_BUF(d_B), CLH_INT(width));
 	
-	/* Launch kernel. */
-	clhLaunchKernel(&chc);
+	/*
+	 * Power of two sizes (default) versus sizes rounded only up to the
+	 * block size, and the split body + remainder launch.
+	 */
+	launch(&chc, CLH_SIZE_POW2, width);
+	launch(&chc, CLH_SIZE_EXACT, width);
+	launch(&chc, CLH_SIZE_SPLIT, width);
+
+	/*
+	 * Same kernel, but specialized for this width at build time: the
+	 * compiler can now unroll the inner loop.
+	 */
+	clhDefineInt(&chc, "WIDTH", width);
+	if (clhLoadKernel(&chc, "matrixmul_kernel.cl", "matrixMul") != CLH_OK)
+		return (1);
+	clhSetArgs(&chc, CLH_BUF(d_C), CLH_BUF(d_A), CLH_BUF(d_B), CLH_INT(width));
+
+	printf("\nSpecialized (-D WIDTH=%d):\n", width);
+	launch(&chc, CLH_SIZE_EXACT, width);
 	
 	/* Copy d_C to h_C. */
 	clEnqueueReadBuffer(chc.command_queue, d_C, CL_TRUE, 0, size, h_C, 0, NULL, NULL);
-	
-	printf("Time spent: %.4f ms\n", chc.time_ms);
 
 #if 0
 	for(int i = 0; i < width; i++)
@@ -94,9 +124,9 @@ int main()
 	free(h_C);
  
  	/* Release device memory. */
-	clReleaseMemObject(d_A);
-	clReleaseMemObject(d_C);
-	clReleaseMemObject(d_B);
+	clhFreeBuffer(&chc, d_A);
+	clhFreeBuffer(&chc, d_C);
+	clhFreeBuffer(&chc, d_B);
 	
 	/* Release clHelper memory. */
 	clhReleaseContext(&chc);
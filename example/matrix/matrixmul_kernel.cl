@@ -28,14 +28,26 @@
  * Device code.
  */
  
+/*
+ * If WIDTH is defined at build time (-D WIDTH=<n>, see clhDefine), the
+ * width argument is ignored and the compiler knows the trip count of
+ * the k loop, so it can unroll it.
+ */
+#ifdef WIDTH
+#define width WIDTH
+#endif
+
 /* OpenCL Kernel. */
 __kernel void
 matrixMul(__global double* c, 
           __global double* a, 
           __global double* b, 
-          int width)
+          int width_arg)
 {
 	double sum = 0;
+#ifndef WIDTH
+	int width = width_arg;
+#endif
 	
 	int row = get_global_id(1);
 	int col = get_global_id(0);
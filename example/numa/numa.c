@@ -0,0 +1,203 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018 Davidson Francis <davidsondfgl@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * numa.c
+ * Bandwidth-bound kernel (STREAM triad, a = b + s * c) on a CPU
+ * OpenCL device, as a single device and partitioned into sub-devices
+ * (one per NUMA node, or with N compute units each), where each
+ * sub-device works on memory placed on its own node.
+ *
+ * Usage: ./numa [-n millions of elements] [-i iterations]
+ *               [-e compute units per sub-device]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <clHelper.h>
+
+/* Work-group size, n is rounded to a multiple of it. */
+#define BLOCK 256
+
+/* Starts a context on the first CPU device. */
+static int start(struct cl_helper_context *chc)
+{
+	struct clh_device_filter filter;
+
+	memset(&filter, 0, sizeof(filter));
+	filter.type = CL_DEVICE_TYPE_CPU;
+	return (clhStartContextEx(chc, &filter));
+}
+
+/* Runs the triad, returns the best bandwidth in GB/s, 0 if error. */
+static double triad(struct cl_helper_context *chc, size_t n, int iters,
+	int split)
+{
+	cl_mem a, b, c;
+	float *h_b, *h_c;
+	double best;
+	int ret;
+
+	h_b = malloc(sizeof(float) * n);
+	h_c = malloc(sizeof(float) * n);
+	if (!h_b || !h_c)
+		return (0);
+	for (size_t i = 0; i < n; i++)
+	{
+		h_b[i] = 1.0f;
+		h_c[i] = 2.0f;
+	}
+
+	/* NDRange first, split buffers follow it. */
+	clhSetSizeMode(chc, CLH_SIZE_EXACT);
+	clhSetBlockSize(chc, BLOCK, 0, 0);
+	clhSetGlobalSize(chc, n, 0, 0);
+
+	if (split)
+	{
+		a = clhAllocSplitBuffer(chc, CL_MEM_READ_WRITE, sizeof(float) * n,
+			NULL);
+		b = clhAllocSplitBuffer(chc, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			sizeof(float) * n, h_b);
+		c = clhAllocSplitBuffer(chc, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			sizeof(float) * n, h_c);
+	}
+	else
+	{
+		a = clhAllocBuffer(chc, CL_MEM_READ_WRITE, sizeof(float) * n, NULL);
+		b = clhAllocBuffer(chc, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			sizeof(float) * n, h_b);
+		c = clhAllocBuffer(chc, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			sizeof(float) * n, h_c);
+	}
+
+	best = 0;
+	if (!a || !b || !c || clhLoadKernel(chc, "triad_kernel.cl", "triad") != CLH_OK)
+		goto out;
+
+	/* Each sub-device gets its own part, plain buffers otherwise. */
+	clhSetArgs(chc, CLH_SPLIT(a), CLH_SPLIT(b), CLH_SPLIT(c), CLH_FLOAT(3.0f));
+
+	/* First run is a warm-up. */
+	for (int i = 0; i <= iters; i++)
+	{
+		if (split)
+			ret = clhLaunchKernelMulti(chc, chc->kernel, NULL);
+		else
+			ret = clhLaunchKernel(chc);
+
+		if (ret != CLH_OK)
+		{
+			best = 0;
+			break;
+		}
+
+		/* Two reads and one write per element. */
+		if (i > 0 && 3.0 * sizeof(float) * n / (chc->time_ms * 1e6) > best)
+			best = 3.0 * sizeof(float) * n / (chc->time_ms * 1e6);
+	}
+
+out:
+	if (split)
+	{
+		if (a) clReleaseMemObject(a);
+		if (b) clReleaseMemObject(b);
+		if (c) clReleaseMemObject(c);
+	}
+	else
+	{
+		clhFreeBuffer(chc, a);
+		clhFreeBuffer(chc, b);
+		clhFreeBuffer(chc, c);
+	}
+	free(h_b);
+	free(h_c);
+	return (best);
+}
+
+int main(int argc, char **argv)
+{
+	struct cl_helper_context chc;
+	double single, parted;
+	int iters, units;
+	size_t n;
+	int opt;
+
+	n = 32;
+	iters = 10;
+	units = 0;
+	while ((opt = getopt(argc, argv, "n:i:e:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'n': n = strtoull(optarg, NULL, 10); break;
+			case 'i': iters = atoi(optarg); break;
+			case 'e': units = atoi(optarg); break;
+			default:
+				fprintf(stderr, "Usage: %s [-n Melems] [-i iters] [-e units]\n",
+					argv[0]);
+				return (1);
+		}
+	}
+
+	n = ((n * 1000000 + BLOCK - 1) / BLOCK) * BLOCK;
+	if (!n || iters < 1)
+		return (1);
+
+	/* Whole device. */
+	if (start(&chc) != CLH_OK)
+		return (1);
+	printf("%s, %u compute units, %zu elements\n", chc.device.name,
+		chc.device.compute_units, n);
+
+	single = triad(&chc, n, iters, 0);
+	printf("  single device:  %8.2f GB/s\n", single);
+	clhReleaseContext(&chc);
+
+	/* Sub-devices. */
+	if (start(&chc) != CLH_OK)
+		return (1);
+
+	if (units > 0)
+	{
+		if (clhPartitionDevice(&chc, CLH_PARTITION_EQUALLY, units) != CLH_OK)
+			return (1);
+	}
+	else if (clhPartitionDevice(&chc, CLH_PARTITION_NUMA, 0) != CLH_OK)
+	{
+		fprintf(stderr, "No NUMA partitioning, try -e <units>\n");
+		clhReleaseContext(&chc);
+		return (1);
+	}
+
+	parted = triad(&chc, n, iters, 1);
+	printf("  %2d sub-devices: %8.2f GB/s (%.2fx)\n", chc.num_devices, parted,
+		single > 0 ? parted / single : 0);
+	clhReleaseContext(&chc);
+	return (0);
+}
@@ -0,0 +1,7 @@
+__kernel void triad(__global float *a, __global const float *b,
+	__global const float *c, float s)
+{
+	/* Split buffers start at the part of this device. */
+	int i = get_global_id(0) - get_global_offset(0);
+	a[i] = b[i] + s * c[i];
+}
@@ -0,0 +1,168 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018 Davidson Francis <davidsondfgl@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * oversub.c
+ * Works on a set of tiles larger than the device memory budget with
+ * tracked buffers: every pass runs a kernel on each tile, and the least
+ * recently used tiles are evicted to the host to make room for the
+ * next ones. Reports the time per pass and the traffic.
+ *
+ * Usage: ./oversub [-t tiles] [-s MB per tile] [-m budget in MB, 0
+ *                  for the device memory] [-p passes]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <clHelper.h>
+
+/* Work-group size, tile sizes are rounded to a multiple of it. */
+#define BLOCK 256
+
+/* Current time, in ms. */
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e3 + ts.tv_nsec / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+	struct cl_helper_context chc;
+	struct clh_tracked **tiles;
+	struct clh_tracked *inc;
+	struct clh_mem_stats stats;
+	unsigned long uploads, readbacks;
+	size_t tile_mb, n;
+	double budget_mb;
+	double t0;
+	float *h;
+	int num_tiles, passes;
+	int failed;
+	int opt;
+
+	num_tiles = 16;
+	tile_mb = 64;
+	budget_mb = 256;
+	passes = 4;
+	while ((opt = getopt(argc, argv, "t:s:m:p:")) != -1)
+	{
+		switch (opt)
+		{
+			case 't': num_tiles = atoi(optarg); break;
+			case 's': tile_mb = strtoull(optarg, NULL, 10); break;
+			case 'm': budget_mb = atof(optarg); break;
+			case 'p': passes = atoi(optarg); break;
+			default:
+				fprintf(stderr, "Usage: %s [-t tiles] [-s MB] [-m budget MB] "
+					"[-p passes]\n", argv[0]);
+				return (1);
+		}
+	}
+
+	n = ((tile_mb * 1024 * 1024 / sizeof(float) + BLOCK - 1) / BLOCK) * BLOCK;
+	if (num_tiles < 1 || !n || passes < 1 || budget_mb < 0)
+		return (1);
+
+	if (clhStartContext(&chc) != CLH_OK)
+		return (1);
+	if (clhLoadKernel(&chc, "oversub_kernel.cl", "accumulate") != CLH_OK)
+		return (1);
+
+	clhSetMemoryBudget(&chc, (cl_ulong)(budget_mb * 1024 * 1024));
+	clhMemoryStats(&chc, 0, &stats);
+	printf("%s, %d tiles x %zu MB = %zu MB, budget %.0f MB\n", chc.device.name,
+		num_tiles, tile_mb, num_tiles * tile_mb,
+		stats.budget / (1024.0 * 1024.0));
+
+	/* Read-only increment, never read back. */
+	inc = clhTrackedAlloc(&chc, CL_MEM_READ_ONLY, sizeof(float) * n, NULL);
+	tiles = calloc(num_tiles, sizeof(*tiles));
+	if (!inc || !tiles)
+		return (1);
+
+	h = clhTrackedMap(&chc, inc, CL_MAP_WRITE);
+	for (size_t i = 0; i < n; i++)
+		h[i] = 1.0f;
+
+	for (int i = 0; i < num_tiles; i++)
+	{
+		tiles[i] = clhTrackedAlloc(&chc, CL_MEM_READ_WRITE, sizeof(float) * n,
+			NULL);
+		if (!tiles[i])
+			return (1);
+	}
+
+	clhSetSizeMode(&chc, CLH_SIZE_EXACT);
+	clhSetBlockSize(&chc, BLOCK, 0, 0);
+	clhSetGlobalSize(&chc, n, 0, 0);
+
+	failed = 0;
+	for (int p = 0; p < passes && !failed; p++)
+	{
+		clhMemoryStats(&chc, 0, &stats);
+		uploads = stats.uploads;
+		readbacks = stats.readbacks;
+
+		t0 = now();
+		for (int i = 0; i < num_tiles; i++)
+		{
+			/* Arguments again for every launch: tiles move. */
+			if (clhSetArgs(&chc, CLH_TRACKED(tiles[i]), CLH_TRACKED(inc),
+				CLH_UINT(n)) != CLH_OK || clhLaunchKernel(&chc) != CLH_OK)
+			{
+				failed = 1;
+				break;
+			}
+		}
+
+		clhMemoryStats(&chc, 0, &stats);
+		printf("pass %d: %8.1f ms, %3lu uploads, %3lu readbacks, %6.0f MB "
+			"resident\n", p, now() - t0, stats.uploads - uploads,
+			stats.readbacks - readbacks,
+			stats.resident_bytes / (1024.0 * 1024.0));
+	}
+
+	/* Every element of every tile was incremented once per pass. */
+	for (int i = 0; i < num_tiles && !failed; i++)
+	{
+		h = clhTrackedMap(&chc, tiles[i], CL_MAP_READ);
+		if (!h || h[0] != passes || h[n - 1] != passes)
+			failed = 1;
+	}
+	printf("%s\n", failed ? "FAILED" : "OK");
+
+	for (int i = 0; i < num_tiles; i++)
+		clhTrackedFree(&chc, tiles[i]);
+	clhTrackedFree(&chc, inc);
+	free(tiles);
+	clhReleaseContext(&chc);
+	return (failed);
+}
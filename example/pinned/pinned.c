@@ -0,0 +1,96 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018 Davidson Francis <davidsondfgl@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <clHelper.h>
+
+#define ITERATIONS 10
+
+/* Wall time, in ms. */
+static double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0);
+}
+
+int main()
+{
+	struct cl_helper_context chc;
+	double start, t_pageable, t_pinned;
+	size_t size;
+	char *h_pageable, *h_pinned;
+	cl_mem d_buf, d_pinned;
+
+	size = 256 * 1024 * 1024;
+
+	/* Start context. */
+	if (clhStartContext(&chc) != CLH_OK)
+		return (1);
+
+	/* Pageable memory + regular device buffer. */
+	h_pageable = malloc(size);
+	memset(h_pageable, 1, size);
+	d_buf = clhAllocBuffer(&chc, CL_MEM_READ_WRITE, size, NULL);
+
+	/* Pinned/zero-copy memory + its device view. */
+	h_pinned = clhAllocHost(&chc, size);
+	memset(h_pinned, 1, size);
+	d_pinned = clhHostBuffer(&chc, h_pinned);
+
+	/* Round trips: host -> device -> host. */
+	start = now_ms();
+	for (int i = 0; i < ITERATIONS; i++)
+	{
+		clhWriteBuffer(&chc, d_buf, h_pageable, size);
+		clhReadBuffer(&chc, h_pageable, d_buf, size);
+	}
+	t_pageable = (now_ms() - start) / ITERATIONS;
+
+	start = now_ms();
+	for (int i = 0; i < ITERATIONS; i++)
+	{
+		clhWriteBuffer(&chc, d_pinned, h_pinned, size);
+		clhReadBuffer(&chc, h_pinned, d_pinned, size);
+	}
+	t_pinned = (now_ms() - start) / ITERATIONS;
+
+	printf("Device shares host memory: %s\n", chc.host_unified ? "yes" : "no");
+	printf("Pageable: %8.3f ms per round trip (%.2f GB/s)\n", t_pageable,
+		(2.0 * size / 1e9) / (t_pageable / 1000.0));
+	printf("Pinned:   %8.3f ms per round trip (%.2f GB/s)\n", t_pinned,
+		(2.0 * size / 1e9) / (t_pinned / 1000.0));
+
+	/* Release. */
+	free(h_pageable);
+	clhFreeBuffer(&chc, d_buf);
+	clhFreeHost(&chc, h_pinned);
+	clhReleaseContext(&chc);
+	return (0);
+}
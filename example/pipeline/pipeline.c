@@ -0,0 +1,95 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018 Davidson Francis <davidsondfgl@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <clHelper.h>
+
+int main()
+{
+	struct cl_helper_context chc;
+	struct clh_pipeline_stats st;
+	struct clh_pipeline p;
+	size_t num_elems;
+	float *h_in, *h_out;
+	float factor;
+	int errors;
+
+	/* 64 Mi elements, processed in 4 Mi chunks. */
+	num_elems = 64 * 1024 * 1024;
+	factor = 2.0f;
+	h_in  = malloc(num_elems * sizeof(float));
+	h_out = malloc(num_elems * sizeof(float));
+
+	for (size_t i = 0; i < num_elems; i++)
+		h_in[i] = (float)(i & 1023);
+
+	/* Start context. */
+	if (clhStartContext(&chc) != CLH_OK)
+		return (1);
+
+	/* Load kernel from file. */
+	if (clhLoadKernel(&chc, "scale_kernel.cl", "scale") != CLH_OK)
+		return (1);
+
+	/* Arguments that do not change between chunks. */
+	clSetKernelArg(chc.kernel, 3, sizeof(float), &factor);
+
+	/* Pipeline: scale(in, out, count, factor). */
+	p.kernel        = chc.kernel;
+	p.arg_in        = 0;
+	p.arg_out       = 1;
+	p.arg_count     = 2;
+	p.input         = h_in;
+	p.in_elem_size  = sizeof(float);
+	p.output        = h_out;
+	p.out_elem_size = sizeof(float);
+	p.num_elems     = num_elems;
+	p.chunk_elems   = 4 * 1024 * 1024;
+	p.local_size    = 0;
+
+	/* Serial (1 buffer) versus triple buffering. */
+	for (int nbuf = 1; nbuf <= 3; nbuf += 2)
+	{
+		p.num_buffers = nbuf;
+		if (clhRunPipeline(&chc, &p, &st) != CLH_OK)
+			break;
+
+		printf("%d buffer(s): total %.2f ms | upload %.2f ms, compute %.2f ms,"
+			" download %.2f ms (%d chunks)\n", nbuf, st.total_ms, st.upload_ms,
+			st.compute_ms, st.download_ms, st.chunks);
+	}
+
+	/* Check. */
+	errors = 0;
+	for (size_t i = 0; i < num_elems; i++)
+		if (h_out[i] != h_in[i] * factor)
+			errors++;
+	printf("Errors: %d\n", errors);
+
+	free(h_in);
+	free(h_out);
+	clhReleaseContext(&chc);
+	return (0);
+}
@@ -0,0 +1,191 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018 Davidson Francis <davidsondfgl@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * reduce.c
+ * Reduction and scan primitives: correctness against the CPU and
+ * bandwidth, for int, float and double. Arrays larger than the device
+ * memory work too (e.g: ./reduce 2000000000), they are processed in
+ * chunks.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <clHelper.h>
+
+/* Wall time, in ms. */
+static double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0);
+}
+
+/* Element i of a typed array, as double. */
+static double get(int type, const void *p, size_t i)
+{
+	if (type == CLH_ARG_INT)
+		return (((const cl_int *)p)[i]);
+	if (type == CLH_ARG_FLOAT)
+		return (((const cl_float *)p)[i]);
+	return (((const cl_double *)p)[i]);
+}
+
+/* Compares a result with the reference, floats with some tolerance. */
+static int same(int type, double a, double b)
+{
+	if (type == CLH_ARG_INT)
+		return (a == b);
+	return (fabs(a - b) <= 1e-3 * (fabs(b) + 1));
+}
+
+/* Runs all the primitives for a given type. */
+static void run(struct cl_helper_context *chc, int type, size_t n)
+{
+	static const char *ops[] = {"sum", "min", "max", "argmax"};
+	double ref[4], value, acc, start, ms;
+	cl_double result;
+	size_t esize, ref_idx;
+	cl_ulong idx;
+	void *in, *out;
+	int ok;
+
+	esize = (type == CLH_ARG_INT) ? sizeof(cl_int) :
+		(type == CLH_ARG_FLOAT) ? sizeof(cl_float) : sizeof(cl_double);
+
+	in  = malloc(n * esize);
+	out = malloc(n * esize);
+	if (!n || !in || !out)
+	{
+		fprintf(stderr, "Not enough host memory for %zu elements\n", n);
+		free(in);
+		free(out);
+		return;
+	}
+
+	/* Small integers: sums are exact, even in float, for a while. */
+	for (size_t i = 0; i < n; i++)
+	{
+		int v = rand() % 4;
+		if (type == CLH_ARG_INT)
+			((cl_int *)in)[i] = v;
+		else if (type == CLH_ARG_FLOAT)
+			((cl_float *)in)[i] = (float)v;
+		else
+			((cl_double *)in)[i] = v;
+	}
+
+	/* CPU reference. */
+	ref[0] = 0;
+	ref[1] = ref[2] = get(type, in, 0);
+	ref_idx = 0;
+	for (size_t i = 0; i < n; i++)
+	{
+		double v = get(type, in, i);
+		ref[0] += v;
+		if (v < ref[1])
+			ref[1] = v;
+		if (v > ref[2])
+		{
+			ref[2] = v;
+			ref_idx = i;
+		}
+	}
+	ref[3] = ref[2];
+
+	printf("%s:\n", type == CLH_ARG_INT ? "int" : type == CLH_ARG_FLOAT ?
+		"float" : "double");
+
+	for (int op = CLH_REDUCE_SUM; op <= CLH_REDUCE_ARGMAX; op++)
+	{
+		start = now_ms();
+		if (clhReduceHost(chc, type, op, in, n, &result, &idx) != CLH_OK)
+		{
+			printf("  %-7s failed\n", ops[op]);
+			continue;
+		}
+		ms = now_ms() - start;
+
+		value = get(type, &result, 0);
+		ok = same(type, value, ref[op]) &&
+			(op != CLH_REDUCE_ARGMAX || idx == ref_idx);
+
+		printf("  %-7s %s, %8.2f GB/s kernel, %8.2f GB/s end-to-end\n",
+			ops[op], ok ? "ok    " : "WRONG ", n * esize / (chc->time_ms * 1e6),
+			n * esize / (ms * 1e6));
+	}
+
+	/* Exclusive scan. */
+	start = now_ms();
+	if (clhScanHost(chc, type, in, out, n) == CLH_OK)
+	{
+		ms = now_ms() - start;
+
+		ok = 1;
+		acc = 0;
+		for (size_t i = 0; i < n && ok; i++)
+		{
+			ok = same(type, get(type, out, i), acc);
+			acc += get(type, in, i);
+		}
+
+		printf("  %-7s %s, %8.2f GB/s kernel, %8.2f GB/s end-to-end\n",
+			"scan", ok ? "ok    " : "WRONG ", 2 * n * esize /
+			(chc->time_ms * 1e6), 2 * n * esize / (ms * 1e6));
+	}
+	else
+		printf("  %-7s failed\n", "scan");
+
+	free(in);
+	free(out);
+}
+
+int main(int argc, char **argv)
+{
+	struct cl_helper_context chc;
+	size_t n;
+
+	n = (argc > 1) ? strtoull(argv[1], NULL, 10) : (size_t)1 << 24;
+	if (!n)
+	{
+		fprintf(stderr, "Usage: %s [number of elements]\n", argv[0]);
+		return (1);
+	}
+
+	if (clhStartContext(&chc) != CLH_OK)
+		return (1);
+
+	printf("%zu elements\n", n);
+	run(&chc, CLH_ARG_INT, n);
+	run(&chc, CLH_ARG_FLOAT, n);
+	run(&chc, CLH_ARG_DOUBLE, n);
+
+	clhReleaseContext(&chc);
+	return (0);
+}
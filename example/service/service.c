@@ -0,0 +1,253 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018 Davidson Francis <davidsondfgl@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * service.c
+ * N threads send small kernel launches (upload, kernel, download) in a
+ * closed loop, first through one shared context guarded by a mutex,
+ * then through a launch service. Reports the throughput and the
+ * request latency percentiles of both.
+ *
+ * Usage: ./service [-t threads] [-r requests per thread]
+ *                  [-s elements per request]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <clHelper.h>
+
+/* Work-group size. */
+#define BLOCK 64
+
+/* Producer thread. */
+struct producer
+{
+	pthread_t thread;
+	cl_mem buf;          /* Own device buffer. */
+	float *host;         /* Own host data.     */
+	double *lat;         /* Latencies, in us.  */
+	int failed;
+};
+
+static struct cl_helper_context chc;
+static struct clh_service *svc;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static cl_kernel kernel;
+static int requests;
+static size_t size;
+
+/* Current time, in us. */
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e6 + ts.tv_nsec / 1e3);
+}
+
+/* Baseline: every request takes the context lock. */
+static void *lockedLoop(void *arg)
+{
+	struct producer *p = arg;
+	double t0;
+	int ret;
+
+	for (int i = 0; i < requests; i++)
+	{
+		t0 = now();
+		pthread_mutex_lock(&lock);
+		ret = clhWriteBuffer(&chc, p->buf, p->host, sizeof(float) * size);
+		clhSetKernelArgs(&chc, kernel, (struct clh_arg[]){CLH_BUF(p->buf),
+			CLH_UINT(size), CLH_FLOAT(1.0f)}, 3);
+		ret |= clhLaunchKernelHandle(&chc, kernel);
+		ret |= clhReadBuffer(&chc, p->host, p->buf, sizeof(float) * size);
+		pthread_mutex_unlock(&lock);
+		p->lat[i] = now() - t0;
+		if (ret != CLH_OK)
+			p->failed = 1;
+	}
+	return (NULL);
+}
+
+/* Launch service: post and wait, no lock. */
+static void *serviceLoop(void *arg)
+{
+	struct producer *p = arg;
+	struct clh_request req;
+	struct clh_future *f;
+	double t0;
+
+	memset(&req, 0, sizeof(req));
+	req.kernel = kernel;
+	req.args[0] = CLH_BUF(p->buf);
+	req.args[1] = CLH_UINT(size);
+	req.args[2] = CLH_FLOAT(1.0f);
+	req.nargs = 3;
+	req.dims = 1;
+	req.global[0] = ((size + BLOCK - 1) / BLOCK) * BLOCK;
+	req.local[0] = BLOCK;
+	req.write_buf = p->buf;
+	req.write_src = p->host;
+	req.write_size = sizeof(float) * size;
+	req.read_buf = p->buf;
+	req.read_dst = p->host;
+	req.read_size = sizeof(float) * size;
+	req.device = -1;
+
+	for (int i = 0; i < requests; i++)
+	{
+		t0 = now();
+		if (clhServicePost(svc, &req, &f) != CLH_OK ||
+			clhFutureWait(f, NULL) != CLH_OK)
+		{
+			p->failed = 1;
+		}
+		p->lat[i] = now() - t0;
+	}
+	return (NULL);
+}
+
+static int cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return ((x > y) - (x < y));
+}
+
+/* Runs the producers and prints the results. */
+static int run(const char *name, struct producer *p, int threads,
+	void *(*loop)(void *))
+{
+	double t0, total, *all;
+	int failed;
+	size_t n;
+
+	for (int i = 0; i < threads; i++)
+	{
+		memset(p[i].host, 0, sizeof(float) * size);
+		p[i].failed = 0;
+	}
+
+	t0 = now();
+	for (int i = 0; i < threads; i++)
+		pthread_create(&p[i].thread, NULL, loop, &p[i]);
+	for (int i = 0; i < threads; i++)
+		pthread_join(p[i].thread, NULL);
+	total = now() - t0;
+
+	/* Each request adds 1 to every element. */
+	failed = 0;
+	n = (size_t)threads * requests;
+	all = malloc(sizeof(double) * n);
+	for (int i = 0; i < threads; i++)
+	{
+		failed |= p[i].failed || p[i].host[size - 1] != (float)requests;
+		memcpy(all + (size_t)i * requests, p[i].lat, sizeof(double) * requests);
+	}
+	qsort(all, n, sizeof(double), cmp);
+
+	printf("%-8s %10.0f req/s   p50 %8.1f us   p99 %8.1f us   p99.9 %8.1f us%s\n",
+		name, n / (total / 1e6), all[n / 2], all[n * 99 / 100],
+		all[n * 999 / 1000], failed ? "   FAILED" : "");
+	free(all);
+	return (failed);
+}
+
+int main(int argc, char **argv)
+{
+	struct clh_service_stats stats;
+	struct producer *p;
+	int threads;
+	int failed;
+	int opt;
+
+	threads = 8;
+	requests = 2000;
+	size = 1024;
+	while ((opt = getopt(argc, argv, "t:r:s:")) != -1)
+	{
+		switch (opt)
+		{
+			case 't': threads = atoi(optarg); break;
+			case 'r': requests = atoi(optarg); break;
+			case 's': size = strtoull(optarg, NULL, 10); break;
+			default:
+				fprintf(stderr, "Usage: %s [-t threads] [-r requests] [-s size]\n",
+					argv[0]);
+				return (1);
+		}
+	}
+	if (threads < 1 || requests < 1 || !size)
+		return (1);
+
+	if (clhStartContext(&chc) != CLH_OK)
+		return (1);
+	if (clhLoadKernel(&chc, "service_kernel.cl", "step") != CLH_OK)
+		return (1);
+	kernel = chc.kernel;
+
+	/* Baseline launch size. */
+	clhSetSizeMode(&chc, CLH_SIZE_EXACT);
+	clhSetBlockSize(&chc, BLOCK, 0, 0);
+	clhSetGlobalSize(&chc, size, 0, 0);
+
+	p = calloc(threads, sizeof(*p));
+	for (int i = 0; i < threads; i++)
+	{
+		p[i].buf  = clhAllocBuffer(&chc, CL_MEM_READ_WRITE, sizeof(float) * size,
+			NULL);
+		p[i].host = malloc(sizeof(float) * size);
+		p[i].lat  = malloc(sizeof(double) * requests);
+		if (!p[i].buf || !p[i].host || !p[i].lat)
+			return (1);
+	}
+
+	printf("%s, %d threads x %d requests, %zu elements\n", chc.device.name,
+		threads, requests, size);
+
+	failed = run("locked", p, threads, lockedLoop);
+
+	if ((svc = clhServiceStart(&chc, 0)) == NULL)
+		return (1);
+	failed |= run("service", p, threads, serviceLoop);
+
+	clhServiceStats(svc, &stats);
+	printf("service: %lu requests, %lu flushes, %.2f requests per flush\n",
+		stats.completed, stats.flushes, stats.avg_batch);
+	clhServiceStop(svc);
+
+	for (int i = 0; i < threads; i++)
+	{
+		clhFreeBuffer(&chc, p[i].buf);
+		free(p[i].host);
+		free(p[i].lat);
+	}
+	free(p);
+	clhReleaseContext(&chc);
+	return (failed);
+}
@@ -0,0 +1,92 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018 Davidson Francis <davidsondfgl@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * startup.c
+ * Context startup latency: the first context probes the devices (cold),
+ * the next ones, started from several threads at once, reuse the
+ * process-wide device cache (warm).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <clHelper.h>
+
+#define THREADS 8
+
+/* Per-thread result. */
+struct result
+{
+	double startup_ms;
+	int cached;
+	int ret;
+};
+
+/* Starts and releases a context. */
+static void *start(void *arg)
+{
+	struct result *res = arg;
+	struct cl_helper_context chc;
+
+	res->ret = clhStartContext(&chc);
+	res->startup_ms = chc.startup_ms;
+	res->cached = chc.probe_cached;
+	clhReleaseContext(&chc);
+	return (NULL);
+}
+
+int main()
+{
+	struct result cold, warm[THREADS];
+	pthread_t threads[THREADS];
+	double sum;
+
+	/* Cold start. */
+	start(&cold);
+	if (cold.ret != CLH_OK)
+		return (1);
+
+	printf("Cold startup: %8.3f ms (%s)\n", cold.startup_ms,
+		cold.cached ? "cached" : "probed");
+
+	/* Warm starts, all at once. */
+	for (int i = 0; i < THREADS; i++)
+		pthread_create(&threads[i], NULL, start, &warm[i]);
+
+	sum = 0;
+	for (int i = 0; i < THREADS; i++)
+	{
+		pthread_join(threads[i], NULL);
+		if (warm[i].ret != CLH_OK)
+			return (1);
+
+		printf("Warm startup #%d: %8.3f ms (%s)\n", i, warm[i].startup_ms,
+			warm[i].cached ? "cached" : "probed");
+		sum += warm[i].startup_ms;
+	}
+
+	printf("Average warm startup: %8.3f ms\n", sum / THREADS);
+	return (0);
+}